@@ -66,6 +66,23 @@ void Backup::DoBackup(std::shared_ptr<BackupEventHandler> event_handler) {
     error_text += error.error_text();
   }
 
+  bool succeeded = !error_text.size() && !coordinator_->IsCancelled();
+  for (auto sync : syncs_to_do_) {
+    try {
+      sync->BackupFinished(succeeded);
+    } catch (const std::exception &e) {
+      LOG(ERROR) << "Error finishing sync: " << e.what();
+      // A sync that can't be committed, e.g. as traces were dropped, means
+      // the backup is missing writes
+      if (succeeded) {
+        if (error_text.size()) {
+          error_text += "\n";
+        }
+        error_text += e.what();
+      }
+    }
+  }
+
   if (error_text.size()) {
     event_handler->BackupFailed(error_text);
   } else if (coordinator_->IsCancelled()) {
@@ -31,7 +31,27 @@ BackupBuilder::CreateDeviceSynchronizer(const Vector &vector,
   uint16_t port = (uint16_t)vector.destination_port();
 
   auto remote_device =
-      block_device_factory_->CreateRemoteBlockDevice(host, port);
+      block_device_factory_->CreateRemoteBlockDevice(host, port,
+                                                     *source_device);
+
+  // Changes are tracked for each destination, so a backup to one doesn't
+  // reset what another needs
+  std::string destination_id = host + ":" + std::to_string(port);
+
+  // Dropped traces mean the tracked changes are incomplete. A full on a
+  // restarted tracer, which gets larger relay buffers, is the only way back.
+  if (sector_manager_->IsTracing(*source_device) &&
+      sector_manager_->NeedsResync(*source_device)) {
+    if (!is_full) {
+      LOG(ERROR) << "Traces of " << source_device->path() << " were dropped."
+                 << " Must do a full.";
+      throw BackupException("Traces were dropped for source");
+    }
+    LOG(INFO) << "Restarting tracer of " << source_device->path()
+              << " after dropped traces";
+    sector_manager_->StopTracer(*source_device);
+    sector_manager_->StartTracer(*source_device);
+  }
 
   if (!sector_manager_->IsTracing(*source_device)) {
     if (is_full) {
@@ -41,24 +61,33 @@ BackupBuilder::CreateDeviceSynchronizer(const Vector &vector,
                  << " Must do a full.";
       throw BackupException("No trace data exists for source");
     }
+  } else if (!is_full &&
+             !sector_manager_->HasGeneration(*source_device, destination_id)) {
+    LOG(ERROR) << source_device->path() << " has no changes tracked for "
+               << destination_id << ". Must do a full.";
+    throw BackupException("No trace data exists for destination");
   }
 
+  auto store = sector_manager_->GetStore(*source_device, destination_id);
+
+  DLOG(INFO) << "Creating DeviceSynchronizer for "
+             << source_device->path();
+  auto synchronizer = std::make_shared<DeviceSynchronizer>(source_device,
+                                                           sector_manager_,
+                                                           remote_device,
+                                                           destination_id);
+  synchronizer->SetCpuPlacement(cpu_placement_);
+
   if (is_full) {
-    auto store = sector_manager_->GetStore(*source_device);
     store->ClearIntervals();
 
-    auto in_use_set = source_device->GetInUseSectors();
-    for (const SectorInterval &interval : *in_use_set) {
-      DLOG(INFO) << "Adding interval " << interval;
-      store->AddNonVolatileInterval(interval);
-    }
+    // The in-use sectors are loaded as the sync runs, so copying starts
+    // before the whole filesystem has been scanned
+    synchronizer->SetInUseProducer(
+        source_device->CreateInUseSectorProducer());
   }
 
-  DLOG(INFO) << "Creating DeviceSynchronizer for "
-             << source_device->path();
-  return std::make_shared<DeviceSynchronizer>(source_device,
-                                              sector_manager_,
-                                              remote_device);
+  return synchronizer;
 }
 
 } // datto_linux_client
@@ -6,6 +6,7 @@
 
 #include "backup/backup.h"
 #include "block_device/block_device_factory.h"
+#include "cpu_placement/cpu_placement.h"
 #include "device_synchronizer/device_synchronizer_interface.h"
 #include "unsynced_sector_manager/unsynced_sector_manager.h"
 
@@ -18,7 +19,8 @@ class BackupBuilder {
   BackupBuilder(std::shared_ptr<BlockDeviceFactory> block_device_factory,
                 std::shared_ptr<UnsyncedSectorManager> sector_manager)
       : block_device_factory_(block_device_factory),
-        sector_manager_(sector_manager) {}
+        sector_manager_(sector_manager),
+        cpu_placement_() {}
       
   virtual ~BackupBuilder() {}
 
@@ -28,6 +30,12 @@ class BackupBuilder {
       const std::shared_ptr<BackupCoordinator> &coordinator,
       bool is_full);
 
+  // Syncs of backups created afterwards run near their source device, see
+  // DeviceSynchronizer::SetCpuPlacement
+  void SetCpuPlacement(std::shared_ptr<const CpuPlacement> placement) {
+    cpu_placement_ = placement;
+  }
+
   BackupBuilder(const BackupBuilder &) = delete;
   BackupBuilder& operator=(const BackupBuilder &) = delete;
 
@@ -41,6 +49,7 @@ class BackupBuilder {
  private:
   std::shared_ptr<BlockDeviceFactory> block_device_factory_;
   std::shared_ptr<UnsyncedSectorManager> sector_manager_;
+  std::shared_ptr<const CpuPlacement> cpu_placement_;
 };
 
 } // datto_linux_client
@@ -14,4 +14,10 @@ void PrintingSyncCountHandler::UpdateSyncedCount(uint64_t num_synced_a) {
   printf("%" PRIu64 " synced bytes\n", num_synced_a);
 }
 
+void PrintingSyncCountHandler::UpdateReconnectCount(
+    uint32_t num_reconnects_a) {
+  SyncCountHandler::UpdateReconnectCount(num_reconnects_a);
+  printf("%" PRIu32 " reconnects\n", num_reconnects_a);
+}
+
 } // datto_linux_client
@@ -13,6 +13,7 @@ class PrintingSyncCountHandler : public SyncCountHandler {
   virtual void UpdateSyncedCount(uint64_t num_synced_a);
   // num_unsynced should be the total synced
   virtual void UpdateUnsyncedCount(uint64_t num_unsynced_a) {}
+  virtual void UpdateReconnectCount(uint32_t num_reconnects_a);
 
   PrintingSyncCountHandler(const SyncCountHandler &) = delete;
   PrintingSyncCountHandler& operator=(const SyncCountHandler &) = delete;
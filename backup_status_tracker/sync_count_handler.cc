@@ -5,7 +5,8 @@ namespace datto_linux_client {
 SyncCountHandler::SyncCountHandler(BlockDeviceStatus *block_device_status,
                                    std::shared_ptr<std::mutex> to_lock_mutex)
     : block_device_status_(block_device_status),
-      to_lock_mutex_(to_lock_mutex) {
+      to_lock_mutex_(to_lock_mutex),
+      reconnect_count_(0) {
   std::lock_guard<std::mutex> lock(*to_lock_mutex_);
   block_device_status_->set_bytes_transferred(0);
 }
@@ -19,4 +20,8 @@ void SyncCountHandler::UpdateUnsyncedCount(uint64_t num_unsynced) {
   block_device_status_->set_bytes_unsynced(num_unsynced);
 }
 
+void SyncCountHandler::UpdateReconnectCount(uint32_t num_reconnects) {
+  reconnect_count_ = num_reconnects;
+}
+
 } // datto_linux_client
@@ -1,6 +1,7 @@
 #ifndef DATTO_CLIENT_BACKUP_STATUS_TRACKER_SYNC_COUNT_HANDLER_H_
 #define DATTO_CLIENT_BACKUP_STATUS_TRACKER_SYNC_COUNT_HANDLER_H_
 
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include <unistd.h>
@@ -19,15 +20,24 @@ class SyncCountHandler {
   virtual void UpdateSyncedCount(uint64_t num_synced);
   // num_unsynced should be the total synced
   virtual void UpdateUnsyncedCount(uint64_t num_unsynced);
+  // num_reconnects should be the total times the destination was
+  // reconnected to
+  virtual void UpdateReconnectCount(uint32_t num_reconnects);
+
+  uint32_t reconnect_count() const {
+    return reconnect_count_;
+  }
 
   SyncCountHandler(const SyncCountHandler &) = delete;
   SyncCountHandler& operator=(const SyncCountHandler &) = delete;
  protected:
   // For unit testing and subclasses
-  SyncCountHandler() {}
+  SyncCountHandler() : reconnect_count_(0) {}
  private:
   BlockDeviceStatus *block_device_status_;
   std::shared_ptr<std::mutex> to_lock_mutex_;
+  // BlockDeviceStatus has no field for this yet
+  std::atomic<uint32_t> reconnect_count_;
 };
 
 } // datto_linux_client
@@ -16,6 +16,15 @@ BlockDevice::BlockDevice(std::string a_path) : path_(a_path) {
   Init();
 }
 
+BlockDevice::BlockDevice(const std::string &name, uint64_t device_size_bytes,
+                         uint32_t block_size_bytes)
+    : path_(name),
+      dev_t_(0),
+      device_size_bytes_(device_size_bytes),
+      block_size_bytes_(block_size_bytes),
+      throttle_scalar_(1.0),
+      fd_(-1) {}
+
 void BlockDevice::Init() {
   fd_ = -1;
   struct stat statbuf;
@@ -57,6 +57,13 @@ class BlockDevice {
   // Note that block_path_ must be set and Init() called before the
   // subclass constructor returns
   BlockDevice() { }
+
+  // For devices without a local block device node, such as one only
+  // reached over the network. @name is used as the path, and Open() and
+  // Flush() must be overridden.
+  BlockDevice(const std::string &name, uint64_t device_size_bytes,
+              uint32_t block_size_bytes);
+
   std::string path_;
 
   // Do the actual initialization of the object
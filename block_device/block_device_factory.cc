@@ -7,12 +7,20 @@
 #include <glog/logging.h>
 #include <unistd.h>
 #include <linux/limits.h>
+#include <sys/sysmacros.h>
+
+#include <fstream>
+#include <sstream>
 
 #include "block_device/nbd_block_device.h"
+#include "block_device/partition_info.h"
+#include "block_device/userspace_nbd_block_device.h"
 #include "block_device/ext_mountable_block_device.h"
 
 namespace {
 using datto_linux_client::BlockDeviceException;
+using datto_linux_client::PartitionInfo;
+using datto_linux_client::ReadPartitionInfo;
 
 std::string GetFilesystemFromPath(std::string path) {
   char *fs = ::blkid_get_tag_value(NULL, "TYPE", path.c_str());
@@ -34,10 +42,38 @@ std::string GetPathFromUuid(std::string uuid) {
   }
   return std::string(real_path_buf);
 }
+
+// The largest request the device takes, 0 if unknown. Partitions share the
+// queue of their disk.
+uint32_t GetMaxSectorsKb(::dev_t device) {
+  PartitionInfo partition;
+  try {
+    if (ReadPartitionInfo(device, &partition)) {
+      device = partition.disk_dev_t;
+    }
+  } catch (const BlockDeviceException &e) {
+    LOG(WARNING) << e.what();
+  }
+
+  std::ostringstream queue_path;
+  queue_path << "/sys/dev/block/" << major(device) << ":" << minor(device)
+             << "/queue/max_sectors_kb";
+  std::ifstream queue_file(queue_path.str());
+  uint32_t max_sectors_kb;
+  if (!(queue_file >> max_sectors_kb)) {
+    LOG(WARNING) << "Unable to read " << queue_path.str();
+    return 0;
+  }
+  return max_sectors_kb;
+}
 }
 
 namespace datto_linux_client {
 
+BlockDeviceFactory::BlockDeviceFactory()
+    : use_userspace_nbd_(true),
+      max_nbd_connections_(NbdClient::DEFAULT_MAX_CONNECTIONS) {}
+
 std::shared_ptr<MountableBlockDevice>
 BlockDeviceFactory::CreateMountableBlockDeviceFromUuid(std::string uuid) {
   std::string path = GetPathFromUuid(uuid);
@@ -63,7 +99,24 @@ BlockDeviceFactory::CreateMountableBlockDeviceFromPath(std::string path) {
 std::shared_ptr<RemoteBlockDevice>
 BlockDeviceFactory::CreateRemoteBlockDevice(std::string hostname,
                                             uint16_t port_num) {
-  return std::make_shared<NbdBlockDevice>(hostname, port_num);
+  if (use_userspace_nbd_) {
+    return std::make_shared<UserspaceNbdBlockDevice>(hostname, port_num);
+  }
+  return std::make_shared<NbdBlockDevice>(hostname, port_num,
+                                          max_nbd_connections_, 0, 0);
+}
+
+std::shared_ptr<RemoteBlockDevice>
+BlockDeviceFactory::CreateRemoteBlockDevice(std::string hostname,
+                                            uint16_t port_num,
+                                            const BlockDevice &source) {
+  if (use_userspace_nbd_) {
+    return std::make_shared<UserspaceNbdBlockDevice>(hostname, port_num);
+  }
+  return std::make_shared<NbdBlockDevice>(hostname, port_num,
+                                          max_nbd_connections_,
+                                          source.BlockSizeBytes(),
+                                          GetMaxSectorsKb(source.dev_t()));
 }
 
 } // datto_linux_client
@@ -11,7 +11,7 @@ namespace datto_linux_client {
 
 class BlockDeviceFactory {
  public:
-  BlockDeviceFactory() {}
+  BlockDeviceFactory();
   virtual ~BlockDeviceFactory() {}
 
   virtual std::shared_ptr<MountableBlockDevice>
@@ -22,6 +22,27 @@ class BlockDeviceFactory {
 
   virtual std::shared_ptr<RemoteBlockDevice> CreateRemoteBlockDevice(
       std::string hostname, uint16_t port_num);
+
+  // As above, with a kernel NBD device's block size and request size
+  // matching source
+  virtual std::shared_ptr<RemoteBlockDevice> CreateRemoteBlockDevice(
+      std::string hostname, uint16_t port_num, const BlockDevice &source);
+
+  // Remote devices are reached with a UserspaceNbdBlockDevice, which
+  // reconnects if the connection drops, instead of a kernel NBD device.
+  // On by default.
+  void SetUseUserspaceNbd(bool use_userspace_nbd) {
+    use_userspace_nbd_ = use_userspace_nbd;
+  }
+
+  // Connections to a server allowing more than one, for kernel NBD devices
+  void SetMaxNbdConnections(int max_nbd_connections) {
+    max_nbd_connections_ = max_nbd_connections;
+  }
+
+ private:
+  bool use_userspace_nbd_;
+  int max_nbd_connections_;
 };
 
 } // datto_linux_client
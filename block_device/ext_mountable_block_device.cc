@@ -3,6 +3,9 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <vector>
+
 #include <glog/logging.h>
 
 #include "block_device/block_device_exception.h"
@@ -14,90 +17,161 @@
 
 namespace datto_linux_client {
 
-ExtMountableBlockDevice::ExtMountableBlockDevice(std::string a_path,
-                                                 bool is_ext2)
-    : MountableBlockDevice(a_path), is_ext2_(is_ext2) { }
+namespace {
 
-std::shared_ptr<const SectorSet> ExtMountableBlockDevice::GetInUseSectors() {
-  std::shared_ptr<SectorSet> sectors(new SectorSet());
-  ExtErrorTable error_table;
-
-  FreezeHelper freeze_helper(*this, 2000);
-
-  std::unique_ptr<ExtFileSystem> ext_fs;
-  freeze_helper.RunWhileFrozen([&]() {
-    ext_fs = std::unique_ptr<ExtFileSystem>(
-        new ExtFileSystem(BlockDevice::path(), error_table));
-  });
-
-  uint32_t bitmap_size;
-  uint32_t block_size;
-  uint32_t blocks_per_group;
-  uint64_t blocks_count;
-  uint64_t group_desc_count;
-  uint64_t sectors_per_block;
-
-  freeze_helper.RunWhileFrozen([&]() {
-    blocks_per_group = ext_fs->super()->s_blocks_per_group;
-    block_size = 0x400 << ext_fs->super()->s_log_block_size;
-    sectors_per_block = block_size / 512;
-    bitmap_size = my_roundup(blocks_per_group, 8) / 8;
-    group_desc_count = ext_fs->group_desc_count();
-    blocks_count = ext_fs->super()->s_blocks_count;
-  });
-
-  std::unique_ptr<char[]> block_bitmap(new char[bitmap_size]);
-
-  // First two sectors (sector 0, 1) are always included as it isn't managed by
-  // the fs
-  sectors->insert(SectorInterval(0, 2));
-
-
-  // Iterates over every group in the file system
-  for (uint64_t i = 0; i < group_desc_count; ++i) {
-    off_t cur_group_block_offset;
-    DLOG(INFO) << "Checking ext group #" << i;
-    freeze_helper.RunWhileFrozen([&]() {
-      // Calculate the block offset for the current group
-      cur_group_block_offset = ext_fs->super()->s_first_data_block +
-                                   (i * blocks_per_group);
-
-      // Load the block bitmap for this group
-      ext2fs_get_block_bitmap_range(ext_fs->block_map(),
-                                    cur_group_block_offset,
-                                    blocks_per_group,
-                                    block_bitmap.get());
+// Adds [lower, upper) to the end of batch, extending the last interval if
+// they touch or overlap
+void AppendRun(std::vector<SectorInterval> *const batch,
+               uint64_t lower, uint64_t upper) {
+  if (!batch->empty() && batch->back().upper() >= lower) {
+    if (upper > batch->back().upper()) {
+      batch->back() = SectorInterval(batch->back().lower(), upper);
+    }
+    return;
+  }
+  batch->push_back(SectorInterval(lower, upper));
+}
+
+// Scans the block bitmap of each ext group in order. Runs of allocated
+// blocks are produced as single intervals, a few groups at a time.
+class ExtInUseSectorProducer : public InUseSectorProducer {
+ public:
+  // Small batches let the caller start copying before the scan is done
+  static const uint64_t GROUPS_PER_BATCH = 64;
+
+  ExtInUseSectorProducer(MountableBlockDevice &block_device,
+                         const std::string &path)
+      : error_table_(),
+        freeze_helper_(block_device, 2000),
+        ext_fs_(),
+        next_group_(0),
+        sent_boot_sectors_(false),
+        total_sectors_(0) {
+    freeze_helper_.RunWhileFrozen([&]() {
+      ext_fs_ = std::unique_ptr<ExtFileSystem>(
+          new ExtFileSystem(path, error_table_));
     });
 
+    freeze_helper_.RunWhileFrozen([&]() {
+      blocks_per_group_ = ext_fs_->super()->s_blocks_per_group;
+      uint32_t block_size = 0x400 << ext_fs_->super()->s_log_block_size;
+      sectors_per_block_ = block_size / 512;
+      group_desc_count_ = ext_fs_->group_desc_count();
+      blocks_count_ = ext_fs_->super()->s_blocks_count;
+    });
+    freeze_helper_.ThawNow();
+
+    uint32_t bitmap_size = my_roundup(blocks_per_group_, 8) / 8;
+    block_bitmap_ = std::unique_ptr<char[]>(new char[bitmap_size]);
+  }
+
+  virtual bool NextBatch(std::vector<SectorInterval> *const batch) {
+    batch->clear();
+
+    if (!sent_boot_sectors_) {
+      // First two sectors (sector 0, 1) are always included as it isn't
+      // managed by the fs
+      batch->push_back(SectorInterval(0, 2));
+      sent_boot_sectors_ = true;
+    }
+
+    while (batch->empty() && next_group_ < group_desc_count_) {
+      uint64_t end_group = std::min(next_group_ + GROUPS_PER_BATCH,
+                                    group_desc_count_);
+      for (; next_group_ < end_group; ++next_group_) {
+        AddGroup(next_group_, batch);
+      }
+    }
+
+    for (const SectorInterval &interval : *batch) {
+      total_sectors_ += boost::icl::cardinality(interval);
+    }
+    if (batch->empty()) {
+      LOG(INFO) << "ext file system is size " << total_sectors_ * 512;
+    }
+    return !batch->empty();
+  }
+
+ private:
+  void AddGroup(uint64_t group, std::vector<SectorInterval> *const batch) {
+    DLOG(INFO) << "Checking ext group #" << group;
+    off_t cur_group_block_offset = ext_fs_->super()->s_first_data_block +
+                                   (group * blocks_per_group_);
+
+    // The bitmaps were read into memory under the freeze when the file
+    // system was opened, so this only copies from that
+    ext2fs_get_block_bitmap_range(ext_fs_->block_map(),
+                                  cur_group_block_offset,
+                                  blocks_per_group_,
+                                  block_bitmap_.get());
+
+    // Stop at the end of this group or the end of the file system
+    uint64_t num_blocks = blocks_per_group_;
+    if (cur_group_block_offset + num_blocks > blocks_count_) {
+      num_blocks = blocks_count_ > (uint64_t)cur_group_block_offset ?
+                   blocks_count_ - cur_group_block_offset : 0;
+    }
 
-    // Iterate over every block assigned to this group
-    // Break if we have reached the end of this group (locks_per_group)
-    // or the end of the file system (s_blocks_count)
-    for (uint64_t j = 0;
-         (j < blocks_per_group &&
-            (j + cur_group_block_offset < blocks_count));
-         ++j) {
-      if (ext2fs_test_bit(j, block_bitmap.get())) {
-        // If the bit is set then the block is allocated.
-        off_t cur_block_offset = cur_group_block_offset + j;
-
-        // Calculate the sector for the current block
-        uint64_t sector_location = sectors_per_block * cur_block_offset;
-
-        // Insert an interval starting at the sector for the current block
-        // and ending at the last sector for the current block
-        // Remember that the SectorIntervals are [x, y) where x is 
-        // inclusive and y is exclusive.
-        sectors->insert(SectorInterval(sector_location,
-              sector_location + sectors_per_block));
+    // Blocks are added as runs, a byte of the bitmap at a time when it is
+    // entirely free or entirely allocated
+    const unsigned char *bitmap =
+        reinterpret_cast<const unsigned char *>(block_bitmap_.get());
+    uint64_t j = 0;
+    while (j < num_blocks) {
+      if (j % 8 == 0 && j + 8 <= num_blocks &&
+          (bitmap[j / 8] == 0 || bitmap[j / 8] == 0xff)) {
+        if (bitmap[j / 8] == 0xff) {
+          AddBlocks(cur_group_block_offset + j, 8, batch);
+        }
+        j += 8;
+        continue;
       }
+      if (ext2fs_test_bit(j, block_bitmap_.get())) {
+        AddBlocks(cur_group_block_offset + j, 1, batch);
+      }
+      ++j;
     }
   }
 
-  LOG(INFO) << "ext file system is size "
-            << boost::icl::cardinality(*sectors) * 512;
+  void AddBlocks(uint64_t first_block, uint64_t num_blocks,
+                 std::vector<SectorInterval> *const batch) {
+    uint64_t sector_location = sectors_per_block_ * first_block;
+    AppendRun(batch, sector_location,
+              sector_location + sectors_per_block_ * num_blocks);
+  }
+
+  ExtErrorTable error_table_;
+  FreezeHelper freeze_helper_;
+  std::unique_ptr<ExtFileSystem> ext_fs_;
+  std::unique_ptr<char[]> block_bitmap_;
+
+  uint32_t blocks_per_group_;
+  uint64_t sectors_per_block_;
+  uint64_t group_desc_count_;
+  uint64_t blocks_count_;
+
+  uint64_t next_group_;
+  bool sent_boot_sectors_;
+  uint64_t total_sectors_;
+};
+
+const uint64_t ExtInUseSectorProducer::GROUPS_PER_BATCH;
+
+} // unnamed namespace
+
+ExtMountableBlockDevice::ExtMountableBlockDevice(std::string a_path,
+                                                 bool is_ext2)
+    : MountableBlockDevice(a_path), is_ext2_(is_ext2) { }
+
+std::shared_ptr<const SectorSet> ExtMountableBlockDevice::GetInUseSectors() {
+  ExtInUseSectorProducer producer(*this, BlockDevice::path());
+  return CollectInUseSectors(&producer);
+}
 
-  return sectors;
+std::unique_ptr<InUseSectorProducer>
+ExtMountableBlockDevice::CreateInUseSectorProducer() {
+  return std::unique_ptr<InUseSectorProducer>(
+      new ExtInUseSectorProducer(*this, BlockDevice::path()));
 }
 
 void ExtMountableBlockDevice::Freeze() {
@@ -14,6 +14,7 @@ class ExtMountableBlockDevice : public MountableBlockDevice {
  public:
   explicit ExtMountableBlockDevice(std::string path, bool is_ext2);
   virtual std::shared_ptr<const SectorSet> GetInUseSectors();
+  virtual std::unique_ptr<InUseSectorProducer> CreateInUseSectorProducer();
   virtual void Freeze();
   virtual void Thaw();
  private:
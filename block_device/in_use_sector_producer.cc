@@ -0,0 +1,35 @@
+#include "block_device/in_use_sector_producer.h"
+
+namespace datto_linux_client {
+
+const size_t SectorSetProducer::INTERVALS_PER_BATCH;
+
+SectorSetProducer::SectorSetProducer(
+    std::shared_ptr<const SectorSet> sector_set)
+    : sector_set_(sector_set),
+      next_(sector_set_->begin()) { }
+
+bool SectorSetProducer::NextBatch(std::vector<SectorInterval> *const batch) {
+  batch->clear();
+  while (next_ != sector_set_->end() &&
+         batch->size() < INTERVALS_PER_BATCH) {
+    batch->push_back(*next_);
+    ++next_;
+  }
+  return !batch->empty();
+}
+
+std::shared_ptr<SectorSet> CollectInUseSectors(
+    InUseSectorProducer *producer) {
+  std::shared_ptr<SectorSet> sectors(new SectorSet());
+  std::vector<SectorInterval> batch;
+  while (producer->NextBatch(&batch)) {
+    // Batches are sorted, so always append at the end
+    for (const SectorInterval &interval : batch) {
+      sectors->add(sectors->end(), interval);
+    }
+  }
+  return sectors;
+}
+
+}
@@ -0,0 +1,49 @@
+#ifndef DATTO_CLIENT_BLOCK_DEVICE_IN_USE_SECTOR_PRODUCER_H_
+#define DATTO_CLIENT_BLOCK_DEVICE_IN_USE_SECTOR_PRODUCER_H_
+
+#include <memory>
+#include <vector>
+#include <stddef.h>
+
+#include "unsynced_sector_manager/sector_interval.h"
+#include "unsynced_sector_manager/sector_set.h"
+
+namespace datto_linux_client {
+
+// InUseSectorProducer hands out the in-use sectors of a filesystem a batch
+// at a time, so work on the first batches can start before the whole
+// filesystem has been scanned.
+class InUseSectorProducer {
+ public:
+  // Replaces the contents of batch with the next intervals. Intervals are
+  // sorted, don't overlap, and don't start before the end of the previous
+  // batch. Returns false once everything has been produced.
+  virtual bool NextBatch(std::vector<SectorInterval> *const batch) = 0;
+
+  virtual ~InUseSectorProducer() {}
+
+  InUseSectorProducer(const InUseSectorProducer &) = delete;
+  InUseSectorProducer& operator=(const InUseSectorProducer &) = delete;
+ protected:
+  InUseSectorProducer() {}
+};
+
+// Produces the intervals of a SectorSet that has already been built
+class SectorSetProducer : public InUseSectorProducer {
+ public:
+  static const size_t INTERVALS_PER_BATCH = 4096;
+
+  explicit SectorSetProducer(std::shared_ptr<const SectorSet> sector_set);
+  virtual bool NextBatch(std::vector<SectorInterval> *const batch);
+
+ private:
+  std::shared_ptr<const SectorSet> sector_set_;
+  SectorSet::const_iterator next_;
+};
+
+// Runs producer to completion and returns everything it produced
+std::shared_ptr<SectorSet> CollectInUseSectors(InUseSectorProducer *producer);
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_DEVICE_IN_USE_SECTOR_PRODUCER_H_
@@ -148,6 +148,12 @@ void MountableBlockDevice::CloseMount() {
   close(mount_file_descriptor_);
 }
 
+std::unique_ptr<InUseSectorProducer>
+MountableBlockDevice::CreateInUseSectorProducer() {
+  return std::unique_ptr<InUseSectorProducer>(
+      new SectorSetProducer(GetInUseSectors()));
+}
+
 std::string MountableBlockDevice::GetUuid() const {
   char *uuid = ::blkid_get_tag_value(NULL, "UUID", path_.c_str());
   if (!uuid) {
@@ -8,6 +8,7 @@
 #include <time.h>
 
 #include "block_device/block_device.h"
+#include "block_device/in_use_sector_producer.h"
 #include "unsynced_sector_manager/sector_set.h"
 
 namespace datto_linux_client {
@@ -31,6 +32,11 @@ class MountableBlockDevice : public BlockDevice {
   // These will be relative from the start of the partition
   virtual std::shared_ptr<const SectorSet> GetInUseSectors() = 0;
 
+  // Same sectors as GetInUseSectors, but in batches as the filesystem is
+  // scanned. The default scans everything up front. The producer must not
+  // outlive this device.
+  virtual std::unique_ptr<InUseSectorProducer> CreateInUseSectorProducer();
+
   // Return a file descriptor for the mount point
   // Throw an exception if one is already open, or if
   // it isn't mounted
@@ -7,11 +7,19 @@
 namespace datto_linux_client {
 
 NbdBlockDevice::NbdBlockDevice(std::string remote_host, uint16_t remote_port)
+    : NbdBlockDevice(remote_host, remote_port,
+                     NbdClient::DEFAULT_MAX_CONNECTIONS, 0, 0) {}
+
+NbdBlockDevice::NbdBlockDevice(std::string remote_host, uint16_t remote_port,
+                               int max_connections,
+                               uint32_t block_size_bytes,
+                               uint32_t max_sectors_kb)
     : RemoteBlockDevice() {
   DLOG(INFO) << "Creating nbd client for host " << remote_host
              << " and port " << remote_port;
-  nbd_client_ = std::unique_ptr<NbdClient>(new NbdClient(remote_host,
-                                                         remote_port));
+  nbd_client_ = std::unique_ptr<NbdClient>(new NbdClient(
+      remote_host, remote_port, max_connections, block_size_bytes,
+      max_sectors_kb));
 
   path_ = (nbd_client_)->nbd_device_path();
   LOG(INFO) << "NBD Path: " << path_;
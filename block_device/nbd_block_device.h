@@ -17,6 +17,11 @@ class NbdBlockDevice : public RemoteBlockDevice {
   // local_block_path is the *local* block device (e.g. /dev/nbd0)
   NbdBlockDevice(std::string remote_host, uint16_t remote_port);
 
+  // The rest is passed to the NbdClient, see there
+  NbdBlockDevice(std::string remote_host, uint16_t remote_port,
+                 int max_connections, uint32_t block_size_bytes,
+                 uint32_t max_sectors_kb);
+
   bool IsConnected() const;
   void Disconnect();
 
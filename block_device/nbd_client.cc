@@ -1,24 +1,31 @@
 #include "block_device/nbd_client.h"
 
 #include <dirent.h>
-#include <endian.h>
 #include <fcntl.h>
 #include <glog/logging.h>
 #include <linux/nbd.h>
-#include <netdb.h>
+#include <string.h>
 #include <sys/ioctl.h>
-#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "block_device/nbd_exception.h"
+#include "block_device/nbd_negotiation.h"
+#include "block_device/nbd_protocol.h"
+#include "block_device/nbd_socket.h"
 
 namespace {
 using ::datto_linux_client::NbdException;
 
-const char NBD_ACK_MAGIC[] = "NBDMAGIC";
-const uint64_t NBD_NEGOTIATE_MAGIC = 0x00420281861253LL;
+const uint32_t DEFAULT_BLOCK_SIZE_BYTES = 4096;
+
+// Seconds the kernel waits on a request before failing it
+const uint64_t REQUEST_TIMEOUT_SECONDS = 10;
+
+// How long Disconnect waits for the kernel to tear down a device connected
+// over netlink
+const int DISCONNECT_WAIT_MILLIS = 5000;
 
 void LoadNBDModule() {
   struct stat buf;
@@ -82,118 +89,129 @@ std::string FindOpenNbdDevice() {
   return open_device;
 }
 
-int OpenNbdSocket(std::string host, uint16_t port) {
-  int sock;
-
-  // see man 3 getaddrinfo
-  struct addrinfo hints = {};
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_ADDRCONFIG;
-  hints.ai_protocol = IPPROTO_TCP;
-
-  struct addrinfo *ai;
-  int err = getaddrinfo(host.c_str(), std::to_string(port).c_str(),
-                        &hints, &ai);
-  if (err) {
-    throw NbdException("getaddinfo error: " + std::string(gai_strerror(err)));
-  }
+// The pid file exists while the device is connected
+bool HasPidFile(const std::string &nbd_device_path) {
+  int last_slash_pos = nbd_device_path.rfind('/');
+  std::string block_device_name = nbd_device_path.substr(last_slash_pos + 1);
 
-  bool success = false;
-  for (struct addrinfo *ai_iter = ai;
-       ai_iter != NULL;
-       ai_iter = ai_iter->ai_next) {
-    sock = socket(ai_iter->ai_family, ai_iter->ai_socktype,
-                  ai_iter->ai_protocol);
-
-    if (sock == -1) {
-      continue;
-    }
+  std::string pid_path = "/sys/block/" + block_device_name + "/pid";
 
-    if (connect(sock, ai_iter->ai_addr, ai_iter->ai_addrlen) != -1) {
-      success = true;
-      break;
+  if (access(pid_path.c_str(), F_OK)) {
+    if (errno != ENOENT) {
+      PLOG(ERROR) << "access threw an unexpected error";
     }
+    return false;
   }
+  return true;
+}
 
-  freeaddrinfo(ai);
+// The kernel takes powers of two from 512 bytes to a page
+bool IsValidBlockSize(uint32_t block_size_bytes) {
+  return block_size_bytes >= 512 &&
+         block_size_bytes <= static_cast<uint32_t>(getpagesize()) &&
+         (block_size_bytes & (block_size_bytes - 1)) == 0;
+}
 
-  if (!success) {
-    throw NbdException("Unable to open socket");
-  }
+} // unnamed namespace
 
-  DLOG(INFO) << "Opened NBD socket";
+namespace datto_linux_client {
 
-  return sock;
-}
+const int NbdClient::DEFAULT_MAX_CONNECTIONS;
 
-// Header from server should be:
-// 8 bytes:   first magic
-// 8 bytes:   second (version based??) magic
-// 8 bytes:   size of remote block device
-// 4 bytes:   block device flags
-// 124 bytes: zeros
-void NegotiateNbdCommunication(int sock, uint64_t *block_device_size) {
-  // 9 0s so we can use strcmp below without issue
-  char buf[256] = "\0\0\0\0\0\0\0\0\0";
-  uint64_t second_magic;
-
-  if (read(sock, buf, 8) < 0) {
-    PLOG(ERROR) << "Read magic 1 from sock";
-    throw NbdException("Unable to read first magic from socket");
-  }
+NbdClient::NbdClient(std::string a_host, uint16_t a_port)
+    : NbdClient(a_host, a_port, DEFAULT_MAX_CONNECTIONS, 0, 0) {}
 
-  if (strlen(buf) == 0) {
-    throw NbdException("Server closed connection before sending data");
-  }
+NbdClient::NbdClient(std::string a_host, uint16_t a_port,
+                     int max_connections, uint32_t block_size_bytes,
+                     uint32_t max_sectors_kb)
+    : host_(a_host),
+      port_(a_port),
+      disconnect_(false),
+      block_device_size_(0),
+      block_size_bytes_(DEFAULT_BLOCK_SIZE_BYTES),
+      transmission_flags_(0),
+      netlink_(),
+      nbd_index_(-1),
+      nbd_fd_(-1),
+      socks_() {
 
-  if (strcmp(buf, NBD_ACK_MAGIC)) {
-    LOG(ERROR) << "Got bad first NBD magic number 0x"
-               << std::hex << (uint64_t)buf << std::dec;
-    throw NbdException("Got bad first magic number");
-  }
+  LoadNBDModule();
 
-  if (read(sock, &second_magic, sizeof(second_magic)) < 0) {
-    PLOG(ERROR) << "Read magic 2 from sock";
-    throw NbdException("Unable to read second magic from socket");
+  try {
+    netlink_ = std::unique_ptr<NbdNetlink>(new NbdNetlink());
+  } catch (const NbdException &e) {
+    LOG(WARNING) << "No NBD netlink interface, using a single connection";
+    max_connections = 1;
   }
-  second_magic = be64toh(second_magic);
 
-  if (second_magic != NBD_NEGOTIATE_MAGIC) {
-    LOG(ERROR) << "Got bad second NBD magic number 0x"
-               << std::hex << second_magic << std::dec;
-    throw NbdException("Got bad second magic number");
+  if (IsValidBlockSize(block_size_bytes)) {
+    block_size_bytes_ = block_size_bytes;
+  } else if (block_size_bytes) {
+    LOG(WARNING) << "Using " << block_size_bytes_ << " byte NBD blocks "
+                 << "instead of " << block_size_bytes;
   }
 
-  if (read(sock, block_device_size, sizeof(*block_device_size)) < 0) {
-    PLOG(ERROR) << "Read block size from sock";
-    throw NbdException("Unable to read block size from socket");
+  try {
+    OpenSockets(max_connections);
+
+    if (netlink_) {
+      NbdDeviceConfig config;
+      config.size_bytes = block_device_size_;
+      config.block_size_bytes = block_size_bytes_;
+      config.server_flags = transmission_flags_;
+      config.timeout_seconds = REQUEST_TIMEOUT_SECONDS;
+      nbd_index_ = netlink_->Connect(socks_, config);
+      nbd_device_path_ = "/dev/nbd" + std::to_string(nbd_index_);
+      LOG(INFO) << "Connected " << nbd_device_path_ << " with "
+                << socks_.size() << " connections";
+    } else {
+      ConnectWithIoctls();
+    }
+  } catch (...) {
+    for (int sock : socks_) {
+      close(sock);
+    }
+    if (nbd_fd_ >= 0) {
+      close(nbd_fd_);
+    }
+    throw;
   }
 
-  *block_device_size = be64toh(*block_device_size);
-
-  // The server sends 124 bytes of zeros after the 4 byte flag argument.
-  // We skip the flag argument as not all kernels support it, so read 128.
-  if (read(sock, &buf, 128) < 0) {
-    PLOG(ERROR) << "Read negotiation zeros from sock";
-    throw NbdException("Unable to read final negotiation zeros from socket");
+  if (max_sectors_kb) {
+    SetMaxSectorsKb(max_sectors_kb);
   }
 }
 
-} // unnamed namespace
-
-namespace datto_linux_client {
-
-NbdClient::NbdClient(std::string a_host, uint16_t a_port)
-    : host_(a_host),
-      port_(a_port),
-      disconnect_(false) {
-
-  LoadNBDModule();
+void NbdClient::OpenSockets(int max_connections) {
+  while (true) {
+    int sock = OpenNbdSocket(host_, port_);
+    socks_.push_back(sock);
+    TuneNbdSocket(sock);
+
+    NbdExportInfo info = NegotiateNbdExport(sock, "");
+    if (socks_.size() == 1) {
+      block_device_size_ = info.size_bytes;
+      transmission_flags_ = info.transmission_flags;
+    } else if (info.size_bytes != block_device_size_ ||
+               info.transmission_flags != transmission_flags_) {
+      throw NbdException("Export changed between NBD connections");
+    }
 
-  sock_ = OpenNbdSocket(host_, port_);
-  NegotiateNbdCommunication(sock_, &block_device_size_);
+    // Each connection gets a share of the requests, which is only safe if
+    // the server says so
+    if (!(transmission_flags_ & nbd_protocol::FLAG_CAN_MULTI_CONN)) {
+      if (max_connections > 1) {
+        LOG(INFO) << "NBD server doesn't allow multiple connections";
+      }
+      return;
+    }
+    if (static_cast<int>(socks_.size()) >= max_connections) {
+      return;
+    }
+  }
+}
 
+void NbdClient::ConnectWithIoctls() {
   nbd_device_path_ = FindOpenNbdDevice();
   LOG(INFO) << "Found open NBD device " << nbd_device_path_;
 
@@ -228,13 +246,14 @@ NbdClient::NbdClient(std::string a_host, uint16_t a_port)
 }
 
 void NbdClient::ConfigureNbdDevice() {
-  if (ioctl(nbd_fd_, NBD_SET_BLKSIZE, 4096UL) < 0) {
+  if (ioctl(nbd_fd_, NBD_SET_BLKSIZE,
+            static_cast<unsigned long>(block_size_bytes_)) < 0) {
     PLOG(ERROR) << "NBD_SET_BLKSIZE";
     throw NbdException("Unable to set block size for NBD device");
   }
 
-  // Shifting by 12 (2^12 = 4096) is the way the original nbd code does it
-  if (ioctl(nbd_fd_, NBD_SET_SIZE_BLOCKS, block_device_size_ >> 12) < 0) {
+  if (ioctl(nbd_fd_, NBD_SET_SIZE_BLOCKS,
+            block_device_size_ / block_size_bytes_) < 0) {
     PLOG(ERROR) << "NBD_SET_SIZE_BLOCKS";
     throw NbdException("Unable to set block size for NBD device");
   }
@@ -244,40 +263,66 @@ void NbdClient::ConfigureNbdDevice() {
 
   // we use unsigned long because that's how it's defined in the kernel
   // function __nbd_ioctl
-  if (ioctl(nbd_fd_, NBD_SET_TIMEOUT, 10UL)) {
+  if (ioctl(nbd_fd_, NBD_SET_TIMEOUT,
+            static_cast<unsigned long>(REQUEST_TIMEOUT_SECONDS))) {
     PLOG(ERROR) << "NBD_SET_TIMEOUT";
     throw NbdException("Unable to set timeout for NBD device");
   }
 
-  if (ioctl(nbd_fd_, NBD_SET_SOCK, sock_) < 0) {
+  // Lets the kernel send flushes and trims. Not fatal, as the device works
+  // without them.
+  if (ioctl(nbd_fd_, NBD_SET_FLAGS,
+            static_cast<unsigned long>(transmission_flags_)) < 0) {
+    PLOG(WARNING) << "NBD_SET_FLAGS";
+  }
+
+  if (ioctl(nbd_fd_, NBD_SET_SOCK, socks_[0]) < 0) {
     PLOG(ERROR) << "NBD_SET_SOCK";
     throw NbdException("Unable to set socket for NBD device");
   }
 }
 
-bool NbdClient::IsConnected() {
+// Larger requests mean fewer round trips to the server. The kernel refuses
+// anything over max_hw_sectors_kb, which only costs the tuning.
+void NbdClient::SetMaxSectorsKb(uint32_t max_sectors_kb) {
   int last_slash_pos = nbd_device_path_.rfind('/');
-  std::string block_device_name = nbd_device_path_.substr(last_slash_pos + 1);
-
-  std::string pid_path = "/sys/block/" + block_device_name + "/pid";
-
-  LOG(INFO) << "Checking if " << pid_path << " exists for NBD connectivity";
-
-  if (access(pid_path.c_str(), F_OK)) {
-    if (errno == ENOENT) {
-      return false;
-    } else {
-      PLOG(ERROR) << "access threw an unexpected error";
-      return false;
-    }
+  std::string queue_path = "/sys/block/" +
+                           nbd_device_path_.substr(last_slash_pos + 1) +
+                           "/queue/max_sectors_kb";
+  std::string value = std::to_string(max_sectors_kb);
+
+  int fd = open(queue_path.c_str(), O_WRONLY);
+  if (fd < 0 || write(fd, value.c_str(), value.size()) < 0) {
+    PLOG(WARNING) << "Unable to set " << queue_path << " to " << value;
   }
-  return true;
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+bool NbdClient::IsConnected() {
+  LOG(INFO) << "Checking if " << nbd_device_path_
+            << " has a pid file for NBD connectivity";
+  return HasPidFile(nbd_device_path_);
 }
 
 void NbdClient::Disconnect() {
   if (!disconnect_) {
     LOG(INFO) << "Disconnecting NbdClient";
     disconnect_ = true;
+
+    if (nbd_index_ >= 0) {
+      netlink_->Disconnect(nbd_index_);
+      // Unlike NBD_DO_IT returning, nothing says when the kernel is done
+      for (int waited_millis = 0;
+           HasPidFile(nbd_device_path_) &&
+           waited_millis < DISCONNECT_WAIT_MILLIS;
+           waited_millis += 10) {
+        usleep(10000);
+      }
+      return;
+    }
+
     if (ioctl(nbd_fd_, NBD_DISCONNECT) < 0) {
       if (errno != EINVAL) {
         PLOG(ERROR) << "NBD_DISCONNECT";
@@ -304,8 +349,12 @@ NbdClient::~NbdClient() {
   } catch (const std::runtime_error &e) {
     LOG(ERROR) << e.what();
   }
-  close(nbd_fd_);
-  close(sock_);
+  if (nbd_fd_ >= 0) {
+    close(nbd_fd_);
+  }
+  for (int sock : socks_) {
+    close(sock);
+  }
 }
 
 }
@@ -3,15 +3,30 @@
 
 #include <stdint.h>
 #include <atomic>
+#include <memory>
 #include <string>
 #include <thread>
+#include <vector>
+
+#include "block_device/nbd_netlink.h"
 
 namespace datto_linux_client {
 
+// Connects a kernel nbd device to a server. Devices are set up over netlink
+// when the kernel supports it, with up to max_connections sockets if the
+// server allows more than one. Otherwise the ioctls are used with a single
+// socket.
 class NbdClient {
  public:
+  static const int DEFAULT_MAX_CONNECTIONS = 4;
+
   NbdClient(std::string host, uint16_t port);
 
+  // block_size_bytes and max_sectors_kb are applied to the nbd device, 0
+  // keeps the defaults
+  NbdClient(std::string host, uint16_t port, int max_connections,
+            uint32_t block_size_bytes, uint32_t max_sectors_kb);
+
   std::string host() const {
     return host_;
   }
@@ -21,6 +36,9 @@ class NbdClient {
   std::string nbd_device_path() const {
     return nbd_device_path_;
   }
+  int num_connections() const {
+    return socks_.size();
+  }
 
   bool IsConnected();
   void Disconnect();
@@ -30,7 +48,10 @@ class NbdClient {
   NbdClient(const NbdClient &);
   NbdClient& operator=(const NbdClient &);
  private:
+  void OpenSockets(int max_connections);
   void ConfigureNbdDevice();
+  void ConnectWithIoctls();
+  void SetMaxSectorsKb(uint32_t max_sectors_kb);
 
   std::string host_;
   uint16_t port_;
@@ -41,9 +62,16 @@ class NbdClient {
   std::thread nbd_do_it_thread_;
 
   uint64_t block_device_size_;
+  uint32_t block_size_bytes_;
+  uint16_t transmission_flags_;
+
+  // Null if the kernel has no nbd netlink family
+  std::unique_ptr<NbdNetlink> netlink_;
+  // Of the device connected over netlink, -1 with the ioctls
+  int nbd_index_;
 
   int nbd_fd_;
-  int sock_;
+  std::vector<int> socks_;
 
   std::string nbd_device_path_;
 };
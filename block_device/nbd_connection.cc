@@ -0,0 +1,328 @@
+#include "block_device/nbd_connection.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include <glog/logging.h>
+
+#include "block_device/nbd_exception.h"
+#include "block_device/nbd_negotiation.h"
+#include "block_device/nbd_protocol.h"
+#include "block_device/nbd_socket.h"
+
+namespace {
+
+using ::datto_linux_client::NbdException;
+using ::datto_linux_client::WriteVectorFully;
+
+// The server gets this long to finish what is in flight on disconnect
+const int DISCONNECT_WAIT_SECONDS = 10;
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+const size_t NbdConnection::DEFAULT_MAX_IN_FLIGHT;
+const uint32_t NbdConnection::MAX_REQUEST_BYTES;
+
+NbdConnection::NbdConnection(const std::string &host, uint16_t port,
+                             const std::string &export_name)
+    : NbdConnection(OpenNbdSocket(host, port), export_name,
+                    DEFAULT_MAX_IN_FLIGHT) {}
+
+NbdConnection::NbdConnection(int sock, const std::string &export_name,
+                             size_t max_in_flight)
+    : sock_(sock),
+      max_in_flight_(max_in_flight),
+      size_bytes_(0),
+      block_size_bytes_(0),
+      transmission_flags_(0),
+      mutex_(),
+      state_changed_(),
+      pending_(),
+      completed_(),
+      next_handle_(1),
+      is_connected_(false),
+      send_mutex_(),
+      disconnect_(false) {
+  TuneNbdSocket(sock_);
+
+  try {
+    NbdExportInfo info = NegotiateNbdExport(sock_, export_name);
+    size_bytes_ = info.size_bytes;
+    block_size_bytes_ = info.block_size_bytes;
+    transmission_flags_ = info.transmission_flags;
+  } catch (...) {
+    close(sock_);
+    throw;
+  }
+
+  LOG(INFO) << "Negotiated NBD export of " << size_bytes_ << " bytes, "
+            << "flags 0x" << std::hex << transmission_flags_ << std::dec;
+  if (transmission_flags_ & nbd_protocol::FLAG_READ_ONLY) {
+    LOG(WARNING) << "NBD export is read only";
+  }
+
+  is_connected_ = true;
+  receive_thread_ = std::thread(&NbdConnection::DoReceive, this);
+}
+
+bool NbdConnection::CanFlush() const {
+  return transmission_flags_ & nbd_protocol::FLAG_SEND_FLUSH;
+}
+
+bool NbdConnection::CanTrim() const {
+  return transmission_flags_ & nbd_protocol::FLAG_SEND_TRIM;
+}
+
+bool NbdConnection::CanWriteZeroes() const {
+  return transmission_flags_ & nbd_protocol::FLAG_SEND_WRITE_ZEROES;
+}
+
+uint64_t NbdConnection::AsyncRead(char *buf, uint32_t num_bytes,
+                                  uint64_t offset) {
+  return Submit(nbd_protocol::CMD_READ, buf, num_bytes, offset);
+}
+
+uint64_t NbdConnection::AsyncWrite(const char *buf, uint32_t num_bytes,
+                                   uint64_t offset) {
+  return Submit(nbd_protocol::CMD_WRITE, buf, num_bytes, offset);
+}
+
+uint64_t NbdConnection::AsyncTrim(uint32_t num_bytes, uint64_t offset) {
+  return Submit(nbd_protocol::CMD_TRIM, nullptr, num_bytes, offset);
+}
+
+uint64_t NbdConnection::AsyncWriteZeroes(uint32_t num_bytes,
+                                         uint64_t offset) {
+  return Submit(nbd_protocol::CMD_WRITE_ZEROES, nullptr, num_bytes, offset);
+}
+
+uint64_t NbdConnection::AsyncFlush() {
+  return Submit(nbd_protocol::CMD_FLUSH, nullptr, 0, 0);
+}
+
+void NbdConnection::Read(char *buf, uint32_t num_bytes, uint64_t offset) {
+  Wait(AsyncRead(buf, num_bytes, offset));
+}
+
+void NbdConnection::Write(const char *buf, uint32_t num_bytes,
+                          uint64_t offset) {
+  Wait(AsyncWrite(buf, num_bytes, offset));
+}
+
+void NbdConnection::Flush() {
+  Wait(AsyncFlush());
+}
+
+uint64_t NbdConnection::Submit(uint16_t type, const char *buf,
+                               uint32_t num_bytes, uint64_t offset) {
+  if ((type == nbd_protocol::CMD_READ || type == nbd_protocol::CMD_WRITE) &&
+      num_bytes > MAX_REQUEST_BYTES) {
+    throw NbdException("NBD request too large");
+  }
+
+  uint64_t handle;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    state_changed_.wait(lock, [&]() {
+      return pending_.size() < max_in_flight_ || !is_connected_;
+    });
+    if (!is_connected_) {
+      throw NbdException("NBD connection lost");
+    }
+    handle = next_handle_++;
+    PendingRequest &request = pending_[handle];
+    request.type = type;
+    request.read_buf = nullptr;
+    if (type == nbd_protocol::CMD_READ) {
+      request.read_buf = const_cast<char *>(buf);
+    }
+    request.num_bytes = num_bytes;
+  }
+
+  // The handle is opaque to the server, so it isn't byte swapped
+  nbd_protocol::Request request;
+  request.magic = htobe32(nbd_protocol::REQUEST_MAGIC);
+  request.flags = 0;
+  request.type = htobe16(type);
+  request.handle = handle;
+  request.offset = htobe64(offset);
+  request.length = htobe32(num_bytes);
+
+  struct iovec iov[2];
+  iov[0].iov_base = &request;
+  iov[0].iov_len = sizeof(request);
+  iov[1].iov_base = const_cast<char *>(buf);
+  iov[1].iov_len = num_bytes;
+  int iov_count = type == nbd_protocol::CMD_WRITE ? 2 : 1;
+
+  try {
+    std::lock_guard<std::mutex> send_lock(send_mutex_);
+    WriteVectorFully(sock_, iov, iov_count);
+  } catch (const NbdException &e) {
+    // Part of the request may have been sent, so nothing after it can be.
+    // The receive thread fails what is in flight once it sees the shutdown.
+    shutdown(sock_, SHUT_RDWR);
+    throw;
+  }
+  return handle;
+}
+
+// As this is the initial function of a thread, this method must not throw
+// an exception or the entire program will go down
+void NbdConnection::DoReceive() {
+  try {
+    while (true) {
+      nbd_protocol::SimpleReply reply;
+      ReadFully(sock_, &reply, sizeof(reply));
+      if (be32toh(reply.magic) != nbd_protocol::SIMPLE_REPLY_MAGIC) {
+        throw NbdException("Got bad reply magic number");
+      }
+
+      PendingRequest request;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto request_itr = pending_.find(reply.handle);
+        if (request_itr == pending_.end()) {
+          throw NbdException("Got reply for unknown request");
+        }
+        request = request_itr->second;
+      }
+
+      // Reads are the only replies with data, and only on success
+      int error = be32toh(reply.error);
+      if (request.type == nbd_protocol::CMD_READ && !error) {
+        ReadFully(sock_, request.read_buf, request.num_bytes);
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.erase(reply.handle);
+        completed_[reply.handle] = error;
+      }
+      state_changed_.notify_all();
+    }
+  } catch (const std::exception &e) {
+    if (!disconnect_) {
+      LOG(ERROR) << "NBD connection lost: " << e.what();
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_connected_ = false;
+    FailPending();
+  }
+  state_changed_.notify_all();
+}
+
+void NbdConnection::FailPending() {
+  for (const auto &request : pending_) {
+    completed_[request.first] = ENOTCONN;
+  }
+  pending_.clear();
+}
+
+void NbdConnection::Wait(uint64_t handle) {
+  int error;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    state_changed_.wait(lock, [&]() {
+      return completed_.count(handle) || !pending_.count(handle);
+    });
+    auto completed_itr = completed_.find(handle);
+    if (completed_itr == completed_.end()) {
+      throw NbdException("Waiting for unknown NBD request");
+    }
+    error = completed_itr->second;
+    completed_.erase(completed_itr);
+  }
+
+  if (error) {
+    LOG(ERROR) << "NBD request failed: " << strerror(error);
+    throw NbdException("NBD request failed");
+  }
+}
+
+void NbdConnection::WaitAll() {
+  int error = 0;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    state_changed_.wait(lock, [&]() { return pending_.empty(); });
+    for (const auto &completed : completed_) {
+      if (completed.second) {
+        error = completed.second;
+        break;
+      }
+    }
+    completed_.clear();
+  }
+
+  if (error) {
+    LOG(ERROR) << "NBD request failed: " << strerror(error);
+    throw NbdException("NBD request failed");
+  }
+}
+
+size_t NbdConnection::InFlight() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pending_.size();
+}
+
+bool NbdConnection::IsConnected() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return is_connected_ && !disconnect_;
+}
+
+void NbdConnection::Disconnect() {
+  if (disconnect_.exchange(true)) {
+    return;
+  }
+  LOG(INFO) << "Disconnecting NbdConnection";
+
+  bool is_idle;
+  bool is_connected;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    is_idle = state_changed_.wait_for(
+        lock, std::chrono::seconds(DISCONNECT_WAIT_SECONDS),
+        [&]() { return pending_.empty(); });
+    is_connected = is_connected_;
+  }
+  if (!is_idle) {
+    LOG(WARNING) << "Disconnecting with NBD requests in flight";
+  }
+
+  if (is_connected) {
+    nbd_protocol::Request request = {};
+    request.magic = htobe32(nbd_protocol::REQUEST_MAGIC);
+    request.type = htobe16(nbd_protocol::CMD_DISC);
+    try {
+      std::lock_guard<std::mutex> send_lock(send_mutex_);
+      WriteFully(sock_, &request, sizeof(request));
+    } catch (const NbdException &e) {
+      LOG(WARNING) << "Unable to send NBD disconnect: " << e.what();
+    }
+  }
+
+  // The server closes its end after a disconnect, but may not if it is
+  // misbehaving
+  shutdown(sock_, SHUT_RDWR);
+  if (receive_thread_.joinable()) {
+    receive_thread_.join();
+  }
+}
+
+NbdConnection::~NbdConnection() {
+  Disconnect();
+  close(sock_);
+}
+
+}
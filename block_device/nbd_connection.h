@@ -0,0 +1,125 @@
+#ifndef DATTO_CLIENT_BLOCK_DEVICE_NBD_CONNECTION_H_
+#define DATTO_CLIENT_BLOCK_DEVICE_NBD_CONNECTION_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace datto_linux_client {
+
+// NbdConnection speaks the NBD protocol to a server from user space, so
+// it needs neither the nbd module, a free /dev/nbdN, nor root. See
+// NegotiateNbdExport for the handshake.
+//
+// Requests are pipelined. The Async methods send a request and return its
+// handle without waiting for the reply, blocking only while max_in_flight
+// requests are outstanding. A reader thread matches replies to requests by
+// handle, so the server may complete them in any order. Write data is sent
+// straight from the caller's buffer.
+class NbdConnection {
+ public:
+  static const size_t DEFAULT_MAX_IN_FLIGHT = 64;
+  // Servers commonly refuse larger reads and writes. Trims and zeroing
+  // writes carry no payload, so they aren't limited.
+  static const uint32_t MAX_REQUEST_BYTES = 32 * 1024 * 1024;
+
+  NbdConnection(const std::string &host, uint16_t port,
+                const std::string &export_name);
+
+  // Takes ownership of sock, which must already be connected
+  NbdConnection(int sock, const std::string &export_name,
+                size_t max_in_flight);
+
+  uint64_t size_bytes() const {
+    return size_bytes_;
+  }
+
+  // What the server prefers, 4096 if it didn't say
+  uint32_t block_size_bytes() const {
+    return block_size_bytes_;
+  }
+
+  uint16_t transmission_flags() const {
+    return transmission_flags_;
+  }
+
+  bool CanFlush() const;
+  bool CanTrim() const;
+  bool CanWriteZeroes() const;
+
+  // buf must stay valid and, for writes, unchanged until the request is
+  // done. These throw an NbdException if the connection is lost.
+  uint64_t AsyncRead(char *buf, uint32_t num_bytes, uint64_t offset);
+  uint64_t AsyncWrite(const char *buf, uint32_t num_bytes, uint64_t offset);
+  uint64_t AsyncTrim(uint32_t num_bytes, uint64_t offset);
+  uint64_t AsyncWriteZeroes(uint32_t num_bytes, uint64_t offset);
+  uint64_t AsyncFlush();
+
+  // Returns once the request is done. Throws an NbdException if it failed
+  // or the connection was lost before it was done.
+  void Wait(uint64_t handle);
+
+  // Wait for every request sent so far, throwing for the first that
+  // failed. Their handles can't be waited for afterwards.
+  void WaitAll();
+
+  void Read(char *buf, uint32_t num_bytes, uint64_t offset);
+  void Write(const char *buf, uint32_t num_bytes, uint64_t offset);
+  void Flush();
+
+  size_t InFlight() const;
+
+  bool IsConnected() const;
+  // Requests still in flight fail. Doesn't throw if already disconnected.
+  void Disconnect();
+
+  ~NbdConnection();
+
+  NbdConnection(const NbdConnection &) = delete;
+  NbdConnection& operator=(const NbdConnection &) = delete;
+
+ private:
+  struct PendingRequest {
+    uint16_t type;
+    // Where a read's data goes
+    char *read_buf;
+    uint32_t num_bytes;
+  };
+
+  uint64_t Submit(uint16_t type, const char *buf, uint32_t num_bytes,
+                  uint64_t offset);
+  void DoReceive();
+  // Fails everything in flight. Must be called with mutex_ held.
+  void FailPending();
+
+  int sock_;
+  size_t max_in_flight_;
+
+  uint64_t size_bytes_;
+  uint32_t block_size_bytes_;
+  uint16_t transmission_flags_;
+
+  // Guards everything below, except sending which is under send_mutex_
+  mutable std::mutex mutex_;
+  std::condition_variable state_changed_;
+  std::map<uint64_t, PendingRequest> pending_;
+  // By handle, the errno the server returned. Removed once waited for.
+  std::map<uint64_t, int> completed_;
+  uint64_t next_handle_;
+  bool is_connected_;
+
+  // Requests are written whole, one at a time
+  std::mutex send_mutex_;
+
+  std::atomic<bool> disconnect_;
+  std::thread receive_thread_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_DEVICE_NBD_CONNECTION_H_
@@ -0,0 +1,204 @@
+#include "block_device/nbd_negotiation.h"
+
+#include <endian.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <glog/logging.h>
+
+#include "block_device/nbd_exception.h"
+#include "block_device/nbd_protocol.h"
+#include "block_device/nbd_socket.h"
+
+namespace {
+
+using ::datto_linux_client::NbdException;
+using ::datto_linux_client::NbdExportInfo;
+using ::datto_linux_client::ReadFully;
+using ::datto_linux_client::WriteFully;
+using ::datto_linux_client::WriteVectorFully;
+namespace nbd_protocol = ::datto_linux_client::nbd_protocol;
+
+const uint32_t DEFAULT_BLOCK_SIZE_BYTES = 4096;
+
+struct __attribute__((packed)) OptionHeader {
+  uint64_t magic;
+  uint32_t option;
+  uint32_t length;
+};
+
+struct __attribute__((packed)) OptionReplyHeader {
+  uint64_t magic;
+  uint32_t option;
+  uint32_t type;
+  uint32_t length;
+};
+
+void SendOption(int sock, uint32_t option, const std::string &data) {
+  OptionHeader header;
+  header.magic = htobe64(nbd_protocol::OPTS_MAGIC);
+  header.option = htobe32(option);
+  header.length = htobe32(data.size());
+
+  struct iovec iov[2];
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = const_cast<char *>(data.data());
+  iov[1].iov_len = data.size();
+  WriteVectorFully(sock, iov, 2);
+}
+
+void AppendBe16(std::string *data, uint16_t value) {
+  value = htobe16(value);
+  data->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void AppendBe32(std::string *data, uint32_t value) {
+  value = htobe32(value);
+  data->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+T ReadAt(const std::string &data, size_t offset) {
+  T value;
+  memcpy(&value, data.data() + offset, sizeof(value));
+  return value;
+}
+
+// Oldstyle servers follow the magic with:
+// 8 bytes:   size of the export
+// 4 bytes:   flags, the transmission flags are the low 16 bits
+// 124 bytes: zeros
+void NegotiateOldstyle(int sock, NbdExportInfo *info) {
+  char buf[124];
+  uint32_t flags;
+  ReadFully(sock, &info->size_bytes, sizeof(info->size_bytes));
+  ReadFully(sock, &flags, sizeof(flags));
+  ReadFully(sock, buf, sizeof(buf));
+  info->size_bytes = be64toh(info->size_bytes);
+  info->transmission_flags = be32toh(flags) & 0xffff;
+}
+
+// Returns false if the server doesn't support NBD_OPT_GO
+bool NegotiateGo(int sock, const std::string &export_name,
+                 NbdExportInfo *info) {
+  std::string data;
+  AppendBe32(&data, export_name.size());
+  data += export_name;
+  // Asking for the block size, the export info is always sent
+  AppendBe16(&data, 1);
+  AppendBe16(&data, nbd_protocol::INFO_BLOCK_SIZE);
+  SendOption(sock, nbd_protocol::OPT_GO, data);
+
+  bool has_export_info = false;
+  while (true) {
+    OptionReplyHeader header;
+    ReadFully(sock, &header, sizeof(header));
+    uint32_t type = be32toh(header.type);
+    std::string reply(be32toh(header.length), '\0');
+    if (!reply.empty()) {
+      ReadFully(sock, &reply[0], reply.size());
+    }
+
+    if (be64toh(header.magic) != nbd_protocol::REP_MAGIC) {
+      throw NbdException("Got bad option reply magic number");
+    } else if (type == nbd_protocol::REP_ACK) {
+      break;
+    } else if (type == nbd_protocol::REP_ERR_UNSUP) {
+      VLOG(1) << "Server doesn't support NBD_OPT_GO";
+      return false;
+    } else if (type & nbd_protocol::REP_FLAG_ERROR) {
+      LOG(ERROR) << "Server refused export '" << export_name << "': "
+                 << reply;
+      throw NbdException("Server refused export");
+    } else if (type != nbd_protocol::REP_INFO || reply.size() < 2) {
+      continue;
+    }
+
+    uint16_t info_type = be16toh(ReadAt<uint16_t>(reply, 0));
+    if (info_type == nbd_protocol::INFO_EXPORT && reply.size() >= 12) {
+      info->size_bytes = be64toh(ReadAt<uint64_t>(reply, 2));
+      info->transmission_flags = be16toh(ReadAt<uint16_t>(reply, 10));
+      has_export_info = true;
+    } else if (info_type == nbd_protocol::INFO_BLOCK_SIZE &&
+               reply.size() >= 14) {
+      // Minimum, preferred and maximum
+      uint32_t preferred = be32toh(ReadAt<uint32_t>(reply, 6));
+      if (preferred) {
+        info->block_size_bytes = preferred;
+      }
+    }
+  }
+
+  if (!has_export_info) {
+    throw NbdException("Server didn't describe the export");
+  }
+  return true;
+}
+
+void NegotiateExportName(int sock, const std::string &export_name,
+                         bool no_zeroes, NbdExportInfo *info) {
+  SendOption(sock, nbd_protocol::OPT_EXPORT_NAME, export_name);
+
+  ReadFully(sock, &info->size_bytes, sizeof(info->size_bytes));
+  ReadFully(sock, &info->transmission_flags,
+            sizeof(info->transmission_flags));
+  info->size_bytes = be64toh(info->size_bytes);
+  info->transmission_flags = be16toh(info->transmission_flags);
+
+  if (!no_zeroes) {
+    char buf[124];
+    ReadFully(sock, buf, sizeof(buf));
+  }
+}
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+NbdExportInfo NegotiateNbdExport(int sock, const std::string &export_name) {
+  NbdExportInfo info;
+  info.size_bytes = 0;
+  info.block_size_bytes = DEFAULT_BLOCK_SIZE_BYTES;
+  info.transmission_flags = 0;
+
+  uint64_t magic;
+  ReadFully(sock, &magic, sizeof(magic));
+  if (be64toh(magic) != nbd_protocol::INIT_MAGIC) {
+    LOG(ERROR) << "Got bad first NBD magic number 0x"
+               << std::hex << be64toh(magic) << std::dec;
+    throw NbdException("Got bad first magic number");
+  }
+
+  ReadFully(sock, &magic, sizeof(magic));
+  magic = be64toh(magic);
+  if (magic == nbd_protocol::OLDSTYLE_MAGIC) {
+    NegotiateOldstyle(sock, &info);
+    return info;
+  } else if (magic != nbd_protocol::OPTS_MAGIC) {
+    LOG(ERROR) << "Got bad second NBD magic number 0x"
+               << std::hex << magic << std::dec;
+    throw NbdException("Got bad second magic number");
+  }
+
+  uint16_t handshake_flags;
+  ReadFully(sock, &handshake_flags, sizeof(handshake_flags));
+  handshake_flags = be16toh(handshake_flags);
+
+  uint32_t client_flags = handshake_flags &
+                          (nbd_protocol::FLAG_FIXED_NEWSTYLE |
+                           nbd_protocol::FLAG_NO_ZEROES);
+  client_flags = htobe32(client_flags);
+  WriteFully(sock, &client_flags, sizeof(client_flags));
+
+  // Only fixed newstyle servers answer options other than EXPORT_NAME
+  if (!(handshake_flags & nbd_protocol::FLAG_FIXED_NEWSTYLE) ||
+      !NegotiateGo(sock, export_name, &info)) {
+    NegotiateExportName(sock, export_name,
+                        handshake_flags & nbd_protocol::FLAG_NO_ZEROES,
+                        &info);
+  }
+  return info;
+}
+
+}
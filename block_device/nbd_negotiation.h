@@ -0,0 +1,26 @@
+#ifndef DATTO_CLIENT_BLOCK_DEVICE_NBD_NEGOTIATION_H_
+#define DATTO_CLIENT_BLOCK_DEVICE_NBD_NEGOTIATION_H_
+
+#include <stdint.h>
+
+#include <string>
+
+namespace datto_linux_client {
+
+// What the server said about an export during the handshake
+struct NbdExportInfo {
+  uint64_t size_bytes;
+  // What the server prefers, 4096 if it didn't say
+  uint32_t block_size_bytes;
+  uint16_t transmission_flags;
+};
+
+// Does the handshake on a connected socket, leaving it ready for requests.
+// Negotiation is fixed newstyle with NBD_OPT_GO, falling back to
+// NBD_OPT_EXPORT_NAME and to oldstyle servers. Throws an NbdException on
+// failure.
+NbdExportInfo NegotiateNbdExport(int sock, const std::string &export_name);
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_DEVICE_NBD_NEGOTIATION_H_
@@ -0,0 +1,215 @@
+#include "block_device/nbd_netlink.h"
+
+#include <errno.h>
+#include <linux/genetlink.h>
+#include <linux/nbd-netlink.h>
+#include <linux/netlink.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+#include "block_device/nbd_exception.h"
+
+namespace {
+
+using ::datto_linux_client::NbdException;
+
+// Replies here are small, the largest is the family description
+const size_t RECEIVE_BUFFER_BYTES = 32 * 1024;
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+NbdNetlink::NbdNetlink() : NbdNetlink(NBD_GENL_FAMILY_NAME) {}
+
+NbdNetlink::NbdNetlink(const std::string &family_name)
+    : sock_(-1),
+      sequence_(0),
+      family_id_(0) {
+  sock_ = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+  if (sock_ < 0) {
+    PLOG(ERROR) << "Unable to open generic netlink socket";
+    throw NbdException("Unable to open generic netlink socket");
+  }
+
+  try {
+    // The family name includes its terminator
+    AddAttribute(CTRL_ATTR_FAMILY_NAME, family_name.c_str(),
+                 family_name.size() + 1);
+    std::string payload = Request(GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 1);
+    int64_t family_id = FindAttribute(payload, CTRL_ATTR_FAMILY_ID);
+    if (family_id < 0) {
+      throw NbdException("No family id in netlink reply");
+    }
+    family_id_ = family_id;
+  } catch (...) {
+    close(sock_);
+    throw;
+  }
+  DLOG(INFO) << "Netlink family " << family_name << " is " << family_id_;
+}
+
+int NbdNetlink::Connect(const std::vector<int> &socks,
+                        const NbdDeviceConfig &config) {
+  AddU64(NBD_ATTR_SIZE_BYTES, config.size_bytes);
+  AddU64(NBD_ATTR_BLOCK_SIZE_BYTES, config.block_size_bytes);
+  AddU64(NBD_ATTR_SERVER_FLAGS, config.server_flags);
+  AddU64(NBD_ATTR_TIMEOUT, config.timeout_seconds);
+  BeginNested(NBD_ATTR_SOCKETS);
+  for (int sock : socks) {
+    BeginNested(NBD_SOCK_ITEM);
+    AddU32(NBD_SOCK_FD, sock);
+    EndNested();
+  }
+  EndNested();
+
+  // Without NBD_ATTR_INDEX the kernel finds a free device
+  std::string payload = Request(family_id_, NBD_CMD_CONNECT,
+                                NBD_GENL_VERSION);
+  int64_t index = FindAttribute(payload, NBD_ATTR_INDEX);
+  if (index < 0) {
+    throw NbdException("No device index in NBD connect reply");
+  }
+  return index;
+}
+
+void NbdNetlink::Disconnect(int index) {
+  AddU32(NBD_ATTR_INDEX, index);
+  Request(family_id_, NBD_CMD_DISCONNECT, NBD_GENL_VERSION);
+}
+
+std::string NbdNetlink::Request(uint16_t family_id, uint8_t command,
+                                uint8_t version) {
+  struct nlmsghdr header = {};
+  header.nlmsg_len = NLMSG_HDRLEN + GENL_HDRLEN + attributes_.size();
+  header.nlmsg_type = family_id;
+  header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  header.nlmsg_seq = ++sequence_;
+
+  struct genlmsghdr genl_header = {};
+  genl_header.cmd = command;
+  genl_header.version = version;
+
+  std::string request(reinterpret_cast<char *>(&header), NLMSG_HDRLEN);
+  request.append(reinterpret_cast<char *>(&genl_header), GENL_HDRLEN);
+  request += attributes_;
+  attributes_.clear();
+  nested_starts_.clear();
+
+  struct sockaddr_nl kernel_addr = {};
+  kernel_addr.nl_family = AF_NETLINK;
+  if (sendto(sock_, request.data(), request.size(), 0,
+             reinterpret_cast<struct sockaddr *>(&kernel_addr),
+             sizeof(kernel_addr)) < 0) {
+    PLOG(ERROR) << "Unable to send netlink request";
+    throw NbdException("Unable to send netlink request");
+  }
+
+  // A reply, if there is one, comes before the ack
+  std::string payload;
+  std::vector<char> buf(RECEIVE_BUFFER_BYTES);
+  while (true) {
+    ssize_t bytes_received = recv(sock_, buf.data(), buf.size(), 0);
+    if (bytes_received < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PLOG(ERROR) << "Unable to receive netlink reply";
+      throw NbdException("Unable to receive netlink reply");
+    }
+
+    int bytes_left = bytes_received;
+    for (struct nlmsghdr *reply =
+             reinterpret_cast<struct nlmsghdr *>(buf.data());
+         NLMSG_OK(reply, bytes_left);
+         reply = NLMSG_NEXT(reply, bytes_left)) {
+      if (reply->nlmsg_seq != sequence_) {
+        continue;
+      }
+      if (reply->nlmsg_type == NLMSG_ERROR) {
+        auto *error = static_cast<struct nlmsgerr *>(NLMSG_DATA(reply));
+        if (error->error) {
+          LOG(ERROR) << "Netlink command " << static_cast<int>(command)
+                     << " failed: " << strerror(-error->error);
+          throw NbdException("Netlink request failed");
+        }
+        return payload;
+      }
+      if (reply->nlmsg_len >= NLMSG_HDRLEN + GENL_HDRLEN) {
+        payload.assign(
+            static_cast<char *>(NLMSG_DATA(reply)) + GENL_HDRLEN,
+            reply->nlmsg_len - NLMSG_HDRLEN - GENL_HDRLEN);
+      }
+    }
+  }
+}
+
+void NbdNetlink::AddAttribute(uint16_t type, const void *data,
+                              size_t length) {
+  struct nlattr attribute;
+  attribute.nla_len = NLA_HDRLEN + length;
+  attribute.nla_type = type;
+  attributes_.append(reinterpret_cast<char *>(&attribute), NLA_HDRLEN);
+  if (length) {
+    attributes_.append(static_cast<const char *>(data), length);
+    attributes_.append(NLA_ALIGN(length) - length, '\0');
+  }
+}
+
+void NbdNetlink::AddU32(uint16_t type, uint32_t value) {
+  AddAttribute(type, &value, sizeof(value));
+}
+
+void NbdNetlink::AddU64(uint16_t type, uint64_t value) {
+  AddAttribute(type, &value, sizeof(value));
+}
+
+void NbdNetlink::BeginNested(uint16_t type) {
+  nested_starts_.push_back(attributes_.size());
+  AddAttribute(type | NLA_F_NESTED, nullptr, 0);
+}
+
+void NbdNetlink::EndNested() {
+  size_t start = nested_starts_.back();
+  nested_starts_.pop_back();
+  uint16_t length = attributes_.size() - start;
+  memcpy(&attributes_[start], &length, sizeof(length));
+}
+
+int64_t NbdNetlink::FindAttribute(const std::string &payload,
+                                  uint16_t type) {
+  size_t offset = 0;
+  while (offset + NLA_HDRLEN <= payload.size()) {
+    struct nlattr attribute;
+    memcpy(&attribute, payload.data() + offset, NLA_HDRLEN);
+    if (attribute.nla_len < NLA_HDRLEN ||
+        offset + attribute.nla_len > payload.size()) {
+      break;
+    }
+
+    size_t data_length = attribute.nla_len - NLA_HDRLEN;
+    const char *data = payload.data() + offset + NLA_HDRLEN;
+    if ((attribute.nla_type & NLA_TYPE_MASK) == type) {
+      if (data_length == sizeof(uint16_t)) {
+        uint16_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+      } else if (data_length == sizeof(uint32_t)) {
+        uint32_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+      }
+    }
+    offset += NLA_ALIGN(attribute.nla_len);
+  }
+  return -1;
+}
+
+NbdNetlink::~NbdNetlink() {
+  close(sock_);
+}
+
+}
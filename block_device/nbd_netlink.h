@@ -0,0 +1,74 @@
+#ifndef DATTO_CLIENT_BLOCK_DEVICE_NBD_NETLINK_H_
+#define DATTO_CLIENT_BLOCK_DEVICE_NBD_NETLINK_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace datto_linux_client {
+
+// How a kernel nbd device is set up on connect
+struct NbdDeviceConfig {
+  uint64_t size_bytes;
+  uint64_t block_size_bytes;
+  // Transmission flags from the handshake
+  uint64_t server_flags;
+  uint64_t timeout_seconds;
+};
+
+// Configures kernel nbd devices through the nbd generic netlink family.
+// Unlike the ioctls this attaches several sockets to a device, and the
+// kernel picks a free device itself, reusing pre-allocated ones.
+class NbdNetlink {
+ public:
+  // Throws an NbdException if the kernel has no nbd netlink family
+  NbdNetlink();
+
+  // Connects the sockets, which must be past the handshake, to a free nbd
+  // device. Returns the device's index, as in /dev/nbd<index>.
+  int Connect(const std::vector<int> &socks, const NbdDeviceConfig &config);
+
+  void Disconnect(int index);
+
+  uint16_t family_id() const {
+    return family_id_;
+  }
+
+  ~NbdNetlink();
+
+  NbdNetlink(const NbdNetlink &) = delete;
+  NbdNetlink& operator=(const NbdNetlink &) = delete;
+
+ protected:
+  // Resolves family_name instead of nbd, for tests
+  explicit NbdNetlink(const std::string &family_name);
+
+ private:
+  // Sends a request built with the Add methods, and returns the payload of
+  // its reply, if any. Throws an NbdException if the kernel refuses it.
+  std::string Request(uint16_t family_id, uint8_t command, uint8_t version);
+
+  void AddAttribute(uint16_t type, const void *data, size_t length);
+  void AddU32(uint16_t type, uint32_t value);
+  void AddU64(uint16_t type, uint64_t value);
+  // Attributes added until EndNested go inside this one
+  void BeginNested(uint16_t type);
+  void EndNested();
+
+  // Returns a u16 or u32 attribute from a reply payload, or -1
+  static int64_t FindAttribute(const std::string &payload, uint16_t type);
+
+  int sock_;
+  uint32_t sequence_;
+  uint16_t family_id_;
+
+  // Attributes of the request being built
+  std::string attributes_;
+  // Offsets of the headers of the open nested attributes
+  std::vector<size_t> nested_starts_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_DEVICE_NBD_NETLINK_H_
@@ -0,0 +1,76 @@
+#ifndef DATTO_CLIENT_BLOCK_DEVICE_NBD_PROTOCOL_H_
+#define DATTO_CLIENT_BLOCK_DEVICE_NBD_PROTOCOL_H_
+
+#include <stdint.h>
+
+// Values from the NBD protocol, see doc/proto.md in the nbd project.
+// Everything on the wire is big endian.
+namespace datto_linux_client {
+namespace nbd_protocol {
+
+const uint64_t INIT_MAGIC = 0x4e42444d41474943ULL;  // "NBDMAGIC"
+const uint64_t OLDSTYLE_MAGIC = 0x00420281861253ULL;
+const uint64_t OPTS_MAGIC = 0x49484156454f5054ULL;  // "IHAVEOPT"
+const uint64_t REP_MAGIC = 0x3e889045565a9ULL;
+
+// Handshake flags from the server, and the client flags answering them
+const uint16_t FLAG_FIXED_NEWSTYLE = 1 << 0;
+const uint16_t FLAG_NO_ZEROES = 1 << 1;
+
+// Options
+const uint32_t OPT_EXPORT_NAME = 1;
+const uint32_t OPT_ABORT = 2;
+const uint32_t OPT_GO = 7;
+
+// Option replies. Errors have the top bit set.
+const uint32_t REP_ACK = 1;
+const uint32_t REP_INFO = 3;
+const uint32_t REP_FLAG_ERROR = 1U << 31;
+const uint32_t REP_ERR_UNSUP = REP_FLAG_ERROR | 1;
+
+// Information types of REP_INFO
+const uint16_t INFO_EXPORT = 0;
+const uint16_t INFO_BLOCK_SIZE = 3;
+
+// Transmission flags of an export
+const uint16_t FLAG_HAS_FLAGS = 1 << 0;
+const uint16_t FLAG_READ_ONLY = 1 << 1;
+const uint16_t FLAG_SEND_FLUSH = 1 << 2;
+const uint16_t FLAG_SEND_FUA = 1 << 3;
+const uint16_t FLAG_SEND_TRIM = 1 << 5;
+const uint16_t FLAG_SEND_WRITE_ZEROES = 1 << 6;
+const uint16_t FLAG_CAN_MULTI_CONN = 1 << 8;
+
+const uint32_t REQUEST_MAGIC = 0x25609513;
+const uint32_t SIMPLE_REPLY_MAGIC = 0x67446698;
+
+// Commands
+const uint16_t CMD_READ = 0;
+const uint16_t CMD_WRITE = 1;
+const uint16_t CMD_DISC = 2;
+const uint16_t CMD_FLUSH = 3;
+const uint16_t CMD_TRIM = 4;
+const uint16_t CMD_WRITE_ZEROES = 6;
+
+// Command flags
+const uint16_t CMD_FLAG_FUA = 1 << 0;
+
+struct __attribute__((packed)) Request {
+  uint32_t magic;
+  uint16_t flags;
+  uint16_t type;
+  uint64_t handle;
+  uint64_t offset;
+  uint32_t length;
+};
+
+struct __attribute__((packed)) SimpleReply {
+  uint32_t magic;
+  uint32_t error;
+  uint64_t handle;
+};
+
+} // nbd_protocol
+} // datto_linux_client
+
+#endif //  DATTO_CLIENT_BLOCK_DEVICE_NBD_PROTOCOL_H_
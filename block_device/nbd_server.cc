@@ -1,65 +1,575 @@
 #include "block_device/nbd_server.h"
 
+#include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <signal.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <map>
 
 #include "block_device/block_device_exception.h"
+#include "block_device/nbd_exception.h"
+#include "block_device/nbd_protocol.h"
+#include "block_device/nbd_socket.h"
 #include <glog/logging.h>
 
+namespace {
+
+using ::datto_linux_client::NbdException;
+using ::datto_linux_client::ReadFully;
+using ::datto_linux_client::WriteFully;
+namespace nbd_protocol = ::datto_linux_client::nbd_protocol;
+
+const uint16_t TRANSMISSION_FLAGS = nbd_protocol::FLAG_HAS_FLAGS |
+                                    nbd_protocol::FLAG_SEND_FLUSH |
+                                    nbd_protocol::FLAG_SEND_TRIM |
+                                    nbd_protocol::FLAG_SEND_WRITE_ZEROES |
+                                    nbd_protocol::FLAG_CAN_MULTI_CONN;
+
+const uint32_t PREFERRED_BLOCK_SIZE_BYTES = 4096;
+const uint32_t MAX_REQUEST_BYTES = 32 * 1024 * 1024;
+
+// Written when zeroes can't be punched into the file
+const size_t ZERO_BUFFER_BYTES = 1024 * 1024;
+
+void AppendBe16(std::string *data, uint16_t value) {
+  value = htobe16(value);
+  data->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void AppendBe32(std::string *data, uint32_t value) {
+  value = htobe32(value);
+  data->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void AppendBe64(std::string *data, uint64_t value) {
+  value = htobe64(value);
+  data->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void SendOptionReply(int sock, uint32_t option, uint32_t type,
+                     const std::string &reply) {
+  std::string message;
+  AppendBe64(&message, nbd_protocol::REP_MAGIC);
+  AppendBe32(&message, option);
+  AppendBe32(&message, type);
+  AppendBe32(&message, reply.size());
+  message += reply;
+  WriteFully(sock, message.data(), message.size());
+}
+
+} // unnamed namespace
+
 namespace datto_linux_client {
 
-NbdServer::NbdServer(const std::string &file_to_serve) {
-  uint16_t port_a = rand() % 55535 + 10000;
-  Init(file_to_serve, port_a);
+struct NbdServer::Reply {
+  uint64_t handle;
+  int error;
+  // Of a successful read
+  std::vector<char> data;
+};
+
+struct NbdServer::Connection {
+  explicit Connection(int a_sock)
+      : sock(a_sock),
+        num_requests(0),
+        receive_done(false),
+        dropped(false),
+        finished(false) {}
+
+  int sock;
+  // Only touched by the receive thread
+  uint64_t num_requests;
+  std::thread receive_thread;
+  std::thread reply_thread;
+
+  // Guards everything below
+  std::mutex mutex;
+  std::condition_variable replies_changed;
+  // By when they are due
+  std::multimap<std::chrono::steady_clock::time_point, Reply> replies;
+  bool receive_done;
+  // Nothing more is sent once set
+  bool dropped;
+
+  // Set once both threads are done with the connection
+  std::atomic<bool> finished;
+};
+
+NbdServer::NbdServer(const std::string &file_to_serve)
+    : NbdServer(file_to_serve, 0) {}
+
+NbdServer::NbdServer(const std::string &file_to_serve, const uint16_t port_a)
+    : port_(0),
+      listen_sock_(-1),
+      stopping_(false),
+      fd_(-1),
+      size_bytes_(0) {
+  fd_ = open(file_to_serve.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd_ < 0) {
+    PLOG(ERROR) << "Unable to open " << file_to_serve;
+    throw BlockDeviceException("Unable to open file to serve");
+  }
+  off_t size = lseek(fd_, 0, SEEK_END);
+  if (size < 0) {
+    PLOG(ERROR) << "Unable to get size of " << file_to_serve;
+    close(fd_);
+    throw BlockDeviceException("Unable to get size of file to serve");
+  }
+  size_bytes_ = size;
+
+  LOG(INFO) << "Serving " << file_to_serve << " over NBD";
+  Init(port_a);
+}
+
+NbdServer::NbdServer(uint64_t memory_bytes)
+    : port_(0),
+      listen_sock_(-1),
+      stopping_(false),
+      fd_(-1),
+      memory_(memory_bytes),
+      size_bytes_(memory_bytes) {
+  LOG(INFO) << "Serving " << memory_bytes << " bytes of memory over NBD";
+  Init(0);
+}
+
+void NbdServer::Init(uint16_t port_a) {
+  conditions_ = NbdServerConditions();
+  statistics_ = NbdServerStatistics();
+
+  listen_sock_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_sock_ < 0) {
+    PLOG(ERROR) << "socket";
+    throw BlockDeviceException("Unable to create NBD server socket");
+  }
+
+  int reuse = 1;
+  setsockopt(listen_sock_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  // Only local clients, this is for testing
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port_a);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  if (bind(listen_sock_, reinterpret_cast<struct sockaddr *>(&addr),
+           addr_len) ||
+      listen(listen_sock_, SOMAXCONN) ||
+      getsockname(listen_sock_, reinterpret_cast<struct sockaddr *>(&addr),
+                  &addr_len)) {
+    PLOG(ERROR) << "Unable to listen on port " << port_a;
+    close(listen_sock_);
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+    throw BlockDeviceException("Unable to listen for NBD clients");
+  }
+  port_ = ntohs(addr.sin_port);
+  LOG(INFO) << "NBD server listening on " << port_;
+
+  accept_thread_ = std::thread(&NbdServer::DoAccept, this);
+}
+
+void NbdServer::SetConditions(const NbdServerConditions &conditions) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  conditions_ = conditions;
+}
+
+NbdServerStatistics NbdServer::GetStatistics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return statistics_;
+}
+
+void NbdServer::DropConnections() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &connection : connections_) {
+    if (connection->finished) {
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> connection_lock(connection->mutex);
+      connection->dropped = true;
+    }
+    connection->replies_changed.notify_all();
+    shutdown(connection->sock, SHUT_RDWR);
+    statistics_.dropped_connections++;
+  }
+}
+
+void NbdServer::ReadData(char *buf, size_t num_bytes, uint64_t offset) {
+  if (Serve(nbd_protocol::CMD_READ, buf, num_bytes, offset)) {
+    throw BlockDeviceException("Unable to read served data");
+  }
+}
+
+// As this is the initial function of a thread, this method must not throw
+// an exception or the entire program will go down. This goes for the other
+// Do methods too.
+void NbdServer::DoAccept() {
+  while (!stopping_) {
+    int sock = accept4(listen_sock_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (sock < 0) {
+      if (stopping_) {
+        break;
+      } else if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      PLOG(ERROR) << "accept";
+      break;
+    }
 
+    ReapConnections(false);
+    TuneNbdSocket(sock);
+
+    auto connection = std::make_shared<Connection>(sock);
+    connection->receive_thread = std::thread(&NbdServer::DoReceive, this,
+                                             connection);
+    connection->reply_thread = std::thread(&NbdServer::DoReply, this,
+                                           connection);
+    std::lock_guard<std::mutex> lock(mutex_);
+    statistics_.connections++;
+    connections_.push_back(connection);
+  }
+}
+
+bool NbdServer::Handshake(int sock) {
+  std::string greeting;
+  AppendBe64(&greeting, nbd_protocol::INIT_MAGIC);
+  AppendBe64(&greeting, nbd_protocol::OPTS_MAGIC);
+  AppendBe16(&greeting, nbd_protocol::FLAG_FIXED_NEWSTYLE |
+                        nbd_protocol::FLAG_NO_ZEROES);
+  WriteFully(sock, greeting.data(), greeting.size());
+
+  uint32_t client_flags;
+  ReadFully(sock, &client_flags, sizeof(client_flags));
+  client_flags = be32toh(client_flags);
+
+  while (true) {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t length;
+    ReadFully(sock, &magic, sizeof(magic));
+    ReadFully(sock, &option, sizeof(option));
+    ReadFully(sock, &length, sizeof(length));
+    if (be64toh(magic) != nbd_protocol::OPTS_MAGIC) {
+      throw NbdException("Got bad option magic number");
+    }
+    option = be32toh(option);
+    length = be32toh(length);
+    if (length > MAX_REQUEST_BYTES) {
+      throw NbdException("Option too large");
+    }
+    // Only one export is served, so the name doesn't matter
+    std::string data(length, '\0');
+    if (length) {
+      ReadFully(sock, &data[0], length);
+    }
+
+    if (option == nbd_protocol::OPT_EXPORT_NAME) {
+      std::string reply;
+      AppendBe64(&reply, size_bytes_);
+      AppendBe16(&reply, TRANSMISSION_FLAGS);
+      if (!(client_flags & nbd_protocol::FLAG_NO_ZEROES)) {
+        reply.append(124, '\0');
+      }
+      WriteFully(sock, reply.data(), reply.size());
+      return true;
+    } else if (option == nbd_protocol::OPT_GO) {
+      std::string export_info;
+      AppendBe16(&export_info, nbd_protocol::INFO_EXPORT);
+      AppendBe64(&export_info, size_bytes_);
+      AppendBe16(&export_info, TRANSMISSION_FLAGS);
+      SendOptionReply(sock, option, nbd_protocol::REP_INFO, export_info);
+
+      std::string block_size;
+      AppendBe16(&block_size, nbd_protocol::INFO_BLOCK_SIZE);
+      AppendBe32(&block_size, 1);
+      AppendBe32(&block_size, PREFERRED_BLOCK_SIZE_BYTES);
+      AppendBe32(&block_size, MAX_REQUEST_BYTES);
+      SendOptionReply(sock, option, nbd_protocol::REP_INFO, block_size);
+
+      SendOptionReply(sock, option, nbd_protocol::REP_ACK, "");
+      return true;
+    } else if (option == nbd_protocol::OPT_ABORT) {
+      SendOptionReply(sock, option, nbd_protocol::REP_ACK, "");
+      return false;
+    }
+    SendOptionReply(sock, option, nbd_protocol::REP_ERR_UNSUP, "");
+  }
+}
+
+void NbdServer::DoReceive(std::shared_ptr<Connection> connection) {
+  bool dropped = false;
+  try {
+    if (!Handshake(connection->sock)) {
+      throw NbdException("Client aborted the handshake");
+    }
+
+    while (true) {
+      nbd_protocol::Request request;
+      ReadFully(connection->sock, &request, sizeof(request));
+      if (be32toh(request.magic) != nbd_protocol::REQUEST_MAGIC) {
+        throw NbdException("Got bad request magic number");
+      }
+      uint16_t type = be16toh(request.type);
+      uint64_t offset = be64toh(request.offset);
+      uint32_t length = be32toh(request.length);
+      if (type == nbd_protocol::CMD_DISC) {
+        break;
+      } else if ((type == nbd_protocol::CMD_READ ||
+                  type == nbd_protocol::CMD_WRITE) &&
+                 length > MAX_REQUEST_BYTES) {
+        // Only these carry a payload that has to be buffered
+        throw NbdException("Request too large");
+      }
+
+      auto arrival_time = std::chrono::steady_clock::now();
+      std::vector<char> buf;
+      if (type == nbd_protocol::CMD_READ ||
+          type == nbd_protocol::CMD_WRITE) {
+        buf.resize(length);
+      }
+      if (type == nbd_protocol::CMD_WRITE) {
+        ReadFully(connection->sock, buf.data(), length);
+        Throttle(length);
+      }
+
+      NbdServerConditions conditions;
+      uint64_t request_num;
+      std::chrono::microseconds delay;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        conditions = conditions_;
+        request_num = ++statistics_.requests;
+        delay = std::chrono::microseconds(conditions.latency_micros);
+        if (conditions.jitter_micros) {
+          delay += std::chrono::microseconds(
+              random_() % (conditions.jitter_micros + 1));
+        }
+      }
+
+      if (conditions.drop_after_requests &&
+          ++connection->num_requests >= conditions.drop_after_requests) {
+        dropped = true;
+        break;
+      }
+
+      Reply reply;
+      reply.handle = request.handle;
+      if (conditions.fail_every_n_requests &&
+          request_num % conditions.fail_every_n_requests == 0) {
+        reply.error = EIO;
+      } else {
+        reply.error = Serve(type, buf.data(), length, offset);
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (reply.error) {
+          statistics_.failed_requests++;
+        } else if (type == nbd_protocol::CMD_READ) {
+          statistics_.bytes_read += length;
+        } else if (type == nbd_protocol::CMD_WRITE) {
+          statistics_.bytes_written += length;
+        } else if (type == nbd_protocol::CMD_TRIM ||
+                   type == nbd_protocol::CMD_WRITE_ZEROES) {
+          statistics_.trims++;
+        } else if (type == nbd_protocol::CMD_FLUSH) {
+          statistics_.flushes++;
+        }
+      }
+      if (type == nbd_protocol::CMD_READ && !reply.error) {
+        reply.data = std::move(buf);
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(connection->mutex);
+        connection->replies.emplace(arrival_time + delay, std::move(reply));
+      }
+      connection->replies_changed.notify_all();
+    }
+  } catch (const NbdException &e) {
+    VLOG(1) << "NBD server connection closed: " << e.what();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(connection->mutex);
+    connection->receive_done = true;
+    connection->dropped = connection->dropped || dropped;
+  }
+  connection->replies_changed.notify_all();
+
+  if (dropped) {
+    LOG(INFO) << "Dropping NBD connection";
+    shutdown(connection->sock, SHUT_RDWR);
+    std::lock_guard<std::mutex> lock(mutex_);
+    statistics_.dropped_connections++;
+  }
 }
-NbdServer::NbdServer(const std::string &file_to_serve, const uint16_t port_a) {
-  Init(file_to_serve, port_a);
+
+void NbdServer::DoReply(std::shared_ptr<Connection> connection) {
+  std::unique_lock<std::mutex> lock(connection->mutex);
+  while (!connection->dropped) {
+    if (connection->replies.empty()) {
+      if (connection->receive_done) {
+        break;
+      }
+      connection->replies_changed.wait(lock);
+      continue;
+    }
+
+    auto next_reply = connection->replies.begin();
+    if (std::chrono::steady_clock::now() < next_reply->first) {
+      connection->replies_changed.wait_until(lock, next_reply->first);
+      continue;
+    }
+    Reply reply = std::move(next_reply->second);
+    connection->replies.erase(next_reply);
+    lock.unlock();
+
+    nbd_protocol::SimpleReply header;
+    header.magic = htobe32(nbd_protocol::SIMPLE_REPLY_MAGIC);
+    header.error = htobe32(reply.error);
+    header.handle = reply.handle;
+
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = reply.data.data();
+    iov[1].iov_len = reply.data.size();
+    try {
+      Throttle(reply.data.size());
+      WriteVectorFully(connection->sock, iov, reply.data.empty() ? 1 : 2);
+    } catch (const NbdException &e) {
+      VLOG(1) << "Unable to send NBD reply: " << e.what();
+      lock.lock();
+      break;
+    }
+    lock.lock();
+  }
+  lock.unlock();
+
+  // Also wakes the receive thread if it is still reading
+  shutdown(connection->sock, SHUT_RDWR);
+  connection->finished = true;
 }
 
-void NbdServer::Init(const std::string &file_to_serve, const uint16_t port_a) {
-  port_ = port_a;
+void NbdServer::ReapConnections(bool wait) {
+  std::vector<std::shared_ptr<Connection>> done;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto done_begin = std::partition(
+        connections_.begin(), connections_.end(),
+        [&](const std::shared_ptr<Connection> &connection) {
+          return !wait && !connection->finished;
+        });
+    done.assign(done_begin, connections_.end());
+    connections_.erase(done_begin, connections_.end());
+  }
+
+  for (const auto &connection : done) {
+    connection->receive_thread.join();
+    connection->reply_thread.join();
+    close(connection->sock);
+  }
+}
 
-  LOG(INFO) << "Starting nbd-server on " << port_;
-  pid_t fork_ret = fork();
-  if (fork_ret == -1) {
-      PLOG(ERROR) << "fork";
-      throw BlockDeviceException("fork failed");
+int NbdServer::Serve(uint16_t type, char *buf, uint32_t num_bytes,
+                     uint64_t offset) {
+  if (type == nbd_protocol::CMD_FLUSH) {
+    if (fd_ >= 0 && fdatasync(fd_)) {
+      return errno;
+    }
+    return 0;
   }
-  else if (fork_ret == 0) {
-      // This is the same as 2>&1 1>/dev/null
-      int null_fd = open("/dev/null", O_RDWR);
-      dup2(null_fd, 1);
-      dup2(null_fd, 2);
-      close(null_fd);
-      // -d means it won't daemonize
-      // -C /dev/null disables using a configuration file
-      execl("/bin/nbd-server", "nbd-server",
-            std::to_string(port_).c_str(),
-            file_to_serve.c_str(),
-            "-d",
-            "-C", "/dev/null",
-            nullptr);
-      // If we get here then exec failed
-      PLOG(ERROR) << "execl";
-      _exit(127);
+  if (offset > size_bytes_ || num_bytes > size_bytes_ - offset) {
+    return EINVAL;
   }
-  else {
-      nbd_server_pid_ = fork_ret;
-      // Let the nbd_server start
-      usleep(1000000);
+
+  if (fd_ < 0) {
+    std::lock_guard<std::mutex> lock(memory_mutex_);
+    if (type == nbd_protocol::CMD_READ) {
+      memcpy(buf, &memory_[offset], num_bytes);
+    } else if (type == nbd_protocol::CMD_WRITE) {
+      memcpy(&memory_[offset], buf, num_bytes);
+    } else if (type == nbd_protocol::CMD_TRIM ||
+               type == nbd_protocol::CMD_WRITE_ZEROES) {
+      memset(&memory_[offset], 0, num_bytes);
+    } else {
+      return EINVAL;
+    }
+    return 0;
   }
+
+  if (type == nbd_protocol::CMD_READ) {
+    ssize_t bytes_read = pread(fd_, buf, num_bytes, offset);
+    return bytes_read == num_bytes ? 0 : EIO;
+  } else if (type == nbd_protocol::CMD_WRITE) {
+    ssize_t bytes_written = pwrite(fd_, buf, num_bytes, offset);
+    return bytes_written == num_bytes ? 0 : EIO;
+  } else if (type != nbd_protocol::CMD_TRIM &&
+             type != nbd_protocol::CMD_WRITE_ZEROES) {
+    return EINVAL;
+  }
+
+  // Punching keeps a sparse file sparse, and zeroes what it covers
+  if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                num_bytes) == 0) {
+    return 0;
+  } else if (type == nbd_protocol::CMD_TRIM) {
+    // Trims are only advice
+    return 0;
+  }
+
+  std::vector<char> zeroes(std::min<size_t>(num_bytes, ZERO_BUFFER_BYTES));
+  while (num_bytes > 0) {
+    size_t write_bytes = std::min<size_t>(num_bytes, zeroes.size());
+    if (pwrite(fd_, zeroes.data(), write_bytes, offset) !=
+        static_cast<ssize_t>(write_bytes)) {
+      return EIO;
+    }
+    offset += write_bytes;
+    num_bytes -= write_bytes;
+  }
+  return 0;
+}
+
+void NbdServer::Throttle(uint64_t num_bytes) {
+  std::chrono::steady_clock::time_point sleep_until;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!conditions_.bandwidth_bytes_per_second || !num_bytes) {
+      return;
+    }
+    // Each transfer starts once the ones before it are through the link
+    sleep_until = std::max(link_free_time_,
+                           std::chrono::steady_clock::now());
+    sleep_until += std::chrono::microseconds(
+        num_bytes * 1000000 / conditions_.bandwidth_bytes_per_second);
+    link_free_time_ = sleep_until;
+  }
+  std::this_thread::sleep_until(sleep_until);
 }
 
 NbdServer::~NbdServer() {
-  LOG(INFO) << "Killing nbd-server";
-  if (kill(nbd_server_pid_, SIGTERM)) {
-    PLOG(ERROR) << "kill failed, check nbd-server was stopped correctly";
-  } else {
-    wait(nullptr);
+  LOG(INFO) << "Stopping NBD server on " << port_;
+  stopping_ = true;
+  // Wakes accept
+  shutdown(listen_sock_, SHUT_RDWR);
+  accept_thread_.join();
+  close(listen_sock_);
+
+  DropConnections();
+  ReapConnections(true);
+
+  if (fd_ >= 0) {
+    close(fd_);
   }
 }
 }
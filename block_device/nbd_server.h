@@ -1,28 +1,122 @@
 #ifndef DATTO_CLIENT_BLOCK_DEVICE_NBD_SERVER_H_
 #define DATTO_CLIENT_BLOCK_DEVICE_NBD_SERVER_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <stdint.h>
 #include <unistd.h>
 
 namespace datto_linux_client {
+
+// Network conditions an NbdServer simulates. 0 turns each off.
+struct NbdServerConditions {
+  // Every reply is held back this long after its request arrives
+  uint32_t latency_micros;
+  // Plus up to this much more, chosen at random for each request
+  uint32_t jitter_micros;
+  // Shared by read and write data over all connections
+  uint64_t bandwidth_bytes_per_second;
+  // Every nth request fails with EIO
+  uint64_t fail_every_n_requests;
+  // A connection is closed on its nth request, which isn't replied to
+  uint64_t drop_after_requests;
+};
+
+// Totals since the server started
+struct NbdServerStatistics {
+  uint64_t connections;
+  uint64_t dropped_connections;
+  uint64_t requests;
+  uint64_t failed_requests;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t trims;
+  uint64_t flushes;
+};
+
+// An NBD server running in this process, for tests and benchmarks. It
+// speaks fixed newstyle and serves a file or a memory buffer on the
+// loopback interface, one thread per connection and direction. Replies are
+// sent as they come due, so with jitter they complete out of order.
 class NbdServer {
  public:
-  // Constructing will serve the file on a random port
+  // Constructing will serve the file on a free port
   explicit NbdServer(const std::string &file_to_serve);
   // Constructing will serve the file on the port
   NbdServer(const std::string &file_to_serve, const uint16_t port);
+  // Serves memory_bytes of zeroes on a free port
+  explicit NbdServer(uint64_t memory_bytes);
 
   uint16_t port() {
     return port_;
   }
-  // Destructor kills the nbd-server serving the file
+
+  uint64_t size_bytes() const {
+    return size_bytes_;
+  }
+
+  // Applies to requests that arrive from now on
+  void SetConditions(const NbdServerConditions &conditions);
+
+  NbdServerStatistics GetStatistics() const;
+
+  // Closes every connection without replying to what is in flight, as if
+  // the network went away. The server keeps accepting new ones.
+  void DropConnections();
+
+  // Reads what is being served, bypassing the simulated conditions
+  void ReadData(char *buf, size_t num_bytes, uint64_t offset);
+
+  // Stops the server and closes every connection
   ~NbdServer();
+
+  NbdServer(const NbdServer &) = delete;
+  NbdServer& operator=(const NbdServer &) = delete;
+
  private:
-  void Init(const std::string &file_to_serve, const uint16_t port);
-  pid_t nbd_server_pid_;
+  struct Connection;
+  struct Reply;
+
+  void Init(uint16_t port);
+  void DoAccept();
+  // Returns false if the client went away or aborted
+  bool Handshake(int sock);
+  void DoReceive(std::shared_ptr<Connection> connection);
+  void DoReply(std::shared_ptr<Connection> connection);
+  // Joins and closes connections that are done
+  void ReapConnections(bool wait);
+
+  // Does the I/O of a request, returning its errno
+  int Serve(uint16_t type, char *buf, uint32_t num_bytes, uint64_t offset);
+  // Sleeps until the simulated link has room for num_bytes more
+  void Throttle(uint64_t num_bytes);
+
   uint16_t port_;
+  int listen_sock_;
+  std::atomic<bool> stopping_;
+  std::thread accept_thread_;
+
+  // The file being served, or -1 when serving memory_
+  int fd_;
+  std::vector<char> memory_;
+  std::mutex memory_mutex_;
+  uint64_t size_bytes_;
+
+  // Guards everything below
+  mutable std::mutex mutex_;
+  NbdServerConditions conditions_;
+  NbdServerStatistics statistics_;
+  std::mt19937 random_;
+  std::chrono::steady_clock::time_point link_free_time_;
+  std::vector<std::shared_ptr<Connection>> connections_;
 };
 } // datto_linux_client
 
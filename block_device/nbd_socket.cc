@@ -0,0 +1,173 @@
+#include "block_device/nbd_socket.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+#include "block_device/nbd_exception.h"
+
+namespace {
+
+// Enough to keep a 10GbE link busy at a few milliseconds of latency
+const int SOCKET_BUFFER_BYTES = 16 * 1024 * 1024;
+
+// A silent peer is noticed after 10 + 3 * 5 seconds, rather than the two
+// hours it takes with the keepalive defaults
+const int KEEPALIVE_IDLE_SECONDS = 10;
+const int KEEPALIVE_INTERVAL_SECONDS = 5;
+const int KEEPALIVE_PROBES = 3;
+// Data left unacknowledged this long fails the connection instead of
+// being retransmitted for the ~15 minutes of net.ipv4.tcp_retries2
+const unsigned int USER_TIMEOUT_MILLIS = 30 * 1000;
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+int OpenNbdSocket(const std::string &host, uint16_t port) {
+  int sock = -1;
+
+  // see man 3 getaddrinfo
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+  hints.ai_protocol = IPPROTO_TCP;
+
+  struct addrinfo *ai;
+  int err = getaddrinfo(host.c_str(), std::to_string(port).c_str(),
+                        &hints, &ai);
+  if (err) {
+    throw NbdException("getaddinfo error: " + std::string(gai_strerror(err)));
+  }
+
+  bool success = false;
+  for (struct addrinfo *ai_iter = ai;
+       ai_iter != NULL;
+       ai_iter = ai_iter->ai_next) {
+    sock = socket(ai_iter->ai_family, ai_iter->ai_socktype,
+                  ai_iter->ai_protocol);
+
+    if (sock == -1) {
+      continue;
+    }
+
+    if (connect(sock, ai_iter->ai_addr, ai_iter->ai_addrlen) != -1) {
+      success = true;
+      break;
+    }
+    close(sock);
+  }
+
+  freeaddrinfo(ai);
+
+  if (!success) {
+    throw NbdException("Unable to open socket");
+  }
+
+  DLOG(INFO) << "Opened NBD socket";
+
+  return sock;
+}
+
+void TuneNbdSocket(int sock) {
+  int no_delay = 1;
+  if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &no_delay,
+                 sizeof(no_delay))) {
+    // Expected for the UNIX sockets used in tests
+    VLOG(1) << "Unable to set TCP_NODELAY on NBD socket";
+  }
+
+  // Autotuning stops at net.ipv4.tcp_wmem and tcp_rmem, and SO_SNDBUF at
+  // net.core.wmem_max, usually all well under this. Only the FORCE options
+  // go past wmem_max, and they need CAP_NET_ADMIN. Without it autotuning is
+  // left alone, as a capped SO_SNDBUF would only make things worse.
+  int buffer_bytes = SOCKET_BUFFER_BYTES;
+  if (setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, &buffer_bytes,
+                 sizeof(buffer_bytes)) ||
+      setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &buffer_bytes,
+                 sizeof(buffer_bytes))) {
+    VLOG(1) << "Leaving NBD socket buffers to autotuning";
+  }
+
+  int keepalive = 1;
+  int idle_seconds = KEEPALIVE_IDLE_SECONDS;
+  int interval_seconds = KEEPALIVE_INTERVAL_SECONDS;
+  int probes = KEEPALIVE_PROBES;
+  unsigned int user_timeout_millis = USER_TIMEOUT_MILLIS;
+  if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepalive,
+                 sizeof(keepalive)) ||
+      setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle_seconds,
+                 sizeof(idle_seconds)) ||
+      setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval_seconds,
+                 sizeof(interval_seconds)) ||
+      setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes)) ||
+      setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout_millis,
+                 sizeof(user_timeout_millis))) {
+    VLOG(1) << "Unable to set keepalives on NBD socket";
+  }
+}
+
+void ReadFully(int sock, void *buf, size_t num_bytes) {
+  char *pos = static_cast<char *>(buf);
+  while (num_bytes > 0) {
+    ssize_t bytes_read = read(sock, pos, num_bytes);
+    if (bytes_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PLOG(ERROR) << "Read from NBD socket";
+      throw NbdException("Unable to read from socket");
+    } else if (bytes_read == 0) {
+      throw NbdException("Connection closed by server");
+    }
+    pos += bytes_read;
+    num_bytes -= bytes_read;
+  }
+}
+
+void WriteFully(int sock, const void *buf, size_t num_bytes) {
+  struct iovec iov;
+  iov.iov_base = const_cast<void *>(buf);
+  iov.iov_len = num_bytes;
+  WriteVectorFully(sock, &iov, 1);
+}
+
+void WriteVectorFully(int sock, struct iovec *iov, int iov_count) {
+  struct msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iov_count;
+
+  while (msg.msg_iovlen > 0) {
+    // MSG_NOSIGNAL so a closed connection is an error instead of SIGPIPE
+    ssize_t bytes_sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PLOG(ERROR) << "Write to NBD socket";
+      throw NbdException("Unable to write to socket");
+    }
+
+    // Skip what was sent, the iovecs are the caller's to modify
+    while (msg.msg_iovlen > 0 &&
+           static_cast<size_t>(bytes_sent) >= msg.msg_iov->iov_len) {
+      bytes_sent -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base =
+          static_cast<char *>(msg.msg_iov->iov_base) + bytes_sent;
+      msg.msg_iov->iov_len -= bytes_sent;
+    }
+  }
+}
+
+}
@@ -0,0 +1,29 @@
+#ifndef DATTO_CLIENT_BLOCK_DEVICE_NBD_SOCKET_H_
+#define DATTO_CLIENT_BLOCK_DEVICE_NBD_SOCKET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <string>
+
+namespace datto_linux_client {
+
+// Connects a TCP socket to host. Throws an NbdException on failure.
+int OpenNbdSocket(const std::string &host, uint16_t port);
+
+// Turns off Nagle, as requests are latency bound, raises the socket
+// buffers for fast links, and has dead connections fail within about half
+// a minute so they can be reconnected. Failures are only logged.
+void TuneNbdSocket(int sock);
+
+// These throw an NbdException on failure, including the other end closing
+// the socket before everything was read or written
+void ReadFully(int sock, void *buf, size_t num_bytes);
+void WriteFully(int sock, const void *buf, size_t num_bytes);
+// Writes the buffers in order without copying them together first
+void WriteVectorFully(int sock, struct iovec *iov, int iov_count);
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_DEVICE_NBD_SOCKET_H_
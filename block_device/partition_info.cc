@@ -0,0 +1,78 @@
+#include "block_device/partition_info.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+
+#include <glog/logging.h>
+
+#include "block_device/block_device_exception.h"
+
+namespace {
+
+using ::datto_linux_client::BlockDeviceException;
+
+const char SYSFS_DEV_BLOCK_PATH[] = "/sys/dev/block/";
+
+uint64_t ReadSysfsNumber(const std::string &path) {
+  std::ifstream sysfs_file(path);
+  uint64_t value;
+  if (!(sysfs_file >> value)) {
+    LOG(ERROR) << "Unable to read " << path;
+    throw BlockDeviceException("Unable to read partition info");
+  }
+  return value;
+}
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+bool ReadPartitionInfo(::dev_t device, PartitionInfo *const info) {
+  std::ostringstream sysfs_path;
+  sysfs_path << SYSFS_DEV_BLOCK_PATH << major(device) << ":" << minor(device);
+
+  // Only partitions have a partition file
+  struct stat partition_stat;
+  if (stat((sysfs_path.str() + "/partition").c_str(), &partition_stat)) {
+    if (errno == ENOENT) {
+      return false;
+    }
+    PLOG(ERROR) << "Unable to stat " << sysfs_path.str() << "/partition";
+    throw BlockDeviceException("Unable to read partition info");
+  }
+
+  // The link resolves to .../block/sda/sda1, the disk is the parent
+  char resolved[PATH_MAX];
+  if (!realpath(sysfs_path.str().c_str(), resolved)) {
+    PLOG(ERROR) << "Unable to resolve " << sysfs_path.str();
+    throw BlockDeviceException("Unable to read partition info");
+  }
+  std::string disk_sysfs_path(resolved);
+  disk_sysfs_path.erase(disk_sysfs_path.rfind('/'));
+  std::string disk_name =
+      disk_sysfs_path.substr(disk_sysfs_path.rfind('/') + 1);
+
+  std::ifstream dev_file(disk_sysfs_path + "/dev");
+  unsigned int disk_major, disk_minor;
+  char separator;
+  if (!(dev_file >> disk_major >> separator >> disk_minor) ||
+      separator != ':') {
+    LOG(ERROR) << "Unable to read " << disk_sysfs_path << "/dev";
+    throw BlockDeviceException("Unable to read partition info");
+  }
+
+  info->disk_path = "/dev/" + disk_name;
+  info->disk_dev_t = makedev(disk_major, disk_minor);
+  info->start_sector = ReadSysfsNumber(sysfs_path.str() + "/start");
+  info->num_sectors = ReadSysfsNumber(sysfs_path.str() + "/size");
+  return true;
+}
+
+}
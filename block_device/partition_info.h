@@ -0,0 +1,28 @@
+#ifndef DATTO_CLIENT_BLOCK_DEVICE_PARTITION_INFO_H_
+#define DATTO_CLIENT_BLOCK_DEVICE_PARTITION_INFO_H_
+
+#include <stdint.h>
+#include <string>
+
+#include <linux/types.h>
+#include <sys/types.h>
+
+namespace datto_linux_client {
+
+// Where a partition is on its disk, in 512 byte sectors
+struct PartitionInfo {
+  // e.g. /dev/sda for /dev/sda1
+  std::string disk_path;
+  ::dev_t disk_dev_t;
+  uint64_t start_sector;
+  uint64_t num_sectors;
+};
+
+// Reads the partition's start and size from sysfs. Returns false if
+// device is a whole disk, or something else that isn't a partition.
+// Throws a BlockDeviceException if sysfs can't be read.
+bool ReadPartitionInfo(::dev_t device, PartitionInfo *const info);
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_DEVICE_PARTITION_INFO_H_
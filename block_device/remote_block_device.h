@@ -14,6 +14,10 @@ class RemoteBlockDevice : public BlockDevice {
   virtual ~RemoteBlockDevice() { }
  protected:
   RemoteBlockDevice() : BlockDevice() { } 
+  // See the matching BlockDevice constructor
+  RemoteBlockDevice(const std::string &name, uint64_t device_size_bytes,
+                    uint32_t block_size_bytes)
+      : BlockDevice(name, device_size_bytes, block_size_bytes) { }
 };
 
 }
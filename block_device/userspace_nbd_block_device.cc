@@ -0,0 +1,105 @@
+#include "block_device/userspace_nbd_block_device.h"
+#include "block_device/block_device_exception.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <glog/logging.h>
+
+#include "block_device/nbd_exception.h"
+
+namespace {
+
+// Backoff between reconnect attempts doubles up to this
+const int MAX_RECONNECT_WAIT_SECONDS = 30;
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+const int UserspaceNbdBlockDevice::MAX_RECONNECT_ATTEMPTS;
+
+UserspaceNbdBlockDevice::UserspaceNbdBlockDevice(
+    const std::string &remote_host, uint16_t remote_port)
+    : UserspaceNbdBlockDevice(std::make_shared<NbdConnection>(
+          remote_host, remote_port, std::string())) {
+  remote_host_ = remote_host;
+  remote_port_ = remote_port;
+  path_ = "nbd://" + remote_host + ":" + std::to_string(remote_port);
+  LOG(INFO) << "Connected to " << path_ << " from user space";
+}
+
+UserspaceNbdBlockDevice::UserspaceNbdBlockDevice(
+    std::shared_ptr<NbdConnection> connection)
+    : RemoteBlockDevice("nbd", connection->size_bytes(),
+                        connection->block_size_bytes()),
+      connection_(connection),
+      remote_host_(),
+      remote_port_(0),
+      reconnect_count_(0) {}
+
+int UserspaceNbdBlockDevice::Open() {
+  LOG(ERROR) << path_ << " has no local device to open";
+  throw BlockDeviceException("No local device for userspace NBD");
+}
+
+void UserspaceNbdBlockDevice::Flush() {
+  if (connection_->CanFlush()) {
+    connection_->Flush();
+  }
+}
+
+bool UserspaceNbdBlockDevice::IsConnected() const {
+  return connection_->IsConnected();
+}
+
+void UserspaceNbdBlockDevice::Disconnect() {
+  LOG(INFO) << "Disconnecting UserspaceNbdBlockDevice " << path_;
+  connection_->Disconnect();
+}
+
+void UserspaceNbdBlockDevice::Reconnect() {
+  if (remote_host_.empty()) {
+    throw BlockDeviceException("No server address to reconnect to");
+  }
+  connection_->Disconnect();
+
+  int wait_seconds = 1;
+  for (int attempt = 1; attempt <= MAX_RECONNECT_ATTEMPTS; ++attempt) {
+    LOG(INFO) << "Reconnecting to " << path_ << ", attempt " << attempt;
+    std::shared_ptr<NbdConnection> connection;
+    try {
+      connection = std::make_shared<NbdConnection>(remote_host_, remote_port_,
+                                                   std::string());
+    } catch (const NbdException &e) {
+      LOG(WARNING) << "Unable to reconnect to " << path_ << ": " << e.what();
+      if (attempt < MAX_RECONNECT_ATTEMPTS) {
+        WaitToReconnect(wait_seconds);
+        wait_seconds = std::min(wait_seconds * 2, MAX_RECONNECT_WAIT_SECONDS);
+      }
+      continue;
+    }
+
+    if (connection->size_bytes() != DeviceSizeBytes()) {
+      LOG(ERROR) << path_ << " is now " << connection->size_bytes()
+                 << " bytes, was " << DeviceSizeBytes();
+      throw BlockDeviceException("NBD export changed size");
+    }
+    connection_ = connection;
+    reconnect_count_++;
+    LOG(INFO) << "Reconnected to " << path_;
+    return;
+  }
+  throw BlockDeviceException("Unable to reconnect to NBD server");
+}
+
+void UserspaceNbdBlockDevice::WaitToReconnect(int seconds) {
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+}
+
+UserspaceNbdBlockDevice::~UserspaceNbdBlockDevice() {
+  Disconnect();
+}
+
+}
@@ -0,0 +1,69 @@
+#ifndef DATTO_CLIENT_BLOCK_DEVICE_USERSPACE_NBD_BLOCK_DEVICE_H_
+#define DATTO_CLIENT_BLOCK_DEVICE_USERSPACE_NBD_BLOCK_DEVICE_H_
+
+#include <memory>
+#include <string>
+
+#include <stdint.h>
+
+#include "block_device/nbd_connection.h"
+#include "block_device/remote_block_device.h"
+
+namespace datto_linux_client {
+
+// An NBD export reached through an NbdConnection rather than a kernel
+// /dev/nbdN. There is no local device, so Open() throws. Data is written
+// with the connection, see DeviceSynchronizer.
+//
+// A lost connection can be replaced with Reconnect. Anything that was in
+// flight on the old one may not have reached the server.
+class UserspaceNbdBlockDevice : public RemoteBlockDevice {
+ public:
+  UserspaceNbdBlockDevice(const std::string &remote_host,
+                          uint16_t remote_port);
+
+  explicit UserspaceNbdBlockDevice(
+      std::shared_ptr<NbdConnection> connection);
+
+  // Changes on Reconnect
+  std::shared_ptr<NbdConnection> connection() const {
+    return connection_;
+  }
+
+  int reconnect_count() const {
+    return reconnect_count_;
+  }
+
+  virtual int Open();
+  // Sends an NBD flush, if the server supports them
+  virtual void Flush();
+  virtual void Close() { }
+
+  bool IsConnected() const;
+  void Disconnect();
+
+  // Replaces the connection with a new one to the same server, retrying
+  // with exponential backoff. Throws a BlockDeviceException if the server
+  // can't be reached after MAX_RECONNECT_ATTEMPTS, or now serves a
+  // different size.
+  void Reconnect();
+
+  static const int MAX_RECONNECT_ATTEMPTS = 10;
+
+  ~UserspaceNbdBlockDevice();
+
+ protected:
+  // Sleeps between reconnect attempts, for tests
+  virtual void WaitToReconnect(int seconds);
+
+ private:
+  std::shared_ptr<NbdConnection> connection_;
+  // Empty if constructed from a connection, which can't be reconnected
+  std::string remote_host_;
+  uint16_t remote_port_;
+  int reconnect_count_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_DEVICE_USERSPACE_NBD_BLOCK_DEVICE_H_
@@ -50,17 +50,44 @@ macro(add_unit_test test_name)
     add_dependencies(check ctest_${test_name})
 endmacro()
 
-add_unit_test(unsynced_sector_store_test
-              unsynced_sector_manager/unsynced_sector_store.cc)
+add_unit_test(interval_unsynced_sector_store_test
+              unsynced_sector_manager/interval_unsynced_sector_store.cc
+              unsynced_sector_manager/volatile_window.cc
+              unsynced_sector_manager/write_heat_tracker.cc)
+
+add_unit_test(bitmap_unsynced_sector_store_test
+              unsynced_sector_manager/volatile_window.cc
+              unsynced_sector_manager/write_heat_tracker.cc
+              unsynced_sector_manager/bitmap_unsynced_sector_store.cc)
+
+add_unit_test(bpf_dirty_tracker_test
+              cpu_placement/cpu_placement.cc
+              tracing/bpf_dirty_tracker.cc
+              tracing/cpu_tracer.cc
+              tracing/device_tracer.cc
+              tracing/trace_buffer.cc
+              tracing/trace_handler.cc
+              tracing/trace_reader_pool.cc
+              block_device/partition_info.cc
+              unsynced_sector_manager/interval_unsynced_sector_store.cc
+              unsynced_sector_manager/volatile_window.cc
+              unsynced_sector_manager/write_heat_tracker.cc)
 
 add_unit_test(block_device_factory_test
               block_device/block_device.cc
               block_device/ext_file_system.cc
               block_device/ext_mountable_block_device.cc
+              block_device/in_use_sector_producer.cc
               block_device/mountable_block_device.cc
               block_device/nbd_block_device.cc
               block_device/nbd_client.cc
+              block_device/nbd_connection.cc
+              block_device/nbd_negotiation.cc
+              block_device/nbd_netlink.cc
               block_device/nbd_server.cc
+              block_device/nbd_socket.cc
+              block_device/partition_info.cc
+              block_device/userspace_nbd_block_device.cc
               freeze_helper/freeze_helper.cc
               test/loop_device.cc
               block_device/block_device_factory.cc)
@@ -72,6 +99,7 @@ add_unit_test(backup_test
               backup_status_tracker/backup_event_handler.cc
               backup_status_tracker/sync_count_handler.cc
               block_device/block_device.cc
+              block_device/in_use_sector_producer.cc
               block_device/mountable_block_device.cc
               ${PROTO_SRCS}
               backup/backup.cc)
@@ -87,13 +115,34 @@ add_unit_test(backup_manager_test
               backup_status_tracker/backup_event_handler.cc
               backup_status_tracker/backup_status_tracker.cc
               backup_status_tracker/sync_count_handler.cc
+              block_device/partition_info.cc
               tracing/cpu_tracer.cc
+              tracing/trace_buffer.cc
+              tracing/trace_reader_pool.cc
+              tracing/trace_recorder.cc
               tracing/device_tracer.cc
+              tracing/dm_era.cc
+              tracing/era_tracker.cc
+              tracing/bpf_dirty_tracker.cc
               tracing/trace_handler.cc
+              tracing/ring_trace_handler.cc
+              block_device/nbd_connection.cc
+              block_device/nbd_negotiation.cc
+              block_device/nbd_socket.cc
+              block_device/userspace_nbd_block_device.cc
+              cpu_placement/cpu_placement.cc
               device_synchronizer/device_synchronizer.cc
               freeze_helper/freeze_helper.cc
+              unsynced_sector_manager/bitmap_unsynced_sector_store.cc
+              unsynced_sector_manager/change_export.cc
+              unsynced_sector_manager/change_history.cc
+              unsynced_sector_manager/fan_out_unsynced_sector_store.cc
+              unsynced_sector_manager/partition_unsynced_sector_store.cc
+              unsynced_sector_manager/write_only_unsynced_sector_store.cc
               unsynced_sector_manager/unsynced_sector_manager.cc
-              unsynced_sector_manager/unsynced_sector_store.cc
+              unsynced_sector_manager/interval_unsynced_sector_store.cc
+              unsynced_sector_manager/volatile_window.cc
+              unsynced_sector_manager/write_heat_tracker.cc
               ${PROTO_SRCS}
               backup/backup_manager.cc)
 target_link_libraries(backup_manager_test uuid ${PROTOBUF_LIBRARIES})
@@ -109,33 +158,91 @@ add_unit_test(block_device_test
               test/loop_device.cc
               block_device/block_device.cc)
 
+add_unit_test(change_export_test
+              unsynced_sector_manager/change_export.cc)
+
+add_unit_test(change_history_test
+              unsynced_sector_manager/change_history.cc)
+
+add_unit_test(cpu_placement_test
+              cpu_placement/cpu_placement.cc)
+
+add_unit_test(cpu_tracer_test
+              tracing/cpu_tracer.cc
+              tracing/trace_buffer.cc
+              tracing/trace_handler.cc
+              unsynced_sector_manager/interval_unsynced_sector_store.cc
+              unsynced_sector_manager/volatile_window.cc
+              unsynced_sector_manager/write_heat_tracker.cc)
+
 add_unit_test(device_synchronizer_test
               backup_status_tracker/backup_event_handler.cc
               backup_status_tracker/sync_count_handler.cc
               backup/backup_coordinator.cc
               block_device/block_device.cc
+              block_device/in_use_sector_producer.cc
               block_device/mountable_block_device.cc
+              block_device/partition_info.cc
               tracing/cpu_tracer.cc
+              tracing/trace_buffer.cc
+              tracing/trace_reader_pool.cc
+              tracing/trace_recorder.cc
               tracing/device_tracer.cc
+              tracing/dm_era.cc
+              tracing/era_tracker.cc
+              tracing/bpf_dirty_tracker.cc
               tracing/trace_handler.cc
+              tracing/ring_trace_handler.cc
               freeze_helper/freeze_helper.cc
               test/loop_device.cc
+              unsynced_sector_manager/bitmap_unsynced_sector_store.cc
+              unsynced_sector_manager/change_export.cc
+              unsynced_sector_manager/change_history.cc
+              unsynced_sector_manager/fan_out_unsynced_sector_store.cc
+              unsynced_sector_manager/partition_unsynced_sector_store.cc
+              unsynced_sector_manager/write_only_unsynced_sector_store.cc
               unsynced_sector_manager/unsynced_sector_manager.cc
-              unsynced_sector_manager/unsynced_sector_store.cc
+              unsynced_sector_manager/interval_unsynced_sector_store.cc
+              unsynced_sector_manager/volatile_window.cc
+              unsynced_sector_manager/write_heat_tracker.cc
               ${PROTO_SRCS}
+              block_device/nbd_connection.cc
+              block_device/nbd_negotiation.cc
+              block_device/nbd_socket.cc
+              block_device/userspace_nbd_block_device.cc
+              cpu_placement/cpu_placement.cc
               device_synchronizer/device_synchronizer.cc)
 target_link_libraries(device_synchronizer_test blkid uuid ${PROTOBUF_LIBRARIES})
 
 add_unit_test(device_tracer_test
+              cpu_placement/cpu_placement.cc
               test/loop_device.cc
               tracing/device_tracer.cc
               tracing/cpu_tracer.cc
+              tracing/trace_buffer.cc
+              tracing/trace_reader_pool.cc
+              tracing/trace_handler.cc
+              unsynced_sector_manager/interval_unsynced_sector_store.cc
+              unsynced_sector_manager/volatile_window.cc
+              unsynced_sector_manager/write_heat_tracker.cc)
+
+add_unit_test(era_tracker_test
+              cpu_placement/cpu_placement.cc
+              tracing/cpu_tracer.cc
+              tracing/device_tracer.cc
+              tracing/dm_era.cc
+              tracing/era_tracker.cc
+              tracing/trace_buffer.cc
               tracing/trace_handler.cc
-              unsynced_sector_manager/unsynced_sector_store.cc)
+              tracing/trace_reader_pool.cc
+              unsynced_sector_manager/interval_unsynced_sector_store.cc
+              unsynced_sector_manager/volatile_window.cc
+              unsynced_sector_manager/write_heat_tracker.cc)
 
 add_unit_test(extfs_test
               block_device/block_device.cc
               block_device/ext_file_system.cc
+              block_device/in_use_sector_producer.cc
               block_device/mountable_block_device.cc
               freeze_helper/freeze_helper.cc
               test/loop_device.cc
@@ -148,11 +255,15 @@ add_unit_test(flock_test
 add_unit_test(freeze_helper_test
               backup/backup.cc
               block_device/block_device.cc
+              block_device/in_use_sector_producer.cc
               block_device/mountable_block_device.cc
               ${PROTO_SRCS}
               freeze_helper/freeze_helper.cc)
 target_link_libraries(freeze_helper_test blkid uuid ${PROTOBUF_LIBRARIES})
 
+add_unit_test(in_use_sector_producer_test
+              block_device/in_use_sector_producer.cc)
+
 add_unit_test(ipc_request_listener_test
               backup/backup.cc
               backup/backup_coordinator.cc
@@ -168,6 +279,7 @@ target_link_libraries(ipc_request_listener_test uuid ${PROTOBUF_LIBRARIES})
 
 add_unit_test(mountable_block_device_test
               test/loop_device.cc
+              block_device/in_use_sector_producer.cc
               block_device/mountable_block_device.cc
               block_device/block_device.cc)
 target_link_libraries(mountable_block_device_test blkid)
@@ -176,23 +288,101 @@ add_unit_test(nbd_block_device_test
               test/loop_device.cc
               block_device/block_device.cc
               block_device/nbd_client.cc
+              block_device/nbd_negotiation.cc
+              block_device/nbd_netlink.cc
               block_device/nbd_server.cc
+              block_device/nbd_socket.cc
               block_device/nbd_block_device.cc)
 
+add_unit_test(nbd_connection_test
+              block_device/nbd_connection.cc
+              block_device/nbd_negotiation.cc
+              block_device/nbd_socket.cc)
+
+add_unit_test(nbd_netlink_test
+              block_device/nbd_netlink.cc)
+
+add_unit_test(nbd_server_test
+              block_device/nbd_connection.cc
+              block_device/nbd_negotiation.cc
+              block_device/nbd_server.cc
+              block_device/nbd_socket.cc)
+
+add_unit_test(partition_unsynced_sector_store_test
+              unsynced_sector_manager/partition_unsynced_sector_store.cc
+              unsynced_sector_manager/write_only_unsynced_sector_store.cc
+              unsynced_sector_manager/interval_unsynced_sector_store.cc
+              unsynced_sector_manager/volatile_window.cc
+              unsynced_sector_manager/write_heat_tracker.cc)
+
+add_unit_test(ring_trace_handler_test
+              tracing/ring_trace_handler.cc
+              tracing/trace_handler.cc
+              unsynced_sector_manager/interval_unsynced_sector_store.cc
+              unsynced_sector_manager/volatile_window.cc
+              unsynced_sector_manager/write_heat_tracker.cc)
+
 add_unit_test(signal_handler_test
               dattod/signal_handler.cc)
 
+add_unit_test(trace_reader_pool_test
+              cpu_placement/cpu_placement.cc
+              tracing/trace_buffer.cc
+              tracing/trace_reader_pool.cc
+              tracing/trace_handler.cc
+              unsynced_sector_manager/interval_unsynced_sector_store.cc
+              unsynced_sector_manager/volatile_window.cc
+              unsynced_sector_manager/write_heat_tracker.cc)
+
+add_unit_test(trace_replay_test
+              tracing/synthetic_trace_source.cc
+              tracing/trace_recorder.cc
+              tracing/trace_replayer.cc
+              tracing/trace_handler.cc
+              unsynced_sector_manager/interval_unsynced_sector_store.cc
+              unsynced_sector_manager/volatile_window.cc
+              unsynced_sector_manager/write_heat_tracker.cc)
+
 add_unit_test(unsynced_sector_manager_test
+              cpu_placement/cpu_placement.cc
               block_device/block_device.cc
+              block_device/partition_info.cc
               tracing/cpu_tracer.cc
+              tracing/trace_buffer.cc
+              tracing/trace_reader_pool.cc
+              tracing/trace_recorder.cc
               tracing/device_tracer.cc
+              tracing/dm_era.cc
+              tracing/era_tracker.cc
+              tracing/bpf_dirty_tracker.cc
               tracing/trace_handler.cc
+              tracing/ring_trace_handler.cc
               test/loop_device.cc
-              unsynced_sector_manager/unsynced_sector_store.cc
+              unsynced_sector_manager/interval_unsynced_sector_store.cc
+              unsynced_sector_manager/volatile_window.cc
+              unsynced_sector_manager/write_heat_tracker.cc
+              unsynced_sector_manager/bitmap_unsynced_sector_store.cc
+              unsynced_sector_manager/change_export.cc
+              unsynced_sector_manager/change_history.cc
+              unsynced_sector_manager/fan_out_unsynced_sector_store.cc
+              unsynced_sector_manager/partition_unsynced_sector_store.cc
+              unsynced_sector_manager/write_only_unsynced_sector_store.cc
               unsynced_sector_manager/unsynced_sector_manager.cc)
 
+add_unit_test(userspace_nbd_block_device_test
+              block_device/block_device.cc
+              block_device/nbd_connection.cc
+              block_device/nbd_negotiation.cc
+              block_device/nbd_server.cc
+              block_device/nbd_socket.cc
+              block_device/userspace_nbd_block_device.cc)
+
+add_unit_test(write_heat_tracker_test
+              unsynced_sector_manager/write_heat_tracker.cc)
+
 #add_unit_test(xfs_test
 #              test/loop_device.cc
+#              block_device/in_use_sector_producer.cc
 #              block_device/mountable_block_device.cc
 #              block_device/block_device.cc
 #              block_device/xfs_mountable_block_device.cc)
@@ -0,0 +1,177 @@
+#include "cpu_placement/cpu_placement.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/sysinfo.h>
+#include <sys/sysmacros.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+#include <glog/logging.h>
+
+#include "cpu_placement/cpu_placement_exception.h"
+
+namespace {
+
+using ::datto_linux_client::CpuPlacement;
+using ::datto_linux_client::CpuPlacementException;
+
+const char SYSFS_CPU_PATH[] = "/sys/devices/system/cpu/";
+const char SYSFS_NODE_PATH[] = "/sys/devices/system/node/";
+
+std::string ReadFile(const std::string &path) {
+  std::ifstream file(path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  return file ? contents.str() : std::string();
+}
+
+// Isolated CPU files that can't be parsed, e.g. nohz_full is "(null)" on
+// some kernels when it isn't set, count as empty
+std::vector<int> ReadCpuListFile(const std::string &path) {
+  try {
+    return CpuPlacement::ParseCpuList(ReadFile(path));
+  } catch (const CpuPlacementException &e) {
+    VLOG(1) << "Ignoring " << path << ": " << e.what();
+    return std::vector<int>();
+  }
+}
+
+std::vector<int> Intersect(const std::vector<int> &a,
+                           const std::vector<int> &b) {
+  std::vector<int> both;
+  std::set_intersection(a.begin(), a.end(), b.begin(), b.end(),
+                        std::back_inserter(both));
+  return both;
+}
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+CpuPlacement::CpuPlacement() : housekeeping_cpus_() {
+  std::vector<int> online =
+      ReadCpuListFile(std::string(SYSFS_CPU_PATH) + "online");
+  if (online.empty()) {
+    for (int cpu = 0; cpu < get_nprocs_conf(); ++cpu) {
+      online.push_back(cpu);
+    }
+  }
+
+  std::vector<int> isolated =
+      ReadCpuListFile(std::string(SYSFS_CPU_PATH) + "isolated");
+  std::vector<int> nohz_full =
+      ReadCpuListFile(std::string(SYSFS_CPU_PATH) + "nohz_full");
+  isolated.insert(isolated.end(), nohz_full.begin(), nohz_full.end());
+  std::sort(isolated.begin(), isolated.end());
+
+  std::set_difference(online.begin(), online.end(),
+                      isolated.begin(), isolated.end(),
+                      std::back_inserter(housekeeping_cpus_));
+  if (housekeeping_cpus_.empty()) {
+    LOG(WARNING) << "Every CPU is isolated, using them all";
+    housekeeping_cpus_ = online;
+  }
+}
+
+CpuPlacement::CpuPlacement(const std::string &housekeeping_list)
+    : housekeeping_cpus_(ParseCpuList(housekeeping_list)) {
+  if (housekeeping_cpus_.empty()) {
+    throw CpuPlacementException("No housekeeping CPUs");
+  }
+}
+
+std::vector<int> CpuPlacement::ParseCpuList(const std::string &cpu_list) {
+  std::vector<int> cpus;
+  std::istringstream ranges(cpu_list);
+  std::string range;
+  while (std::getline(ranges, range, ',')) {
+    range.erase(range.find_last_not_of(" \t\n") + 1);
+    range.erase(0, range.find_first_not_of(" \t\n"));
+    if (range.empty()) {
+      continue;
+    }
+
+    char *end;
+    long first = strtol(range.c_str(), &end, 10);
+    long last = first;
+    if (*end == '-') {
+      last = strtol(end + 1, &end, 10);
+    }
+    if (end == range.c_str() || *end != '\0' || first < 0 || last < first ||
+        last >= CPU_SETSIZE) {
+      throw CpuPlacementException("Bad CPU list: " + cpu_list);
+    }
+    for (long cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return cpus;
+}
+
+bool CpuPlacement::PinThread(const std::vector<int> &cpus) {
+  if (cpus.empty()) {
+    return false;
+  }
+  int num_cpus = std::max(cpus.back() + 1, get_nprocs_conf());
+  cpu_set_t *cpu_mask = CPU_ALLOC(num_cpus);
+  size_t size = CPU_ALLOC_SIZE(num_cpus);
+
+  CPU_ZERO_S(size, cpu_mask);
+  for (int cpu : cpus) {
+    CPU_SET_S(cpu, size, cpu_mask);
+  }
+  bool is_pinned = sched_setaffinity(0, size, cpu_mask) == 0;
+  if (!is_pinned) {
+    PLOG(ERROR) << "Unable to set CPU affinity";
+  }
+
+  CPU_FREE(cpu_mask);
+  return is_pinned;
+}
+
+bool CpuPlacement::IsHousekeeping(int cpu) const {
+  return std::binary_search(housekeeping_cpus_.begin(),
+                            housekeeping_cpus_.end(), cpu);
+}
+
+std::vector<int> CpuPlacement::DeviceCpus(::dev_t device) const {
+  // A partition's directory is in its disk's, which has the device link
+  std::ostringstream sysfs_path;
+  sysfs_path << "/sys/dev/block/" << major(device) << ":" << minor(device);
+  std::string node = ReadSysfsFile(sysfs_path.str() + "/device/numa_node");
+  if (node.empty()) {
+    node = ReadSysfsFile(sysfs_path.str() + "/../device/numa_node");
+  }
+  int node_num = node.empty() ? -1 : atoi(node.c_str());
+  if (node_num < 0) {
+    return housekeeping_cpus_;
+  }
+
+  std::vector<int> local;
+  try {
+    local = Intersect(housekeeping_cpus_, ParseCpuList(ReadSysfsFile(
+        std::string(SYSFS_NODE_PATH) + "node" + std::to_string(node_num) +
+        "/cpulist")));
+  } catch (const CpuPlacementException &e) {
+    LOG(WARNING) << "Unable to read CPUs of node " << node_num << ": "
+                 << e.what();
+  }
+  return local.empty() ? housekeeping_cpus_ : local;
+}
+
+bool CpuPlacement::PinToHousekeeping() const {
+  return PinThread(housekeeping_cpus_);
+}
+
+std::string CpuPlacement::ReadSysfsFile(const std::string &path) const {
+  return ReadFile(path);
+}
+
+}
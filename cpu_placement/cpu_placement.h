@@ -0,0 +1,65 @@
+#ifndef DATTO_CLIENT_CPU_PLACEMENT_CPU_PLACEMENT_H_
+#define DATTO_CLIENT_CPU_PLACEMENT_CPU_PLACEMENT_H_
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+namespace datto_linux_client {
+
+// CpuPlacement decides which CPUs the threads of dattod run on. CPUs
+// isolated for latency sensitive work (isolcpus=, nohz_full=) are left
+// alone, threads run on the remaining housekeeping CPUs instead.
+//
+// dattod pins its main thread to the housekeeping CPUs before starting any
+// other thread, so every thread inherits them. The trace reader threads are
+// pinned to them as well (see UnsyncedSectorManager::SetCpuPlacement), and
+// read the relay buffers of isolated CPUs from there. A CpuTracer of a CPU
+// outside of its inherited CPUs does the same instead of moving to it.
+class CpuPlacement {
+ public:
+  // The housekeeping CPUs are the online CPUs that aren't isolated
+  CpuPlacement();
+
+  // @housekeeping_list: A cpulist, e.g. "0-3,8"
+  explicit CpuPlacement(const std::string &housekeeping_list);
+
+  virtual ~CpuPlacement() {}
+
+  // Parses a cpulist as used by sysfs and the kernel command line. Throws
+  // a CpuPlacementException if it is malformed.
+  static std::vector<int> ParseCpuList(const std::string &cpu_list);
+
+  // Pins the calling thread to cpus. Returns false, and logs, if it
+  // can't. This doesn't throw as it is called from thread functions.
+  static bool PinThread(const std::vector<int> &cpus);
+
+  const std::vector<int> &housekeeping_cpus() const {
+    return housekeeping_cpus_;
+  }
+
+  bool IsHousekeeping(int cpu) const;
+
+  // The housekeeping CPUs in the NUMA node of device, so a thread copying
+  // the device uses memory near it. All housekeeping CPUs if the node isn't
+  // known or has none of them.
+  std::vector<int> DeviceCpus(::dev_t device) const;
+
+  bool PinToHousekeeping() const;
+
+  CpuPlacement(const CpuPlacement &) = delete;
+  CpuPlacement& operator=(const CpuPlacement &) = delete;
+
+ protected:
+  // Virtual to allow overriding in tests. Returns an empty string if path
+  // can't be read.
+  virtual std::string ReadSysfsFile(const std::string &path) const;
+
+ private:
+  std::vector<int> housekeeping_cpus_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_CPU_PLACEMENT_CPU_PLACEMENT_H_
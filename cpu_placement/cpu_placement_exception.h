@@ -0,0 +1,14 @@
+#ifndef DATTO_CLIENT_CPU_PLACEMENT_CPU_PLACEMENT_EXCEPTION_H_
+#define DATTO_CLIENT_CPU_PLACEMENT_CPU_PLACEMENT_EXCEPTION_H_
+
+#include <stdexcept>
+
+namespace datto_linux_client {
+class CpuPlacementException : public std::runtime_error {
+ public:
+  explicit CpuPlacementException(const std::string &a_what)
+    : runtime_error(a_what) {};
+};
+}
+
+#endif //  DATTO_CLIENT_CPU_PLACEMENT_CPU_PLACEMENT_EXCEPTION_H_
@@ -1,20 +1,26 @@
 #include <memory>
 #include <signal.h>
 #include <string.h>
+#include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include "backup/backup_builder.h"
 #include "backup/backup_manager.h"
 #include "backup_status_tracker/backup_status_tracker.h"
 #include "block_device/block_device_factory.h"
+#include "block_device/nbd_client.h"
+#include "cpu_placement/cpu_placement.h"
 #include "dattod/flock.h"
 #include "dattod/signal_handler.h"
 #include "logging/queuing_log_sink.h"
 #include "request_listener/ipc_request_listener.h"
 #include "request_listener/request_handler.h"
+#include "unsynced_sector_manager/unsynced_sector_manager.h"
+#include "unsynced_sector_manager/unsynced_sector_store.h"
 
 const char DATTO_SOCKET[] = "/var/run/dattod.sock";
 const char FLOCK_PATH[] = "/var/run/dattod.pid";
@@ -24,20 +30,120 @@ const char LOG_PATH[] = "/var/log/dattod.log";
 const char LOG_PATH[] = "/tmp/dattod.log";
 #endif
 
+DEFINE_string(housekeeping_cpus, "",
+              "CPUs dattod runs on, e.g. 0-3. Defaults to the CPUs that "
+              "aren't isolated with isolcpus= or nohz_full=");
+DEFINE_bool(numa_local_sync, false,
+            "Run each sync on the CPUs of its source device's NUMA node");
+DEFINE_bool(userspace_nbd, true,
+            "Speak NBD to backup destinations from user space, which "
+            "reconnects dropped connections, instead of through the kernel "
+            "nbd module");
+DEFINE_int32(nbd_connections,
+             datto_linux_client::NbdClient::DEFAULT_MAX_CONNECTIONS,
+             "Connections per kernel NBD device, when the server allows "
+             "more than one");
+DEFINE_string(store_type, "interval",
+              "How unsynced sectors are tracked: interval (exact, memory "
+              "grows with the number of writes) or bitmap (rounded to "
+              "blocks, memory fixed by the device size)");
+DEFINE_uint64(memory_budget_mb,
+              datto_linux_client::UnsyncedSectorStore::
+                  DEFAULT_MEMORY_BUDGET_BYTES >> 20,
+              "MiB each store and change history of a traced device may "
+              "use before intervals are merged, which copies extra data. "
+              "0 means no limit");
+DEFINE_string(export_changes_dir, "",
+              "On SIGUSR1, write what each traced device changed since its "
+              "last export to <dir>/<device>.changes");
+DEFINE_string(export_changes_format, "run_length",
+              "Format of change exports: run_length or bitmap");
+DEFINE_string(trace_record_dir, "",
+              "Record the block traces of every traced device into this "
+              "directory, so workloads can be replayed offline");
+DEFINE_bool(trace_whole_disk, false,
+            "Trace partitions through their disk, so the partitions of a "
+            "disk share one tracer");
+DEFINE_string(trace_backend, "blktrace",
+              "How writes are tracked: blktrace, era (dm-era targets), bpf, "
+              "or auto (era for dm-era targets, else bpf where available, "
+              "else blktrace)");
+
 namespace {
 using datto_linux_client::BackupBuilder;
 using datto_linux_client::BackupManager;
 using datto_linux_client::BackupStatusTracker;
 using datto_linux_client::BlockDeviceFactory;
+using datto_linux_client::ChangeExportFormat;
+using datto_linux_client::CpuPlacement;
 using datto_linux_client::Flock;
 using datto_linux_client::IpcRequestListener;
 using datto_linux_client::QueuingLogSink;
 using datto_linux_client::RequestHandler;
 using datto_linux_client::SignalHandler;
 using datto_linux_client::UnsyncedSectorManager;
+
+bool ParseStoreType(const std::string &name,
+                    UnsyncedSectorManager::StoreType *const store_type) {
+  if (name == "interval") {
+    *store_type = UnsyncedSectorManager::INTERVAL_STORE;
+  } else if (name == "bitmap") {
+    *store_type = UnsyncedSectorManager::BITMAP_STORE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool ParseTraceBackend(const std::string &name,
+                       UnsyncedSectorManager::TraceBackend *const backend) {
+  if (name == "blktrace") {
+    *backend = UnsyncedSectorManager::BLKTRACE_BACKEND;
+  } else if (name == "era") {
+    *backend = UnsyncedSectorManager::DM_ERA_BACKEND;
+  } else if (name == "bpf") {
+    *backend = UnsyncedSectorManager::BPF_BACKEND;
+  } else if (name == "auto") {
+    *backend = UnsyncedSectorManager::AUTO_BACKEND;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool ParseExportFormat(const std::string &name,
+                       ChangeExportFormat *const format) {
+  if (name == "run_length") {
+    *format = datto_linux_client::RUN_LENGTH_EXPORT;
+  } else if (name == "bitmap") {
+    *format = datto_linux_client::BITMAP_EXPORT;
+  } else {
+    return false;
+  }
+  return true;
+}
 }
 
 int main(int argc, char *argv[]) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  // Checked before daemonizing so mistakes are reported on the terminal
+  UnsyncedSectorManager::StoreType store_type;
+  if (!ParseStoreType(FLAGS_store_type, &store_type)) {
+    LOG(ERROR) << "Unknown --store_type " << FLAGS_store_type;
+    return 1;
+  }
+  UnsyncedSectorManager::TraceBackend trace_backend;
+  if (!ParseTraceBackend(FLAGS_trace_backend, &trace_backend)) {
+    LOG(ERROR) << "Unknown --trace_backend " << FLAGS_trace_backend;
+    return 1;
+  }
+  ChangeExportFormat export_format;
+  if (!ParseExportFormat(FLAGS_export_changes_format, &export_format)) {
+    LOG(ERROR) << "Unknown --export_changes_format "
+               << FLAGS_export_changes_format;
+    return 1;
+  }
 
 #ifdef NDEBUG
   if (daemon(0, 0)) {
@@ -57,6 +163,19 @@ int main(int argc, char *argv[]) {
   FLAGS_logtostderr = 1;
 
   google::InitGoogleLogging(argv[0]);
+
+  // Threads inherit this, so it must happen before any other thread starts
+  std::shared_ptr<CpuPlacement> cpu_placement;
+  try {
+    cpu_placement = FLAGS_housekeeping_cpus.empty() ?
+        std::make_shared<CpuPlacement>() :
+        std::make_shared<CpuPlacement>(FLAGS_housekeeping_cpus);
+  } catch (const std::runtime_error &e) {
+    LOG(ERROR) << e.what();
+    return 1;
+  }
+  cpu_placement->PinToHousekeeping();
+
   QueuingLogSink log_sink(LOG_PATH);
   google::AddLogSink(&log_sink);
 
@@ -72,14 +191,30 @@ int main(int argc, char *argv[]) {
 
   // Block typical death signals
   std::vector<int> signals_to_block { SIGTERM, SIGINT };
+  if (!FLAGS_export_changes_dir.empty()) {
+    signals_to_block.push_back(SIGUSR1);
+  }
   SignalHandler signal_handler(signals_to_block);
   signal_handler.BlockSignals();
 
   {
     auto block_device_factory = std::make_shared<BlockDeviceFactory>();
+    block_device_factory->SetUseUserspaceNbd(FLAGS_userspace_nbd);
+    block_device_factory->SetMaxNbdConnections(FLAGS_nbd_connections);
     auto sector_manager = std::make_shared<UnsyncedSectorManager>();
+    sector_manager->SetDefaultStoreType(store_type);
+    sector_manager->SetDefaultMemoryBudget(FLAGS_memory_budget_mb << 20);
+    sector_manager->SetChangeExportDir(FLAGS_export_changes_dir,
+                                       export_format);
+    sector_manager->SetTraceRecordDir(FLAGS_trace_record_dir);
+    sector_manager->SetTraceWholeDisk(FLAGS_trace_whole_disk);
+    sector_manager->SetDefaultTraceBackend(trace_backend);
+    sector_manager->SetCpuPlacement(cpu_placement);
     auto backup_builder = std::make_shared<BackupBuilder>(block_device_factory,
         sector_manager);
+    if (FLAGS_numa_local_sync) {
+      backup_builder->SetCpuPlacement(cpu_placement);
+    }
     auto status_tracker = std::make_shared<BackupStatusTracker>();
 
     // Create the backup manager
@@ -93,8 +228,14 @@ int main(int argc, char *argv[]) {
     IpcRequestListener request_listener(DATTO_SOCKET,
         std::move(request_handler));
 
-    // Listen for signals
-    signal_handler.WaitForSignal([&](int) {} );
+    // Listen for signals. SIGUSR1 exports changes, the rest stop dattod.
+    while (signal_handler.WaitForSignal([&](int) {} ) == SIGUSR1) {
+      try {
+        sector_manager->ExportAllChanges();
+      } catch (const std::exception &e) {
+        LOG(ERROR) << "Unable to export changes: " << e.what();
+      }
+    }
   }
 
   // Clean up
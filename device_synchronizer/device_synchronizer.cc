@@ -1,19 +1,37 @@
 #include "device_synchronizer/device_synchronizer.h"
 
+#include <errno.h>
+#include <linux/fs.h>
 #include <stdint.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <memory>
+#include <vector>
+
 #include <glog/logging.h>
 
+#include "block_device/nbd_connection.h"
+#include "block_device/nbd_exception.h"
+#include "block_device/userspace_nbd_block_device.h"
 #include "device_synchronizer/device_synchronizer_exception.h"
 #include "freeze_helper/freeze_helper.h"
+#include "unsynced_sector_manager/claimed_interval.h"
 #include "unsynced_sector_manager/sector_interval.h"
+#include "unsynced_sector_manager/store_statistics.h"
+#include "unsynced_sector_manager/trace_statistics.h"
 
 namespace {
 
+using ::datto_linux_client::ClaimedInterval;
 using ::datto_linux_client::DeviceSynchronizerException;
+using ::datto_linux_client::FreezeHelper;
+using ::datto_linux_client::NbdConnection;
+using ::datto_linux_client::NbdException;
+using ::datto_linux_client::SectorInterval;
 
 uint32_t SECTOR_SIZE = 512;
 uint32_t ONE_MEGABYTE = 1024 * 1024;
@@ -21,32 +39,262 @@ uint32_t ONE_MEGABYTE = 1024 * 1024;
 time_t SECONDS_BETWEEN_FLUSHES = 5;
 time_t SECONDS_TO_FREEZE = 2;
 
-inline void copy_block(int source_fd, int destination_fd,
-                       ssize_t block_size_bytes, off_t offset) {
-  char buf[block_size_bytes];
+// Volatile data is read into memory while the filesystem is frozen and
+// written to the destination after the thaw. This bounds how much is read
+// during a single freeze.
+uint64_t MAX_FROZEN_BUFFER_BYTES = 8 * ONE_MEGABYTE;
+
+// Upper bounds on the work taken from the store at once. Keeping these small
+// keeps cancellation and progress updates responsive.
+size_t MAX_INTERVALS_PER_CLAIM = 64;
+uint64_t MAX_BYTES_PER_CLAIM = 8 * ONE_MEGABYTE;
+
+// Discarded intervals trimmed from the destination at once
+size_t MAX_INTERVALS_PER_TRIM = 64;
+
+// While in-use sectors are still being produced, keep at least this much
+// in the store so claims always have something to work with
+uint64_t MIN_LOADED_BYTES = 64 * ONE_MEGABYTE;
+
+// Non-volatile data is copied through buffers of this size
+uint64_t COPY_BUFFER_BYTES = ONE_MEGABYTE;
+
+// Writes kept in flight to a userspace NBD destination
+size_t NBD_WRITE_BUFFERS = 16;
 
-  DLOG_EVERY_N(INFO, 1000) << "Copying block " << google::COUNTER;
+// Trims and zeroing writes sent to an NBD server at once. They carry no
+// payload, so NbdConnection::MAX_REQUEST_BYTES doesn't apply.
+uint64_t MAX_NBD_TRIM_BYTES = 1024 * ONE_MEGABYTE;
 
-  ssize_t bytes_read = pread(source_fd, buf, block_size_bytes, offset);
+// The destination is flushed after this much is copied. Until then the
+// copied intervals are kept, to go back to the store if the connection is
+// lost.
+uint64_t MAX_UNFLUSHED_BYTES = 256 * ONE_MEGABYTE;
+
+inline void read_blocks(int source_fd, char *buf, ssize_t num_bytes,
+                        off_t offset) {
+  ssize_t bytes_read = pread(source_fd, buf, num_bytes, offset);
   if (bytes_read == -1) {
     PLOG(ERROR) << "Error while reading from source";
     throw DeviceSynchronizerException("Error reading from source");
-  } else if (bytes_read != block_size_bytes) {
-    PLOG(INFO) << "Expected to read " << block_size_bytes
+  } else if (bytes_read != num_bytes) {
+    PLOG(INFO) << "Expected to read " << num_bytes
                << ". Got " << bytes_read;
     throw DeviceSynchronizerException("Unexpected read result");
   }
+}
 
-  ssize_t bytes_written = pwrite(destination_fd, buf, bytes_read, offset);
+inline void write_blocks(int destination_fd, const char *buf,
+                         ssize_t num_bytes, off_t offset) {
+  ssize_t bytes_written = pwrite(destination_fd, buf, num_bytes, offset);
   if (bytes_written == -1) {
     PLOG(ERROR) << "Error while writing to destination";
     throw DeviceSynchronizerException("Error writing to destination");
-  } else if (bytes_written != block_size_bytes) {
-    PLOG(INFO) << "Expected to write " << block_size_bytes
+  } else if (bytes_written != num_bytes) {
+    PLOG(INFO) << "Expected to write " << num_bytes
                << ". Got " << bytes_written;
     throw DeviceSynchronizerException("Unexpected read result");
   }
 }
+
+// Where copied data goes. Writes may finish after Write returns.
+class DestinationWriter {
+ public:
+  virtual ~DestinationWriter() {}
+
+  // A buffer of COPY_BUFFER_BYTES to read the next write into
+  virtual char *NextBuffer() = 0;
+  // buf must not change until it is returned by NextBuffer again or Drain
+  // returns
+  virtual void Write(const char *buf, ssize_t num_bytes, off_t offset) = 0;
+  // Returns false if the destination can't trim
+  virtual bool Trim(const SectorInterval &interval) = 0;
+  // Returns once every write is done. Throws if any failed.
+  virtual void Drain() = 0;
+  // Makes what was written durable on the destination
+  virtual void Flush() = 0;
+};
+
+// Writes to a local block device, one write at a time
+class FdDestinationWriter : public DestinationWriter {
+ public:
+  explicit FdDestinationWriter(int destination_fd)
+      : destination_fd_(destination_fd),
+        buffer_(COPY_BUFFER_BYTES) {}
+
+  char *NextBuffer() {
+    return buffer_.data();
+  }
+
+  void Write(const char *buf, ssize_t num_bytes, off_t offset) {
+    write_blocks(destination_fd_, buf, num_bytes, offset);
+  }
+
+  bool Trim(const SectorInterval &interval);
+
+  void Drain() {}
+  void Flush() {}
+
+ private:
+  int destination_fd_;
+  std::vector<char> buffer_;
+};
+
+// Keeps up to NBD_WRITE_BUFFERS writes in flight on an NbdConnection. The
+// buffers are sent as they are, so a buffer is reused only once the write
+// from it is done.
+class NbdDestinationWriter : public DestinationWriter {
+ public:
+  explicit NbdDestinationWriter(std::shared_ptr<NbdConnection> connection)
+      : connection_(connection),
+        buffers_(NBD_WRITE_BUFFERS, std::vector<char>(COPY_BUFFER_BYTES)),
+        write_handles_(NBD_WRITE_BUFFERS, 0),
+        next_buffer_(0) {}
+
+  char *NextBuffer() {
+    size_t index = next_buffer_;
+    next_buffer_ = (next_buffer_ + 1) % buffers_.size();
+    if (write_handles_[index]) {
+      uint64_t handle = write_handles_[index];
+      write_handles_[index] = 0;
+      connection_->Wait(handle);
+    }
+    return buffers_[index].data();
+  }
+
+  void Write(const char *buf, ssize_t num_bytes, off_t offset) {
+    uint64_t handle = connection_->AsyncWrite(buf, num_bytes, offset);
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+      if (buf == buffers_[i].data()) {
+        write_handles_[i] = handle;
+      }
+    }
+  }
+
+  bool Trim(const SectorInterval &interval);
+
+  void Drain() {
+    std::fill(write_handles_.begin(), write_handles_.end(), 0);
+    connection_->WaitAll();
+  }
+
+  void Flush() {
+    Drain();
+    if (connection_->CanFlush()) {
+      connection_->Flush();
+    }
+  }
+
+ private:
+  std::shared_ptr<NbdConnection> connection_;
+  std::vector<std::vector<char>> buffers_;
+  // Of the write from each buffer, 0 once it is waited for
+  std::vector<uint64_t> write_handles_;
+  size_t next_buffer_;
+};
+
+// Copies the blocks of an interval from the source to the destination.
+//
+// Volatile data is only read while frozen so the freeze doesn't include the
+// time it takes to write to the destination. Intervals larger than the
+// buffer are done in multiple, smaller freezes.
+void copy_interval(const ClaimedInterval &claimed, int source_fd,
+                   DestinationWriter *writer, int block_size_bytes,
+                   FreezeHelper *freeze_helper,
+                   std::vector<char> *frozen_buffer) {
+  const int sectors_per_block = block_size_bytes / SECTOR_SIZE;
+  uint64_t num_sectors = boost::icl::cardinality(claimed.interval);
+  uint64_t num_blocks = (num_sectors + sectors_per_block - 1) /
+                        sectors_per_block;
+  off_t offset = claimed.interval.lower() * SECTOR_SIZE;
+  uint64_t bytes_left = num_blocks * block_size_bytes;
+
+  if (!claimed.is_volatile) {
+    // Whole blocks at a time
+    uint64_t chunk_bytes = std::max(
+        COPY_BUFFER_BYTES / block_size_bytes * block_size_bytes,
+        static_cast<uint64_t>(block_size_bytes));
+    while (bytes_left > 0) {
+      ssize_t write_bytes = std::min(bytes_left, chunk_bytes);
+      char *buf = writer->NextBuffer();
+      read_blocks(source_fd, buf, write_bytes, offset);
+      writer->Write(buf, write_bytes, offset);
+      offset += write_bytes;
+      bytes_left -= write_bytes;
+    }
+    return;
+  }
+
+  if (frozen_buffer->empty()) {
+    uint64_t buffer_blocks = MAX_FROZEN_BUFFER_BYTES / block_size_bytes;
+    frozen_buffer->resize(std::max(buffer_blocks, (uint64_t)1) *
+                          block_size_bytes);
+  }
+
+  while (bytes_left > 0) {
+    ssize_t window_bytes = std::min(bytes_left,
+                                    (uint64_t)frozen_buffer->size());
+    freeze_helper->RunWhileFrozen([&]() {
+      read_blocks(source_fd, frozen_buffer->data(), window_bytes, offset);
+    });
+    freeze_helper->ThawNow();
+    writer->Write(frozen_buffer->data(), window_bytes, offset);
+    // The buffer is read into again next time around
+    writer->Drain();
+    offset += window_bytes;
+    bytes_left -= window_bytes;
+  }
+}
+
+// Discards an interval on the destination, or zeroes it if the destination
+// can't discard. Stale data on the destination is harmless, so this only
+// returns false rather than throwing when neither works.
+bool FdDestinationWriter::Trim(const SectorInterval &interval) {
+  uint64_t range[2] = {interval.lower() * SECTOR_SIZE,
+                       boost::icl::cardinality(interval) * SECTOR_SIZE};
+  if (ioctl(destination_fd_, BLKDISCARD, range) == 0) {
+    return true;
+  }
+  if (errno == EOPNOTSUPP &&
+      ioctl(destination_fd_, BLKZEROOUT, range) == 0) {
+    return true;
+  }
+  PLOG(WARNING) << "Unable to trim " << interval << " on destination";
+  return false;
+}
+
+// As above, with NBD trims or zeroing writes
+bool NbdDestinationWriter::Trim(const SectorInterval &interval) {
+  bool can_trim = connection_->CanTrim();
+  if (!can_trim && !connection_->CanWriteZeroes()) {
+    LOG(WARNING) << "NBD server can't trim or write zeroes";
+    return false;
+  }
+
+  uint64_t offset = interval.lower() * SECTOR_SIZE;
+  uint64_t bytes_left = boost::icl::cardinality(interval) * SECTOR_SIZE;
+  try {
+    while (bytes_left > 0) {
+      uint32_t trim_bytes = std::min(bytes_left, MAX_NBD_TRIM_BYTES);
+      if (can_trim) {
+        connection_->Wait(connection_->AsyncTrim(trim_bytes, offset));
+      } else {
+        connection_->Wait(connection_->AsyncWriteZeroes(trim_bytes, offset));
+      }
+      offset += trim_bytes;
+      bytes_left -= trim_bytes;
+    }
+  } catch (const NbdException &e) {
+    // Left to DoSync to reconnect
+    if (!connection_->IsConnected()) {
+      throw;
+    }
+    LOG(WARNING) << "Unable to trim " << interval << " on destination: "
+                 << e.what();
+    return false;
+  }
+  return true;
+}
 } // unnamed namespace
 
 namespace datto_linux_client {
@@ -55,9 +303,20 @@ DeviceSynchronizer::DeviceSynchronizer(
     std::shared_ptr<MountableBlockDevice> source_device_a,
     std::shared_ptr<UnsyncedSectorManager> sector_manager_a,
     std::shared_ptr<BlockDevice> destination_device_a)
+    : DeviceSynchronizer(source_device_a, sector_manager_a,
+                         destination_device_a, std::string()) { }
+
+DeviceSynchronizer::DeviceSynchronizer(
+    std::shared_ptr<MountableBlockDevice> source_device_a,
+    std::shared_ptr<UnsyncedSectorManager> sector_manager_a,
+    std::shared_ptr<BlockDevice> destination_device_a,
+    const std::string &destination_id)
     : source_device_(source_device_a),
       sector_manager_(sector_manager_a),
-      destination_device_(destination_device_a) {
+      destination_device_(destination_device_a),
+      destination_id_(destination_id),
+      cpu_placement_(),
+      in_use_producer_() {
 
   if (source_device_->dev_t() == destination_device_->dev_t()) {
     LOG(ERROR) << "Attempt to synchronize a device with itself";
@@ -82,23 +341,87 @@ void DeviceSynchronizer::DoSync(
     std::shared_ptr<SyncCountHandler> count_handler) {
   LOG(INFO) << "Starting sync ";
 
+  // This thread only does this sync, so it can stay near the source
+  if (cpu_placement_) {
+    CpuPlacement::PinThread(cpu_placement_->DeviceCpus(
+        source_device_->dev_t()));
+  }
+
   uint64_t total_bytes_sent = 0;
   int source_fd = source_device_->Open();
-  int destination_fd = destination_device_->Open();
+  std::unique_ptr<DestinationWriter> writer;
+  auto nbd_destination =
+      std::dynamic_pointer_cast<UserspaceNbdBlockDevice>(destination_device_);
+  if (nbd_destination) {
+    writer.reset(new NbdDestinationWriter(nbd_destination->connection()));
+  } else {
+    writer.reset(new FdDestinationWriter(destination_device_->Open()));
+  }
   FreezeHelper freeze_helper(*source_device_, SECONDS_TO_FREEZE * 1000);
 
   const int block_size_bytes = source_device_->BlockSizeBytes();
-  const int sectors_per_block = block_size_bytes / SECTOR_SIZE;
-  DLOG(INFO) << "Sectors per block: " << sectors_per_block;
+  DLOG(INFO) << "Sectors per block: " << block_size_bytes / SECTOR_SIZE;
 
-  auto source_store = sector_manager_->GetStore(*source_device_);
+  auto source_store = sector_manager_->GetStore(*source_device_,
+                                                destination_id_);
 
   time_t flush_time = 0;
   bool was_done = false;
 
+  // Holds volatile data read during a freeze, allocated on first use
+  std::vector<char> frozen_buffer;
+  std::vector<ClaimedInterval> claimed_intervals;
+  std::vector<SectorInterval> in_use_batch;
+  std::vector<SectorInterval> discarded_intervals;
+  bool can_trim = true;
+
+  // Claimed since the last flush, so possibly not on the destination yet.
+  // Kept as claimed, so volatile ones are still read under a freeze when
+  // they are copied again.
+  std::vector<ClaimedInterval> unflushed_intervals;
+  uint64_t unflushed_sector_count = 0;
+  auto flush_destination = [&]() {
+    writer->Flush();
+    unflushed_intervals.clear();
+    unflushed_sector_count = 0;
+  };
+
+  // Only a lost userspace NBD connection is recovered from. The unflushed
+  // intervals go back to the store and the sync carries on over a new
+  // connection. Anything else, including the server failing a request,
+  // fails the sync as before.
+  auto recover_destination = [&](const NbdException &e) {
+    if (!nbd_destination || nbd_destination->IsConnected()) {
+      throw;
+    }
+    LOG(WARNING) << "Lost connection to destination: " << e.what();
+    source_store->ReturnClaimedIntervals(unflushed_intervals);
+    unflushed_intervals.clear();
+    unflushed_sector_count = 0;
+
+    nbd_destination->Reconnect();
+    writer.reset(new NbdDestinationWriter(nbd_destination->connection()));
+    count_handler->UpdateReconnectCount(nbd_destination->reconnect_count());
+  };
+
   while (!coordinator->IsCancelled()) {
     uint64_t unsynced_sector_count = source_store->UnsyncedSectorCount();
 
+    if (in_use_producer_ &&
+        unsynced_sector_count < MIN_LOADED_BYTES / SECTOR_SIZE) {
+      // The producer may need to freeze the filesystem itself
+      freeze_helper.ThawNow();
+      while (unsynced_sector_count < MIN_LOADED_BYTES / SECTOR_SIZE) {
+        if (!in_use_producer_->NextBatch(&in_use_batch)) {
+          LOG(INFO) << "Finished loading in-use sectors";
+          in_use_producer_.reset();
+          break;
+        }
+        source_store->AddNonVolatileIntervals(in_use_batch);
+        unsynced_sector_count = source_store->UnsyncedSectorCount();
+      }
+    }
+
     // If there is under 1MB left, freeze and flush the filesystem so things
     // are consistent while it wraps up
     if (unsynced_sector_count < ONE_MEGABYTE / SECTOR_SIZE) {
@@ -110,17 +433,48 @@ void DeviceSynchronizer::DoSync(
       // Update sync count after flush and during freeze
       freeze_helper.RunWhileFrozen([&]() {
         // Let the trace data hit
-        // sector_manager_->FlushTracer(*source_device_);
+        sector_manager_->FlushTracer(*source_device_);
         unsynced_sector_count = source_store->UnsyncedSectorCount();
       });
     }
 
+    // Discarded intervals written since are taken back out of the store,
+    // so trimming them first never clears anything that still gets copied
+    source_store->ClaimDiscardedIntervals(&discarded_intervals,
+                                          MAX_INTERVALS_PER_TRIM);
+    try {
+      for (const SectorInterval &discarded : discarded_intervals) {
+        if (!can_trim) {
+          break;
+        }
+        VLOG(1) << "Trimming interval: " << discarded;
+        can_trim = writer->Trim(discarded);
+      }
+    } catch (const NbdException &e) {
+      // Untrimmed intervals only leave stale data on the destination
+      recover_destination(e);
+    }
+
     // Let the event handler know how much is left
     count_handler->UpdateUnsyncedCount(unsynced_sector_count * SECTOR_SIZE);
 
     if (flush_time > 0 && unsynced_sector_count == 0) {
       LOG(INFO) << "Sync complete";
       if (!was_done) {
+        try {
+          flush_destination();
+        } catch (const NbdException &e) {
+          recover_destination(e);
+          continue;
+        }
+        // Checked after the last flush of the tracer, as the store can't
+        // be trusted to be complete once traces were dropped
+        if (sector_manager_->NeedsResync(*source_device_)) {
+          LOG(ERROR) << "Traces of " << source_device_->path()
+                     << " were dropped during the sync";
+          throw DeviceSynchronizerException("Traces were dropped during"
+                                            " the sync");
+        }
         coordinator->SignalFinished();
         was_done = true;
       }
@@ -133,43 +487,111 @@ void DeviceSynchronizer::DoSync(
       coordinator->SignalMoreWorkToDo();
     }
 
-    SectorInterval to_sync_interval;
-    // to_sync_interval is sectors, not blocks
-    bool is_volatile = source_store->GetInterval(&to_sync_interval,
-                                                 time(NULL));
+    // Claiming moves the intervals to the synced set, so anything that
+    // isn't copied needs to be handed back to the store.
+    //
+    // Frequently rewritten regions are left until the end, as copying them
+    // early is likely wasted when they are written again.
+    bool defer_hot = unsynced_sector_count >= ONE_MEGABYTE / SECTOR_SIZE;
+    source_store->ClaimIntervals(&claimed_intervals, MAX_INTERVALS_PER_CLAIM,
+                                 MAX_BYTES_PER_CLAIM / SECTOR_SIZE,
+                                 time(NULL), defer_hot);
+    for (const ClaimedInterval &claimed : claimed_intervals) {
+      unflushed_intervals.push_back(claimed);
+      unflushed_sector_count += boost::icl::cardinality(claimed.interval);
+    }
 
-    VLOG(1) << "Cardinality is: "
-            << boost::icl::cardinality(to_sync_interval);
-    source_store->RemoveInterval(to_sync_interval);
+    try {
+      for (size_t i = 0; i < claimed_intervals.size(); ++i) {
+        const ClaimedInterval &claimed = claimed_intervals[i];
+
+        if (coordinator->IsCancelled()) {
+          // These go back as they were claimed, so volatile ones are still
+          // read under a freeze
+          source_store->ReturnClaimedIntervals(std::vector<ClaimedInterval>(
+              claimed_intervals.begin() + i, claimed_intervals.end()));
+          break;
+        }
+
+        VLOG(1) << "Syncing interval: " << claimed.interval;
+        copy_interval(claimed, source_fd, writer.get(), block_size_bytes,
+                      &freeze_helper, &frozen_buffer);
+        VLOG(1) << "Finished copying interval " << claimed.interval;
+
+        total_bytes_sent +=
+            boost::icl::cardinality(claimed.interval) * SECTOR_SIZE;
+        count_handler->UpdateSyncedCount(total_bytes_sent);
+      }
+      // Nothing claimed is left in flight between claims
+      writer->Drain();
+      if (unflushed_sector_count >= MAX_UNFLUSHED_BYTES / SECTOR_SIZE) {
+        flush_destination();
+      }
+    } catch (const NbdException &e) {
+      recover_destination(e);
+    }
+  }
+  StoreStatistics stats = source_store->GetStatistics();
+  LOG(INFO) << "Sent " << total_bytes_sent << " bytes, "
+            << stats.rewritten_sectors * SECTOR_SIZE
+            << " of which were rewritten after being sent";
 
-    // Loop until we copy all of the blocks of the sector interval
-    VLOG(1) << "Syncing interval: " << to_sync_interval;
+  source_device_->Close();
+  destination_device_->Close();
+  DLOG(INFO) << "Sync completed";
+}
 
-    off_t offset = to_sync_interval.lower() * SECTOR_SIZE;
-    for (uint64_t i = 0;
-        i < boost::icl::cardinality(to_sync_interval);
-        i += sectors_per_block) {
+void DeviceSynchronizer::SetInUseProducer(
+    std::unique_ptr<InUseSectorProducer> producer) {
+  in_use_producer_ = std::move(producer);
+}
 
-      auto copy_func = [&]() {
-        copy_block(source_fd, destination_fd, block_size_bytes, offset);
-      };
+void DeviceSynchronizer::SetCpuPlacement(
+    std::shared_ptr<const CpuPlacement> placement) {
+  cpu_placement_ = placement;
+}
 
-      if (is_volatile) {
-        freeze_helper.RunWhileFrozen(copy_func);
-      } else {
-        copy_func();
-      }
-      offset += block_size_bytes;
+void DeviceSynchronizer::BackupFinished(bool succeeded) {
+  // One line per backup with what is otherwise only kept in memory. Only
+  // logs, as the backup's result doesn't depend on it.
+  try {
+    uint32_t reconnect_count = 0;
+    auto nbd_destination =
+        std::dynamic_pointer_cast<UserspaceNbdBlockDevice>(
+            destination_device_);
+    if (nbd_destination) {
+      reconnect_count = nbd_destination->reconnect_count();
     }
-    VLOG(1) << "Finished copying interval " << to_sync_interval;
+    TraceStatistics trace_stats =
+        sector_manager_->GetTraceStatistics(*source_device_);
+    StoreStatistics store_stats =
+        sector_manager_->GetStore(*source_device_,
+                                  destination_id_)->GetStatistics();
+    LOG(INFO) << "Backup of " << source_device_->path()
+              << (succeeded ? " succeeded" : " failed") << ": "
+              << reconnect_count << " reconnects, "
+              << trace_stats.dropped_traces << " traces dropped ("
+              << trace_stats.total_dropped_traces << " in total), "
+              << trace_stats.resync_count << " resyncs, "
+              << store_stats.synced_sectors << " sectors synced, "
+              << store_stats.rewritten_sectors << " rewritten, "
+              << store_stats.unsynced_sectors << " unsynced in "
+              << store_stats.interval_count << " intervals, "
+              << store_stats.granularity_sectors << " sector granularity, "
+              << store_stats.memory_bytes << " bytes tracked";
+  } catch (const std::exception &e) {
+    LOG(WARNING) << "Unable to summarize backup of "
+                 << source_device_->path() << ": " << e.what();
+  }
 
-    total_bytes_sent +=
-        boost::icl::cardinality(to_sync_interval) * SECTOR_SIZE;
-    count_handler->UpdateSyncedCount(total_bytes_sent);
+  if (destination_id_.empty()) {
+    return;
+  }
+  if (succeeded) {
+    sector_manager_->CommitGeneration(*source_device_, destination_id_);
+  } else {
+    sector_manager_->AbandonGeneration(*source_device_, destination_id_);
   }
-  source_device_->Close();
-  destination_device_->Close();
-  DLOG(INFO) << "Sync completed";
 }
 
 DeviceSynchronizer::~DeviceSynchronizer() {
@@ -1,6 +1,10 @@
 #ifndef DATTO_CLIENT_DEVICE_SYNCHRONIZER_DEVICE_SYNCHRONIZER_H_
 #define DATTO_CLIENT_DEVICE_SYNCHRONIZER_DEVICE_SYNCHRONIZER_H_
 
+#include <string>
+
+#include "block_device/in_use_sector_producer.h"
+#include "cpu_placement/cpu_placement.h"
 #include "device_synchronizer/device_synchronizer_interface.h"
 
 namespace datto_linux_client {
@@ -22,6 +26,15 @@ class DeviceSynchronizer : public DeviceSynchronizerInterface {
       std::shared_ptr<UnsyncedSectorManager> sector_manager,
       std::shared_ptr<BlockDevice> destination_device);
 
+  // @destination_id: Identifies the destination so its changes are tracked
+  //                  apart from other destinations of the same source, see
+  //                  UnsyncedSectorManager::GetStore
+  DeviceSynchronizer(
+      std::shared_ptr<MountableBlockDevice> source_device,
+      std::shared_ptr<UnsyncedSectorManager> sector_manager,
+      std::shared_ptr<BlockDevice> destination_device,
+      const std::string &destination_id);
+
   // Precondition: source_device must be both traced and mounted
   //
   // @coordinator: Provides communication methods with the other
@@ -30,6 +43,20 @@ class DeviceSynchronizer : public DeviceSynchronizerInterface {
   void DoSync(std::shared_ptr<BackupCoordinator> coordinator,
               std::shared_ptr<SyncCountHandler> count_handler);
 
+  // Has DoSync load sectors from @producer into the store as it goes, so
+  // copying can start before the producer is finished. The sync isn't
+  // complete until everything from @producer has been copied.
+  void SetInUseProducer(std::unique_ptr<InUseSectorProducer> producer);
+
+  // Has DoSync run on the CPUs near the source device, see
+  // CpuPlacement::DeviceCpus. Otherwise it runs wherever it was started.
+  void SetCpuPlacement(std::shared_ptr<const CpuPlacement> placement);
+
+  // Logs a summary of the backup, with the reconnects, dropped traces,
+  // resyncs and store statistics, then commits or abandons the
+  // destination's generation
+  virtual void BackupFinished(bool succeeded);
+
   std::shared_ptr<const MountableBlockDevice> source_device() const {
     return source_device_;
   }
@@ -48,6 +75,10 @@ class DeviceSynchronizer : public DeviceSynchronizerInterface {
   std::shared_ptr<MountableBlockDevice> source_device_;
   std::shared_ptr<UnsyncedSectorManager> sector_manager_;
   std::shared_ptr<BlockDevice> destination_device_;
+  std::string destination_id_;
+  std::shared_ptr<const CpuPlacement> cpu_placement_;
+  // Declared after source_device_ as it may refer to it
+  std::unique_ptr<InUseSectorProducer> in_use_producer_;
 };
 }
 
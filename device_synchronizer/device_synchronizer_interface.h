@@ -27,6 +27,10 @@ class DeviceSynchronizerInterface {
 
   virtual std::shared_ptr<const BlockDevice> destination_device() const = 0;
 
+  // Called once every sync in the backup is over. @succeeded is only set
+  // if the whole backup succeeded.
+  virtual void BackupFinished(bool succeeded) {}
+
   virtual ~DeviceSynchronizerInterface() {}
 
   DeviceSynchronizerInterface(const DeviceSynchronizerInterface &) = delete;
@@ -1,5 +1,7 @@
 #include "freeze_helper/freeze_helper.h"
 
+#include <chrono>
+
 namespace datto_linux_client {
 
 FreezeHelper::FreezeHelper(MountableBlockDevice &block_device,
@@ -8,12 +10,11 @@ FreezeHelper::FreezeHelper(MountableBlockDevice &block_device,
       freeze_time_millis_(freeze_time_millis),
       unfreeze_thread_(),
       is_frozen_(false),
-      was_error_(false) {}
+      was_error_(false),
+      thaw_requested_(false) {}
 
 FreezeHelper::~FreezeHelper() {
-  if (unfreeze_thread_.joinable()) {
-    unfreeze_thread_.join();
-  }
+  ThawNow();
 }
 
 void FreezeHelper::RunWhileFrozen(std::function<void()> to_run) {
@@ -41,6 +42,10 @@ void FreezeHelper::BeginRequiredFreezeBlock() {
 
   did_freeze_ = false;
   was_error_ = false;
+  {
+    std::lock_guard<std::mutex> thaw_lock(thaw_mutex_);
+    thaw_requested_ = false;
+  }
   unfreeze_thread_ = std::thread([&]() {
     try {
       block_device_.Freeze();
@@ -48,7 +53,12 @@ void FreezeHelper::BeginRequiredFreezeBlock() {
       is_frozen_ = true;
       continue_var_.notify_one();
 
-      usleep(freeze_time_millis_ * 1000);
+      {
+        std::unique_lock<std::mutex> thaw_lock(thaw_mutex_);
+        thaw_var_.wait_for(thaw_lock,
+                           std::chrono::milliseconds(freeze_time_millis_),
+                           [&]() { return thaw_requested_; });
+      }
 
       is_frozen_ = false;
       block_device_.Thaw();
@@ -75,4 +85,16 @@ bool FreezeHelper::EndRequiredFreezeBlock() {
   return is_frozen_;
 }
 
+void FreezeHelper::ThawNow() {
+  {
+    std::lock_guard<std::mutex> thaw_lock(thaw_mutex_);
+    thaw_requested_ = true;
+  }
+  thaw_var_.notify_one();
+
+  if (unfreeze_thread_.joinable()) {
+    unfreeze_thread_.join();
+  }
+}
+
 } // datto_linux_client
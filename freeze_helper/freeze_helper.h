@@ -37,6 +37,11 @@ class FreezeHelper {
 
   void RunWhileFrozen(std::function<void()> to_run);
 
+  // Thaws the MountableBlockDevice without waiting for freeze_time_millis
+  // to pass. This returns once the device is thawed. Does nothing if the
+  // device isn't frozen.
+  void ThawNow();
+
   FreezeHelper(const FreezeHelper &) = delete;
   FreezeHelper& operator=(const FreezeHelper &) = delete;
  private:
@@ -46,11 +51,15 @@ class FreezeHelper {
   std::atomic<bool> is_frozen_;
   std::atomic<bool> did_freeze_;
   std::atomic<bool> was_error_;
+  bool thaw_requested_;
 
   std::exception_ptr freeze_exception_;
 
   std::condition_variable continue_var_;
   std::mutex continue_mutex_;
+
+  std::condition_variable thaw_var_;
+  std::mutex thaw_mutex_;
 };
 } // datto_linux_client
 
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <vector>
 
 #include <glog/logging.h>
 
@@ -50,10 +51,8 @@ int main(int argc, char *argv[]) {
   auto source_store = sector_manager->GetStore(*source_device);
 
   auto in_use_set = source_device->GetInUseSectors();
-
-  for (const SectorInterval &interval : *in_use_set) {
-    source_store->AddNonVolatileInterval(interval);
-  }
+  source_store->AddNonVolatileIntervals(
+      std::vector<SectorInterval>(in_use_set->begin(), in_use_set->end()));
 
   uint64_t bytes_total = source_store->UnsyncedSectorCount() * 512;
   auto fake_coordinator = std::make_shared<FakeBackupCoordinator>(); 
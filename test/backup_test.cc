@@ -44,6 +44,7 @@ class MockDeviceSynchronizer : public DeviceSynchronizerInterface {
                      std::shared_ptr<const UnsyncedSectorManager>());
   MOCK_CONST_METHOD0(destination_device,
                      std::shared_ptr<const BlockDevice>());
+  MOCK_METHOD1(BackupFinished, void(bool succeeded));
 };
 
 class MockBackupCoordinator : public BackupCoordinator {
@@ -172,6 +173,35 @@ TEST_F(BackupTest, HandlesException) {
   b.DoBackup(event_handler);
 }
 
+TEST_F(BackupTest, CommitFailureFailsBackup) {
+  auto device_sync = std::make_shared<MockDeviceSynchronizer>();
+  std::vector<BackupError> no_errors;
+  EXPECT_CALL(*coordinator, GetFatalErrors())
+      .WillOnce(Return(no_errors));
+  EXPECT_CALL(*coordinator, WaitUntilFinished(_))
+      .WillOnce(Return(true));
+  EXPECT_CALL(*event_handler, CreateSyncCountHandler(_))
+      .WillOnce(Return(sync_count_handler));
+  EXPECT_CALL(*device_sync, source_device())
+      .WillRepeatedly(Return(source_device));
+  EXPECT_CALL(*device_sync, DoSync(Eq(coordinator), Eq(sync_count_handler)));
+
+  // e.g. traces were dropped after the sync finished
+  EXPECT_CALL(*device_sync, BackupFinished(true))
+      .WillOnce(Throw(DeviceSynchronizerException("Test exception")));
+
+  EXPECT_CALL(*event_handler, BackupInProgress());
+  EXPECT_CALL(*event_handler, BackupFailed(_));
+  EXPECT_CALL(*event_handler, BackupSucceeded())
+      .Times(0);
+
+  std::vector<std::shared_ptr<DeviceSynchronizerInterface>> work =
+      {device_sync};
+
+  Backup b(work, coordinator);
+  b.DoBackup(event_handler);
+}
+
 TEST_F(BackupTest, HandlesMany) {
   EXPECT_CALL(*event_handler, CreateSyncCountHandler(_))
       .Times(2)
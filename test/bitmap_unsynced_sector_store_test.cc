@@ -0,0 +1,371 @@
+#include "unsynced_sector_manager/bitmap_unsynced_sector_store.h"
+#include "unsynced_sector_manager/sector_interval.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::BitmapUnsyncedSectorStore;
+using ::datto_linux_client::ClaimedInterval;
+using ::datto_linux_client::SectorInterval;
+using ::datto_linux_client::SectorSet;
+using ::datto_linux_client::StoreStatistics;
+using ::datto_linux_client::TimedInterval;
+
+// 1MB device with 4k blocks, 8 sectors per block
+const uint64_t DEVICE_SIZE = 1024 * 1024;
+const uint64_t BLOCK_SIZE = 4096;
+
+TEST(BitmapUnsyncedSectorStoreTest, DefaultConstructor) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+
+  EXPECT_EQ(0UL, store.UnsyncedSectorCount());
+
+  SectorInterval output_interval;
+
+  store.GetInterval(&output_interval, time(NULL));
+  EXPECT_EQ(0UL, boost::icl::length(output_interval));
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, RoundsToBlocks) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+  SectorInterval output_interval;
+
+  store.AddInterval(SectorInterval(1, 10), 1000);
+  EXPECT_EQ(16UL, store.UnsyncedSectorCount());
+
+  store.GetInterval(&output_interval, time(NULL));
+  EXPECT_TRUE(SectorInterval(0, 16) == output_interval) << output_interval;
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, MergesAdjacentIntervals) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+  SectorInterval output_interval;
+
+  store.AddInterval(SectorInterval(8, 16), 1000);
+  store.AddInterval(SectorInterval(16, 40), 1000);
+  store.GetInterval(&output_interval, time(NULL));
+  EXPECT_TRUE(SectorInterval(8, 40) == output_interval) << output_interval;
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, ReturnsIntervalsInOrder) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+  SectorInterval output_interval;
+
+  // Far enough apart to cross several bitmap words
+  store.AddNonVolatileInterval(SectorInterval(1600, 1608));
+  store.AddNonVolatileInterval(SectorInterval(8, 16));
+
+  store.GetInterval(&output_interval, time(NULL));
+  EXPECT_TRUE(SectorInterval(8, 16) == output_interval) << output_interval;
+  store.GetInterval(&output_interval, time(NULL));
+  EXPECT_TRUE(SectorInterval(1600, 1608) == output_interval)
+      << output_interval;
+  // Wraps back around
+  store.GetInterval(&output_interval, time(NULL));
+  EXPECT_TRUE(SectorInterval(8, 16) == output_interval) << output_interval;
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, RemoveIntervalTest) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+  SectorInterval output_interval;
+
+  store.AddInterval(SectorInterval(0, 160), 1000);
+  store.RemoveInterval(SectorInterval(40, 160));
+  store.GetInterval(&output_interval, time(NULL));
+
+  EXPECT_TRUE(SectorInterval(0, 40) == output_interval) << output_interval;
+  EXPECT_EQ(40UL, store.UnsyncedSectorCount());
+
+  store.RemoveInterval(SectorInterval(0, 160));
+  store.GetInterval(&output_interval, time(NULL));
+  EXPECT_TRUE(SectorInterval(0, 0) == output_interval) << output_interval;
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, ReInsertSyncHistory) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+
+  store.AddInterval(SectorInterval(0, 80), 1000);
+  store.RemoveInterval(SectorInterval(0, 80));
+  EXPECT_EQ(0UL, store.UnsyncedSectorCount());
+
+  store.ReInsertSyncHistory();
+  EXPECT_EQ(80UL, store.UnsyncedSectorCount());
+
+  store.RemoveInterval(SectorInterval(0, 80));
+  store.ClearSyncHistory();
+  store.ReInsertSyncHistory();
+  EXPECT_EQ(0UL, store.UnsyncedSectorCount());
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, PartialLastBlock) {
+  // Device ends half way through the last block
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE + 2048, BLOCK_SIZE);
+  SectorInterval output_interval;
+  uint64_t device_sectors = (DEVICE_SIZE + 2048) / 512;
+
+  store.AddNonVolatileInterval(SectorInterval(device_sectors - 1,
+                                              device_sectors));
+  EXPECT_EQ(4UL, store.UnsyncedSectorCount());
+
+  store.GetInterval(&output_interval, time(NULL));
+  EXPECT_TRUE(SectorInterval(device_sectors - 4, device_sectors) ==
+              output_interval) << output_interval;
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, ClaimIntervalsTest) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+  std::vector<ClaimedInterval> claimed;
+
+  store.AddNonVolatileInterval(SectorInterval(0, 16));
+  store.AddNonVolatileInterval(SectorInterval(800, 1600));
+
+  // Second run is split by the sector limit
+  store.ClaimIntervals(&claimed, 10, 400, time(NULL), false);
+  ASSERT_EQ(2UL, claimed.size());
+  EXPECT_TRUE(SectorInterval(0, 16) == claimed[0].interval)
+      << claimed[0].interval;
+  EXPECT_TRUE(SectorInterval(800, 1184) == claimed[1].interval)
+      << claimed[1].interval;
+  EXPECT_EQ(416UL, store.UnsyncedSectorCount());
+
+  store.ClaimIntervals(&claimed, 1, 4000, time(NULL), false);
+  ASSERT_EQ(1UL, claimed.size());
+  EXPECT_TRUE(SectorInterval(1184, 1600) == claimed[0].interval)
+      << claimed[0].interval;
+
+  store.ClaimIntervals(&claimed, 1, 4000, time(NULL), false);
+  EXPECT_EQ(0UL, claimed.size());
+
+  store.ReInsertSyncHistory();
+  EXPECT_EQ(816UL, store.UnsyncedSectorCount());
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, ClearAllTest) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+
+  store.AddInterval(SectorInterval(1, 20), 1000);
+  EXPECT_NE(0UL, store.UnsyncedSectorCount());
+
+  store.ClearIntervals();
+  EXPECT_EQ(0UL, store.UnsyncedSectorCount());
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, StatisticsTest) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+
+  // Blocks [0, 1), [2, 4) and [8, 9)
+  store.AddInterval(SectorInterval(0, 8), time(NULL));
+  store.AddNonVolatileInterval(SectorInterval(16, 32));
+  store.AddNonVolatileInterval(SectorInterval(64, 72));
+
+  StoreStatistics stats = store.GetStatistics();
+  EXPECT_EQ(32UL, stats.unsynced_sectors);
+  EXPECT_EQ(8UL, stats.volatile_sectors);
+  EXPECT_EQ(3UL, stats.interval_count);
+  EXPECT_EQ(16UL, stats.peak_extent_sectors);
+  EXPECT_EQ(8UL, stats.granularity_sectors);
+  EXPECT_LT(0UL, stats.memory_bytes);
+
+  // Joining the first two runs
+  store.AddNonVolatileInterval(SectorInterval(8, 16));
+  EXPECT_EQ(2UL, store.GetStatistics().interval_count);
+
+  // Splitting a run across a word boundary
+  store.AddNonVolatileInterval(SectorInterval(60 * 8, 70 * 8));
+  EXPECT_EQ(3UL, store.GetStatistics().interval_count);
+  store.RemoveInterval(SectorInterval(63 * 8, 65 * 8));
+  stats = store.GetStatistics();
+  EXPECT_EQ(4UL, stats.interval_count);
+  EXPECT_EQ(16UL, stats.synced_sectors);
+  EXPECT_EQ(stats.unsynced_sectors, store.UnsyncedSectorCount());
+
+  store.ReInsertSyncHistory();
+  stats = store.GetStatistics();
+  EXPECT_EQ(3UL, stats.interval_count);
+  EXPECT_EQ(0UL, stats.synced_sectors);
+
+  store.ClearIntervals();
+  stats = store.GetStatistics();
+  EXPECT_EQ(0UL, stats.unsynced_sectors);
+  EXPECT_EQ(0UL, stats.interval_count);
+  EXPECT_EQ(0UL, stats.peak_extent_sectors);
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, AddIntervalsTest) {
+  // Large enough that the intervals are in different time chunks
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE * 8, BLOCK_SIZE);
+  std::vector<TimedInterval> intervals(2);
+  intervals[0].interval = SectorInterval(0, 8);
+  intervals[0].epoch = 1000;
+  intervals[1].interval = SectorInterval(8192, 8200);
+  intervals[1].epoch = 1995;
+
+  store.AddIntervals(intervals);
+  EXPECT_EQ(16UL, store.UnsyncedSectorCount());
+
+  std::vector<ClaimedInterval> claimed;
+  store.ClaimIntervals(&claimed, 10, 1000, 2000, false);
+  ASSERT_EQ(2UL, claimed.size());
+  EXPECT_FALSE(claimed[0].is_volatile);
+  EXPECT_TRUE(claimed[1].is_volatile);
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, ReturnClaimedIntervalsTest) {
+  // Large enough that the intervals are in different time chunks
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE * 8, BLOCK_SIZE);
+  store.AddInterval(SectorInterval(0, 8), 1000);
+  store.AddInterval(SectorInterval(8192, 8200), 1995);
+
+  std::vector<ClaimedInterval> claimed;
+  store.ClaimIntervals(&claimed, 10, 1000, 2000, false);
+  ASSERT_EQ(2UL, claimed.size());
+  store.ReturnClaimedIntervals(claimed);
+  EXPECT_EQ(16UL, store.UnsyncedSectorCount());
+  EXPECT_EQ(0UL, store.GetStatistics().synced_sectors);
+  EXPECT_EQ(0UL, store.GetStatistics().rewritten_sectors);
+
+  // They keep their write times, so they are as volatile as before
+  store.ClaimIntervals(&claimed, 10, 1000, 2000, false);
+  ASSERT_EQ(2UL, claimed.size());
+  EXPECT_FALSE(claimed[0].is_volatile);
+  EXPECT_TRUE(claimed[1].is_volatile);
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, AddNonVolatileIntervalsTest) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+  std::vector<SectorInterval> sorted;
+  sorted.push_back(SectorInterval(0, 8));
+  sorted.push_back(SectorInterval(8, 20));
+  sorted.push_back(SectorInterval(64, 72));
+  store.AddNonVolatileIntervals(sorted);
+  EXPECT_EQ(32UL, store.UnsyncedSectorCount());
+  EXPECT_EQ(2UL, store.GetStatistics().interval_count);
+
+  SectorSet exported;
+  store.ExportIntervals(&exported, false);
+  EXPECT_TRUE(boost::icl::contains(exported, SectorInterval(0, 24)));
+  EXPECT_TRUE(boost::icl::contains(exported, SectorInterval(64, 72)));
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, DeferHotTest) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE * 8, BLOCK_SIZE);
+  std::vector<ClaimedInterval> claimed;
+
+  // Rewrite the start of the device every second
+  for (int i = 0; i < 10; ++i) {
+    store.AddInterval(SectorInterval(0, 8), 1000 + i);
+  }
+  store.AddNonVolatileInterval(SectorInterval(8192, 8200));
+
+  store.ClaimIntervals(&claimed, 10, 10000, 1010, true);
+  ASSERT_EQ(1UL, claimed.size());
+  EXPECT_EQ(SectorInterval(8192, 8200), claimed[0].interval);
+
+  // Only the hot interval is left, so it is claimed anyway
+  store.ClaimIntervals(&claimed, 10, 10000, 1010, true);
+  ASSERT_EQ(1UL, claimed.size());
+  EXPECT_EQ(SectorInterval(0, 8), claimed[0].interval);
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, RewrittenSectorsTest) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE * 8, BLOCK_SIZE);
+  std::vector<ClaimedInterval> claimed;
+
+  store.AddNonVolatileInterval(SectorInterval(0, 16));
+  store.ClaimIntervals(&claimed, 10, 10000, 1000, false);
+  EXPECT_EQ(0UL, store.GetStatistics().rewritten_sectors);
+
+  // Rewriting it twice before it is sent again only counts once
+  store.AddInterval(SectorInterval(0, 8), 1000);
+  store.AddInterval(SectorInterval(0, 8), 1001);
+  EXPECT_EQ(8UL, store.GetStatistics().rewritten_sectors);
+
+  store.ClearSyncHistory();
+  EXPECT_EQ(0UL, store.GetStatistics().rewritten_sectors);
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, AdaptiveVolatileSecondsTest) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE * 8, BLOCK_SIZE);
+  std::vector<ClaimedInterval> claimed;
+  EXPECT_EQ(10, store.VolatileSeconds());
+
+  store.SetAdaptiveVolatileSeconds(true);
+  for (int i = 0; i < 5; ++i) {
+    store.AddInterval(SectorInterval(0, 8), 1000 + i * 20);
+  }
+  store.ClaimIntervals(&claimed, 10, 10000, 2000, false);
+  EXPECT_EQ(40, store.VolatileSeconds());
+  EXPECT_EQ(40, store.GetStatistics().volatile_seconds);
+
+  store.SetAdaptiveVolatileSeconds(false);
+  EXPECT_EQ(10, store.VolatileSeconds());
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, ExportIntervalsTest) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+  SectorSet exported;
+
+  store.AddInterval(SectorInterval(10, 20), 1000);
+  store.AddNonVolatileInterval(SectorInterval(100, 104));
+
+  store.ExportIntervals(&exported, false);
+  EXPECT_EQ(2UL, exported.iterative_size());
+  EXPECT_TRUE(boost::icl::contains(exported, SectorInterval(8, 24)));
+  EXPECT_NE(0UL, store.UnsyncedSectorCount());
+
+  store.ExportIntervals(&exported, true);
+  EXPECT_EQ(2UL, exported.iterative_size());
+  EXPECT_EQ(0UL, store.UnsyncedSectorCount());
+
+  store.ExportIntervals(&exported, false);
+  EXPECT_TRUE(exported.empty());
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, DiscardIntervalsTest) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+  std::vector<SectorInterval> discarded;
+
+  store.AddInterval(SectorInterval(0, 64), 1000);
+
+  // Only whole blocks are discarded
+  store.DiscardIntervals({SectorInterval(4, 36)});
+  EXPECT_EQ(40UL, store.UnsyncedSectorCount());
+  EXPECT_EQ(24UL, store.GetStatistics().discarded_sectors);
+
+  // A later write is no longer discarded
+  store.AddInterval(SectorInterval(17, 18), 1000);
+  EXPECT_EQ(48UL, store.UnsyncedSectorCount());
+  EXPECT_EQ(16UL, store.GetStatistics().discarded_sectors);
+
+  store.ClaimDiscardedIntervals(&discarded, 10);
+  ASSERT_EQ(2UL, discarded.size());
+  EXPECT_EQ(SectorInterval(8, 16), discarded[0]);
+  EXPECT_EQ(SectorInterval(24, 32), discarded[1]);
+  EXPECT_EQ(0UL, store.GetStatistics().discarded_sectors);
+}
+
+// Timing tests
+
+TEST(BitmapUnsyncedSectorStoreTest, VolatileTest) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+  SectorInterval output_interval;
+
+  store.AddInterval(SectorInterval(1, 20), 1000);
+  bool is_volatile = store.GetInterval(&output_interval, 1005);
+  EXPECT_TRUE(is_volatile);
+
+  is_volatile = store.GetInterval(&output_interval, 2000);
+  EXPECT_FALSE(is_volatile);
+}
+
+TEST(BitmapUnsyncedSectorStoreTest, AddNonVolatileTest) {
+  BitmapUnsyncedSectorStore store(10, DEVICE_SIZE, BLOCK_SIZE);
+  SectorInterval output_interval;
+
+  store.AddNonVolatileInterval(SectorInterval(1, 20));
+  bool is_volatile = store.GetInterval(&output_interval, 1005);
+  EXPECT_FALSE(is_volatile);
+}
+
+} // namespace
@@ -2,6 +2,7 @@
 #include "block_device/ext_mountable_block_device.h"
 #include "block_device/nbd_block_device.h"
 #include "block_device/nbd_server.h"
+#include "block_device/userspace_nbd_block_device.h"
 #include "test/loop_device.h"
 
 #include <gtest/gtest.h>
@@ -19,6 +20,7 @@ using ::datto_linux_client::BlockDeviceFactory;
 using ::datto_linux_client::NbdServer;
 using ::datto_linux_client::ExtMountableBlockDevice;
 using ::datto_linux_client::NbdBlockDevice;
+using ::datto_linux_client::UserspaceNbdBlockDevice;
 
 // Might want to move this to loop_device.cc
 std::string get_uuid(std::string path) {
@@ -117,8 +119,22 @@ TEST(BlockDeviceFactoryTest, ThrowsOnBadUUID) {
   }
 }
 
+TEST(BlockDeviceFactoryTest, ReturnsUserspaceNbd) {
+  BlockDeviceFactory fact;
+  LoopDevice loop_dev;
+  NbdServer nbd_server(loop_dev.path());
+
+  auto nbd_block_dev = fact.CreateRemoteBlockDevice(LOCAL_TEST_HOST,
+                                                    nbd_server.port());
+
+  ASSERT_TRUE((bool)nbd_block_dev);
+  EXPECT_NE(nullptr,
+            dynamic_cast<UserspaceNbdBlockDevice*>(nbd_block_dev.get()));
+}
+
 TEST(BlockDeviceFactoryTest, ReturnsNbd) {
   BlockDeviceFactory fact;
+  fact.SetUseUserspaceNbd(false);
   LoopDevice loop_dev;
   NbdServer nbd_server(loop_dev.path());
 
@@ -0,0 +1,78 @@
+#include "tracing/bpf_dirty_tracker.h"
+#include "unsynced_sector_manager/sector_interval.h"
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::BpfDirtyTracker;
+using ::datto_linux_client::SectorInterval;
+
+const char BIO_QUEUE_FORMAT[] =
+    "name: block_bio_queue\n"
+    "ID: 1154\n"
+    "format:\n"
+    "\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+    "\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+    "\n"
+    "\tfield:dev_t dev;\toffset:8;\tsize:4;\tsigned:0;\n"
+    "\tfield:sector_t sector;\toffset:16;\tsize:8;\tsigned:0;\n"
+    "\tfield:unsigned int nr_sector;\toffset:24;\tsize:4;\tsigned:0;\n"
+    "\tfield:char rwbs[8];\toffset:28;\tsize:8;\tsigned:1;\n"
+    "\tfield:char comm[16];\toffset:36;\tsize:16;\tsigned:1;\n";
+
+TEST(BpfDirtyTrackerTest, ParseFieldOffset) {
+  uint32_t offset = 0;
+  EXPECT_TRUE(BpfDirtyTracker::ParseFieldOffset(BIO_QUEUE_FORMAT, "dev",
+                                                &offset));
+  EXPECT_EQ(8U, offset);
+  EXPECT_TRUE(BpfDirtyTracker::ParseFieldOffset(BIO_QUEUE_FORMAT, "sector",
+                                                &offset));
+  EXPECT_EQ(16U, offset);
+  EXPECT_TRUE(BpfDirtyTracker::ParseFieldOffset(BIO_QUEUE_FORMAT,
+                                                "nr_sector", &offset));
+  EXPECT_EQ(24U, offset);
+  EXPECT_TRUE(BpfDirtyTracker::ParseFieldOffset(BIO_QUEUE_FORMAT, "rwbs",
+                                                &offset));
+  EXPECT_EQ(28U, offset);
+
+  EXPECT_FALSE(BpfDirtyTracker::ParseFieldOffset(BIO_QUEUE_FORMAT, "bytes",
+                                                 &offset));
+  EXPECT_FALSE(BpfDirtyTracker::ParseFieldOffset("", "dev", &offset));
+}
+
+TEST(BpfDirtyTrackerTest, ReadAndClear) {
+  // 20 blocks of 8 sectors, the last one partial
+  std::vector<uint64_t> words(3);
+  uint8_t *bytemap = reinterpret_cast<uint8_t *>(words.data());
+  bytemap[0] = 1;
+  bytemap[1] = 1;
+  bytemap[7] = 1;
+  // Runs across the word boundary
+  bytemap[8] = 1;
+  bytemap[19] = 1;
+  // Past the last block, ignored
+  bytemap[22] = 1;
+
+  std::vector<SectorInterval> written;
+  BpfDirtyTracker::ReadAndClear(bytemap, 20, 8, 155, &written);
+
+  ASSERT_EQ(3U, written.size());
+  EXPECT_EQ(SectorInterval(0, 16), written[0]);
+  EXPECT_EQ(SectorInterval(56, 72), written[1]);
+  EXPECT_EQ(SectorInterval(152, 155), written[2]);
+
+  for (uint64_t i = 0; i < 20; ++i) {
+    EXPECT_EQ(0, bytemap[i]);
+  }
+
+  BpfDirtyTracker::ReadAndClear(bytemap, 20, 8, 155, &written);
+  EXPECT_TRUE(written.empty());
+}
+
+}
@@ -0,0 +1,140 @@
+#include "unsynced_sector_manager/change_export.h"
+#include "unsynced_sector_manager/sector_interval.h"
+#include "unsynced_sector_manager/unsynced_tracking_exception.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::BITMAP_EXPORT;
+using ::datto_linux_client::CHANGE_EXPORT_MAGIC;
+using ::datto_linux_client::CHANGE_EXPORT_VERSION;
+using ::datto_linux_client::ChangeExportHeader;
+using ::datto_linux_client::RUN_LENGTH_EXPORT;
+using ::datto_linux_client::SectorInterval;
+using ::datto_linux_client::SectorSet;
+using ::datto_linux_client::UnsyncedTrackingException;
+using ::datto_linux_client::WriteChangeExport;
+
+const uint64_t DEVICE_SIZE = 1024 * 1024;
+const uint64_t BLOCK_SIZE = 4096;
+
+class ChangeExportTest : public ::testing::Test {
+ protected:
+  ChangeExportTest() : mapped_(nullptr), mapped_size_(0) {
+    char dir_template[] = "/tmp/change_export_test_XXXXXX";
+    dir_ = mkdtemp(dir_template);
+    path_ = dir_ + "/export";
+  }
+
+  ~ChangeExportTest() {
+    if (mapped_) {
+      munmap(mapped_, mapped_size_);
+    }
+    unlink(path_.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  // Maps the export and returns the header
+  const ChangeExportHeader *MapExport() {
+    int fd = open(path_.c_str(), O_RDONLY);
+    EXPECT_NE(-1, fd);
+    struct stat stat_buf;
+    fstat(fd, &stat_buf);
+    mapped_size_ = stat_buf.st_size;
+    mapped_ = mmap(nullptr, mapped_size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    EXPECT_NE(MAP_FAILED, mapped_);
+    return static_cast<const ChangeExportHeader *>(mapped_);
+  }
+
+  const uint64_t *Entries(const ChangeExportHeader *header) {
+    return reinterpret_cast<const uint64_t *>(
+        static_cast<const char *>(mapped_) + header->data_offset);
+  }
+
+  std::string dir_;
+  std::string path_;
+  void *mapped_;
+  size_t mapped_size_;
+};
+
+TEST_F(ChangeExportTest, RunLengthTest) {
+  SectorSet changed;
+  changed += SectorInterval(8, 24);
+  changed += SectorInterval(100, 101);
+
+  WriteChangeExport(path_, RUN_LENGTH_EXPORT, changed, DEVICE_SIZE,
+                    BLOCK_SIZE);
+
+  const ChangeExportHeader *header = MapExport();
+  EXPECT_EQ(0, memcmp(CHANGE_EXPORT_MAGIC, header->magic, 8));
+  EXPECT_EQ(CHANGE_EXPORT_VERSION, header->version);
+  EXPECT_EQ((uint32_t)RUN_LENGTH_EXPORT, header->format);
+  EXPECT_EQ(DEVICE_SIZE, header->device_size_bytes);
+  EXPECT_EQ(2UL, header->entry_count);
+  EXPECT_EQ(sizeof(*header) + 4 * sizeof(uint64_t), mapped_size_);
+
+  const uint64_t *entries = Entries(header);
+  EXPECT_EQ(8UL, entries[0]);
+  EXPECT_EQ(16UL, entries[1]);
+  EXPECT_EQ(100UL, entries[2]);
+  EXPECT_EQ(1UL, entries[3]);
+}
+
+TEST_F(ChangeExportTest, BitmapTest) {
+  SectorSet changed;
+  // Blocks 1 and 2, then a partial block 12, then blocks 60 to 70
+  changed += SectorInterval(8, 24);
+  changed += SectorInterval(100, 101);
+  changed += SectorInterval(60 * 8, 71 * 8);
+
+  WriteChangeExport(path_, BITMAP_EXPORT, changed, DEVICE_SIZE, BLOCK_SIZE);
+
+  const ChangeExportHeader *header = MapExport();
+  EXPECT_EQ((uint32_t)BITMAP_EXPORT, header->format);
+  EXPECT_EQ(BLOCK_SIZE, header->block_size_bytes);
+  // 256 blocks
+  ASSERT_EQ(4UL, header->entry_count);
+
+  const uint64_t *entries = Entries(header);
+  EXPECT_EQ((1ULL << 1) | (1ULL << 2) | (1ULL << 12) | (0xFULL << 60),
+            entries[0]);
+  EXPECT_EQ(0x7FULL, entries[1]);
+  EXPECT_EQ(0UL, entries[2]);
+  EXPECT_EQ(0UL, entries[3]);
+}
+
+TEST_F(ChangeExportTest, ReplacesExistingExport) {
+  SectorSet changed;
+  changed += SectorInterval(0, 8);
+  WriteChangeExport(path_, RUN_LENGTH_EXPORT, changed, DEVICE_SIZE,
+                    BLOCK_SIZE);
+
+  changed.clear();
+  WriteChangeExport(path_, RUN_LENGTH_EXPORT, changed, DEVICE_SIZE,
+                    BLOCK_SIZE);
+
+  const ChangeExportHeader *header = MapExport();
+  EXPECT_EQ(0UL, header->entry_count);
+  EXPECT_EQ(sizeof(*header), mapped_size_);
+  EXPECT_NE(0, access((path_ + ".tmp").c_str(), F_OK));
+}
+
+TEST_F(ChangeExportTest, BadPathTest) {
+  SectorSet changed;
+  EXPECT_THROW(WriteChangeExport(dir_ + "/missing/export", BITMAP_EXPORT,
+                                 changed, DEVICE_SIZE, BLOCK_SIZE),
+               UnsyncedTrackingException);
+}
+
+} // namespace
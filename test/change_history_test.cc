@@ -0,0 +1,86 @@
+#include "unsynced_sector_manager/change_history.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::ChangeHistory;
+using ::datto_linux_client::SectorInterval;
+using ::datto_linux_client::SectorSet;
+
+TEST(ChangeHistoryTest, NotRecordingUntilStarted) {
+  ChangeHistory history;
+  history.AddWrite(SectorInterval(0, 10));
+  EXPECT_EQ(0UL, history.IntervalCount());
+
+  uint64_t generation = history.StartGeneration();
+  history.AddWrite(SectorInterval(0, 10));
+  EXPECT_EQ(1UL, history.IntervalCount());
+
+  SectorSet changed;
+  history.AddChangedSince(generation, &changed);
+  EXPECT_EQ(10UL, boost::icl::cardinality(changed));
+}
+
+TEST(ChangeHistoryTest, ChangedSince) {
+  ChangeHistory history;
+  uint64_t first = history.StartGeneration();
+  history.AddWrite(SectorInterval(0, 10));
+  uint64_t second = history.StartGeneration();
+  history.AddWrite(SectorInterval(20, 30));
+  // Rewriting moves the sectors to the newer generation
+  history.AddWrite(SectorInterval(5, 10));
+
+  SectorSet changed;
+  history.AddChangedSince(first, &changed);
+  EXPECT_EQ(20UL, boost::icl::cardinality(changed));
+
+  changed.clear();
+  history.AddChangedSince(second, &changed);
+  EXPECT_EQ(15UL, boost::icl::cardinality(changed));
+  EXPECT_TRUE(boost::icl::contains(changed, SectorInterval(5, 10)));
+  EXPECT_FALSE(boost::icl::contains(changed, 0UL));
+}
+
+TEST(ChangeHistoryTest, Prune) {
+  ChangeHistory history;
+  history.StartGeneration();
+  history.AddWrite(SectorInterval(0, 10));
+  uint64_t second = history.StartGeneration();
+  history.AddWrite(SectorInterval(20, 30));
+
+  history.Prune(second);
+  EXPECT_EQ(1UL, history.IntervalCount());
+
+  history.Prune(0);
+  EXPECT_EQ(0UL, history.IntervalCount());
+  history.AddWrite(SectorInterval(40, 50));
+  EXPECT_EQ(0UL, history.IntervalCount());
+}
+
+TEST(ChangeHistoryTest, MemoryBudget) {
+  ChangeHistory history;
+  // Room for 100 intervals
+  history.SetMemoryBudget(6400);
+  uint64_t first = history.StartGeneration();
+  for (uint64_t i = 0; i < 200; ++i) {
+    history.AddWrite(SectorInterval(i * 4, i * 4 + 1));
+  }
+  uint64_t second = history.StartGeneration();
+  history.AddWrite(SectorInterval(2, 3));
+
+  EXPECT_LE(history.IntervalCount(), 100UL);
+  EXPECT_LT(1UL, history.GranularitySectors());
+
+  // Rounding out only adds sectors, and keeps the latest generation
+  SectorSet changed;
+  history.AddChangedSince(first, &changed);
+  for (uint64_t i = 0; i < 200; ++i) {
+    EXPECT_TRUE(boost::icl::contains(changed, i * 4));
+  }
+  changed.clear();
+  history.AddChangedSince(second, &changed);
+  EXPECT_TRUE(boost::icl::contains(changed, 2UL));
+}
+
+} // namespace
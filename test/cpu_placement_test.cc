@@ -0,0 +1,101 @@
+#include "cpu_placement/cpu_placement.h"
+#include "cpu_placement/cpu_placement_exception.h"
+
+#include <sched.h>
+#include <sys/sysmacros.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::CpuPlacement;
+using ::datto_linux_client::CpuPlacementException;
+
+// Answers sysfs reads from a map, for a device on node 1
+class FakeSysfsCpuPlacement : public CpuPlacement {
+ public:
+  explicit FakeSysfsCpuPlacement(const std::string &housekeeping_list)
+      : CpuPlacement(housekeeping_list) {}
+
+  std::map<std::string, std::string> files;
+
+ protected:
+  virtual std::string ReadSysfsFile(const std::string &path) const {
+    return files.count(path) ? files.at(path) : std::string();
+  }
+};
+
+TEST(CpuPlacementTest, ParseCpuList) {
+  EXPECT_EQ(std::vector<int>({0, 1, 2, 3, 8, 10, 11}),
+            CpuPlacement::ParseCpuList("0-3,8,10-11\n"));
+  EXPECT_EQ(std::vector<int>({2}), CpuPlacement::ParseCpuList(" 2 "));
+  EXPECT_EQ(std::vector<int>({1, 2}), CpuPlacement::ParseCpuList("2,1,2"));
+  EXPECT_TRUE(CpuPlacement::ParseCpuList("\n").empty());
+  EXPECT_TRUE(CpuPlacement::ParseCpuList("").empty());
+
+  EXPECT_THROW(CpuPlacement::ParseCpuList("(null)"), CpuPlacementException);
+  EXPECT_THROW(CpuPlacement::ParseCpuList("3-1"), CpuPlacementException);
+  EXPECT_THROW(CpuPlacement::ParseCpuList("1-"), CpuPlacementException);
+  EXPECT_THROW(CpuPlacement::ParseCpuList("-1"), CpuPlacementException);
+}
+
+TEST(CpuPlacementTest, HousekeepingList) {
+  CpuPlacement placement("0-1,4");
+  EXPECT_EQ(std::vector<int>({0, 1, 4}), placement.housekeeping_cpus());
+  EXPECT_TRUE(placement.IsHousekeeping(1));
+  EXPECT_FALSE(placement.IsHousekeeping(2));
+
+  EXPECT_THROW(CpuPlacement(""), CpuPlacementException);
+}
+
+TEST(CpuPlacementTest, SystemHousekeeping) {
+  CpuPlacement placement;
+  EXPECT_FALSE(placement.housekeeping_cpus().empty());
+}
+
+TEST(CpuPlacementTest, DeviceCpus) {
+  FakeSysfsCpuPlacement placement("0-3,8-11");
+  ::dev_t disk = makedev(8, 0);
+  ::dev_t partition = makedev(8, 1);
+  placement.files["/sys/dev/block/8:0/device/numa_node"] = "1\n";
+  placement.files["/sys/dev/block/8:1/../device/numa_node"] = "1\n";
+  placement.files["/sys/devices/system/node/node1/cpulist"] = "8-15\n";
+
+  EXPECT_EQ(std::vector<int>({8, 9, 10, 11}), placement.DeviceCpus(disk));
+  EXPECT_EQ(std::vector<int>({8, 9, 10, 11}),
+            placement.DeviceCpus(partition));
+
+  // Unknown node
+  EXPECT_EQ(placement.housekeeping_cpus(),
+            placement.DeviceCpus(makedev(7, 0)));
+  placement.files["/sys/dev/block/8:0/device/numa_node"] = "-1\n";
+  EXPECT_EQ(placement.housekeeping_cpus(), placement.DeviceCpus(disk));
+
+  // The node has no housekeeping CPUs
+  placement.files["/sys/dev/block/8:0/device/numa_node"] = "2\n";
+  placement.files["/sys/devices/system/node/node2/cpulist"] = "16-23\n";
+  EXPECT_EQ(placement.housekeeping_cpus(), placement.DeviceCpus(disk));
+}
+
+TEST(CpuPlacementTest, PinThread) {
+  cpu_set_t original;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(original), &original));
+  int cpu = sched_getcpu();
+  ASSERT_GE(cpu, 0);
+
+  EXPECT_TRUE(CpuPlacement::PinThread(std::vector<int>({cpu})));
+  cpu_set_t pinned;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(pinned), &pinned));
+  EXPECT_EQ(1, CPU_COUNT(&pinned));
+  EXPECT_TRUE(CPU_ISSET(cpu, &pinned));
+
+  EXPECT_FALSE(CpuPlacement::PinThread(std::vector<int>()));
+
+  ASSERT_EQ(0, sched_setaffinity(0, sizeof(original), &original));
+}
+
+}
@@ -0,0 +1,173 @@
+#include "tracing/cpu_tracer.h"
+#include "tracing/trace_handler.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::CpuTracer;
+using ::datto_linux_client::TraceBuffer;
+using ::datto_linux_client::TraceHandler;
+
+class RecordingTraceHandler : public TraceHandler {
+ public:
+  RecordingTraceHandler() {}
+
+  virtual void AddTrace(const struct blk_io_trace &trace_data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sectors_.push_back(trace_data.sector);
+  }
+
+  std::vector<uint64_t> sectors() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sectors_;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::vector<uint64_t> sectors_;
+};
+
+struct blk_io_trace MakeTrace(uint64_t sector, uint32_t action,
+                              uint16_t pdu_len) {
+  struct blk_io_trace trace;
+  memset(&trace, 0, sizeof(trace));
+  trace.magic = BLK_IO_TRACE_MAGIC | BLK_IO_TRACE_VERSION;
+  trace.action = action;
+  trace.sector = sector;
+  trace.bytes = 4096;
+  trace.pdu_len = pdu_len;
+  return trace;
+}
+
+// A FIFO stands in for the relay file of one CPU
+class CpuTracerTest : public ::testing::Test {
+ protected:
+  CpuTracerTest() {
+    char dir_template[] = "/tmp/cpu_tracer_test.XXXXXX";
+    dir_ = mkdtemp(dir_template);
+    fifo_path_ = dir_ + "/trace0";
+    mkfifo(fifo_path_.c_str(), 0600);
+    // Opening read/write doesn't wait for a reader
+    write_fd_ = open(fifo_path_.c_str(), O_RDWR);
+  }
+
+  ~CpuTracerTest() {
+    close(write_fd_);
+    unlink(fifo_path_.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  void Write(const void *data, size_t length) {
+    ASSERT_EQ((ssize_t)length, write(write_fd_, data, length));
+  }
+
+  void WriteTrace(const struct blk_io_trace &trace) {
+    Write(&trace, sizeof(trace));
+    std::vector<char> pdu(trace.pdu_len, 'x');
+    if (pdu.size()) {
+      Write(pdu.data(), pdu.size());
+    }
+  }
+
+  std::string dir_;
+  std::string fifo_path_;
+  int write_fd_;
+};
+
+TEST_F(CpuTracerTest, ParsesManyTracesPerRead) {
+  auto handler = std::make_shared<RecordingTraceHandler>();
+  CpuTracer tracer(fifo_path_, 0, handler);
+
+  for (uint64_t i = 0; i < 100; ++i) {
+    WriteTrace(MakeTrace(i, BLK_TC_ACT(BLK_TC_WRITE) | __BLK_TA_QUEUE, 0));
+  }
+  tracer.FlushBuffer();
+
+  auto sectors = handler->sectors();
+  ASSERT_EQ(100UL, sectors.size());
+  for (uint64_t i = 0; i < 100; ++i) {
+    EXPECT_EQ(i, sectors[i]);
+  }
+}
+
+TEST_F(CpuTracerTest, SkipsPayloadsAndOtherActions) {
+  auto handler = std::make_shared<RecordingTraceHandler>();
+  CpuTracer tracer(fifo_path_, 0, handler);
+
+  WriteTrace(MakeTrace(1, BLK_TC_ACT(BLK_TC_NOTIFY) | BLK_TN_MESSAGE, 100));
+  WriteTrace(MakeTrace(2, BLK_TC_ACT(BLK_TC_READ) | __BLK_TA_QUEUE, 0));
+  WriteTrace(MakeTrace(3, BLK_TC_ACT(BLK_TC_WRITE) | __BLK_TA_QUEUE, 0));
+  tracer.FlushBuffer();
+
+  auto sectors = handler->sectors();
+  ASSERT_EQ(1UL, sectors.size());
+  EXPECT_EQ(3UL, sectors[0]);
+}
+
+TEST_F(CpuTracerTest, TraceAcrossReads) {
+  auto handler = std::make_shared<RecordingTraceHandler>();
+  CpuTracer tracer(fifo_path_, 0, handler);
+
+  struct blk_io_trace trace =
+      MakeTrace(7, BLK_TC_ACT(BLK_TC_WRITE) | __BLK_TA_QUEUE, 0);
+  const char *bytes = reinterpret_cast<const char *>(&trace);
+  Write(bytes, 10);
+  tracer.FlushBuffer();
+  EXPECT_TRUE(handler->sectors().empty());
+
+  Write(bytes + 10, sizeof(trace) - 10);
+  tracer.FlushBuffer();
+  ASSERT_EQ(1UL, handler->sectors().size());
+  EXPECT_EQ(7UL, handler->sectors()[0]);
+}
+
+TEST_F(CpuTracerTest, PayloadLargerThanBuffer) {
+  auto handler = std::make_shared<RecordingTraceHandler>();
+  CpuTracer tracer(fifo_path_, 0, handler);
+
+  // With the largest pdu_len the trace doesn't fit in the buffer
+  ASSERT_GT(sizeof(struct blk_io_trace) + 0xffff,
+            TraceBuffer::BUFFER_BYTES);
+  for (int i = 0; i < 3; ++i) {
+    WriteTrace(MakeTrace(i, BLK_TC_ACT(BLK_TC_NOTIFY) | BLK_TN_MESSAGE,
+                         0xffff));
+  }
+  WriteTrace(MakeTrace(9, BLK_TC_ACT(BLK_TC_WRITE) | __BLK_TA_QUEUE, 0));
+  tracer.FlushBuffer();
+
+  ASSERT_EQ(1UL, handler->sectors().size());
+  EXPECT_EQ(9UL, handler->sectors()[0]);
+}
+
+TEST_F(CpuTracerTest, RequestAndWaitForFlush) {
+  auto handler = std::make_shared<RecordingTraceHandler>();
+  CpuTracer tracer(fifo_path_, 0, handler);
+
+  for (uint64_t i = 0; i < 10; ++i) {
+    WriteTrace(MakeTrace(i, BLK_TC_ACT(BLK_TC_WRITE) | __BLK_TA_QUEUE, 0));
+    uint64_t ticket = tracer.RequestFlush();
+    tracer.WaitForFlush(ticket);
+    ASSERT_EQ(i + 1, handler->sectors().size());
+  }
+
+  // Later tickets cover earlier ones
+  uint64_t first_ticket = tracer.RequestFlush();
+  uint64_t second_ticket = tracer.RequestFlush();
+  EXPECT_LT(first_ticket, second_ticket);
+  tracer.WaitForFlush(second_ticket);
+  tracer.WaitForFlush(first_ticket);
+}
+
+} // namespace
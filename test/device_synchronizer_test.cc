@@ -1,8 +1,10 @@
 #include "device_synchronizer/device_synchronizer.h"
+#include "device_synchronizer/device_synchronizer_exception.h"
 
 #include "backup/backup_coordinator.h"
 #include "backup_status_tracker/sync_count_handler.h"
 #include "test/loop_device.h"
+#include "unsynced_sector_manager/interval_unsynced_sector_store.h"
 #include "unsynced_sector_manager/sector_interval.h"
 #include "unsynced_sector_manager/sector_set.h"
 
@@ -24,8 +26,11 @@ namespace {
 
 using ::datto_linux_client::BackupCoordinator;
 using ::datto_linux_client::BlockDevice;
+using ::datto_linux_client::ClaimedInterval;
 using ::datto_linux_client::DeviceSynchronizer;
+using ::datto_linux_client::DeviceSynchronizerException;
 using ::datto_linux_client::DeviceTracer;
+using ::datto_linux_client::IntervalUnsyncedSectorStore;
 using ::datto_linux_client::MountableBlockDevice;
 using ::datto_linux_client::SectorInterval;
 using ::datto_linux_client::SectorSet;
@@ -34,6 +39,7 @@ using ::datto_linux_client::UnsyncedSectorManager;
 using ::datto_linux_client::UnsyncedSectorStore;
 using ::datto_linux_client_test::LoopDevice;
 using ::testing::Assign;
+using ::testing::Invoke;
 using ::testing::AtLeast;
 using ::testing::NiceMock;
 using ::testing::StrictMock;
@@ -75,16 +81,22 @@ class MockUnsyncedSectorManager : public UnsyncedSectorManager {
   MockUnsyncedSectorManager() {}
   MOCK_CONST_METHOD1(IsTracing, bool(const BlockDevice &));
   MOCK_METHOD1(FlushTracer, void(const BlockDevice &));
+  MOCK_METHOD1(NeedsResync, bool(const BlockDevice &));
   MOCK_METHOD1(GetStore,
                std::shared_ptr<UnsyncedSectorStore>(const BlockDevice &));
 };
 
-class MockUnsyncedSectorStore : public UnsyncedSectorStore {
+class MockUnsyncedSectorStore : public IntervalUnsyncedSectorStore {
  public:
-  MockUnsyncedSectorStore() : UnsyncedSectorStore(10) {}
+  MockUnsyncedSectorStore() : IntervalUnsyncedSectorStore(10) {}
   MOCK_METHOD2(AddInterval, void(const SectorInterval &, const time_t epoch));
   MOCK_METHOD1(AddNonVolatileInterval, void(const SectorInterval &));
   MOCK_METHOD1(RemoveInterval, void(const SectorInterval &));
+  MOCK_METHOD5(ClaimIntervals, void(std::vector<ClaimedInterval> *const output,
+                                    size_t max_intervals,
+                                    uint64_t max_sectors,
+                                    const time_t epoch,
+                                    bool defer_hot));
   MOCK_METHOD0(ClearIntervals, void());
   MOCK_CONST_METHOD2(GetInterval, bool(SectorInterval *const output,
                                   const time_t epoch));
@@ -180,15 +192,23 @@ TEST_F(DeviceSynchronizerTest, SimpleSyncTest) {
       .Times(AtLeast(1))
       .WillRepeatedly(ReturnPointee(&unsynced_count));
 
-  EXPECT_CALL(*mock_store, RemoveInterval(interval_to_sync))
-      .Times(1)
-      .WillOnce(DoAll(Assign(&unsynced_count, 0),
-                      Assign(&interval_to_sync, SectorInterval(0, 0))));
-
-  EXPECT_CALL(*mock_store, GetInterval(_, _))
+  EXPECT_CALL(*mock_store, ClaimIntervals(_, _, _, _, _))
       .Times(AtLeast(1))
-      .WillRepeatedly(DoAll(SetArgPointee<0>(interval_to_sync),
-                            Return(true)));
+      .WillRepeatedly(Invoke([&](std::vector<ClaimedInterval> *const output,
+                                 size_t max_intervals,
+                                 uint64_t max_sectors,
+                                 const time_t epoch,
+                                 bool defer_hot) {
+        output->clear();
+        if (unsynced_count > 0) {
+          ClaimedInterval claimed;
+          claimed.interval = interval_to_sync;
+          claimed.is_volatile = true;
+          claimed.epoch = time(NULL);
+          output->push_back(claimed);
+          unsynced_count = 0;
+        }
+      }));
 
   EXPECT_CALL(*source_manager, GetStore(Truly(is_source)))
       .Times(AtLeast(1))
@@ -197,6 +217,12 @@ TEST_F(DeviceSynchronizerTest, SimpleSyncTest) {
   EXPECT_CALL(*source_manager, IsTracing(_))
       .WillRepeatedly(Return(true));
 
+  // Traces are flushed on every check while frozen
+  EXPECT_CALL(*source_manager, FlushTracer(Truly(is_source)))
+      .Times(AtLeast(1));
+  EXPECT_CALL(*source_manager, NeedsResync(Truly(is_source)))
+      .WillOnce(Return(false));
+
   EXPECT_CALL(*coordinator, IsCancelled())
       .WillRepeatedly(Return(false));
   EXPECT_CALL(*coordinator, SignalFinished());
@@ -208,6 +234,41 @@ TEST_F(DeviceSynchronizerTest, SimpleSyncTest) {
   device_synchronizer->DoSync(coordinator, count_handler);
 }
 
+TEST_F(DeviceSynchronizerTest, DroppedTracesFailSync) {
+  ConstructSynchronizer();
+
+  auto coordinator = std::make_shared<MockBackupCoordinator>();
+  auto count_handler = std::make_shared<NiceMock<MockSyncCountHandler>>();
+  auto mock_store = std::make_shared<NiceMock<MockUnsyncedSectorStore>>();
+
+  EXPECT_CALL(*source_device, Thaw())
+      .Times(AtLeast(1));
+  EXPECT_CALL(*source_device, Freeze())
+      .Times(AtLeast(1));
+
+  EXPECT_CALL(*mock_store, UnsyncedSectorCount())
+      .WillRepeatedly(Return(0));
+
+  EXPECT_CALL(*source_manager, GetStore(Truly(is_source)))
+      .WillRepeatedly(Return(mock_store));
+  EXPECT_CALL(*source_manager, IsTracing(_))
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(*source_manager, FlushTracer(Truly(is_source)))
+      .Times(AtLeast(1));
+  // The store can't be trusted once traces were dropped, so the sync must
+  // not be reported as finished
+  EXPECT_CALL(*source_manager, NeedsResync(Truly(is_source)))
+      .WillOnce(Return(true));
+
+  EXPECT_CALL(*coordinator, IsCancelled())
+      .WillRepeatedly(Return(false));
+  EXPECT_CALL(*coordinator, SignalFinished())
+      .Times(0);
+
+  EXPECT_THROW(device_synchronizer->DoSync(coordinator, count_handler),
+               DeviceSynchronizerException);
+}
+
 // This uses mostly real versions of things
 TEST_F(DeviceSynchronizerTest, SyncTest) {
   // Write garbage to the first 4k block then sync (which should overwrite it)
@@ -1,6 +1,6 @@
 #include "tracing/block_trace_exception.h"
 #include "tracing/device_tracer.h"
-#include "unsynced_sector_manager/unsynced_sector_store.h"
+#include "unsynced_sector_manager/interval_unsynced_sector_store.h"
 #include "test/loop_device.h"
 
 #include <memory>
@@ -18,6 +18,7 @@ namespace {
 
 using ::datto_linux_client::BlockTraceException;
 using ::datto_linux_client::DeviceTracer;
+using ::datto_linux_client::IntervalUnsyncedSectorStore;
 using ::datto_linux_client::SectorInterval;
 using ::datto_linux_client::TraceHandler;
 using ::datto_linux_client::UnsyncedSectorStore;
@@ -36,7 +37,7 @@ class DeviceTracerTest : public ::testing::Test {
     LOG(INFO) << "Path is: " << loop_dev->path();
 
     sector_store =
-      std::shared_ptr<UnsyncedSectorStore>(new UnsyncedSectorStore(10));
+      std::shared_ptr<UnsyncedSectorStore>(new IntervalUnsyncedSectorStore(10));
     dummy_handler =
       std::shared_ptr<TraceHandler>(new DummyHandler());
     real_handler =
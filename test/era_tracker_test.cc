@@ -0,0 +1,129 @@
+#include "tracing/block_trace_exception.h"
+#include "tracing/dm_era.h"
+#include "tracing/era_tracker.h"
+#include "unsynced_sector_manager/sector_interval.h"
+#include "unsynced_sector_manager/interval_unsynced_sector_store.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::BlockTraceException;
+using ::datto_linux_client::DmEra;
+using ::datto_linux_client::EraTracker;
+using ::datto_linux_client::IntervalUnsyncedSectorStore;
+using ::datto_linux_client::SectorInterval;
+
+// Answers dmsetup and era_invalidate like an era target of 1000 sectors
+// with 8 sector blocks
+class FakeEraCommands {
+ public:
+  FakeEraCommands() : era(1), metadata_snapshots(0), fail_invalidate(false) {}
+
+  std::string Run(const std::string &command) {
+    commands.push_back(command);
+    if (command.find("dmsetup table") == 0) {
+      return "0 1000 era 253:1 253:2 8\n";
+    } else if (command.find("dmsetup status") == 0) {
+      return "0 1000 era 8 21/4096 " + std::to_string(era) + " -\n";
+    } else if (command.find("checkpoint") != std::string::npos) {
+      era++;
+    } else if (command.find("take_metadata_snap") != std::string::npos) {
+      metadata_snapshots++;
+    } else if (command.find("drop_metadata_snap") != std::string::npos) {
+      metadata_snapshots--;
+    } else if (command.find("era_invalidate") == 0) {
+      if (fail_invalidate) {
+        throw BlockTraceException("Command failed");
+      }
+      return blocks;
+    }
+    return "";
+  }
+
+  DmEra::CommandRunner Runner() {
+    return [this](const std::string &command) { return Run(command); };
+  }
+
+  uint32_t era;
+  int metadata_snapshots;
+  bool fail_invalidate;
+  std::string blocks;
+  std::vector<std::string> commands;
+};
+
+TEST(DmEraTest, ReadsTable) {
+  FakeEraCommands commands;
+  DmEra era("source", commands.Runner());
+  EXPECT_EQ(8UL, era.block_sectors());
+  EXPECT_EQ("dmsetup table 'source'", commands.commands[0]);
+  EXPECT_EQ(1U, era.CurrentEra());
+  EXPECT_EQ(2U, era.Checkpoint());
+}
+
+TEST(DmEraTest, RejectsOtherTargets) {
+  DmEra::CommandRunner linear = [](const std::string &) {
+    return std::string("0 1000 linear 8:1 0\n");
+  };
+  EXPECT_THROW(DmEra("source", linear), BlockTraceException);
+}
+
+TEST(DmEraTest, WrittenSince) {
+  FakeEraCommands commands;
+  commands.blocks = "<blocks>\n"
+                    "  <range begin=\"0\" end=\"2\"/>\n"
+                    "  <block block=\"10\"/>\n"
+                    "  <block block=\"124\"/>\n"
+                    "</blocks>\n";
+  DmEra era("source", commands.Runner());
+
+  std::vector<SectorInterval> written;
+  era.WrittenSince(5, &written);
+  ASSERT_EQ(3UL, written.size());
+  EXPECT_EQ(SectorInterval(0, 16), written[0]);
+  EXPECT_EQ(SectorInterval(80, 88), written[1]);
+  // Cut off at the end of the device
+  EXPECT_EQ(SectorInterval(992, 1000), written[2]);
+  EXPECT_EQ(0, commands.metadata_snapshots);
+}
+
+TEST(DmEraTest, DropsSnapshotOnFailure) {
+  FakeEraCommands commands;
+  commands.fail_invalidate = true;
+  DmEra era("source", commands.Runner());
+
+  std::vector<SectorInterval> written;
+  EXPECT_THROW(era.WrittenSince(5, &written), BlockTraceException);
+  EXPECT_EQ(0, commands.metadata_snapshots);
+}
+
+TEST(EraTrackerTest, FlushAddsWrittenBlocks) {
+  FakeEraCommands commands;
+  auto era = std::make_shared<DmEra>("source", commands.Runner());
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  EraTracker tracker(era, store);
+  EXPECT_EQ(2U, commands.era);
+
+  commands.blocks = "<blocks>\n  <range begin=\"1\" end=\"3\"/>\n</blocks>\n";
+  tracker.FlushBuffers();
+  EXPECT_EQ(16UL, store->UnsyncedSectorCount());
+  EXPECT_EQ(3U, commands.era);
+  EXPECT_EQ(0UL, tracker.DroppedTraces());
+}
+
+TEST(EraTrackerTest, FailedFlushIsDropped) {
+  FakeEraCommands commands;
+  auto era = std::make_shared<DmEra>("source", commands.Runner());
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  EraTracker tracker(era, store);
+
+  commands.fail_invalidate = true;
+  tracker.FlushBuffers();
+  EXPECT_EQ(1UL, tracker.DroppedTraces());
+}
+
+} // namespace
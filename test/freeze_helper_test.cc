@@ -62,4 +62,17 @@ TEST(FreezeHelperTest, DoesKeepFrozen) {
   EXPECT_TRUE(was_frozen);
 }
 
+TEST(FreezeHelperTest, ThawNow) {
+  MockMountableBlockDevice dev;
+  EXPECT_CALL(dev, Freeze());
+  EXPECT_CALL(dev, Thaw());
+  FreezeHelper fh(dev, 10000);
+
+  time_t start_time = time(NULL);
+  fh.BeginRequiredFreezeBlock();
+  fh.ThawNow();
+  EXPECT_FALSE(fh.EndRequiredFreezeBlock());
+  EXPECT_GT(5, time(NULL) - start_time);
+}
+
 }
@@ -0,0 +1,52 @@
+#include "block_device/in_use_sector_producer.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::CollectInUseSectors;
+using ::datto_linux_client::SectorInterval;
+using ::datto_linux_client::SectorSet;
+using ::datto_linux_client::SectorSetProducer;
+
+TEST(InUseSectorProducerTest, EmptySet) {
+  SectorSetProducer producer(std::make_shared<SectorSet>());
+  std::vector<SectorInterval> batch;
+  EXPECT_FALSE(producer.NextBatch(&batch));
+  EXPECT_TRUE(batch.empty());
+}
+
+TEST(InUseSectorProducerTest, ProducesInBatches) {
+  auto sector_set = std::make_shared<SectorSet>();
+  const uint64_t num_intervals = SectorSetProducer::INTERVALS_PER_BATCH + 10;
+  for (uint64_t i = 0; i < num_intervals; ++i) {
+    *sector_set += SectorInterval(i * 16, i * 16 + 8);
+  }
+
+  SectorSetProducer producer(sector_set);
+  std::vector<SectorInterval> batch;
+
+  ASSERT_TRUE(producer.NextBatch(&batch));
+  EXPECT_EQ(SectorSetProducer::INTERVALS_PER_BATCH, batch.size());
+  EXPECT_TRUE(SectorInterval(0, 8) == batch[0]);
+  uint64_t last_upper = batch.back().upper();
+
+  ASSERT_TRUE(producer.NextBatch(&batch));
+  EXPECT_EQ(10UL, batch.size());
+  EXPECT_LE(last_upper, batch[0].lower());
+
+  EXPECT_FALSE(producer.NextBatch(&batch));
+}
+
+TEST(InUseSectorProducerTest, CollectInUseSectors) {
+  auto sector_set = std::make_shared<SectorSet>();
+  for (uint64_t i = 0; i < 10000; ++i) {
+    *sector_set += SectorInterval(i * 3, i * 3 + 2);
+  }
+
+  SectorSetProducer producer(sector_set);
+  auto collected = CollectInUseSectors(&producer);
+  EXPECT_TRUE(*sector_set == *collected);
+}
+
+} // namespace
@@ -0,0 +1,430 @@
+#include "unsynced_sector_manager/interval_unsynced_sector_store.h"
+#include "unsynced_sector_manager/sector_interval.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::ClaimedInterval;
+using ::datto_linux_client::IntervalUnsyncedSectorStore;
+using ::datto_linux_client::SectorInterval;
+using ::datto_linux_client::SectorSet;
+using ::datto_linux_client::StoreStatistics;
+using ::datto_linux_client::TimedInterval;
+
+// Basic tests
+
+TEST(IntervalUnsyncedSectorStoreTest, DefaultConstructor) {
+  IntervalUnsyncedSectorStore store(10);
+
+  EXPECT_EQ(0UL, store.UnsyncedSectorCount());
+
+  SectorInterval output_interval;
+
+  store.GetInterval(&output_interval, time(NULL));
+  EXPECT_EQ(0UL, boost::icl::length(output_interval));
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, AddIntervalTest) {
+  IntervalUnsyncedSectorStore store(10);
+  SectorInterval interval1(1, 10);
+  SectorInterval interval2(5, 20);
+
+  SectorInterval output_interval;
+
+  store.AddInterval(interval1, 1000);
+  EXPECT_EQ(9UL, store.UnsyncedSectorCount());
+
+  store.GetInterval(&output_interval, time(NULL));
+  EXPECT_TRUE(interval1 == output_interval) << output_interval;
+
+  store.AddInterval(interval2, 1000);
+  store.GetInterval(&output_interval, time(NULL));
+  EXPECT_TRUE(SectorInterval(1, 20) == output_interval) << output_interval;
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, RemoveIntervalTest) {
+  IntervalUnsyncedSectorStore store(10);
+  SectorInterval interval1(1, 20);
+  SectorInterval interval2(5, 20);
+  SectorInterval output_interval;
+
+  store.AddInterval(interval1, 1000);
+  store.RemoveInterval(interval2);
+  store.GetInterval(&output_interval, time(NULL));
+
+  EXPECT_TRUE(SectorInterval(1, 5) == output_interval) << output_interval;
+  EXPECT_EQ(4UL, store.UnsyncedSectorCount());
+
+  store.RemoveInterval(interval1);
+  store.GetInterval(&output_interval, time(NULL));
+  EXPECT_TRUE(SectorInterval(0, 0) == output_interval) << output_interval;
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, ClearAllTest) {
+  IntervalUnsyncedSectorStore store(10);
+  SectorInterval interval(1, 20);
+
+  store.AddInterval(interval, 1000);
+  EXPECT_NE(0UL, store.UnsyncedSectorCount());
+
+  store.ClearIntervals();
+  EXPECT_EQ(0UL, store.UnsyncedSectorCount());
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, ClaimIntervalsTest) {
+  IntervalUnsyncedSectorStore store(10);
+  std::vector<ClaimedInterval> claimed;
+
+  store.AddNonVolatileInterval(SectorInterval(0, 10));
+  store.AddNonVolatileInterval(SectorInterval(20, 30));
+  store.AddNonVolatileInterval(SectorInterval(40, 50));
+
+  store.ClaimIntervals(&claimed, 2, 1000, time(NULL), false);
+  ASSERT_EQ(2UL, claimed.size());
+  EXPECT_TRUE(SectorInterval(0, 10) == claimed[0].interval);
+  EXPECT_TRUE(SectorInterval(20, 30) == claimed[1].interval);
+  EXPECT_EQ(10UL, store.UnsyncedSectorCount());
+
+  store.ClaimIntervals(&claimed, 2, 1000, time(NULL), false);
+  ASSERT_EQ(1UL, claimed.size());
+  EXPECT_TRUE(SectorInterval(40, 50) == claimed[0].interval);
+  EXPECT_EQ(0UL, store.UnsyncedSectorCount());
+
+  store.ClaimIntervals(&claimed, 2, 1000, time(NULL), false);
+  EXPECT_EQ(0UL, claimed.size());
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, ClaimIntervalsSplitsTest) {
+  IntervalUnsyncedSectorStore store(10);
+  std::vector<ClaimedInterval> claimed;
+
+  store.AddNonVolatileInterval(SectorInterval(0, 100));
+
+  store.ClaimIntervals(&claimed, 10, 30, time(NULL), false);
+  ASSERT_EQ(1UL, claimed.size());
+  EXPECT_TRUE(SectorInterval(0, 30) == claimed[0].interval);
+  EXPECT_EQ(70UL, store.UnsyncedSectorCount());
+
+  store.ClaimIntervals(&claimed, 10, 30, time(NULL), false);
+  ASSERT_EQ(1UL, claimed.size());
+  EXPECT_TRUE(SectorInterval(30, 60) == claimed[0].interval);
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, ClaimIntervalsWrapsTest) {
+  IntervalUnsyncedSectorStore store(10);
+  std::vector<ClaimedInterval> claimed;
+
+  store.AddNonVolatileInterval(SectorInterval(50, 60));
+  store.ClaimIntervals(&claimed, 10, 1000, time(NULL), false);
+  ASSERT_EQ(1UL, claimed.size());
+
+  // Added behind the cursor
+  store.AddNonVolatileInterval(SectorInterval(0, 10));
+  store.ClaimIntervals(&claimed, 10, 1000, time(NULL), false);
+  ASSERT_EQ(1UL, claimed.size());
+  EXPECT_TRUE(SectorInterval(0, 10) == claimed[0].interval);
+
+  // Claimed intervals are synced
+  store.ReInsertSyncHistory();
+  EXPECT_EQ(20UL, store.UnsyncedSectorCount());
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, StatisticsTest) {
+  IntervalUnsyncedSectorStore store(10);
+  SectorInterval output_interval;
+
+  store.AddInterval(SectorInterval(0, 10), time(NULL));
+  store.AddNonVolatileInterval(SectorInterval(20, 50));
+  store.AddNonVolatileInterval(SectorInterval(5, 25));
+
+  // Intervals with different write times are tracked separately
+  StoreStatistics stats = store.GetStatistics();
+  EXPECT_EQ(50UL, stats.unsynced_sectors);
+  EXPECT_EQ(10UL, stats.volatile_sectors);
+  EXPECT_EQ(2UL, stats.interval_count);
+  EXPECT_EQ(0UL, stats.synced_sectors);
+  EXPECT_EQ(30UL, stats.peak_extent_sectors);
+
+  store.RemoveInterval(SectorInterval(10, 20));
+  stats = store.GetStatistics();
+  EXPECT_EQ(40UL, stats.unsynced_sectors);
+  EXPECT_EQ(2UL, stats.interval_count);
+  EXPECT_EQ(10UL, stats.synced_sectors);
+  EXPECT_EQ(40UL, store.UnsyncedSectorCount());
+
+  store.ReInsertSyncHistory();
+  stats = store.GetStatistics();
+  EXPECT_EQ(50UL, stats.unsynced_sectors);
+  EXPECT_EQ(2UL, stats.interval_count);
+  EXPECT_EQ(0UL, stats.synced_sectors);
+
+  store.ClearIntervals();
+  stats = store.GetStatistics();
+  EXPECT_EQ(0UL, stats.unsynced_sectors);
+  EXPECT_EQ(0UL, stats.volatile_sectors);
+  EXPECT_EQ(0UL, stats.interval_count);
+  EXPECT_EQ(0UL, stats.peak_extent_sectors);
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, AddIntervalsTest) {
+  IntervalUnsyncedSectorStore store(10);
+  std::vector<TimedInterval> intervals(2);
+  intervals[0].interval = SectorInterval(0, 8);
+  intervals[0].epoch = 1000;
+  intervals[1].interval = SectorInterval(8192, 8200);
+  intervals[1].epoch = 1995;
+
+  store.AddIntervals(intervals);
+  EXPECT_EQ(16UL, store.UnsyncedSectorCount());
+
+  std::vector<ClaimedInterval> claimed;
+  store.ClaimIntervals(&claimed, 10, 1000, 2000, false);
+  ASSERT_EQ(2UL, claimed.size());
+  EXPECT_FALSE(claimed[0].is_volatile);
+  EXPECT_TRUE(claimed[1].is_volatile);
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, ReturnClaimedIntervalsTest) {
+  IntervalUnsyncedSectorStore store(10);
+  store.AddInterval(SectorInterval(0, 8), 1000);
+  store.AddInterval(SectorInterval(8192, 8200), 1995);
+
+  std::vector<ClaimedInterval> claimed;
+  store.ClaimIntervals(&claimed, 10, 1000, 2000, false);
+  ASSERT_EQ(2UL, claimed.size());
+  store.ReturnClaimedIntervals(claimed);
+  EXPECT_EQ(16UL, store.UnsyncedSectorCount());
+  EXPECT_EQ(0UL, store.GetStatistics().synced_sectors);
+  EXPECT_EQ(0UL, store.GetStatistics().rewritten_sectors);
+
+  // They keep their write times, so they are as volatile as before
+  store.ClaimIntervals(&claimed, 10, 1000, 2000, false);
+  ASSERT_EQ(2UL, claimed.size());
+  EXPECT_FALSE(claimed[0].is_volatile);
+  EXPECT_TRUE(claimed[1].is_volatile);
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, DeferHotTest) {
+  IntervalUnsyncedSectorStore store(10);
+  std::vector<ClaimedInterval> claimed;
+
+  // Rewrite the start of the device every second
+  for (int i = 0; i < 10; ++i) {
+    store.AddInterval(SectorInterval(0, 8), 1000 + i);
+  }
+  store.AddNonVolatileInterval(SectorInterval(8192, 8200));
+
+  store.ClaimIntervals(&claimed, 10, 10000, 1010, true);
+  ASSERT_EQ(1UL, claimed.size());
+  EXPECT_EQ(SectorInterval(8192, 8200), claimed[0].interval);
+
+  // Only the hot interval is left, so it is claimed anyway
+  store.ClaimIntervals(&claimed, 10, 10000, 1010, true);
+  ASSERT_EQ(1UL, claimed.size());
+  EXPECT_EQ(SectorInterval(0, 8), claimed[0].interval);
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, RewrittenSectorsTest) {
+  IntervalUnsyncedSectorStore store(10);
+  std::vector<ClaimedInterval> claimed;
+
+  store.AddNonVolatileInterval(SectorInterval(0, 16));
+  store.ClaimIntervals(&claimed, 10, 10000, 1000, false);
+  EXPECT_EQ(0UL, store.GetStatistics().rewritten_sectors);
+
+  // Rewriting it twice before it is sent again only counts once
+  store.AddInterval(SectorInterval(0, 8), 1000);
+  store.AddInterval(SectorInterval(0, 8), 1001);
+  EXPECT_EQ(8UL, store.GetStatistics().rewritten_sectors);
+
+  store.ClearSyncHistory();
+  EXPECT_EQ(0UL, store.GetStatistics().rewritten_sectors);
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, AdaptiveVolatileSecondsTest) {
+  IntervalUnsyncedSectorStore store(10);
+  std::vector<ClaimedInterval> claimed;
+  EXPECT_EQ(10, store.VolatileSeconds());
+
+  store.SetAdaptiveVolatileSeconds(true);
+  for (int i = 0; i < 5; ++i) {
+    store.AddInterval(SectorInterval(0, 8), 1000 + i * 20);
+  }
+  store.ClaimIntervals(&claimed, 10, 10000, 2000, false);
+  EXPECT_EQ(40, store.VolatileSeconds());
+  EXPECT_EQ(40, store.GetStatistics().volatile_seconds);
+
+  store.SetAdaptiveVolatileSeconds(false);
+  EXPECT_EQ(10, store.VolatileSeconds());
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, MemoryBudgetTest) {
+  IntervalUnsyncedSectorStore store(10);
+  store.SetMemoryBudget(100 * IntervalUnsyncedSectorStore::BYTES_PER_INTERVAL);
+
+  for (uint64_t i = 0; i < 1000; ++i) {
+    store.AddNonVolatileInterval(SectorInterval(i * 16, i * 16 + 1));
+  }
+
+  StoreStatistics stats = store.GetStatistics();
+  EXPECT_LE(stats.memory_bytes,
+            100 * IntervalUnsyncedSectorStore::BYTES_PER_INTERVAL);
+  EXPECT_EQ(IntervalUnsyncedSectorStore::FIRST_COARSE_SECTORS *
+                IntervalUnsyncedSectorStore::COARSEN_FACTOR,
+            stats.granularity_sectors);
+
+  // Everything that was added is still covered
+  std::vector<ClaimedInterval> claimed;
+  SectorSet claimed_set;
+  do {
+    store.ClaimIntervals(&claimed, 10, 100000, time(NULL), false);
+    for (const ClaimedInterval &claimed_interval : claimed) {
+      claimed_set += claimed_interval.interval;
+    }
+  } while (!claimed.empty());
+  for (uint64_t i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(boost::icl::contains(claimed_set, i * 16));
+  }
+
+  store.ClearIntervals();
+  EXPECT_EQ(1UL, store.GetStatistics().granularity_sectors);
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, AddNonVolatileIntervalsTest) {
+  IntervalUnsyncedSectorStore store(10);
+  // Written while the load is running
+  store.AddInterval(SectorInterval(25, 35), 1000);
+
+  std::vector<SectorInterval> sorted;
+  sorted.push_back(SectorInterval(0, 10));
+  sorted.push_back(SectorInterval(10, 20));
+  sorted.push_back(SectorInterval(30, 40));
+  sorted.push_back(SectorInterval(50, 60));
+  store.AddNonVolatileIntervals(sorted);
+  EXPECT_EQ(45UL, store.UnsyncedSectorCount());
+
+  SectorSet exported;
+  store.ExportIntervals(&exported, false);
+  EXPECT_EQ(45UL, boost::icl::cardinality(exported));
+  EXPECT_TRUE(boost::icl::contains(exported, SectorInterval(0, 20)));
+  EXPECT_TRUE(boost::icl::contains(exported, SectorInterval(25, 40)));
+
+  std::vector<ClaimedInterval> claimed;
+  store.ClaimIntervals(&claimed, 10, 1000, 2000, false);
+  uint64_t claimed_sectors = 0;
+  for (const ClaimedInterval &claimed_interval : claimed) {
+    EXPECT_FALSE(claimed_interval.is_volatile);
+    claimed_sectors += boost::icl::cardinality(claimed_interval.interval);
+  }
+  EXPECT_EQ(45UL, claimed_sectors);
+  EXPECT_EQ(0UL, store.UnsyncedSectorCount());
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, NoMemoryBudgetTest) {
+  IntervalUnsyncedSectorStore store(10);
+  store.SetMemoryBudget(0);
+
+  for (uint64_t i = 0; i < 1000; ++i) {
+    store.AddNonVolatileInterval(SectorInterval(i * 16, i * 16 + 1));
+  }
+
+  StoreStatistics stats = store.GetStatistics();
+  EXPECT_EQ(1UL, stats.granularity_sectors);
+  EXPECT_EQ(1000UL, stats.interval_count);
+  EXPECT_EQ(1000 * IntervalUnsyncedSectorStore::BYTES_PER_INTERVAL,
+            stats.memory_bytes);
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, ExportIntervalsTest) {
+  IntervalUnsyncedSectorStore store(10);
+  SectorSet exported;
+
+  store.AddInterval(SectorInterval(10, 20), 1000);
+  store.AddNonVolatileInterval(SectorInterval(100, 104));
+
+  store.ExportIntervals(&exported, false);
+  EXPECT_EQ(2UL, exported.iterative_size());
+  EXPECT_TRUE(boost::icl::contains(exported, SectorInterval(10, 20)));
+  EXPECT_NE(0UL, store.UnsyncedSectorCount());
+
+  store.ExportIntervals(&exported, true);
+  EXPECT_EQ(2UL, exported.iterative_size());
+  EXPECT_EQ(0UL, store.UnsyncedSectorCount());
+
+  store.ExportIntervals(&exported, false);
+  EXPECT_TRUE(exported.empty());
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, DiscardIntervalsTest) {
+  IntervalUnsyncedSectorStore store(10);
+  std::vector<ClaimedInterval> claimed;
+  std::vector<SectorInterval> discarded;
+
+  store.AddInterval(SectorInterval(0, 100), 1000);
+  store.ClaimIntervals(&claimed, 1, 10, 2000, false);
+  store.AddInterval(SectorInterval(200, 300), 1000);
+
+  store.DiscardIntervals({SectorInterval(5, 250)});
+  EXPECT_EQ(50UL, store.UnsyncedSectorCount());
+
+  StoreStatistics stats = store.GetStatistics();
+  EXPECT_EQ(245UL, stats.discarded_sectors);
+  EXPECT_EQ(5UL, stats.synced_sectors);
+
+  // A later write is no longer discarded
+  store.AddInterval(SectorInterval(100, 110), 1000);
+  EXPECT_EQ(235UL, store.GetStatistics().discarded_sectors);
+
+  store.ClaimDiscardedIntervals(&discarded, 1);
+  ASSERT_EQ(1UL, discarded.size());
+  EXPECT_EQ(SectorInterval(5, 100), discarded[0]);
+
+  store.ClaimDiscardedIntervals(&discarded, 10);
+  ASSERT_EQ(1UL, discarded.size());
+  EXPECT_EQ(SectorInterval(110, 250), discarded[0]);
+  EXPECT_EQ(0UL, store.GetStatistics().discarded_sectors);
+
+  store.ClaimDiscardedIntervals(&discarded, 10);
+  EXPECT_TRUE(discarded.empty());
+}
+
+// Timing tests
+
+TEST(IntervalUnsyncedSectorStoreTest, VolatileTest) {
+  IntervalUnsyncedSectorStore store(10);
+  SectorInterval interval1(1, 20);
+  SectorInterval output_interval;
+
+  store.AddInterval(interval1, 1000);
+  bool is_volatile = store.GetInterval(&output_interval, 1005);
+  EXPECT_TRUE(is_volatile);
+
+  is_volatile = store.GetInterval(&output_interval, 2000);
+  EXPECT_FALSE(is_volatile);
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, ClaimVolatileTest) {
+  IntervalUnsyncedSectorStore store(10);
+  std::vector<ClaimedInterval> claimed;
+
+  store.AddInterval(SectorInterval(1, 20), 1000);
+  store.AddNonVolatileInterval(SectorInterval(30, 40));
+
+  store.ClaimIntervals(&claimed, 10, 1000, 1005, false);
+  ASSERT_EQ(2UL, claimed.size());
+  EXPECT_TRUE(claimed[0].is_volatile);
+  EXPECT_FALSE(claimed[1].is_volatile);
+}
+
+TEST(IntervalUnsyncedSectorStoreTest, AddNonVolatileTest) {
+  IntervalUnsyncedSectorStore store(10);
+  SectorInterval interval1(1, 20);
+  SectorInterval output_interval;
+
+  store.AddNonVolatileInterval(interval1);
+  bool is_volatile = store.GetInterval(&output_interval, 1005);
+  EXPECT_FALSE(is_volatile);
+}
+
+} // namespace
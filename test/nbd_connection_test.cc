@@ -0,0 +1,390 @@
+#include "block_device/nbd_connection.h"
+#include "block_device/nbd_exception.h"
+#include "block_device/nbd_protocol.h"
+#include "block_device/nbd_socket.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::NbdConnection;
+using ::datto_linux_client::NbdException;
+using ::datto_linux_client::ReadFully;
+using ::datto_linux_client::WriteFully;
+namespace nbd_protocol = ::datto_linux_client::nbd_protocol;
+
+const uint64_t EXPORT_BYTES = 1024 * 1024;
+
+enum class Handshake { GO, EXPORT_NAME, OLDSTYLE };
+
+// Serves a memory buffer over one end of a socketpair, from its own thread.
+// Replies are held back until reply_batch requests have arrived and then
+// sent newest first, so requests complete out of order.
+class FakeNbdServer {
+ public:
+  FakeNbdServer(Handshake handshake, uint16_t transmission_flags,
+                size_t reply_batch)
+      : data(EXPORT_BYTES),
+        fail_offset(UINT64_MAX),
+        drop_after(SIZE_MAX),
+        num_requests(0),
+        num_flushes(0),
+        num_trims(0),
+        disconnected(false),
+        handshake_(handshake),
+        transmission_flags_(transmission_flags),
+        reply_batch_(reply_batch) {
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks)) {
+      throw std::runtime_error("socketpair failed");
+    }
+    client_sock = socks[0];
+    server_sock_ = socks[1];
+  }
+
+  void Start() {
+    thread_ = std::thread(&FakeNbdServer::Serve, this);
+  }
+
+  ~FakeNbdServer() {
+    shutdown(server_sock_, SHUT_RDWR);
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    close(server_sock_);
+  }
+
+  int client_sock;
+  std::vector<char> data;
+  // Requests touching this offset get EIO
+  uint64_t fail_offset;
+  // Close the connection once this many requests arrive, without replying
+  size_t drop_after;
+
+  size_t num_requests;
+  size_t num_flushes;
+  size_t num_trims;
+  bool disconnected;
+
+ private:
+  struct Reply {
+    uint64_t handle;
+    int error;
+    std::vector<char> read_data;
+  };
+
+  void WriteBe16(uint16_t value) {
+    value = htobe16(value);
+    WriteFully(server_sock_, &value, sizeof(value));
+  }
+
+  void WriteBe32(uint32_t value) {
+    value = htobe32(value);
+    WriteFully(server_sock_, &value, sizeof(value));
+  }
+
+  void WriteBe64(uint64_t value) {
+    value = htobe64(value);
+    WriteFully(server_sock_, &value, sizeof(value));
+  }
+
+  void WriteOptionReply(uint32_t option, uint32_t type,
+                        const std::string &reply) {
+    WriteBe64(nbd_protocol::REP_MAGIC);
+    WriteBe32(option);
+    WriteBe32(type);
+    WriteBe32(reply.size());
+    WriteFully(server_sock_, reply.data(), reply.size());
+  }
+
+  void DoHandshake() {
+    WriteBe64(nbd_protocol::INIT_MAGIC);
+    if (handshake_ == Handshake::OLDSTYLE) {
+      char zeroes[124] = {};
+      WriteBe64(nbd_protocol::OLDSTYLE_MAGIC);
+      WriteBe64(EXPORT_BYTES);
+      WriteBe32(transmission_flags_);
+      WriteFully(server_sock_, zeroes, sizeof(zeroes));
+      return;
+    }
+
+    WriteBe64(nbd_protocol::OPTS_MAGIC);
+    WriteBe16(nbd_protocol::FLAG_FIXED_NEWSTYLE |
+              nbd_protocol::FLAG_NO_ZEROES);
+    uint32_t client_flags;
+    ReadFully(server_sock_, &client_flags, sizeof(client_flags));
+
+    while (true) {
+      uint64_t magic;
+      uint32_t option;
+      uint32_t length;
+      ReadFully(server_sock_, &magic, sizeof(magic));
+      ReadFully(server_sock_, &option, sizeof(option));
+      ReadFully(server_sock_, &length, sizeof(length));
+      std::string option_data(be32toh(length), '\0');
+      if (!option_data.empty()) {
+        ReadFully(server_sock_, &option_data[0], option_data.size());
+      }
+      option = be32toh(option);
+
+      if (option == nbd_protocol::OPT_EXPORT_NAME) {
+        WriteBe64(EXPORT_BYTES);
+        WriteBe16(transmission_flags_);
+        return;
+      } else if (option != nbd_protocol::OPT_GO ||
+                 handshake_ == Handshake::EXPORT_NAME) {
+        WriteOptionReply(option, nbd_protocol::REP_ERR_UNSUP, "");
+        continue;
+      }
+
+      std::string info;
+      info.append("\0\0", 2);  // NBD_INFO_EXPORT
+      uint64_t size = htobe64(EXPORT_BYTES);
+      uint16_t flags = htobe16(transmission_flags_);
+      info.append(reinterpret_cast<char *>(&size), sizeof(size));
+      info.append(reinterpret_cast<char *>(&flags), sizeof(flags));
+      WriteOptionReply(option, nbd_protocol::REP_INFO, info);
+
+      std::string block_size("\0\3", 2);  // NBD_INFO_BLOCK_SIZE
+      uint32_t sizes[3] = {htobe32(512), htobe32(8192), htobe32(65536)};
+      block_size.append(reinterpret_cast<char *>(sizes), sizeof(sizes));
+      WriteOptionReply(option, nbd_protocol::REP_INFO, block_size);
+
+      WriteOptionReply(option, nbd_protocol::REP_ACK, "");
+      return;
+    }
+  }
+
+  void SendReplies(std::vector<Reply> *replies) {
+    for (auto itr = replies->rbegin(); itr != replies->rend(); ++itr) {
+      nbd_protocol::SimpleReply reply;
+      reply.magic = htobe32(nbd_protocol::SIMPLE_REPLY_MAGIC);
+      reply.error = htobe32(itr->error);
+      reply.handle = itr->handle;
+      WriteFully(server_sock_, &reply, sizeof(reply));
+      if (!itr->read_data.empty()) {
+        WriteFully(server_sock_, itr->read_data.data(),
+                   itr->read_data.size());
+      }
+    }
+    replies->clear();
+  }
+
+  void Serve() {
+    try {
+      DoHandshake();
+
+      std::vector<Reply> replies;
+      while (true) {
+        nbd_protocol::Request request;
+        ReadFully(server_sock_, &request, sizeof(request));
+        uint16_t type = be16toh(request.type);
+        uint64_t offset = be64toh(request.offset);
+        uint32_t length = be32toh(request.length);
+
+        if (type == nbd_protocol::CMD_DISC) {
+          SendReplies(&replies);
+          disconnected = true;
+          break;
+        }
+        if (type == nbd_protocol::CMD_WRITE) {
+          ReadFully(server_sock_, &data[offset], length);
+        }
+        if (++num_requests >= drop_after) {
+          break;
+        }
+
+        Reply reply;
+        reply.handle = request.handle;
+        reply.error = 0;
+        if (fail_offset >= offset && fail_offset < offset + length) {
+          reply.error = EIO;
+        } else if (type == nbd_protocol::CMD_READ) {
+          reply.read_data.assign(data.begin() + offset,
+                                 data.begin() + offset + length);
+        } else if (type == nbd_protocol::CMD_TRIM ||
+                   type == nbd_protocol::CMD_WRITE_ZEROES) {
+          std::fill(data.begin() + offset, data.begin() + offset + length,
+                    0);
+          ++num_trims;
+        } else if (type == nbd_protocol::CMD_FLUSH) {
+          ++num_flushes;
+        }
+
+        replies.push_back(std::move(reply));
+        if (replies.size() >= reply_batch_) {
+          SendReplies(&replies);
+        }
+      }
+    } catch (const NbdException &e) {
+      // The client went away
+    }
+    shutdown(server_sock_, SHUT_RDWR);
+  }
+
+  Handshake handshake_;
+  uint16_t transmission_flags_;
+  size_t reply_batch_;
+  int server_sock_;
+  std::thread thread_;
+};
+
+const uint16_t ALL_FLAGS = nbd_protocol::FLAG_HAS_FLAGS |
+                           nbd_protocol::FLAG_SEND_FLUSH |
+                           nbd_protocol::FLAG_SEND_TRIM |
+                           nbd_protocol::FLAG_SEND_WRITE_ZEROES;
+
+TEST(NbdConnectionTest, NegotiateGo) {
+  FakeNbdServer server(Handshake::GO, ALL_FLAGS, 1);
+  server.Start();
+  NbdConnection connection(server.client_sock, "", 4);
+
+  EXPECT_EQ(EXPORT_BYTES, connection.size_bytes());
+  EXPECT_EQ(8192U, connection.block_size_bytes());
+  EXPECT_TRUE(connection.CanFlush());
+  EXPECT_TRUE(connection.CanTrim());
+  EXPECT_TRUE(connection.CanWriteZeroes());
+  EXPECT_TRUE(connection.IsConnected());
+
+  connection.Disconnect();
+  EXPECT_FALSE(connection.IsConnected());
+}
+
+TEST(NbdConnectionTest, NegotiateExportName) {
+  FakeNbdServer server(Handshake::EXPORT_NAME,
+                       nbd_protocol::FLAG_HAS_FLAGS, 1);
+  server.Start();
+  NbdConnection connection(server.client_sock, "", 4);
+
+  EXPECT_EQ(EXPORT_BYTES, connection.size_bytes());
+  EXPECT_EQ(4096U, connection.block_size_bytes());
+  EXPECT_FALSE(connection.CanFlush());
+  EXPECT_FALSE(connection.CanTrim());
+}
+
+TEST(NbdConnectionTest, NegotiateOldstyle) {
+  FakeNbdServer server(Handshake::OLDSTYLE,
+                       nbd_protocol::FLAG_HAS_FLAGS |
+                       nbd_protocol::FLAG_SEND_FLUSH, 1);
+  server.Start();
+  NbdConnection connection(server.client_sock, "", 4);
+
+  EXPECT_EQ(EXPORT_BYTES, connection.size_bytes());
+  EXPECT_TRUE(connection.CanFlush());
+  EXPECT_FALSE(connection.CanTrim());
+
+  char buf[4096] = {};
+  server.data[4096] = 'x';
+  connection.Read(buf, sizeof(buf), 4096);
+  EXPECT_EQ('x', buf[0]);
+}
+
+TEST(NbdConnectionTest, PipelinedOutOfOrder) {
+  // Replies only come once 8 requests are in flight, in reverse
+  FakeNbdServer server(Handshake::GO, ALL_FLAGS, 8);
+  server.Start();
+  NbdConnection connection(server.client_sock, "", 8);
+
+  std::vector<std::vector<char>> buffers;
+  std::vector<uint64_t> handles;
+  for (int i = 0; i < 8; ++i) {
+    buffers.emplace_back(4096, 'a' + i);
+    handles.push_back(connection.AsyncWrite(buffers[i].data(), 4096,
+                                            i * 4096));
+  }
+  for (uint64_t handle : handles) {
+    connection.Wait(handle);
+  }
+  EXPECT_EQ(0U, connection.InFlight());
+  EXPECT_EQ('a', server.data[0]);
+  EXPECT_EQ('h', server.data[7 * 4096 + 4095]);
+
+  std::vector<std::vector<char>> read_buffers(8, std::vector<char>(4096));
+  for (int i = 0; i < 8; ++i) {
+    connection.AsyncRead(read_buffers[i].data(), 4096, i * 4096);
+  }
+  connection.WaitAll();
+  for (int i = 0; i < 8; ++i) {
+    EXPECT_EQ(buffers[i], read_buffers[i]);
+  }
+}
+
+TEST(NbdConnectionTest, TrimAndFlush) {
+  FakeNbdServer server(Handshake::GO, ALL_FLAGS, 1);
+  server.Start();
+  NbdConnection connection(server.client_sock, "", 4);
+
+  std::vector<char> buf(8192, 'z');
+  connection.Write(buf.data(), buf.size(), 0);
+  connection.Wait(connection.AsyncTrim(4096, 0));
+  connection.Wait(connection.AsyncWriteZeroes(512, 4096));
+  connection.Flush();
+
+  EXPECT_EQ(0, server.data[4095]);
+  EXPECT_EQ(0, server.data[4096]);
+  EXPECT_EQ('z', server.data[4096 + 512]);
+  EXPECT_EQ(2U, server.num_trims);
+  EXPECT_EQ(1U, server.num_flushes);
+
+  connection.Disconnect();
+  EXPECT_TRUE(server.disconnected);
+}
+
+TEST(NbdConnectionTest, ErrorReply) {
+  FakeNbdServer server(Handshake::GO, ALL_FLAGS, 1);
+  server.fail_offset = 4096;
+  server.Start();
+  NbdConnection connection(server.client_sock, "", 4);
+
+  char buf[4096] = {};
+  EXPECT_THROW(connection.Write(buf, sizeof(buf), 4096), NbdException);
+  connection.AsyncWrite(buf, sizeof(buf), 4096);
+  EXPECT_THROW(connection.WaitAll(), NbdException);
+
+  // The connection is still usable
+  EXPECT_TRUE(connection.IsConnected());
+  connection.Write(buf, sizeof(buf), 0);
+}
+
+TEST(NbdConnectionTest, ConnectionLost) {
+  // Nothing is replied to before the server goes away
+  FakeNbdServer server(Handshake::GO, ALL_FLAGS, 4);
+  server.drop_after = 2;
+  server.Start();
+  NbdConnection connection(server.client_sock, "", 4);
+
+  char buf[4096] = {};
+  uint64_t first = connection.AsyncWrite(buf, sizeof(buf), 0);
+  uint64_t second = connection.AsyncWrite(buf, sizeof(buf), 4096);
+
+  EXPECT_THROW(connection.Wait(first), NbdException);
+  EXPECT_THROW(connection.Wait(second), NbdException);
+  EXPECT_FALSE(connection.IsConnected());
+  EXPECT_EQ(0U, connection.InFlight());
+  EXPECT_THROW(connection.AsyncWrite(buf, sizeof(buf), 0), NbdException);
+}
+
+TEST(NbdConnectionTest, BadMagic) {
+  int socks[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, socks));
+  uint64_t magic = 0;
+  WriteFully(socks[1], &magic, sizeof(magic));
+  EXPECT_THROW(NbdConnection(socks[0], "", 4), NbdException);
+  close(socks[1]);
+}
+
+} // namespace
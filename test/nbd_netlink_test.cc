@@ -0,0 +1,31 @@
+#include "block_device/nbd_exception.h"
+#include "block_device/nbd_netlink.h"
+
+#include <linux/genetlink.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::NbdException;
+using ::datto_linux_client::NbdNetlink;
+
+// Resolves a family every kernel has, so no nbd module is needed
+class ControlNetlink : public NbdNetlink {
+ public:
+  explicit ControlNetlink(const std::string &family_name)
+      : NbdNetlink(family_name) {}
+};
+
+TEST(NbdNetlinkTest, ResolvesFamily) {
+  ControlNetlink netlink("nlctrl");
+  EXPECT_EQ(GENL_ID_CTRL, netlink.family_id());
+}
+
+TEST(NbdNetlinkTest, UnknownFamily) {
+  EXPECT_THROW(ControlNetlink("no_such_family"), NbdException);
+}
+
+} // namespace
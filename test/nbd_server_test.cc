@@ -0,0 +1,221 @@
+#include "block_device/nbd_server.h"
+#include "block_device/nbd_connection.h"
+#include "block_device/nbd_exception.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::NbdConnection;
+using ::datto_linux_client::NbdException;
+using ::datto_linux_client::NbdServer;
+using ::datto_linux_client::NbdServerConditions;
+using ::datto_linux_client::NbdServerStatistics;
+
+const uint64_t EXPORT_BYTES = 4 * 1024 * 1024;
+const uint32_t IO_BYTES = 64 * 1024;
+
+NbdServerConditions NoConditions() {
+  NbdServerConditions conditions = {};
+  return conditions;
+}
+
+TEST(NbdServerTest, MemoryRoundTrip) {
+  NbdServer server(EXPORT_BYTES);
+  NbdConnection connection("localhost", server.port(), "");
+
+  EXPECT_EQ(EXPORT_BYTES, connection.size_bytes());
+  EXPECT_TRUE(connection.CanFlush());
+  EXPECT_TRUE(connection.CanTrim());
+
+  std::vector<char> written(IO_BYTES, 'x');
+  connection.Write(written.data(), IO_BYTES, 4096);
+  connection.Flush();
+
+  std::vector<char> read(IO_BYTES);
+  connection.Read(read.data(), IO_BYTES, 4096);
+  EXPECT_EQ(written, read);
+
+  server.ReadData(read.data(), IO_BYTES, 4096);
+  EXPECT_EQ(written, read);
+
+  connection.Disconnect();
+  NbdServerStatistics statistics = server.GetStatistics();
+  EXPECT_EQ(1U, statistics.connections);
+  EXPECT_EQ(3U, statistics.requests);
+  EXPECT_EQ(IO_BYTES, statistics.bytes_read);
+  EXPECT_EQ(IO_BYTES, statistics.bytes_written);
+  EXPECT_EQ(1U, statistics.flushes);
+}
+
+TEST(NbdServerTest, ServesFile) {
+  char path[] = "/tmp/nbd_server_test_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_LE(0, fd);
+  ASSERT_EQ(0, ftruncate(fd, EXPORT_BYTES));
+
+  {
+    NbdServer server(path);
+    NbdConnection connection("localhost", server.port(), "");
+    EXPECT_EQ(EXPORT_BYTES, connection.size_bytes());
+
+    std::vector<char> written(IO_BYTES, 'y');
+    connection.Write(written.data(), IO_BYTES, EXPORT_BYTES - IO_BYTES);
+    connection.WaitAll();
+
+    std::vector<char> read(IO_BYTES);
+    ASSERT_EQ(IO_BYTES, pread(fd, read.data(), IO_BYTES,
+                              EXPORT_BYTES - IO_BYTES));
+    EXPECT_EQ(written, read);
+
+    connection.Wait(connection.AsyncTrim(IO_BYTES, EXPORT_BYTES - IO_BYTES));
+    connection.Read(read.data(), IO_BYTES, EXPORT_BYTES - IO_BYTES);
+    EXPECT_EQ(std::vector<char>(IO_BYTES), read);
+  }
+
+  close(fd);
+  unlink(path);
+}
+
+TEST(NbdServerTest, TrimsMoreThanMaxRequest) {
+  const uint32_t TRIM_BYTES = 64 * 1024 * 1024 + IO_BYTES;
+  NbdServer server(TRIM_BYTES + IO_BYTES);
+  NbdConnection connection("localhost", server.port(), "");
+
+  std::vector<char> written(IO_BYTES, 'x');
+  connection.Write(written.data(), IO_BYTES, TRIM_BYTES - IO_BYTES);
+  connection.Write(written.data(), IO_BYTES, TRIM_BYTES);
+
+  // Only reads and writes are limited to MAX_REQUEST_BYTES
+  connection.Wait(connection.AsyncTrim(TRIM_BYTES, 0));
+  EXPECT_TRUE(connection.IsConnected());
+
+  std::vector<char> read(IO_BYTES);
+  connection.Read(read.data(), IO_BYTES, TRIM_BYTES - IO_BYTES);
+  EXPECT_EQ(std::vector<char>(IO_BYTES), read);
+  connection.Read(read.data(), IO_BYTES, TRIM_BYTES);
+  EXPECT_EQ(written, read);
+
+  connection.Wait(connection.AsyncWriteZeroes(TRIM_BYTES, IO_BYTES));
+  connection.Read(read.data(), IO_BYTES, TRIM_BYTES);
+  EXPECT_EQ(std::vector<char>(IO_BYTES), read);
+  EXPECT_EQ(0U, server.GetStatistics().failed_requests);
+}
+
+TEST(NbdServerTest, OutOfRangeFails) {
+  NbdServer server(EXPORT_BYTES);
+  NbdConnection connection("localhost", server.port(), "");
+
+  std::vector<char> buf(IO_BYTES);
+  EXPECT_THROW(connection.Read(buf.data(), IO_BYTES, EXPORT_BYTES),
+               NbdException);
+  EXPECT_EQ(1U, server.GetStatistics().failed_requests);
+}
+
+TEST(NbdServerTest, InjectsLatency) {
+  NbdServer server(EXPORT_BYTES);
+  NbdConnection connection("localhost", server.port(), "");
+
+  NbdServerConditions conditions = NoConditions();
+  conditions.latency_micros = 50000;
+  conditions.jitter_micros = 10000;
+  server.SetConditions(conditions);
+
+  // Pipelined requests wait out the latency together
+  std::vector<char> buf(IO_BYTES);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 8; i++) {
+    connection.AsyncRead(buf.data(), IO_BYTES, i * IO_BYTES);
+  }
+  connection.WaitAll();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  EXPECT_LE(std::chrono::milliseconds(50), elapsed);
+  EXPECT_GT(std::chrono::milliseconds(400), elapsed);
+}
+
+TEST(NbdServerTest, CapsBandwidth) {
+  NbdServer server(EXPORT_BYTES);
+  NbdConnection connection("localhost", server.port(), "");
+
+  NbdServerConditions conditions = NoConditions();
+  conditions.bandwidth_bytes_per_second = 10 * 1024 * 1024;
+  server.SetConditions(conditions);
+
+  std::vector<char> buf(1024 * 1024);
+  auto start = std::chrono::steady_clock::now();
+  connection.Write(buf.data(), buf.size(), 0);
+  connection.Read(buf.data(), buf.size(), 0);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  // 2MiB at 10MiB/s
+  EXPECT_LE(std::chrono::milliseconds(190), elapsed);
+}
+
+TEST(NbdServerTest, InjectsErrors) {
+  NbdServer server(EXPORT_BYTES);
+  NbdConnection connection("localhost", server.port(), "");
+
+  NbdServerConditions conditions = NoConditions();
+  conditions.fail_every_n_requests = 2;
+  server.SetConditions(conditions);
+
+  std::vector<char> buf(IO_BYTES);
+  EXPECT_NO_THROW(connection.Read(buf.data(), IO_BYTES, 0));
+  EXPECT_THROW(connection.Read(buf.data(), IO_BYTES, 0), NbdException);
+  EXPECT_NO_THROW(connection.Read(buf.data(), IO_BYTES, 0));
+  EXPECT_TRUE(connection.IsConnected());
+  EXPECT_EQ(1U, server.GetStatistics().failed_requests);
+}
+
+TEST(NbdServerTest, DropsAfterRequests) {
+  NbdServer server(EXPORT_BYTES);
+  NbdServerConditions conditions = NoConditions();
+  conditions.drop_after_requests = 3;
+  server.SetConditions(conditions);
+
+  NbdConnection connection("localhost", server.port(), "");
+  std::vector<char> buf(IO_BYTES);
+  connection.Read(buf.data(), IO_BYTES, 0);
+  connection.Read(buf.data(), IO_BYTES, 0);
+  EXPECT_THROW(connection.Read(buf.data(), IO_BYTES, 0), NbdException);
+  EXPECT_FALSE(connection.IsConnected());
+
+  // New connections get their own count
+  NbdConnection reconnection("localhost", server.port(), "");
+  EXPECT_NO_THROW(reconnection.Read(buf.data(), IO_BYTES, 0));
+
+  NbdServerStatistics statistics = server.GetStatistics();
+  EXPECT_EQ(2U, statistics.connections);
+  EXPECT_EQ(1U, statistics.dropped_connections);
+}
+
+TEST(NbdServerTest, DropConnections) {
+  NbdServer server(EXPORT_BYTES);
+  NbdConnection connection("localhost", server.port(), "");
+
+  NbdServerConditions conditions = NoConditions();
+  conditions.latency_micros = 1000000;
+  server.SetConditions(conditions);
+
+  std::vector<char> buf(IO_BYTES);
+  uint64_t handle = connection.AsyncRead(buf.data(), IO_BYTES, 0);
+  while (server.GetStatistics().requests == 0) {
+    usleep(1000);
+  }
+  server.DropConnections();
+
+  EXPECT_THROW(connection.Wait(handle), NbdException);
+  EXPECT_EQ(1U, server.GetStatistics().dropped_connections);
+}
+
+} // namespace
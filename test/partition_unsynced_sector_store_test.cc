@@ -0,0 +1,94 @@
+#include "unsynced_sector_manager/partition_unsynced_sector_store.h"
+#include "unsynced_sector_manager/sector_interval.h"
+#include "unsynced_sector_manager/interval_unsynced_sector_store.h"
+#include "unsynced_sector_manager/unsynced_tracking_exception.h"
+
+#include <memory>
+#include <time.h>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::ClaimedInterval;
+using ::datto_linux_client::IntervalUnsyncedSectorStore;
+using ::datto_linux_client::PartitionUnsyncedSectorStore;
+using ::datto_linux_client::SectorInterval;
+using ::datto_linux_client::SectorSet;
+using ::datto_linux_client::TimedInterval;
+using ::datto_linux_client::UnsyncedTrackingException;
+
+TEST(PartitionUnsyncedSectorStoreTest, RoutesToPartitions) {
+  PartitionUnsyncedSectorStore disk_store;
+  auto first = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  auto second = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  disk_store.Attach(SectorInterval(100, 200), first);
+  disk_store.Attach(SectorInterval(200, 300), second);
+  EXPECT_EQ(2UL, disk_store.PartitionCount());
+
+  // Spans the end of one partition and the start of the next
+  disk_store.AddInterval(SectorInterval(190, 210), time(NULL));
+  EXPECT_EQ(10UL, first->UnsyncedSectorCount());
+  EXPECT_EQ(10UL, second->UnsyncedSectorCount());
+
+  SectorInterval output;
+  first->GetInterval(&output, time(NULL));
+  EXPECT_EQ(SectorInterval(90, 100), output);
+  second->GetInterval(&output, time(NULL));
+  EXPECT_EQ(SectorInterval(0, 10), output);
+}
+
+TEST(PartitionUnsyncedSectorStoreTest, IgnoresOutsidePartitions) {
+  PartitionUnsyncedSectorStore disk_store;
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  disk_store.Attach(SectorInterval(100, 200), store);
+
+  // e.g. the partition table
+  disk_store.AddNonVolatileInterval(SectorInterval(0, 1));
+  disk_store.AddInterval(SectorInterval(200, 300), time(NULL));
+  EXPECT_EQ(0UL, store->UnsyncedSectorCount());
+}
+
+TEST(PartitionUnsyncedSectorStoreTest, AddIntervalsAndDiscards) {
+  PartitionUnsyncedSectorStore disk_store;
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  disk_store.Attach(SectorInterval(100, 200), store);
+
+  TimedInterval inside = {SectorInterval(100, 150), time(NULL)};
+  TimedInterval outside = {SectorInterval(50, 60), time(NULL)};
+  disk_store.AddIntervals({outside, inside});
+  EXPECT_EQ(50UL, store->UnsyncedSectorCount());
+
+  disk_store.DiscardIntervals({SectorInterval(140, 160)});
+  EXPECT_EQ(40UL, store->UnsyncedSectorCount());
+  EXPECT_EQ(20UL, store->GetStatistics().discarded_sectors);
+}
+
+TEST(PartitionUnsyncedSectorStoreTest, Detach) {
+  PartitionUnsyncedSectorStore disk_store;
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  disk_store.Attach(SectorInterval(100, 200), store);
+  disk_store.Detach(store);
+  EXPECT_EQ(0UL, disk_store.PartitionCount());
+
+  disk_store.AddInterval(SectorInterval(100, 200), time(NULL));
+  EXPECT_EQ(0UL, store->UnsyncedSectorCount());
+}
+
+TEST(PartitionUnsyncedSectorStoreTest, KeepsNothing) {
+  PartitionUnsyncedSectorStore disk_store;
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  disk_store.Attach(SectorInterval(100, 200), store);
+  disk_store.AddNonVolatileIntervals({SectorInterval(100, 150)});
+  EXPECT_EQ(50UL, store->UnsyncedSectorCount());
+  EXPECT_EQ(0UL, disk_store.UnsyncedSectorCount());
+
+  std::vector<ClaimedInterval> claimed;
+  EXPECT_THROW(disk_store.ClaimIntervals(&claimed, 1, 100, time(NULL), false),
+               UnsyncedTrackingException);
+  SectorSet exported;
+  EXPECT_THROW(disk_store.ExportIntervals(&exported, false),
+               UnsyncedTrackingException);
+}
+
+} // namespace
@@ -0,0 +1,191 @@
+#include "tracing/ring_trace_handler.h"
+#include "tracing/trace_ring.h"
+#include "unsynced_sector_manager/interval_unsynced_sector_store.h"
+
+#include <memory>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::IntervalUnsyncedSectorStore;
+using ::datto_linux_client::RingTraceHandler;
+using ::datto_linux_client::SectorInterval;
+using ::datto_linux_client::TraceExtent;
+using ::datto_linux_client::TraceRing;
+
+struct blk_io_trace MakeWriteTrace(uint64_t sector, uint32_t bytes,
+                                   uint32_t cpu) {
+  struct blk_io_trace trace;
+  memset(&trace, 0, sizeof(trace));
+  trace.magic = BLK_IO_TRACE_MAGIC | BLK_IO_TRACE_VERSION;
+  trace.action = BLK_TC_ACT(BLK_TC_WRITE) | __BLK_TA_QUEUE;
+  trace.sector = sector;
+  trace.bytes = bytes;
+  trace.cpu = cpu;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  trace.time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  return trace;
+}
+
+TEST(TraceRingTest, PushPopTest) {
+  TraceRing ring(3);
+  TraceExtent extent = {};
+
+  EXPECT_FALSE(ring.Pop(&extent));
+
+  // Capacity is rounded up to 4
+  for (uint64_t i = 0; i < 4; ++i) {
+    extent.sector = i;
+    EXPECT_TRUE(ring.Push(extent));
+  }
+  EXPECT_FALSE(ring.Push(extent));
+
+  for (uint64_t i = 0; i < 4; ++i) {
+    ASSERT_TRUE(ring.Pop(&extent));
+    EXPECT_EQ(i, extent.sector);
+  }
+  EXPECT_FALSE(ring.Pop(&extent));
+}
+
+TEST(RingTraceHandlerTest, FlushAddsToStore) {
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  RingTraceHandler handler(store, 2);
+
+  handler.AddTrace(MakeWriteTrace(0, 4096, 0));
+  handler.AddTrace(MakeWriteTrace(100, 512, 1));
+  handler.Flush();
+
+  EXPECT_EQ(9UL, store->UnsyncedSectorCount());
+
+  SectorInterval output;
+  EXPECT_TRUE(store->GetInterval(&output, time(NULL)));
+}
+
+TEST(RingTraceHandlerTest, IgnoresNonWrites) {
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  RingTraceHandler handler(store, 1);
+
+  struct blk_io_trace trace = MakeWriteTrace(0, 4096, 0);
+  trace.action = BLK_TC_ACT(BLK_TC_READ) | __BLK_TA_QUEUE;
+  handler.AddTrace(trace);
+  handler.Flush();
+
+  EXPECT_EQ(0UL, store->UnsyncedSectorCount());
+}
+
+TEST(RingTraceHandlerTest, CoalescesWrites) {
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  RingTraceHandler handler(store, 2);
+
+  handler.AddTrace(MakeWriteTrace(8, 4096, 0));
+  handler.AddTrace(MakeWriteTrace(0, 4096, 1));
+  handler.AddTrace(MakeWriteTrace(0, 4096, 0));
+  handler.Flush();
+
+  EXPECT_EQ(16UL, store->UnsyncedSectorCount());
+  EXPECT_EQ(1UL, store->GetStatistics().interval_count);
+}
+
+TEST(RingTraceHandlerTest, FullRingFallsBack) {
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  RingTraceHandler handler(store, 1);
+
+  // An unknown CPU can't use a ring and goes straight to the store
+  handler.AddTrace(MakeWriteTrace(0, 4096, 5));
+  EXPECT_EQ(8UL, store->UnsyncedSectorCount());
+
+  for (size_t i = 0; i < RingTraceHandler::RING_CAPACITY * 2; ++i) {
+    handler.AddTrace(MakeWriteTrace(i * 8, 4096, 0));
+  }
+  handler.Flush();
+
+  EXPECT_EQ(RingTraceHandler::RING_CAPACITY * 16,
+            store->UnsyncedSectorCount());
+}
+
+TEST(RingTraceHandlerTest, UsesTraceTime) {
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  RingTraceHandler handler(store, 1);
+
+  // Written a minute ago, so it isn't volatile
+  struct blk_io_trace trace = MakeWriteTrace(0, 4096, 0);
+  trace.time -= 60 * 1000000000ULL;
+  handler.AddTrace(trace);
+  handler.Flush();
+
+  SectorInterval output;
+  EXPECT_FALSE(store->GetInterval(&output, time(NULL)));
+}
+
+TEST(RingTraceHandlerTest, AppliesDiscardsOnFlush) {
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  RingTraceHandler handler(store, 2);
+
+  struct blk_io_trace discard = MakeWriteTrace(0, 8192, 1);
+  discard.action |= BLK_TC_ACT(BLK_TC_DISCARD);
+
+  struct blk_io_trace earlier = MakeWriteTrace(0, 8192, 0);
+  earlier.time = discard.time - 1;
+  handler.AddTrace(earlier);
+  handler.AddTrace(discard);
+  // Written after the discard but read before it
+  struct blk_io_trace later = MakeWriteTrace(8, 1024, 0);
+  later.time = discard.time + 1;
+  handler.AddTrace(later);
+  handler.Flush();
+
+  EXPECT_EQ(2UL, store->UnsyncedSectorCount());
+  EXPECT_EQ(14UL, store->GetStatistics().discarded_sectors);
+}
+
+TEST(RingTraceHandlerTest, AppliesDiscardsWithoutFlush) {
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  RingTraceHandler handler(store, 1);
+
+  struct blk_io_trace write = MakeWriteTrace(0, 8192, 0);
+  struct blk_io_trace discard = MakeWriteTrace(0, 8192, 0);
+  discard.action |= BLK_TC_ACT(BLK_TC_DISCARD);
+  discard.time = write.time + 1;
+  handler.AddTrace(write);
+  handler.AddTrace(discard);
+
+  // The merge thread applies it once it has been held long enough
+  for (int i = 0; i < 500; ++i) {
+    if (store->GetStatistics().discarded_sectors) {
+      break;
+    }
+    usleep(10000);
+  }
+  EXPECT_EQ(16UL, store->GetStatistics().discarded_sectors);
+  EXPECT_EQ(0UL, store->UnsyncedSectorCount());
+}
+
+TEST(RingTraceHandlerTest, DropsDiscardsOlderThanForgottenWrites) {
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  RingTraceHandler handler(store, 1);
+
+  // No discards are pending when it is merged, so its time isn't kept
+  struct blk_io_trace write = MakeWriteTrace(0, 4096, 0);
+  handler.AddTrace(write);
+  for (int i = 0; i < 500 && store->UnsyncedSectorCount() == 0; ++i) {
+    usleep(10000);
+  }
+  ASSERT_EQ(8UL, store->UnsyncedSectorCount());
+
+  struct blk_io_trace discard = MakeWriteTrace(0, 4096, 0);
+  discard.action |= BLK_TC_ACT(BLK_TC_DISCARD);
+  discard.time = write.time - 1;
+  handler.AddTrace(discard);
+  handler.Flush();
+
+  EXPECT_EQ(8UL, store->UnsyncedSectorCount());
+  EXPECT_EQ(0UL, store->GetStatistics().discarded_sectors);
+}
+
+} // namespace
@@ -0,0 +1,238 @@
+#include "tracing/trace_reader_pool.h"
+#include "tracing/block_trace_exception.h"
+#include "tracing/trace_handler.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::BlockTraceException;
+using ::datto_linux_client::TraceHandler;
+using ::datto_linux_client::TraceReaderPool;
+
+class RecordingTraceHandler : public TraceHandler {
+ public:
+  RecordingTraceHandler() {}
+
+  virtual void AddTrace(const struct blk_io_trace &trace_data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sectors_.push_back(trace_data.sector);
+  }
+
+  std::vector<uint64_t> sectors() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<uint64_t> sorted(sectors_);
+    std::sort(sorted.begin(), sorted.end());
+    return sorted;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::vector<uint64_t> sectors_;
+};
+
+// Records the CPUs the thread calling it may run on
+class AffinityTraceHandler : public TraceHandler {
+ public:
+  AffinityTraceHandler() : num_traces_(0), cpu_count_(0), on_cpu0_(false) {}
+
+  virtual void AddTrace(const struct blk_io_trace &trace_data) {
+    cpu_set_t cpu_mask;
+    CPU_ZERO(&cpu_mask);
+    sched_getaffinity(0, sizeof(cpu_mask), &cpu_mask);
+    std::lock_guard<std::mutex> lock(mutex_);
+    num_traces_++;
+    cpu_count_ = CPU_COUNT(&cpu_mask);
+    on_cpu0_ = CPU_ISSET(0, &cpu_mask);
+  }
+
+  int num_traces() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_traces_;
+  }
+
+  int cpu_count() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cpu_count_;
+  }
+
+  bool on_cpu0() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return on_cpu0_;
+  }
+
+ private:
+  std::mutex mutex_;
+  int num_traces_;
+  int cpu_count_;
+  bool on_cpu0_;
+};
+
+struct blk_io_trace MakeWriteTrace(uint64_t sector) {
+  struct blk_io_trace trace;
+  memset(&trace, 0, sizeof(trace));
+  trace.magic = BLK_IO_TRACE_MAGIC | BLK_IO_TRACE_VERSION;
+  trace.action = BLK_TC_ACT(BLK_TC_WRITE) | __BLK_TA_QUEUE;
+  trace.sector = sector;
+  trace.bytes = 4096;
+  return trace;
+}
+
+// FIFOs stand in for the relay files of each CPU of a device
+class TraceReaderPoolTest : public ::testing::Test {
+ protected:
+  TraceReaderPoolTest() {
+    char dir_template[] = "/tmp/trace_reader_pool_test.XXXXXX";
+    dir_ = mkdtemp(dir_template);
+    num_cpus_ = std::min(2, get_nprocs_conf());
+  }
+
+  ~TraceReaderPoolTest() {
+    for (size_t i = 0; i < write_fds_.size(); ++i) {
+      close(write_fds_[i]);
+      unlink(fifo_paths_[i].c_str());
+    }
+    rmdir(dir_.c_str());
+  }
+
+  // Returns the prefix of the trace files
+  std::string MakeDevice(const std::string &name) {
+    std::string prefix = dir_ + "/" + name + "_trace";
+    for (int cpu = 0; cpu < num_cpus_; ++cpu) {
+      std::string path = prefix + std::to_string(cpu);
+      mkfifo(path.c_str(), 0600);
+      // Opening read/write doesn't wait for a reader
+      write_fds_.push_back(open(path.c_str(), O_RDWR));
+      fifo_paths_.push_back(path);
+    }
+    return prefix;
+  }
+
+  void WriteTrace(int fd, uint64_t sector) {
+    struct blk_io_trace trace = MakeWriteTrace(sector);
+    ASSERT_EQ((ssize_t)sizeof(trace), write(fd, &trace, sizeof(trace)));
+  }
+
+  std::string dir_;
+  int num_cpus_;
+  std::vector<std::string> fifo_paths_;
+  std::vector<int> write_fds_;
+};
+
+TEST_F(TraceReaderPoolTest, ReadsAllCpus) {
+  std::string prefix = MakeDevice("sda");
+  auto handler = std::make_shared<RecordingTraceHandler>();
+  TraceReaderPool pool(2);
+
+  int device_id = pool.AddDevice(prefix, handler);
+  EXPECT_EQ((size_t)num_cpus_, pool.FileCount(device_id));
+
+  for (int cpu = 0; cpu < num_cpus_; ++cpu) {
+    for (int i = 0; i < 10; ++i) {
+      WriteTrace(write_fds_[cpu], cpu * 10 + i);
+    }
+  }
+  pool.FlushDevice(device_id);
+
+  auto sectors = handler->sectors();
+  ASSERT_EQ((size_t)num_cpus_ * 10, sectors.size());
+  for (size_t i = 0; i < sectors.size(); ++i) {
+    EXPECT_EQ(i, sectors[i]);
+  }
+}
+
+TEST_F(TraceReaderPoolTest, ReadsWithoutFlush) {
+  std::string prefix = MakeDevice("sda");
+  auto handler = std::make_shared<RecordingTraceHandler>();
+  TraceReaderPool pool(1);
+
+  pool.AddDevice(prefix, handler);
+  WriteTrace(write_fds_[0], 1);
+
+  for (int i = 0; i < 20 && handler->sectors().empty(); ++i) {
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(TraceReaderPool::DRAIN_MILLIS));
+  }
+  ASSERT_EQ(1UL, handler->sectors().size());
+  EXPECT_EQ(1UL, handler->sectors()[0]);
+}
+
+TEST_F(TraceReaderPoolTest, ReadersArePinned) {
+  std::string prefix = MakeDevice("sda");
+  auto handler = std::make_shared<AffinityTraceHandler>();
+  TraceReaderPool pool(1, std::vector<int>({0}));
+
+  pool.AddDevice(prefix, handler);
+  WriteTrace(write_fds_[0], 1);
+
+  // Not flushed, so the reader thread calls the handler
+  for (int i = 0; i < 20 && handler->num_traces() == 0; ++i) {
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(TraceReaderPool::DRAIN_MILLIS));
+  }
+  ASSERT_EQ(1, handler->num_traces());
+  EXPECT_EQ(1, handler->cpu_count());
+  EXPECT_TRUE(handler->on_cpu0());
+}
+
+TEST_F(TraceReaderPoolTest, DevicesAreSeparate) {
+  std::string prefix_a = MakeDevice("sda");
+  std::string prefix_b = MakeDevice("sdb");
+  auto handler_a = std::make_shared<RecordingTraceHandler>();
+  auto handler_b = std::make_shared<RecordingTraceHandler>();
+  TraceReaderPool pool(1);
+
+  int id_a = pool.AddDevice(prefix_a, handler_a);
+  int id_b = pool.AddDevice(prefix_b, handler_b);
+  EXPECT_NE(id_a, id_b);
+
+  WriteTrace(write_fds_[0], 1);
+  WriteTrace(write_fds_[num_cpus_], 2);
+  pool.FlushDevice(id_a);
+  pool.FlushDevice(id_b);
+
+  ASSERT_EQ(1UL, handler_a->sectors().size());
+  EXPECT_EQ(1UL, handler_a->sectors()[0]);
+  ASSERT_EQ(1UL, handler_b->sectors().size());
+  EXPECT_EQ(2UL, handler_b->sectors()[0]);
+}
+
+TEST_F(TraceReaderPoolTest, NoTracesAfterRemove) {
+  std::string prefix = MakeDevice("sda");
+  auto handler = std::make_shared<RecordingTraceHandler>();
+  TraceReaderPool pool(2);
+
+  int device_id = pool.AddDevice(prefix, handler);
+  pool.RemoveDevice(device_id);
+  EXPECT_EQ(0UL, pool.FileCount(device_id));
+
+  WriteTrace(write_fds_[0], 1);
+  pool.FlushDevice(device_id);
+  EXPECT_TRUE(handler->sectors().empty());
+}
+
+TEST_F(TraceReaderPoolTest, NoTraceFiles) {
+  auto handler = std::make_shared<RecordingTraceHandler>();
+  TraceReaderPool pool(1);
+
+  EXPECT_THROW(pool.AddDevice(dir_ + "/missing", handler),
+               BlockTraceException);
+}
+
+} // namespace
@@ -0,0 +1,212 @@
+#include "tracing/synthetic_trace_source.h"
+#include "tracing/trace_recorder.h"
+#include "tracing/trace_replayer.h"
+#include "tracing/block_trace_exception.h"
+#include "tracing/trace_handler.h"
+#include "unsynced_sector_manager/interval_unsynced_sector_store.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::BlockTraceException;
+using ::datto_linux_client::IntervalUnsyncedSectorStore;
+using ::datto_linux_client::SyntheticPattern;
+using ::datto_linux_client::SyntheticTraceOptions;
+using ::datto_linux_client::SyntheticTraceSource;
+using ::datto_linux_client::TraceFileSource;
+using ::datto_linux_client::TraceHandler;
+using ::datto_linux_client::TraceRecorder;
+using ::datto_linux_client::TraceReplayer;
+
+class CapturingTraceHandler : public TraceHandler {
+ public:
+  CapturingTraceHandler() : flush_count(0) {}
+
+  virtual void AddTrace(const struct blk_io_trace &trace_data) {
+    traces.push_back(trace_data);
+  }
+
+  virtual void Flush() {
+    flush_count++;
+  }
+
+  std::vector<struct blk_io_trace> traces;
+  int flush_count;
+};
+
+SyntheticTraceOptions MakeOptions(SyntheticPattern pattern) {
+  SyntheticTraceOptions options;
+  options.pattern = pattern;
+  options.device_sectors = 1024 * 1024;
+  options.write_sectors = 8;
+  options.num_writes = 10000;
+  options.writes_per_second = 1000;
+  options.num_cpus = 4;
+  return options;
+}
+
+class TraceReplayTest : public ::testing::Test {
+ protected:
+  TraceReplayTest() {
+    char path_template[] = "/tmp/trace_replay_test.XXXXXX";
+    int fd = mkstemp(path_template);
+    close(fd);
+    recording_path_ = path_template;
+  }
+
+  ~TraceReplayTest() {
+    unlink(recording_path_.c_str());
+  }
+
+  std::string recording_path_;
+};
+
+TEST_F(TraceReplayTest, Sequential) {
+  auto handler = std::make_shared<CapturingTraceHandler>();
+  SyntheticTraceSource source(MakeOptions(
+      datto_linux_client::SEQUENTIAL_WRITES));
+  TraceReplayer replayer(handler);
+
+  EXPECT_EQ(10000UL,
+            replayer.Replay(&source, TraceReplayer::AS_FAST_AS_POSSIBLE));
+  ASSERT_EQ(10000UL, handler->traces.size());
+  EXPECT_EQ(1, handler->flush_count);
+  for (size_t i = 0; i < handler->traces.size(); ++i) {
+    EXPECT_EQ(i * 8, handler->traces[i].sector);
+    EXPECT_EQ(4096U, handler->traces[i].bytes);
+    EXPECT_EQ(i % 4, handler->traces[i].cpu);
+    EXPECT_EQ(i * 1000000, handler->traces[i].time);
+  }
+}
+
+TEST_F(TraceReplayTest, SameSeedSameStream) {
+  auto options = MakeOptions(datto_linux_client::UNIFORM_RANDOM_WRITES);
+  SyntheticTraceSource first(options);
+  SyntheticTraceSource second(options);
+
+  struct blk_io_trace first_trace;
+  struct blk_io_trace second_trace;
+  while (first.NextTrace(&first_trace)) {
+    ASSERT_TRUE(second.NextTrace(&second_trace));
+    EXPECT_EQ(first_trace.sector, second_trace.sector);
+    EXPECT_LT(first_trace.sector, options.device_sectors);
+    EXPECT_EQ(0U, first_trace.sector % options.write_sectors);
+  }
+  EXPECT_FALSE(second.NextTrace(&second_trace));
+}
+
+TEST_F(TraceReplayTest, ZipfianIsSkewed) {
+  auto handler = std::make_shared<CapturingTraceHandler>();
+  SyntheticTraceSource source(MakeOptions(
+      datto_linux_client::ZIPFIAN_WRITES));
+  TraceReplayer(handler).Replay(&source, TraceReplayer::AS_FAST_AS_POSSIBLE);
+
+  std::map<uint64_t, int> writes_per_sector;
+  for (const auto &trace : handler->traces) {
+    writes_per_sector[trace.sector]++;
+  }
+  // Uniform would be well under one write per block
+  EXPECT_GT(writes_per_sector[0], 500);
+  EXPECT_GT(writes_per_sector[0], writes_per_sector[8]);
+  EXPECT_LT(writes_per_sector.size(), 10000UL / 2);
+}
+
+TEST_F(TraceReplayTest, BurstyKeepsAverageRate) {
+  auto options = MakeOptions(datto_linux_client::BURSTY_WRITES);
+  options.burst_writes = 100;
+  SyntheticTraceSource source(options);
+
+  struct blk_io_trace trace;
+  struct blk_io_trace previous;
+  ASSERT_TRUE(source.NextTrace(&previous));
+  uint64_t first_time = previous.time;
+  while (source.NextTrace(&trace)) {
+    uint64_t gap = trace.time - previous.time;
+    // Within a burst writes come 10x faster than the average
+    EXPECT_TRUE(gap == 100000 || gap > 1000000) << gap;
+    previous = trace;
+  }
+  // 10000 writes at 1000 per second
+  EXPECT_NEAR(10.0, (previous.time - first_time) / 1e9, 0.2);
+}
+
+TEST_F(TraceReplayTest, BadOptions) {
+  auto options = MakeOptions(datto_linux_client::ZIPFIAN_WRITES);
+  options.zipf_theta = 1.0;
+  EXPECT_THROW(SyntheticTraceSource source(options), BlockTraceException);
+
+  options = MakeOptions(datto_linux_client::SEQUENTIAL_WRITES);
+  options.device_sectors = 0;
+  EXPECT_THROW(SyntheticTraceSource source(options), BlockTraceException);
+}
+
+TEST_F(TraceReplayTest, RecordAndReplay) {
+  auto options = MakeOptions(datto_linux_client::UNIFORM_RANDOM_WRITES);
+  auto passed_on = std::make_shared<CapturingTraceHandler>();
+  {
+    auto recorder = std::make_shared<TraceRecorder>(recording_path_,
+                                                    passed_on);
+    SyntheticTraceSource source(options);
+    TraceReplayer(recorder).Replay(&source,
+                                   TraceReplayer::AS_FAST_AS_POSSIBLE);
+    EXPECT_EQ(options.num_writes, recorder->RecordCount());
+  }
+  ASSERT_EQ(options.num_writes, passed_on->traces.size());
+
+  auto replayed = std::make_shared<CapturingTraceHandler>();
+  TraceFileSource file_source(recording_path_);
+  TraceReplayer(replayed).Replay(&file_source,
+                                 TraceReplayer::AS_FAST_AS_POSSIBLE);
+
+  ASSERT_EQ(passed_on->traces.size(), replayed->traces.size());
+  for (size_t i = 0; i < replayed->traces.size(); ++i) {
+    EXPECT_EQ(passed_on->traces[i].time, replayed->traces[i].time);
+    EXPECT_EQ(passed_on->traces[i].sector, replayed->traces[i].sector);
+    EXPECT_EQ(passed_on->traces[i].bytes, replayed->traces[i].bytes);
+    EXPECT_EQ(passed_on->traces[i].action, replayed->traces[i].action);
+    EXPECT_EQ(passed_on->traces[i].cpu, replayed->traces[i].cpu);
+  }
+}
+
+TEST_F(TraceReplayTest, NotARecording) {
+  EXPECT_THROW(TraceFileSource source(recording_path_), BlockTraceException);
+}
+
+TEST_F(TraceReplayTest, ReplaySpeed) {
+  auto options = MakeOptions(datto_linux_client::SEQUENTIAL_WRITES);
+  // 100ms of writes
+  options.num_writes = 100;
+  auto handler = std::make_shared<CapturingTraceHandler>();
+
+  SyntheticTraceSource source(options);
+  auto start = std::chrono::steady_clock::now();
+  TraceReplayer(handler).Replay(&source, 2.0);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  EXPECT_GE(elapsed, std::chrono::milliseconds(45));
+  EXPECT_EQ(100UL, handler->traces.size());
+}
+
+TEST_F(TraceReplayTest, IntoStore) {
+  auto options = MakeOptions(datto_linux_client::SEQUENTIAL_WRITES);
+  options.num_writes = 1000;
+  auto store = std::make_shared<IntervalUnsyncedSectorStore>(10);
+  auto handler = std::make_shared<TraceHandler>(store);
+
+  SyntheticTraceSource source(options);
+  TraceReplayer(handler).Replay(&source, TraceReplayer::AS_FAST_AS_POSSIBLE);
+
+  EXPECT_EQ(8000UL, store->UnsyncedSectorCount());
+}
+
+} // namespace
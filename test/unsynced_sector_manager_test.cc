@@ -1,20 +1,37 @@
 #include "unsynced_sector_manager/unsynced_sector_manager.h"
 
+#include <fstream>
+#include <map>
 #include <memory>
+#include <stdlib.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
+#include "unsynced_sector_manager/bitmap_unsynced_sector_store.h"
 #include "unsynced_sector_manager/unsynced_sector_store.h"
 #include "unsynced_sector_manager/sector_interval.h"
+#include "unsynced_sector_manager/unsynced_tracking_exception.h"
+#include "tracing/block_trace_exception.h"
 #include "test/loop_device.h"
 
 namespace {
 
+using ::datto_linux_client::BitmapUnsyncedSectorStore;
 using ::datto_linux_client::BlockDevice;
+using ::datto_linux_client::BlockTraceException;
+using ::datto_linux_client::ChangeExportHeader;
+using ::datto_linux_client::ClaimedInterval;
 using ::datto_linux_client::DeviceTracer;
+using ::datto_linux_client::PartitionInfo;
+using ::datto_linux_client::RUN_LENGTH_EXPORT;
+using ::datto_linux_client::RelayBufferSettings;
+using ::datto_linux_client::TraceStatistics;
 using ::datto_linux_client::UnsyncedSectorManager;
 using ::datto_linux_client::UnsyncedSectorStore;
+using ::datto_linux_client::UnsyncedTrackingException;
 using ::datto_linux_client::SectorInterval;
 using ::datto_linux_client_test::LoopDevice;
 
@@ -37,6 +54,99 @@ class TestableUnsyncedSectorManager : public UnsyncedSectorManager {
   }
 };
 
+class NoopDeviceTracer : public DeviceTracer {
+ public:
+  NoopDeviceTracer() : dropped_traces(0) {}
+  ~NoopDeviceTracer() {}
+  virtual void FlushBuffers() {}
+  virtual uint64_t DroppedTraces() { return dropped_traces; }
+  virtual void CleanupBlockTrace() {}
+
+  uint64_t dropped_traces;
+};
+
+// Keeps the store the tracer would write to, so tests can write to it
+class CapturingUnsyncedSectorManager : public UnsyncedSectorManager {
+ public:
+  CapturingUnsyncedSectorManager()
+      : tracers_created(0),
+        era_trackers_created(0),
+        bpf_trackers_created(0),
+        era_available(true),
+        bpf_available(true) {}
+  ~CapturingUnsyncedSectorManager() {}
+
+  std::shared_ptr<UnsyncedSectorStore> traced_store;
+  std::shared_ptr<NoopDeviceTracer> tracer;
+  RelayBufferSettings last_relay_settings;
+  std::string last_traced_path;
+  int tracers_created;
+  int era_trackers_created;
+  int bpf_trackers_created;
+  // Makes CreateEraTracker throw, as for devices that aren't dm-era targets
+  bool era_available;
+  // Makes CreateBpfTracker throw, as on hosts without BPF
+  bool bpf_available;
+  // CreateDeviceTracer throws for this path
+  std::string untraceable_path;
+  // Devices that aren't in here aren't partitions
+  std::map<dev_t, PartitionInfo> partitions;
+
+ protected:
+  virtual std::shared_ptr<DeviceTracer> CreateDeviceTracer(
+      const std::string &path, std::shared_ptr<UnsyncedSectorStore> store,
+      const RelayBufferSettings &relay_settings) {
+    if (path == untraceable_path) {
+      throw BlockTraceException("Can't trace " + path);
+    }
+    traced_store = store;
+    tracer = std::make_shared<NoopDeviceTracer>();
+    last_relay_settings = relay_settings;
+    last_traced_path = path;
+    tracers_created++;
+    return tracer;
+  }
+
+  virtual std::shared_ptr<DeviceTracer> CreateEraTracker(
+      const BlockDevice &device, std::shared_ptr<UnsyncedSectorStore> store) {
+    if (!era_available) {
+      throw BlockTraceException("Not a dm-era target");
+    }
+    traced_store = store;
+    tracer = std::make_shared<NoopDeviceTracer>();
+    era_trackers_created++;
+    return tracer;
+  }
+
+  virtual std::shared_ptr<DeviceTracer> CreateBpfTracker(
+      const BlockDevice &device, std::shared_ptr<UnsyncedSectorStore> store) {
+    if (!bpf_available) {
+      throw BlockTraceException("BPF not available");
+    }
+    traced_store = store;
+    tracer = std::make_shared<NoopDeviceTracer>();
+    bpf_trackers_created++;
+    return tracer;
+  }
+
+  virtual bool GetPartitionInfo(const BlockDevice &device,
+                                PartitionInfo *const info) {
+    if (!partitions.count(device.dev_t())) {
+      return false;
+    }
+    *info = partitions.at(device.dev_t());
+    return true;
+  }
+};
+
+// Claims everything, as a successful sync would
+void SyncAll(std::shared_ptr<UnsyncedSectorStore> store) {
+  std::vector<ClaimedInterval> claimed;
+  do {
+    store->ClaimIntervals(&claimed, 100, 100000, time(NULL), false);
+  } while (!claimed.empty());
+}
+
 TEST(UnsyncedSectorManagerTest, Constructor) {
   TestableUnsyncedSectorManager manager;
 }
@@ -83,4 +193,341 @@ TEST(UnsyncedSectorManagerTest, store) {
   EXPECT_EQ(10UL, store->UnsyncedSectorCount());
 }
 
+TEST(UnsyncedSectorManagerTest, BitmapStore) {
+  TestableUnsyncedSectorManager manager;
+
+  LoopDevice loop_dev;
+  BlockDevice loop_block(loop_dev.path());
+
+  manager.SetStoreType(loop_block, UnsyncedSectorManager::BITMAP_STORE);
+  std::shared_ptr<UnsyncedSectorStore> store(manager.GetStore(loop_block));
+  EXPECT_NE(nullptr,
+            std::dynamic_pointer_cast<BitmapUnsyncedSectorStore>(store));
+
+  try {
+    manager.SetStoreType(loop_block, UnsyncedSectorManager::INTERVAL_STORE);
+    FAIL() << "Shouldn't be able to change the type of an existing store";
+  } catch (const std::runtime_error &e) {
+    // good
+  }
+}
+
+TEST(UnsyncedSectorManagerTest, DefaultStoreType) {
+  TestableUnsyncedSectorManager manager;
+
+  LoopDevice loop_dev;
+  BlockDevice loop_block(loop_dev.path());
+
+  manager.SetDefaultStoreType(UnsyncedSectorManager::BITMAP_STORE);
+  std::shared_ptr<UnsyncedSectorStore> store(manager.GetStore(loop_block));
+  EXPECT_NE(nullptr,
+            std::dynamic_pointer_cast<BitmapUnsyncedSectorStore>(store));
+}
+
+TEST(UnsyncedSectorManagerTest, DefaultMemoryBudget) {
+  TestableUnsyncedSectorManager manager;
+
+  LoopDevice loop_dev;
+  BlockDevice loop_block(loop_dev.path());
+
+  manager.SetDefaultMemoryBudget(100 * UnsyncedSectorStore::BYTES_PER_INTERVAL);
+  std::shared_ptr<UnsyncedSectorStore> store(manager.GetStore(loop_block));
+  for (uint64_t i = 0; i < 1000; i++) {
+    store->AddNonVolatileInterval(SectorInterval(i * 2, i * 2 + 1));
+  }
+  EXPECT_LT(1UL, store->GetStatistics().granularity_sectors);
+}
+
+// Entry count of an export, or UINT64_MAX if it can't be read
+uint64_t ExportEntryCount(const std::string &path) {
+  std::ifstream export_file(path, std::ios::binary);
+  ChangeExportHeader header;
+  if (!export_file.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+    return UINT64_MAX;
+  }
+  return header.entry_count;
+}
+
+TEST(UnsyncedSectorManagerTest, ExportAllChanges) {
+  CapturingUnsyncedSectorManager manager;
+
+  LoopDevice loop_dev;
+  BlockDevice loop_block(loop_dev.path());
+  char dir_template[] = "/tmp/unsynced_sector_manager_test_XXXXXX";
+  std::string dir = mkdtemp(dir_template);
+  std::string name = loop_dev.path().substr(loop_dev.path().rfind('/') + 1);
+  std::string path = dir + "/" + name + ".changes";
+
+  EXPECT_THROW(manager.ExportAllChanges(), UnsyncedTrackingException);
+
+  manager.SetChangeExportDir(dir, RUN_LENGTH_EXPORT);
+  manager.StartTracer(loop_block);
+  manager.traced_store->AddInterval(SectorInterval(0, 10), time(NULL));
+  manager.traced_store->AddInterval(SectorInterval(20, 30), time(NULL));
+
+  manager.ExportAllChanges();
+  EXPECT_EQ(2UL, ExportEntryCount(path));
+
+  // Only what changed since the last export
+  manager.traced_store->AddInterval(SectorInterval(40, 50), time(NULL));
+  manager.ExportAllChanges();
+  EXPECT_EQ(1UL, ExportEntryCount(path));
+
+  unlink(path.c_str());
+  rmdir(dir.c_str());
+}
+
+TEST(UnsyncedSectorManagerTest, Generations) {
+  CapturingUnsyncedSectorManager manager;
+
+  LoopDevice loop_dev;
+  BlockDevice loop_block(loop_dev.path());
+
+  manager.StartTracer(loop_block);
+  EXPECT_FALSE(manager.HasGeneration(loop_block, "a"));
+
+  auto store_a = manager.GetStore(loop_block, "a");
+  auto store_b = manager.GetStore(loop_block, "b");
+  EXPECT_NE(store_a, store_b);
+  EXPECT_EQ(store_a, manager.GetStore(loop_block, "a"));
+
+  manager.traced_store->AddInterval(SectorInterval(0, 10), time(NULL));
+  EXPECT_EQ(10UL, store_a->UnsyncedSectorCount());
+  EXPECT_EQ(10UL, store_b->UnsyncedSectorCount());
+  // The device's own store isn't fed until something asks for it
+  EXPECT_EQ(0UL, manager.GetStore(loop_block)->UnsyncedSectorCount());
+  manager.traced_store->AddInterval(SectorInterval(10, 20), time(NULL));
+  EXPECT_EQ(10UL, manager.GetStore(loop_block)->UnsyncedSectorCount());
+
+  SyncAll(store_a);
+  SyncAll(store_b);
+  manager.CommitGeneration(loop_block, "a");
+  manager.CommitGeneration(loop_block, "b");
+  EXPECT_TRUE(manager.HasGeneration(loop_block, "a"));
+  EXPECT_TRUE(manager.HasGeneration(loop_block, "b"));
+
+  // Only a is backed up after this write
+  manager.traced_store->AddInterval(SectorInterval(100, 110), time(NULL));
+  store_a = manager.GetStore(loop_block, "a");
+  EXPECT_EQ(10UL, store_a->UnsyncedSectorCount());
+  SyncAll(store_a);
+  manager.CommitGeneration(loop_block, "a");
+
+  manager.traced_store->AddInterval(SectorInterval(200, 210), time(NULL));
+  EXPECT_EQ(10UL, manager.GetStore(loop_block, "a")->UnsyncedSectorCount());
+  store_b = manager.GetStore(loop_block, "b");
+  EXPECT_EQ(20UL, store_b->UnsyncedSectorCount());
+
+  // A failed backup leaves the generation as it was
+  SyncAll(store_b);
+  manager.AbandonGeneration(loop_block, "b");
+  EXPECT_EQ(20UL, manager.GetStore(loop_block, "b")->UnsyncedSectorCount());
+
+  manager.StopTracer(loop_block);
+  EXPECT_FALSE(manager.HasGeneration(loop_block, "a"));
+  EXPECT_FALSE(manager.HasGeneration(loop_block, "b"));
+}
+
+TEST(UnsyncedSectorManagerTest, CommitKeepsUnsynced) {
+  CapturingUnsyncedSectorManager manager;
+
+  LoopDevice loop_dev;
+  BlockDevice loop_block(loop_dev.path());
+
+  manager.StartTracer(loop_block);
+  auto store = manager.GetStore(loop_block, "a");
+  // Written after the sync finished, but before the backup was committed
+  manager.traced_store->AddInterval(SectorInterval(0, 10), time(NULL));
+  manager.CommitGeneration(loop_block, "a");
+
+  EXPECT_EQ(10UL, manager.GetStore(loop_block, "a")->UnsyncedSectorCount());
+}
+
+TEST(UnsyncedSectorManagerTest, DroppedTracesNeedResync) {
+  CapturingUnsyncedSectorManager manager;
+
+  LoopDevice loop_dev;
+  BlockDevice loop_block(loop_dev.path());
+
+  manager.StartTracer(loop_block);
+  manager.GetStore(loop_block, "a");
+  manager.CommitGeneration(loop_block, "a");
+  EXPECT_TRUE(manager.HasGeneration(loop_block, "a"));
+  EXPECT_FALSE(manager.NeedsResync(loop_block));
+
+  manager.tracer->dropped_traces = 5;
+  manager.FlushTracer(loop_block);
+  EXPECT_TRUE(manager.NeedsResync(loop_block));
+  EXPECT_FALSE(manager.HasGeneration(loop_block, "a"));
+
+  // A backup that was running when traces were dropped isn't committed
+  manager.GetStore(loop_block, "a");
+  EXPECT_THROW(manager.CommitGeneration(loop_block, "a"),
+               UnsyncedTrackingException);
+  EXPECT_FALSE(manager.HasGeneration(loop_block, "a"));
+
+  TraceStatistics stats = manager.GetTraceStatistics(loop_block);
+  EXPECT_EQ(5UL, stats.dropped_traces);
+  EXPECT_EQ(1UL, stats.resync_count);
+  EXPECT_TRUE(stats.needs_resync);
+  EXPECT_GT(stats.relay_buffer_bytes, DeviceTracer::DEFAULT_BUFFER_BYTES);
+
+  // The restarted tracer gets the larger buffers
+  manager.StopTracer(loop_block);
+  manager.StartTracer(loop_block);
+  EXPECT_FALSE(manager.NeedsResync(loop_block));
+  EXPECT_EQ(stats.relay_buffer_bytes, manager.last_relay_settings.buffer_bytes);
+
+  stats = manager.GetTraceStatistics(loop_block);
+  EXPECT_EQ(0UL, stats.dropped_traces);
+  EXPECT_EQ(5UL, stats.total_dropped_traces);
+}
+
+TEST(UnsyncedSectorManagerTest, WholeDiskTracing) {
+  CapturingUnsyncedSectorManager manager;
+  manager.SetTraceWholeDisk(true);
+
+  LoopDevice loop_dev_a;
+  LoopDevice loop_dev_b;
+  BlockDevice loop_block_a(loop_dev_a.path());
+  BlockDevice loop_block_b(loop_dev_b.path());
+  manager.partitions[loop_block_a.dev_t()] =
+      {"/dev/disk", makedev(250, 0), 2048, 1000};
+  manager.partitions[loop_block_b.dev_t()] =
+      {"/dev/disk", makedev(250, 0), 4096, 1000};
+
+  manager.StartTracer(loop_block_a);
+  manager.StartTracer(loop_block_b);
+  manager.GetStore(loop_block_a);
+  manager.GetStore(loop_block_b);
+  EXPECT_EQ(1, manager.tracers_created);
+  EXPECT_EQ("/dev/disk", manager.last_traced_path);
+
+  // Disk sectors are routed to each partition's own sectors
+  manager.traced_store->AddInterval(SectorInterval(2058, 4116), time(NULL));
+  EXPECT_EQ(990UL, manager.GetStore(loop_block_a)->UnsyncedSectorCount());
+  EXPECT_EQ(20UL, manager.GetStore(loop_block_b)->UnsyncedSectorCount());
+
+  SectorInterval output;
+  manager.GetStore(loop_block_b)->GetInterval(&output, time(NULL));
+  EXPECT_EQ(SectorInterval(0, 20), output);
+
+  // The disk stays traced for the other partition
+  manager.StopTracer(loop_block_a);
+  EXPECT_TRUE(manager.IsTracing(loop_block_b));
+  manager.traced_store->AddInterval(SectorInterval(4096, 4106), time(NULL));
+  EXPECT_EQ(990UL, manager.GetStore(loop_block_a)->UnsyncedSectorCount());
+
+  // Once no partition is traced, the next one starts a new tracer
+  manager.StopTracer(loop_block_b);
+  manager.StartTracer(loop_block_a);
+  EXPECT_EQ(2, manager.tracers_created);
+}
+
+TEST(UnsyncedSectorManagerTest, WholeDiskTracingFallsBack) {
+  CapturingUnsyncedSectorManager manager;
+  manager.SetTraceWholeDisk(true);
+  manager.untraceable_path = "/dev/disk";
+
+  LoopDevice loop_dev;
+  BlockDevice loop_block(loop_dev.path());
+  manager.partitions[loop_block.dev_t()] =
+      {"/dev/disk", makedev(250, 0), 2048, 1000};
+
+  manager.StartTracer(loop_block);
+  EXPECT_TRUE(manager.IsTracing(loop_block));
+  EXPECT_EQ(1, manager.tracers_created);
+  EXPECT_EQ(loop_dev.path(), manager.last_traced_path);
+}
+
+TEST(UnsyncedSectorManagerTest, EraBackend) {
+  CapturingUnsyncedSectorManager manager;
+
+  LoopDevice loop_dev;
+  BlockDevice loop_block(loop_dev.path());
+
+  manager.SetTraceBackend(loop_block, UnsyncedSectorManager::DM_ERA_BACKEND);
+  manager.StartTracer(loop_block);
+  manager.GetStore(loop_block);
+  EXPECT_EQ(1, manager.era_trackers_created);
+  EXPECT_EQ(0, manager.tracers_created);
+
+  manager.traced_store->AddInterval(SectorInterval(0, 8), time(NULL));
+  EXPECT_EQ(8UL, manager.GetStore(loop_block)->UnsyncedSectorCount());
+
+  manager.StopTracer(loop_block);
+  manager.SetTraceBackend(loop_block,
+                          UnsyncedSectorManager::BLKTRACE_BACKEND);
+  manager.StartTracer(loop_block);
+  EXPECT_EQ(1, manager.tracers_created);
+}
+
+TEST(UnsyncedSectorManagerTest, BpfBackend) {
+  CapturingUnsyncedSectorManager manager;
+
+  LoopDevice loop_dev;
+  BlockDevice loop_block(loop_dev.path());
+
+  manager.SetTraceBackend(loop_block, UnsyncedSectorManager::BPF_BACKEND);
+  manager.StartTracer(loop_block);
+  manager.GetStore(loop_block);
+  EXPECT_EQ(1, manager.bpf_trackers_created);
+  EXPECT_EQ(0, manager.tracers_created);
+
+  manager.traced_store->AddInterval(SectorInterval(0, 8), time(NULL));
+  EXPECT_EQ(8UL, manager.GetStore(loop_block)->UnsyncedSectorCount());
+  manager.StopTracer(loop_block);
+
+  // Falls back to blktrace
+  manager.bpf_available = false;
+  manager.StartTracer(loop_block);
+  EXPECT_EQ(1, manager.bpf_trackers_created);
+  EXPECT_EQ(1, manager.tracers_created);
+}
+
+TEST(UnsyncedSectorManagerTest, AutoBackend) {
+  CapturingUnsyncedSectorManager manager;
+
+  LoopDevice loop_dev;
+  BlockDevice loop_block(loop_dev.path());
+
+  manager.SetDefaultTraceBackend(UnsyncedSectorManager::AUTO_BACKEND);
+  manager.StartTracer(loop_block);
+  EXPECT_EQ(1, manager.era_trackers_created);
+  EXPECT_EQ(0, manager.bpf_trackers_created);
+  manager.StopTracer(loop_block);
+
+  // Not a dm-era target
+  manager.era_available = false;
+  manager.StartTracer(loop_block);
+  EXPECT_EQ(1, manager.era_trackers_created);
+  EXPECT_EQ(1, manager.bpf_trackers_created);
+  EXPECT_EQ(0, manager.tracers_created);
+  manager.StopTracer(loop_block);
+
+  manager.bpf_available = false;
+  manager.StartTracer(loop_block);
+  EXPECT_EQ(1, manager.tracers_created);
+  manager.StopTracer(loop_block);
+
+  // A backend set for the device wins over the default
+  manager.SetTraceBackend(loop_block, UnsyncedSectorManager::BLKTRACE_BACKEND);
+  manager.era_available = true;
+  manager.StartTracer(loop_block);
+  EXPECT_EQ(1, manager.era_trackers_created);
+  EXPECT_EQ(2, manager.tracers_created);
+}
+
+TEST(UnsyncedSectorManagerTest, GrowRelaySettings) {
+  RelayBufferSettings settings = DeviceTracer::DefaultRelaySettings();
+  for (int i = 0; i < 20; ++i) {
+    RelayBufferSettings grown = DeviceTracer::GrowRelaySettings(settings);
+    EXPECT_GE(grown.buffer_bytes, settings.buffer_bytes);
+    EXPECT_GE(grown.num_buffers, settings.num_buffers);
+    settings = grown;
+  }
+  EXPECT_EQ(DeviceTracer::MAX_BUFFER_BYTES, settings.buffer_bytes);
+  EXPECT_EQ(DeviceTracer::MAX_NUM_BUFFERS, settings.num_buffers);
+}
+
 } // namespace
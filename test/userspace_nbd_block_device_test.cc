@@ -0,0 +1,76 @@
+#include "block_device/userspace_nbd_block_device.h"
+#include "block_device/block_device_exception.h"
+#include "block_device/nbd_server.h"
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::BlockDeviceException;
+using ::datto_linux_client::NbdServer;
+using ::datto_linux_client::UserspaceNbdBlockDevice;
+
+const uint64_t EXPORT_BYTES = 1024 * 1024;
+
+// Reconnects without waiting between attempts
+class NoWaitUserspaceNbdBlockDevice : public UserspaceNbdBlockDevice {
+ public:
+  NoWaitUserspaceNbdBlockDevice(const std::string &host, uint16_t port)
+      : UserspaceNbdBlockDevice(host, port),
+        num_waits(0) {}
+
+  int num_waits;
+
+ protected:
+  void WaitToReconnect(int seconds) {
+    num_waits++;
+  }
+};
+
+TEST(UserspaceNbdBlockDeviceTest, Reconnect) {
+  NbdServer server(EXPORT_BYTES);
+  UserspaceNbdBlockDevice device("localhost", server.port());
+  EXPECT_EQ(EXPORT_BYTES, device.DeviceSizeBytes());
+
+  std::vector<char> buf(4096, 'x');
+  device.connection()->Write(buf.data(), buf.size(), 0);
+
+  server.DropConnections();
+  EXPECT_ANY_THROW(device.connection()->Write(buf.data(), buf.size(), 0));
+  EXPECT_FALSE(device.IsConnected());
+
+  device.Reconnect();
+  EXPECT_TRUE(device.IsConnected());
+  EXPECT_EQ(1, device.reconnect_count());
+
+  std::vector<char> read_buf(buf.size());
+  device.connection()->Read(read_buf.data(), read_buf.size(), 0);
+  EXPECT_EQ(buf, read_buf);
+  EXPECT_EQ(2U, server.GetStatistics().connections);
+}
+
+TEST(UserspaceNbdBlockDeviceTest, ReconnectGivesUp) {
+  std::unique_ptr<NbdServer> server(new NbdServer(EXPORT_BYTES));
+  NoWaitUserspaceNbdBlockDevice device("localhost", server->port());
+  server.reset();
+
+  EXPECT_THROW(device.Reconnect(), BlockDeviceException);
+  EXPECT_EQ(UserspaceNbdBlockDevice::MAX_RECONNECT_ATTEMPTS - 1,
+            device.num_waits);
+  EXPECT_EQ(0, device.reconnect_count());
+}
+
+TEST(UserspaceNbdBlockDeviceTest, CantReconnectWithoutAddress) {
+  NbdServer server(EXPORT_BYTES);
+  UserspaceNbdBlockDevice connected("localhost", server.port());
+  UserspaceNbdBlockDevice device(connected.connection());
+
+  EXPECT_THROW(device.Reconnect(), BlockDeviceException);
+}
+
+} // namespace
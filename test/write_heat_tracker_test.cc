@@ -0,0 +1,62 @@
+#include "unsynced_sector_manager/write_heat_tracker.h"
+#include "unsynced_sector_manager/sector_interval.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::datto_linux_client::SectorInterval;
+using ::datto_linux_client::WriteHeatTracker;
+
+const uint64_t REGION = WriteHeatTracker::REGION_SECTORS;
+
+TEST(WriteHeatTrackerTest, DefaultConstructor) {
+  WriteHeatTracker heat;
+  EXPECT_FALSE(heat.IsHot(SectorInterval(0, 100), 1000));
+  EXPECT_EQ(0, heat.AverageRewriteSeconds());
+}
+
+TEST(WriteHeatTrackerTest, RewritesMakeRegionHot) {
+  WriteHeatTracker heat;
+  for (uint32_t i = 0; i < WriteHeatTracker::HOT_WRITE_COUNT; ++i) {
+    EXPECT_FALSE(heat.IsHot(SectorInterval(0, 8), 1000 + i));
+    heat.AddWrite(SectorInterval(0, 8), 1000 + i);
+  }
+  EXPECT_TRUE(heat.IsHot(SectorInterval(0, 8), 1010));
+  // Anything overlapping the region is hot
+  EXPECT_TRUE(heat.IsHot(SectorInterval(REGION - 1, REGION * 4), 1010));
+  EXPECT_FALSE(heat.IsHot(SectorInterval(REGION, REGION * 4), 1010));
+  EXPECT_EQ(1, heat.AverageRewriteSeconds());
+}
+
+TEST(WriteHeatTrackerTest, SameSecondIsOneWrite) {
+  WriteHeatTracker heat;
+  for (uint32_t i = 0; i < WriteHeatTracker::HOT_WRITE_COUNT * 4; ++i) {
+    heat.AddWrite(SectorInterval(i * 8, i * 8 + 8), 1000);
+  }
+  EXPECT_FALSE(heat.IsHot(SectorInterval(0, REGION), 1000));
+  EXPECT_EQ(0, heat.AverageRewriteSeconds());
+}
+
+TEST(WriteHeatTrackerTest, HeatDecays) {
+  WriteHeatTracker heat;
+  for (uint32_t i = 0; i < WriteHeatTracker::HOT_WRITE_COUNT; ++i) {
+    heat.AddWrite(SectorInterval(0, 8), 1000 + i);
+  }
+  time_t later = 1000 + WriteHeatTracker::HALF_LIFE_SECONDS * 2;
+  EXPECT_FALSE(heat.IsHot(SectorInterval(0, 8), later));
+}
+
+TEST(WriteHeatTrackerTest, ClearTest) {
+  WriteHeatTracker heat;
+  for (uint32_t i = 0; i < WriteHeatTracker::HOT_WRITE_COUNT; ++i) {
+    heat.AddWrite(SectorInterval(0, 8), 1000 + i * 5);
+  }
+  EXPECT_EQ(5, heat.AverageRewriteSeconds());
+
+  heat.Clear();
+  EXPECT_FALSE(heat.IsHot(SectorInterval(0, 8), 1100));
+  EXPECT_EQ(0, heat.AverageRewriteSeconds());
+}
+
+} // namespace
@@ -0,0 +1,474 @@
+#include "tracing/bpf_dirty_tracker.h"
+
+#include <linux/bpf.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include <glog/logging.h>
+
+#include "block_device/partition_info.h"
+#include "tracing/block_trace_exception.h"
+
+namespace {
+
+using ::datto_linux_client::BlockTraceException;
+
+const char *const TRACEPOINT_PATHS[] = {
+  "/sys/kernel/tracing/events/block/block_bio_queue/",
+  "/sys/kernel/debug/tracing/events/block/block_bio_queue/"
+};
+
+// Used when the queue's largest request can't be read
+const uint64_t DEFAULT_MAX_SECTORS_KB = 1280;
+
+const size_t VERIFIER_LOG_BYTES = 64 * 1024;
+
+std::string ReadFile(const std::string &path) {
+  std::ifstream file(path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  return file ? contents.str() : std::string();
+}
+
+// Devices as the kernel encodes them in traces
+uint64_t KernelDev(::dev_t device) {
+  return (static_cast<uint64_t>(major(device)) << 20) | minor(device);
+}
+
+int Log2(uint64_t value) {
+  int log = 0;
+  while (value >>= 1) {
+    log++;
+  }
+  return log;
+}
+
+long Bpf(int command, union bpf_attr *attr) {
+  return syscall(__NR_bpf, command, attr, sizeof(*attr));
+}
+
+int CreateArrayMap(uint32_t value_size, uint32_t max_entries,
+                   uint32_t flags) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_ARRAY;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = value_size;
+  attr.max_entries = max_entries;
+  attr.map_flags = flags;
+  int fd = Bpf(BPF_MAP_CREATE, &attr);
+  if (fd < 0) {
+    PLOG(WARNING) << "Unable to create BPF map";
+    throw BlockTraceException("Unable to create BPF map");
+  }
+  return fd;
+}
+
+// Builds a BPF program, resolving jumps to named labels
+class BpfAssembler {
+ public:
+  void Emit(uint8_t code, uint8_t dst, uint8_t src, int16_t off,
+            int32_t imm) {
+    struct bpf_insn insn;
+    memset(&insn, 0, sizeof(insn));
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+    insns_.push_back(insn);
+  }
+
+  void Jump(uint8_t code, uint8_t dst, uint8_t src, int32_t imm,
+            const std::string &label) {
+    fixups_.push_back(std::make_pair(insns_.size(), label));
+    Emit(BPF_JMP | code, dst, src, 0, imm);
+  }
+
+  void Label(const std::string &label) {
+    labels_[label] = insns_.size();
+  }
+
+  // Takes two instructions
+  void LoadImm64(uint8_t dst, uint8_t src, uint64_t imm) {
+    Emit(BPF_LD | BPF_IMM | BPF_DW, dst, src, 0,
+         static_cast<int32_t>(imm & 0xffffffff));
+    Emit(0, 0, 0, 0, static_cast<int32_t>(imm >> 32));
+  }
+
+  std::vector<struct bpf_insn> Finish() {
+    for (const auto &fixup : fixups_) {
+      insns_[fixup.first].off = labels_.at(fixup.second) - fixup.first - 1;
+    }
+    return insns_;
+  }
+
+ private:
+  std::vector<struct bpf_insn> insns_;
+  std::vector<std::pair<size_t, std::string>> fixups_;
+  std::map<std::string, size_t> labels_;
+};
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+const uint64_t BpfDirtyTracker::MAX_BLOCKS_PER_WRITE;
+const uint32_t BpfDirtyTracker::BLOCKS_PER_ELEMENT;
+const uint64_t BpfDirtyTracker::MIN_BLOCK_SECTORS;
+
+BpfDirtyTracker::BpfDirtyTracker(::dev_t device, uint64_t device_size_bytes,
+                                 std::shared_ptr<UnsyncedSectorStore> store)
+    : store_(store),
+      device_sectors_(device_size_bytes / 512),
+      block_sectors_(MIN_BLOCK_SECTORS),
+      num_blocks_(0),
+      bytemap_fd_(-1),
+      overflow_fd_(-1),
+      program_fd_(-1),
+      perf_fds_(),
+      bytemap_(nullptr),
+      bytemap_bytes_(0),
+      flush_mutex_() {
+  std::string tracepoint_path;
+  std::string format;
+  for (const char *path : TRACEPOINT_PATHS) {
+    format = ReadFile(std::string(path) + "format");
+    if (!format.empty()) {
+      tracepoint_path = path;
+      break;
+    }
+  }
+  if (format.empty()) {
+    LOG(WARNING) << "The block_bio_queue tracepoint isn't available";
+    throw BlockTraceException("Tracepoint not available");
+  }
+  int tracepoint_id = atoi(ReadFile(tracepoint_path + "id").c_str());
+
+  // Traces have sectors of the whole disk, and depending on the kernel
+  // the device of either the partition or the disk
+  PartitionInfo partition;
+  partition.disk_dev_t = device;
+  partition.start_sector = 0;
+  partition.num_sectors = device_sectors_;
+  ReadPartitionInfo(device, &partition);
+
+  std::ostringstream max_sectors_path;
+  max_sectors_path << "/sys/dev/block/" << major(partition.disk_dev_t) << ":"
+                   << minor(partition.disk_dev_t) << "/queue/max_sectors_kb";
+  uint64_t max_sectors_kb = atoll(ReadFile(max_sectors_path.str()).c_str());
+  if (!max_sectors_kb) {
+    max_sectors_kb = DEFAULT_MAX_SECTORS_KB;
+  }
+  // A request not starting on a block boundary touches one more block
+  uint64_t max_sectors = max_sectors_kb * 2;
+  while (block_sectors_ * (MAX_BLOCKS_PER_WRITE - 1) < max_sectors) {
+    block_sectors_ *= 2;
+  }
+  num_blocks_ = (device_sectors_ + block_sectors_ - 1) / block_sectors_;
+
+  try {
+    uint32_t num_elements =
+        (num_blocks_ + BLOCKS_PER_ELEMENT - 1) / BLOCKS_PER_ELEMENT;
+    bytemap_fd_ = CreateArrayMap(BLOCKS_PER_ELEMENT, num_elements,
+                                 BPF_F_MMAPABLE);
+    overflow_fd_ = CreateArrayMap(sizeof(uint64_t), 1, 0);
+
+    bytemap_bytes_ = static_cast<size_t>(num_elements) * BLOCKS_PER_ELEMENT;
+    void *mapped = mmap(nullptr, bytemap_bytes_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, bytemap_fd_, 0);
+    if (mapped == MAP_FAILED) {
+      PLOG(WARNING) << "Unable to map BPF bytemap";
+      throw BlockTraceException("Unable to map BPF bytemap");
+    }
+    bytemap_ = static_cast<uint8_t *>(mapped);
+
+    LoadProgram(device, partition.disk_dev_t, partition.start_sector,
+                partition.start_sector + device_sectors_,
+                Log2(block_sectors_), format);
+    Attach(tracepoint_id);
+  } catch (...) {
+    Cleanup();
+    throw;
+  }
+
+  LOG(INFO) << "Tracking writes with BPF in " << num_blocks_ << " blocks of "
+            << block_sectors_ << " sectors";
+}
+
+void BpfDirtyTracker::LoadProgram(::dev_t device, ::dev_t disk,
+                                  uint64_t start_sector, uint64_t end_sector,
+                                  int block_shift,
+                                  const std::string &format) {
+  uint32_t dev_offset, sector_offset, nr_sector_offset, rwbs_offset;
+  if (!ParseFieldOffset(format, "dev", &dev_offset) ||
+      !ParseFieldOffset(format, "sector", &sector_offset) ||
+      !ParseFieldOffset(format, "nr_sector", &nr_sector_offset) ||
+      !ParseFieldOffset(format, "rwbs", &rwbs_offset)) {
+    LOG(WARNING) << "Unexpected block_bio_queue format";
+    throw BlockTraceException("Unexpected tracepoint format");
+  }
+  const int element_shift = Log2(BLOCKS_PER_ELEMENT);
+
+  // r6 is the trace, r7 the block being marked and r8 the last block
+  BpfAssembler bpf;
+  bpf.Emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+
+  // Only this device
+  bpf.Emit(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_6, dev_offset, 0);
+  bpf.LoadImm64(BPF_REG_1, 0, KernelDev(device));
+  bpf.Jump(BPF_JEQ | BPF_X, BPF_REG_0, BPF_REG_1, 0, "device");
+  bpf.LoadImm64(BPF_REG_1, 0, KernelDev(disk));
+  bpf.Jump(BPF_JNE | BPF_X, BPF_REG_0, BPF_REG_1, 0, "exit");
+  bpf.Label("device");
+
+  // Only writes, which can follow an F for a flush
+  bpf.Emit(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_0, BPF_REG_6, rwbs_offset, 0);
+  bpf.Jump(BPF_JEQ | BPF_K, BPF_REG_0, 0, 'W', "write");
+  bpf.Emit(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_0, BPF_REG_6,
+           rwbs_offset + 1, 0);
+  bpf.Jump(BPF_JNE | BPF_K, BPF_REG_0, 0, 'W', "exit");
+  bpf.Label("write");
+
+  // Clip [sector, sector + nr_sector) to the device
+  bpf.Emit(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_7, BPF_REG_6,
+           sector_offset, 0);
+  bpf.Emit(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_8, BPF_REG_6,
+           nr_sector_offset, 0);
+  bpf.Jump(BPF_JEQ | BPF_K, BPF_REG_8, 0, 0, "exit");
+  bpf.Emit(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_8, BPF_REG_7, 0, 0);
+  bpf.LoadImm64(BPF_REG_1, 0, start_sector);
+  bpf.Jump(BPF_JGE | BPF_X, BPF_REG_7, BPF_REG_1, 0, "start_ok");
+  bpf.Emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_1, 0, 0);
+  bpf.Label("start_ok");
+  bpf.LoadImm64(BPF_REG_1, 0, end_sector);
+  bpf.Jump(BPF_JGE | BPF_X, BPF_REG_1, BPF_REG_8, 0, "end_ok");
+  bpf.Emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_8, BPF_REG_1, 0, 0);
+  bpf.Label("end_ok");
+  bpf.Jump(BPF_JGE | BPF_X, BPF_REG_7, BPF_REG_8, 0, "exit");
+
+  // To the first and last block
+  bpf.LoadImm64(BPF_REG_1, 0, start_sector);
+  bpf.Emit(BPF_ALU64 | BPF_SUB | BPF_X, BPF_REG_7, BPF_REG_1, 0, 0);
+  bpf.Emit(BPF_ALU64 | BPF_SUB | BPF_X, BPF_REG_8, BPF_REG_1, 0, 0);
+  bpf.Emit(BPF_ALU64 | BPF_SUB | BPF_K, BPF_REG_8, 0, 0, 1);
+  bpf.Emit(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_7, 0, 0, block_shift);
+  bpf.Emit(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_8, 0, 0, block_shift);
+  bpf.Emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_9, BPF_REG_8, 0, 0);
+  bpf.Emit(BPF_ALU64 | BPF_SUB | BPF_X, BPF_REG_9, BPF_REG_7, 0, 0);
+  bpf.Jump(BPF_JGE | BPF_K, BPF_REG_9, 0, MAX_BLOCKS_PER_WRITE, "overflow");
+
+  // Unrolled, as older verifiers don't allow loops
+  for (uint64_t i = 0; i < MAX_BLOCKS_PER_WRITE; ++i) {
+    bpf.Emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0);
+    bpf.Emit(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_1, 0, 0, element_shift);
+    bpf.Emit(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_1, -4, 0);
+    bpf.LoadImm64(BPF_REG_1, BPF_PSEUDO_MAP_FD, bytemap_fd_);
+    bpf.Emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+    bpf.Emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4);
+    bpf.Emit(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+    bpf.Jump(BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, "exit");
+    bpf.Emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0);
+    bpf.Emit(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_1, 0, 0,
+             BLOCKS_PER_ELEMENT - 1);
+    bpf.Emit(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_0, BPF_REG_1, 0, 0);
+    bpf.Emit(BPF_ST | BPF_MEM | BPF_B, BPF_REG_0, 0, 0, 1);
+    bpf.Jump(BPF_JGE | BPF_X, BPF_REG_7, BPF_REG_8, 0, "exit");
+    bpf.Emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_7, 0, 0, 1);
+  }
+  bpf.Jump(BPF_JA, 0, 0, 0, "exit");
+
+  bpf.Label("overflow");
+  bpf.Emit(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, 0);
+  bpf.LoadImm64(BPF_REG_1, BPF_PSEUDO_MAP_FD, overflow_fd_);
+  bpf.Emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+  bpf.Emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4);
+  bpf.Emit(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+  bpf.Jump(BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, "exit");
+  bpf.Emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1);
+  bpf.Emit(BPF_STX | BPF_XADD | BPF_DW, BPF_REG_0, BPF_REG_1, 0, 0);
+
+  bpf.Label("exit");
+  bpf.Emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+  bpf.Emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  std::vector<struct bpf_insn> program = bpf.Finish();
+  std::vector<char> verifier_log(VERIFIER_LOG_BYTES);
+  const char license[] = "GPL";
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_TRACEPOINT;
+  attr.insns = reinterpret_cast<uint64_t>(program.data());
+  attr.insn_cnt = program.size();
+  attr.license = reinterpret_cast<uint64_t>(license);
+  attr.log_buf = reinterpret_cast<uint64_t>(verifier_log.data());
+  attr.log_size = verifier_log.size();
+  attr.log_level = 1;
+  program_fd_ = Bpf(BPF_PROG_LOAD, &attr);
+  if (program_fd_ < 0) {
+    PLOG(WARNING) << "Unable to load BPF program: " << verifier_log.data();
+    throw BlockTraceException("Unable to load BPF program");
+  }
+}
+
+void BpfDirtyTracker::Attach(int tracepoint_id) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_TRACEPOINT;
+  attr.size = sizeof(attr);
+  attr.config = tracepoint_id;
+  attr.sample_period = 1;
+  attr.wakeup_events = 1;
+
+  // A CPU that couldn't be attached to would miss writes
+  int num_cpus = get_nprocs_conf();
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    int fd = syscall(__NR_perf_event_open, &attr, -1, cpu, -1,
+                     PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0) {
+      PLOG(WARNING) << "Unable to open tracepoint on CPU " << cpu;
+      throw BlockTraceException("Unable to open tracepoint");
+    }
+    perf_fds_.push_back(fd);
+    if (ioctl(fd, PERF_EVENT_IOC_SET_BPF, program_fd_) < 0 ||
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
+      PLOG(WARNING) << "Unable to attach BPF program on CPU " << cpu;
+      throw BlockTraceException("Unable to attach BPF program");
+    }
+  }
+}
+
+void BpfDirtyTracker::FlushBuffers() {
+  // Writes are marked as they are queued, so there is nothing to wait for
+  std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+  std::vector<SectorInterval> written;
+  ReadAndClear(bytemap_, num_blocks_, block_sectors_, device_sectors_,
+               &written);
+
+  time_t now = time(NULL);
+  std::vector<TimedInterval> intervals;
+  intervals.reserve(written.size());
+  for (const SectorInterval &interval : written) {
+    TimedInterval timed;
+    timed.interval = interval;
+    timed.epoch = now;
+    intervals.push_back(timed);
+  }
+  store_->AddIntervals(intervals);
+}
+
+uint64_t BpfDirtyTracker::DroppedTraces() {
+  uint32_t key = 0;
+  uint64_t overflows = 0;
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = overflow_fd_;
+  attr.key = reinterpret_cast<uint64_t>(&key);
+  attr.value = reinterpret_cast<uint64_t>(&overflows);
+  if (Bpf(BPF_MAP_LOOKUP_ELEM, &attr) < 0) {
+    PLOG(ERROR) << "Unable to read BPF overflow count";
+    throw BlockTraceException("Unable to read dropped trace count");
+  }
+  return overflows;
+}
+
+bool BpfDirtyTracker::ParseFieldOffset(const std::string &format,
+                                       const std::string &field,
+                                       uint32_t *const offset) {
+  // e.g. "\tfield:sector_t sector;\toffset:16;\tsize:8;\tsigned:0;"
+  std::istringstream lines(format);
+  std::string line;
+  while (std::getline(lines, line)) {
+    size_t decl_start = line.find("field:");
+    size_t decl_end = line.find(';');
+    size_t offset_start = line.find("offset:");
+    if (decl_start == std::string::npos || decl_end == std::string::npos ||
+        offset_start == std::string::npos) {
+      continue;
+    }
+    std::string decl = line.substr(decl_start, decl_end - decl_start);
+    std::string name = decl.substr(decl.find_last_of(" \t") + 1);
+    name = name.substr(0, name.find('['));
+    if (name == field) {
+      *offset = atoi(line.c_str() + offset_start + strlen("offset:"));
+      return true;
+    }
+  }
+  return false;
+}
+
+void BpfDirtyTracker::ReadAndClear(uint8_t *bytemap, uint64_t num_blocks,
+                                   uint64_t block_sectors,
+                                   uint64_t device_sectors,
+                                   std::vector<SectorInterval> *const output) {
+  output->clear();
+  uint64_t *words = reinterpret_cast<uint64_t *>(bytemap);
+  uint64_t num_words = (num_blocks + 7) / 8;
+  uint64_t run_start = 0;
+  uint64_t run_end = 0;
+
+  for (uint64_t word = 0; word < num_words; ++word) {
+    if (!__atomic_load_n(&words[word], __ATOMIC_RELAXED)) {
+      continue;
+    }
+    // Swapping catches a byte set between the read and the clear
+    uint64_t marked = __atomic_exchange_n(&words[word], 0, __ATOMIC_ACQ_REL);
+    const uint8_t *marked_bytes = reinterpret_cast<const uint8_t *>(&marked);
+    for (uint64_t i = 0; i < 8; ++i) {
+      uint64_t block = word * 8 + i;
+      if (!marked_bytes[i] || block >= num_blocks) {
+        continue;
+      }
+      uint64_t start = block * block_sectors;
+      uint64_t end = std::min(start + block_sectors, device_sectors);
+      if (run_end == start && run_end != run_start) {
+        run_end = end;
+        continue;
+      }
+      if (run_end != run_start) {
+        output->push_back(SectorInterval(run_start, run_end));
+      }
+      run_start = start;
+      run_end = end;
+    }
+  }
+  if (run_end != run_start) {
+    output->push_back(SectorInterval(run_start, run_end));
+  }
+}
+
+void BpfDirtyTracker::Cleanup() {
+  for (int fd : perf_fds_) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    close(fd);
+  }
+  perf_fds_.clear();
+  if (bytemap_) {
+    munmap(bytemap_, bytemap_bytes_);
+    bytemap_ = nullptr;
+  }
+  for (int *fd : {&program_fd_, &overflow_fd_, &bytemap_fd_}) {
+    if (*fd >= 0) {
+      close(*fd);
+      *fd = -1;
+    }
+  }
+}
+
+BpfDirtyTracker::~BpfDirtyTracker() {
+  Cleanup();
+}
+
+}
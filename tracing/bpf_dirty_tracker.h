@@ -0,0 +1,87 @@
+#ifndef DATTO_CLIENT_BLOCK_TRACE_BPF_DIRTY_TRACKER_H_
+#define DATTO_CLIENT_BLOCK_TRACE_BPF_DIRTY_TRACKER_H_
+
+#include "tracing/device_tracer.h"
+#include "unsynced_sector_manager/sector_interval.h"
+#include "unsynced_sector_manager/unsynced_sector_store.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace datto_linux_client {
+
+// BpfDirtyTracker stands in for a DeviceTracer with an eBPF program on the
+// block_bio_queue tracepoint. The program marks the blocks each write
+// touches in a map shared with dattod, a byte per block, so nothing is
+// sent to user space per write. FlushBuffers reads and clears the map and
+// adds the marked blocks to the store, so its cost depends on the device
+// size rather than on how much was written.
+//
+// Blocks are sized so the largest request of the queue spans at most
+// MAX_BLOCKS_PER_WRITE blocks. Larger writes aren't marked and are
+// counted as dropped traces instead, so the device needs a resync.
+// Discards aren't tracked.
+//
+// The constructor throws a BlockTraceException if BPF or the tracepoint
+// isn't available, so the caller can fall back to a DeviceTracer.
+class BpfDirtyTracker : public DeviceTracer {
+ public:
+  static const uint64_t MAX_BLOCKS_PER_WRITE = 32;
+  // Each map element holds the bytes of this many blocks
+  static const uint32_t BLOCKS_PER_ELEMENT = 4096;
+  static const uint64_t MIN_BLOCK_SECTORS = 8;
+
+  BpfDirtyTracker(::dev_t device, uint64_t device_size_bytes,
+                  std::shared_ptr<UnsyncedSectorStore> store);
+
+  virtual void FlushBuffers();
+  virtual uint64_t DroppedTraces();
+
+  ~BpfDirtyTracker();
+
+  // Finds the offset of a field in a tracepoint format file. Returns false
+  // if the field isn't there.
+  static bool ParseFieldOffset(const std::string &format,
+                               const std::string &field,
+                               uint32_t *const offset);
+
+  // Clears the marked blocks of bytemap and sets output to their sectors.
+  // bytemap must be 8 byte aligned and a multiple of 8 bytes long. Blocks
+  // marked while this runs are either in output or left marked.
+  static void ReadAndClear(uint8_t *bytemap, uint64_t num_blocks,
+                           uint64_t block_sectors, uint64_t device_sectors,
+                           std::vector<SectorInterval> *const output);
+
+  BpfDirtyTracker(const BpfDirtyTracker &) = delete;
+  BpfDirtyTracker& operator=(const BpfDirtyTracker &) = delete;
+
+ private:
+  void LoadProgram(::dev_t device, ::dev_t disk, uint64_t start_sector,
+                   uint64_t end_sector, int block_shift,
+                   const std::string &format);
+  void Attach(int tracepoint_id);
+  void Cleanup();
+
+  std::shared_ptr<UnsyncedSectorStore> store_;
+  uint64_t device_sectors_;
+  uint64_t block_sectors_;
+  uint64_t num_blocks_;
+
+  int bytemap_fd_;
+  int overflow_fd_;
+  int program_fd_;
+  std::vector<int> perf_fds_;
+  uint8_t *bytemap_;
+  size_t bytemap_bytes_;
+
+  std::mutex flush_mutex_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_TRACE_BPF_DIRTY_TRACKER_H_
@@ -1,35 +1,17 @@
 #include "cpu_tracer.h"
 #include <algorithm>
 #include <thread>
+#include <errno.h>
 #include <fcntl.h>
 #include <glog/logging.h>
 #include <linux/blktrace_api.h>
 #include <poll.h>
 #include <sched.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/sysinfo.h>
 #include <sys/types.h>
-
-namespace {
-using datto_linux_client::BlockTraceException;
-
-void SkipNonseekableFD(int fd, int amount_to_skip) {
-  // Can't use sendfile() here because the output isn't a socket
-  // Seems to be no way to avoid copying unneeded data to userspace
-
-  char buf[512];
-  int read_bytes;
-
-  while (amount_to_skip > 0) {
-    read_bytes = read(fd, &buf, std::min(amount_to_skip, 512));
-    if (read_bytes == -1) {
-      PLOG(ERROR) << "Unable to read from fd";
-      throw BlockTraceException("Couldn't read file descriptor");
-    }
-    amount_to_skip -= read_bytes;
-  }
-}
-} // namespace
+#include <unistd.h>
 
 namespace datto_linux_client {
 
@@ -37,8 +19,13 @@ CpuTracer::CpuTracer(std::string &trace_path, int cpu_num,
                      std::shared_ptr<TraceHandler> trace_handler)
     : trace_handler_(trace_handler),
       cpu_num_(cpu_num),
+      trace_buffer_(),
       stop_trace_(false),
-      flush_buffers_(false) {
+      flush_mutex_(),
+      flush_done_(),
+      flush_requested_(0),
+      flush_completed_(0),
+      is_stopped_(false) {
 
   DLOG(INFO) << "Opening tracer on path " << trace_path;
 
@@ -49,17 +36,34 @@ CpuTracer::CpuTracer(std::string &trace_path, int cpu_num,
     throw BlockTraceException("Open trace_path");
   }
 
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd_ == -1) {
+    PLOG(ERROR) << "eventfd";
+    close(trace_fd_);
+    throw BlockTraceException("Unable to create wake eventfd");
+  }
+
   trace_thread_ = std::thread(&CpuTracer::DoTrace, this);
 
 }
 
-// Lock this thread on just the CPU which it is responsible for tracing
+// Lock this thread on just the CPU which it is responsible for tracing.
+// dattod keeps off isolated CPUs (see CpuPlacement), so a CPU this thread
+// didn't inherit is traced from the CPUs it already runs on instead.
 // This must not throw an exception as it is called directly from DoTrace()
 void CpuTracer::LockOnCPU() {
   int num_cpus = get_nprocs_conf();
   cpu_set_t *cpu_mask = CPU_ALLOC(num_cpus);
   size_t size = CPU_ALLOC_SIZE(num_cpus);
 
+  CPU_ZERO_S(size, cpu_mask);
+  if (sched_getaffinity(0, size, cpu_mask) == 0 &&
+      !CPU_ISSET_S(cpu_num_, size, cpu_mask)) {
+    CPU_FREE(cpu_mask);
+    VLOG(1) << "Tracing CPU " << cpu_num_ << " remotely";
+    return;
+  }
+
   CPU_ZERO_S(size, cpu_mask);
   CPU_SET_S(cpu_num_, size, cpu_mask);
   if (sched_setaffinity(0, size, cpu_mask) < 0) {
@@ -76,58 +80,45 @@ void CpuTracer::LockOnCPU() {
 void CpuTracer::DoTrace() {
   LockOnCPU();
 
-  struct pollfd pfd;
-  pfd.fd = trace_fd_;
-  pfd.events = POLLIN;
+  struct pollfd pfds[2];
+  pfds[0].fd = trace_fd_;
+  pfds[0].events = POLLIN;
+  pfds[1].fd = wake_fd_;
+  pfds[1].events = POLLIN;
 
   int poll_val = 0;
-  struct blk_io_trace trace;
 
   while (!stop_trace_ &&
-      ((poll_val = poll(&pfd, 1, POLL_DELAY_MILLIS)) >= 0)) {
-    if (poll_val == 0 && !flush_buffers_) {
-      // Poll timed out and we aren't forcing a flush
-      continue;
+      ((poll_val = poll(pfds, 2, POLL_DELAY_MILLIS)) >= 0)) {
+    uint64_t flush_ticket = 0;
+    if (pfds[1].revents & POLLIN) {
+      uint64_t value;
+      // Only used to wake up, so the value doesn't matter
+      if (read(wake_fd_, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        PLOG(ERROR) << "Unable to read wake event";
+      }
+      std::lock_guard<std::mutex> lock(flush_mutex_);
+      flush_ticket = flush_requested_;
     }
 
-    // Read the trace from the virtual file
-    int read_bytes = read(trace_fd_, &trace, sizeof(trace));
-    if (read_bytes == -1) {
-      PLOG(ERROR) << "Error while reading trace file descriptor";
-      break;
-    } else if (read_bytes == 0) {
-      VLOG(2) << "Got 0 bytes from read";
-      flush_buffers_ = false;
+    if (!(pfds[0].revents & POLLIN) && flush_ticket == 0) {
+      // Poll timed out and we aren't forcing a flush
       continue;
     }
 
-    // Sanity check
-    if (trace.magic != (BLK_IO_TRACE_MAGIC | BLK_IO_TRACE_VERSION)) {
-      PLOG(ERROR) << "Bad magic number in trace";
-      break;
-    }
-
-    // Hand it off to trace handler
     try {
-      (trace_handler_)->AddTrace(trace);
+      // A flush reads until the kernel has nothing more
+      ssize_t bytes_read;
+      do {
+        bytes_read = trace_buffer_.ReadFrom(trace_fd_, trace_handler_.get());
+      } while (bytes_read > 0 && flush_ticket);
     } catch (const std::exception &e) {
-      PLOG(ERROR) << "Exception while adding trace" << e.what();
+      LOG(ERROR) << "Exception while reading traces: " << e.what();
       break;
     }
 
-    // If the trace had extra data at the end of it, skip over it
-    // Only trace types we don't care about have extra data at the end
-    VLOG(2) << "Action is 0x"
-            << std::hex << trace.action << std::dec;
-    if (trace.pdu_len) {
-      VLOG(2) << "Skipping trailing data for action 0x"
-              << std::hex << trace.action << std::dec;
-      try {
-        SkipNonseekableFD(trace_fd_, trace.pdu_len);
-      } catch (...) {
-        LOG(ERROR) << "Error while seeking reading unused payload from trace";
-        break;
-      }
+    if (flush_ticket) {
+      FinishFlush(flush_ticket);
     }
   }
 
@@ -135,25 +126,59 @@ void CpuTracer::DoTrace() {
     PLOG(ERROR) << "poll";
   }
 
+  {
+    std::lock_guard<std::mutex> lock(flush_mutex_);
+    is_stopped_ = true;
+  }
+  flush_done_.notify_all();
+
   // Don't worry about the return value as we aren't writing anything
   close(trace_fd_);
 }
 
 void CpuTracer::FlushBuffer() {
-  flush_buffers_ = true;
-  // Wait for flush_buffers_ to be marked false
-  LOG(INFO) << "Waiting for buffer to flush";
-  while (flush_buffers_) {
-    std::this_thread::yield();
+  WaitForFlush(RequestFlush());
+}
+
+uint64_t CpuTracer::RequestFlush() {
+  uint64_t ticket;
+  {
+    std::lock_guard<std::mutex> lock(flush_mutex_);
+    ticket = ++flush_requested_;
+  }
+  Wake();
+  return ticket;
+}
+
+void CpuTracer::WaitForFlush(uint64_t ticket) {
+  std::unique_lock<std::mutex> lock(flush_mutex_);
+  flush_done_.wait(lock, [&]() {
+    return flush_completed_ >= ticket || is_stopped_;
+  });
+}
+
+void CpuTracer::FinishFlush(uint64_t ticket) {
+  {
+    std::lock_guard<std::mutex> lock(flush_mutex_);
+    flush_completed_ = std::max(flush_completed_, ticket);
+  }
+  flush_done_.notify_all();
+}
+
+void CpuTracer::Wake() {
+  uint64_t value = 1;
+  if (write(wake_fd_, &value, sizeof(value)) == -1) {
+    PLOG(ERROR) << "Unable to wake trace thread";
   }
-  LOG(INFO) << "Buffer flushed";
 }
 
 void CpuTracer::StopTrace() {
   stop_trace_ = true;
+  Wake();
   if (trace_thread_.joinable()) {
     trace_thread_.join();
   }
+  close(wake_fd_);
 }
 
 CpuTracer::~CpuTracer() {
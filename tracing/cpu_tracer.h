@@ -4,12 +4,15 @@
 #include <boost/icl/interval.hpp>
 
 #include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 
 #include <stdint.h>
 
+#include "tracing/trace_buffer.h"
 #include "tracing/trace_handler.h"
 #include "tracing/block_trace_exception.h"
 
@@ -27,6 +30,13 @@ class CpuTracer {
   // buffer has content. If a backup is about to occur, we need to flush it.
   void FlushBuffer();
 
+  // FlushBuffer split in two, so the buffers of many CPUs can be flushed
+  // at once. RequestFlush wakes the trace thread and returns a ticket to
+  // pass to WaitForFlush, which returns once everything the kernel had
+  // buffered at the time of the request has been handled.
+  uint64_t RequestFlush();
+  void WaitForFlush(uint64_t ticket);
+
   ~CpuTracer();
 
   CpuTracer(const CpuTracer &);
@@ -36,15 +46,28 @@ class CpuTracer {
   void DoTrace();
   void LockOnCPU();
   void StopTrace();
+  void Wake();
+  // Marks every flush up to ticket as done
+  void FinishFlush(uint64_t ticket);
 
   std::shared_ptr<TraceHandler> trace_handler_;
   std::thread trace_thread_;
 
   int trace_fd_;
+  // eventfd the trace thread polls along with trace_fd_
+  int wake_fd_;
   int cpu_num_;
 
+  TraceBuffer trace_buffer_;
+
   std::atomic_bool stop_trace_;
-  std::atomic_bool flush_buffers_;
+
+  std::mutex flush_mutex_;
+  std::condition_variable flush_done_;
+  uint64_t flush_requested_;
+  uint64_t flush_completed_;
+  // Set once the trace thread exits, so waiters don't wait forever
+  bool is_stopped_;
 };
 
 }
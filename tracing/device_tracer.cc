@@ -2,7 +2,8 @@
 
 #include "tracing/block_trace_exception.h"
 
-#include <thread>
+#include <algorithm>
+#include <fstream>
 
 #include <fcntl.h>
 #include <glog/logging.h>
@@ -13,32 +14,79 @@
 
 namespace datto_linux_client {
 
+const uint32_t DeviceTracer::DEFAULT_BUFFER_BYTES;
+const uint32_t DeviceTracer::DEFAULT_NUM_BUFFERS;
+const uint32_t DeviceTracer::MAX_BUFFER_BYTES;
+const uint32_t DeviceTracer::MAX_NUM_BUFFERS;
+
+RelayBufferSettings DeviceTracer::DefaultRelaySettings() {
+  RelayBufferSettings settings;
+  settings.buffer_bytes = DEFAULT_BUFFER_BYTES;
+  settings.num_buffers = DEFAULT_NUM_BUFFERS;
+  return settings;
+}
+
+RelayBufferSettings DeviceTracer::GrowRelaySettings(
+    const RelayBufferSettings &settings) {
+  RelayBufferSettings grown = settings;
+  if (grown.buffer_bytes < MAX_BUFFER_BYTES) {
+    grown.buffer_bytes = std::min(grown.buffer_bytes * 4, MAX_BUFFER_BYTES);
+  } else if (grown.num_buffers < MAX_NUM_BUFFERS) {
+    grown.num_buffers = std::min(grown.num_buffers * 2, MAX_NUM_BUFFERS);
+  }
+  return grown;
+}
+
 DeviceTracer::DeviceTracer(const std::string &block_dev_path,
                            std::shared_ptr<TraceHandler> handler)
-    : handler_(handler) {
+    : DeviceTracer(block_dev_path, handler, nullptr,
+                   DefaultRelaySettings()) {}
+
+DeviceTracer::DeviceTracer(const std::string &block_dev_path,
+                           std::shared_ptr<TraceHandler> handler,
+                           std::shared_ptr<TraceReaderPool> reader_pool)
+    : DeviceTracer(block_dev_path, handler, reader_pool,
+                   DefaultRelaySettings()) {}
 
-  if ((block_dev_fd_ = open(block_dev_path.c_str(),
+DeviceTracer::DeviceTracer(const std::string &block_dev_path,
+                           std::shared_ptr<TraceHandler> handler,
+                           std::shared_ptr<TraceReaderPool> reader_pool,
+                           const RelayBufferSettings &relay_settings)
+    : block_dev_path_(block_dev_path),
+      relay_settings_(relay_settings),
+      handler_(handler),
+      reader_pool_(reader_pool),
+      pool_device_id_(-1) {
+  if ((block_dev_fd_ = open(block_dev_path_.c_str(),
                             O_RDONLY | O_NONBLOCK)) < 0) {
-    PLOG(ERROR) << "Unable to open " << block_dev_path;
+    PLOG(ERROR) << "Unable to open " << block_dev_path_;
     throw BlockTraceException("Unable to open device for tracing");
   }
 
   num_cpus_ = get_nprocs_conf();
   DLOG(INFO) << "num_cpus_: " << num_cpus_;
-  cpu_tracers_ = std::vector<std::unique_ptr<CpuTracer>>(num_cpus_);
 
   try {
     trace_name_ = BeginBlockTrace();
     DLOG(INFO) << "trace_name_: " << trace_name_;
 
-    for (int i = 0; i < num_cpus_; ++i) {
-      std::string trace_path = GetTracePath(i);
-      DLOG(INFO) << "trace_path: " << trace_path;
-
-      cpu_tracers_[i] = std::unique_ptr<CpuTracer>(
-                          new CpuTracer(trace_path, i, handler_));
+    if (reader_pool_) {
+      // The pool opens the files of CPUs that come online later itself
+      pool_device_id_ = reader_pool_->AddDevice(
+          std::string(DEBUG_FS_PATH) + "/block/" + trace_name_ + "/trace",
+          handler_);
+    } else {
+      cpu_tracers_ = std::vector<std::unique_ptr<CpuTracer>>(num_cpus_);
+      for (int i = 0; i < num_cpus_; ++i) {
+        std::string trace_path = GetTracePath(i);
+        DLOG(INFO) << "trace_path: " << trace_path;
+
+        cpu_tracers_[i] = std::unique_ptr<CpuTracer>(
+                            new CpuTracer(trace_path, i, handler_));
+      }
     }
   } catch (...) {
+    cpu_tracers_.clear();
 
     try {
       CleanupBlockTrace();
@@ -59,24 +107,30 @@ DeviceTracer::DeviceTracer(const std::string &block_dev_path,
 }
 
 void DeviceTracer::FlushBuffers() {
-  std::vector<std::thread> flush_threads(cpu_tracers_.size());
+  if (reader_pool_) {
+    reader_pool_->FlushDevice(pool_device_id_);
+    handler_->Flush();
+    return;
+  }
 
+  // Wake every CPU tracer before waiting, so they all drain at once
+  std::vector<uint64_t> tickets(cpu_tracers_.size());
   for (size_t i = 0; i < cpu_tracers_.size(); i++) {
-    flush_threads[i] = std::thread([=]() {
-      this->cpu_tracers_[i]->FlushBuffer();
-    });
+    tickets[i] = cpu_tracers_[i]->RequestFlush();
   }
 
-  for (auto &thread : flush_threads) {
-    thread.join();
+  for (size_t i = 0; i < cpu_tracers_.size(); i++) {
+    cpu_tracers_[i]->WaitForFlush(tickets[i]);
   }
+
+  handler_->Flush();
 }
 
 std::string DeviceTracer::BeginBlockTrace() {
   struct blk_user_trace_setup blktrace_setup = {};
 
-  blktrace_setup.buf_size = BLKTRACE_BUFFER_SIZE;
-  blktrace_setup.buf_nr = BLKTRACE_NUM_SUBBUFFERS;
+  blktrace_setup.buf_size = relay_settings_.buffer_bytes;
+  blktrace_setup.buf_nr = relay_settings_.num_buffers;
   blktrace_setup.act_mask = BLKTRACE_MASK;
 
   if (ioctl(block_dev_fd_, BLKTRACESETUP, &blktrace_setup) < 0) {
@@ -110,6 +164,20 @@ void DeviceTracer::CleanupBlockTrace() {
 
 }
 
+uint64_t DeviceTracer::DroppedTraces() {
+  // The kernel counts the traces it couldn't fit in the relay buffers in
+  // e.g. /sys/kernel/debug/block/sda1/dropped
+  std::string dropped_path = std::string(DEBUG_FS_PATH) + "/block/" +
+                             trace_name_ + "/dropped";
+  std::ifstream dropped_file(dropped_path);
+  uint64_t dropped = 0;
+  if (!(dropped_file >> dropped)) {
+    LOG(ERROR) << "Unable to read " << dropped_path;
+    throw BlockTraceException("Unable to read dropped trace count");
+  }
+  return dropped;
+}
+
 std::string DeviceTracer::GetTracePath(int cpu_num) {
 
   // In general this path will be something like
@@ -135,6 +203,9 @@ DeviceTracer::~DeviceTracer() {
   try {
     DLOG(INFO) << "Clearing CPU tracers";
     cpu_tracers_.clear();
+    if (reader_pool_) {
+      reader_pool_->RemoveDevice(pool_device_id_);
+    }
 
     CleanupBlockTrace();
     close(block_dev_fd_);
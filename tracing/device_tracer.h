@@ -3,9 +3,11 @@
 
 #include "tracing/cpu_tracer.h"
 #include "tracing/trace_handler.h"
+#include "tracing/trace_reader_pool.h"
 
 #include <linux/fs.h>
 #include <linux/blktrace_api.h>
+#include <stdint.h>
 
 #include <memory>
 #include <string>
@@ -15,34 +17,76 @@ namespace datto_linux_client {
 
 static const char DEBUG_FS_PATH[] = "/sys/kernel/debug";
 
-// TODO Check for dropped traces
-// TODO Check if switching to mmap is a good idea (performance)
+// Size of the relay buffers the kernel fills with traces, for each CPU
+struct RelayBufferSettings {
+  uint32_t buffer_bytes;
+  uint32_t num_buffers;
+};
+
+// The relay files are read() rather than mmap()ed. The kernel only marks
+// relay sub-buffers as consumed on read or splice, and blktrace has no way
+// for a process that maps the buffers to report what it consumed or to
+// find out how far the kernel has written. A mapping reader would fill the
+// buffers once and then drop every trace. The per trace cost is cut by
+// reading many traces at a time instead.
+//
 // DeviceTracer is responsible for tracing the writes to a block device
 // and handing off those traces to a TraceHandler instance
 class DeviceTracer {
-  // TODO Move these constants to another location, perhaps a config file
-  static const int BLKTRACE_BUFFER_SIZE = 1024;
-  static const int BLKTRACE_NUM_SUBBUFFERS = 10;
   static const int BLKTRACE_MASK = BLK_TC_QUEUE;
 
  public:
+  static const uint32_t DEFAULT_BUFFER_BYTES = 1024;
+  static const uint32_t DEFAULT_NUM_BUFFERS = 10;
+  // Bounds what dropped traces can grow the buffers to, 8MiB per CPU
+  static const uint32_t MAX_BUFFER_BYTES = 512 * 1024;
+  static const uint32_t MAX_NUM_BUFFERS = 16;
+
+  static RelayBufferSettings DefaultRelaySettings();
+  // Larger buffers to use after settings dropped traces. Buffers grow
+  // before there are more of them, as each one costs a wakeup to read.
+  static RelayBufferSettings GrowRelaySettings(
+      const RelayBufferSettings &settings);
+
   // Starts a trace for the device specificed by block_dev_path
   // Traces will be sent to the TraceHandler instance
   DeviceTracer(const std::string &block_dev_path,
                std::shared_ptr<TraceHandler> handler);
 
+  // Same as above, but the trace files are read by reader_pool instead of
+  // a thread per CPU
+  DeviceTracer(const std::string &block_dev_path,
+               std::shared_ptr<TraceHandler> handler,
+               std::shared_ptr<TraceReaderPool> reader_pool);
+
+  DeviceTracer(const std::string &block_dev_path,
+               std::shared_ptr<TraceHandler> handler,
+               std::shared_ptr<TraceReaderPool> reader_pool,
+               const RelayBufferSettings &relay_settings);
+
   // Flush the trace buffers. This method returns once the buffers
   // have finished flushing and have been given to the TraceHandler
   virtual void FlushBuffers();
 
+  // Number of traces the kernel has dropped since the trace started
+  // because the relay buffers were full. Any drop means writes are
+  // missing from the TraceHandler.
+  virtual uint64_t DroppedTraces();
+
+  RelayBufferSettings relay_settings() const { return relay_settings_; }
+
   virtual ~DeviceTracer();
 
   DeviceTracer(const DeviceTracer &) = delete;
   DeviceTracer& operator=(const DeviceTracer &) = delete;
 
  protected:
-  // For creating stubs in unit testing
-  DeviceTracer() : block_dev_fd_(-1) {}
+  // For creating stubs in unit testing, and for tracers that don't use
+  // blktrace
+  DeviceTracer()
+      : block_dev_fd_(-1),
+        relay_settings_(DefaultRelaySettings()),
+        pool_device_id_(-1) {}
 
  private:
   std::string BeginBlockTrace();
@@ -53,10 +97,14 @@ class DeviceTracer {
   std::string trace_name_;
   int block_dev_fd_;
   int num_cpus_;
+  RelayBufferSettings relay_settings_;
 
   std::shared_ptr<TraceHandler> handler_;
 
   std::vector<std::unique_ptr<CpuTracer>> cpu_tracers_;
+
+  std::shared_ptr<TraceReaderPool> reader_pool_;
+  int pool_device_id_;
 };
 
 }
@@ -0,0 +1,180 @@
+#include "tracing/dm_era.h"
+
+#include <stdio.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include <glog/logging.h>
+
+#include "tracing/block_trace_exception.h"
+
+namespace {
+
+using ::datto_linux_client::BlockTraceException;
+
+std::string RunShellCommand(const std::string &command) {
+  VLOG(1) << "Running " << command;
+  FILE *pipe = popen(command.c_str(), "r");
+  if (!pipe) {
+    PLOG(ERROR) << "Unable to run " << command;
+    throw BlockTraceException("Unable to run command");
+  }
+
+  std::string output;
+  char buf[4096];
+  size_t bytes_read;
+  while ((bytes_read = fread(buf, 1, sizeof(buf), pipe)) > 0) {
+    output.append(buf, bytes_read);
+  }
+
+  int status = pclose(pipe);
+  if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    LOG(ERROR) << command << " failed with status " << status;
+    throw BlockTraceException("Command failed");
+  }
+  return output;
+}
+
+// Values of an XML attribute, e.g. begin="10" gives 10
+bool ReadAttribute(const std::string &line, const std::string &name,
+                   uint64_t *value) {
+  size_t pos = line.find(" " + name + "=\"");
+  if (pos == std::string::npos) {
+    return false;
+  }
+  std::istringstream value_stream(line.substr(pos + name.size() + 3));
+  return static_cast<bool>(value_stream >> *value);
+}
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+std::string DmEra::DeviceMapperName(::dev_t device) {
+  std::ostringstream name_path;
+  name_path << "/sys/dev/block/" << major(device) << ":" << minor(device)
+            << "/dm/name";
+  std::ifstream name_file(name_path.str());
+  std::string dm_name;
+  if (!(name_file >> dm_name)) {
+    LOG(ERROR) << "Unable to read " << name_path.str();
+    throw BlockTraceException("Not a device-mapper device");
+  }
+  return dm_name;
+}
+
+DmEra::DmEra(const std::string &dm_name)
+    : DmEra(dm_name, RunShellCommand) {}
+
+DmEra::DmEra(const std::string &dm_name, CommandRunner run_command)
+    : dm_name_(dm_name),
+      run_command_(run_command),
+      metadata_device_(),
+      device_sectors_(0),
+      block_sectors_(0) {
+  // e.g. 0 2097152 era 253:1 253:2 128
+  std::istringstream table(run_command_("dmsetup table '" + dm_name_ + "'"));
+  uint64_t start;
+  std::string target, origin_device;
+  if (!(table >> start >> device_sectors_ >> target >> metadata_device_ >>
+        origin_device >> block_sectors_) ||
+      target != "era" || block_sectors_ == 0) {
+    LOG(ERROR) << dm_name_ << " isn't a single era target";
+    throw BlockTraceException("Not an era target");
+  }
+  LOG(INFO) << "Using era target " << dm_name_ << " with "
+            << block_sectors_ << " sector blocks";
+}
+
+uint32_t DmEra::Checkpoint() {
+  SendMessage("checkpoint");
+  return CurrentEra();
+}
+
+uint32_t DmEra::CurrentEra() {
+  // e.g. 0 2097152 era 8 21/4096 3 -
+  std::istringstream status(
+      run_command_("dmsetup status '" + dm_name_ + "'"));
+  uint64_t start, length, metadata_block_size;
+  std::string target, metadata_usage;
+  uint32_t era;
+  if (!(status >> start >> length >> target >> metadata_block_size >>
+        metadata_usage >> era) ||
+      target != "era") {
+    LOG(ERROR) << "Unexpected status for " << dm_name_;
+    throw BlockTraceException("Unable to read current era");
+  }
+  return era;
+}
+
+void DmEra::WrittenSince(uint32_t era,
+                         std::vector<SectorInterval> *const output) {
+  // era_invalidate leaves out the era it is given, so ask from the one
+  // before. The blocks of that era were already read last time, so
+  // reading them again only costs a little extra copying.
+  std::ostringstream command;
+  command << "era_invalidate --metadata-snapshot --written-since "
+          << (era ? era - 1 : 0) << " /dev/block/" << metadata_device_;
+
+  SendMessage("take_metadata_snap");
+  std::string blocks;
+  try {
+    blocks = run_command_(command.str());
+  } catch (...) {
+    try {
+      SendMessage("drop_metadata_snap");
+    } catch (const std::exception &e) {
+      LOG(ERROR) << "Unable to drop era metadata snapshot: " << e.what();
+    }
+    throw;
+  }
+  SendMessage("drop_metadata_snap");
+
+  ParseBlocks(blocks, output);
+}
+
+void DmEra::SendMessage(const std::string &message) {
+  run_command_("dmsetup message '" + dm_name_ + "' 0 " + message);
+}
+
+void DmEra::ParseBlocks(const std::string &xml,
+                        std::vector<SectorInterval> *const output) const {
+  // <blocks>
+  //   <range begin="0" end="5"/>
+  //   <block block="7"/>
+  // </blocks>
+  // where ranges end before end
+  output->clear();
+  std::istringstream lines(xml);
+  std::string line;
+  uint64_t begin, end;
+  while (std::getline(lines, line)) {
+    if (line.find("<range") != std::string::npos) {
+      if (!ReadAttribute(line, "begin", &begin) ||
+          !ReadAttribute(line, "end", &end) || end < begin) {
+        LOG(ERROR) << "Bad range from era_invalidate: " << line;
+        throw BlockTraceException("Unable to read era blocks");
+      }
+    } else if (line.find("<block") != std::string::npos &&
+               line.find("<blocks") == std::string::npos) {
+      if (!ReadAttribute(line, "block", &begin)) {
+        LOG(ERROR) << "Bad block from era_invalidate: " << line;
+        throw BlockTraceException("Unable to read era blocks");
+      }
+      end = begin + 1;
+    } else {
+      continue;
+    }
+    // The last block can extend past the end of the device
+    uint64_t end_sector = std::min(end * block_sectors_, device_sectors_);
+    if (begin * block_sectors_ < end_sector) {
+      output->push_back(SectorInterval(begin * block_sectors_, end_sector));
+    }
+  }
+}
+
+}
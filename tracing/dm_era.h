@@ -0,0 +1,70 @@
+#ifndef DATTO_CLIENT_BLOCK_TRACE_DM_ERA_H_
+#define DATTO_CLIENT_BLOCK_TRACE_DM_ERA_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "unsynced_sector_manager/sector_interval.h"
+
+namespace datto_linux_client {
+
+// DmEra talks to a device-mapper era target, which records the era each
+// block was last written in. Eras are ended with Checkpoint, and the blocks
+// written since an era are read back out of a snapshot of the era metadata
+// with era_invalidate from thin-provisioning-tools.
+//
+// The era device has to be set up beforehand, with the source's filesystem
+// on top of it.
+class DmEra {
+ public:
+  // Runs a shell command and returns what it wrote to stdout. Throws a
+  // BlockTraceException if it fails.
+  typedef std::function<std::string(const std::string &)> CommandRunner;
+
+  // Name of the device-mapper device with the given dev_t, from sysfs.
+  // Throws a BlockTraceException if it isn't a device-mapper device.
+  static std::string DeviceMapperName(::dev_t device);
+
+  // Throws a BlockTraceException if dm_name isn't an era target
+  explicit DmEra(const std::string &dm_name);
+  DmEra(const std::string &dm_name, CommandRunner run_command);
+  virtual ~DmEra() {}
+
+  // Starts a new era and returns it
+  virtual uint32_t Checkpoint();
+
+  virtual uint32_t CurrentEra();
+
+  // Sets output to the sectors of every block written in era or later
+  virtual void WrittenSince(uint32_t era,
+                            std::vector<SectorInterval> *const output);
+
+  uint64_t block_sectors() const { return block_sectors_; }
+
+  DmEra(const DmEra &) = delete;
+  DmEra& operator=(const DmEra &) = delete;
+
+ protected:
+  // For creating stubs in unit testing
+  DmEra() : device_sectors_(0), block_sectors_(0) {}
+
+ private:
+  void SendMessage(const std::string &message);
+  void ParseBlocks(const std::string &xml,
+                   std::vector<SectorInterval> *const output) const;
+
+  std::string dm_name_;
+  CommandRunner run_command_;
+  // As major:minor
+  std::string metadata_device_;
+  uint64_t device_sectors_;
+  uint64_t block_sectors_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_TRACE_DM_ERA_H_
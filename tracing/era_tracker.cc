@@ -0,0 +1,55 @@
+#include "tracing/era_tracker.h"
+
+#include <time.h>
+
+#include <vector>
+
+#include <glog/logging.h>
+
+namespace datto_linux_client {
+
+EraTracker::EraTracker(std::shared_ptr<DmEra> era,
+                       std::shared_ptr<UnsyncedSectorStore> store)
+    : era_(era),
+      store_(store),
+      since_era_(0),
+      failed_flushes_(0),
+      flush_mutex_() {
+  // Writes from before this are covered by the first backup being a full
+  since_era_ = era_->Checkpoint();
+}
+
+void EraTracker::FlushBuffers() {
+  std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+  try {
+    // Writes from here on are in the new era and are read next time
+    uint32_t next_era = era_->Checkpoint();
+
+    std::vector<SectorInterval> written;
+    era_->WrittenSince(since_era_, &written);
+
+    time_t now = time(NULL);
+    std::vector<TimedInterval> intervals;
+    intervals.reserve(written.size());
+    for (const SectorInterval &interval : written) {
+      TimedInterval timed;
+      timed.interval = interval;
+      timed.epoch = now;
+      intervals.push_back(timed);
+    }
+    store_->AddIntervals(intervals);
+    since_era_ = next_era;
+    VLOG(1) << "Added " << intervals.size() << " written ranges, now in era "
+            << next_era;
+  } catch (const std::exception &e) {
+    LOG(ERROR) << "Unable to read written blocks: " << e.what();
+    failed_flushes_++;
+  }
+}
+
+uint64_t EraTracker::DroppedTraces() {
+  std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+  return failed_flushes_;
+}
+
+}
@@ -0,0 +1,45 @@
+#ifndef DATTO_CLIENT_BLOCK_TRACE_ERA_TRACKER_H_
+#define DATTO_CLIENT_BLOCK_TRACE_ERA_TRACKER_H_
+
+#include "tracing/device_tracer.h"
+#include "tracing/dm_era.h"
+#include "unsynced_sector_manager/unsynced_sector_store.h"
+
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+
+namespace datto_linux_client {
+
+// EraTracker stands in for a DeviceTracer on sources under a dm-era target.
+// Nothing is sent to user space per write; instead FlushBuffers ends the
+// current era and adds every block written since the last flush to the
+// store. Between flushes the store doesn't see new writes.
+//
+// If the written blocks can't be read, they are counted as dropped
+// traces, so the device needs a resync.
+class EraTracker : public DeviceTracer {
+ public:
+  EraTracker(std::shared_ptr<DmEra> era,
+             std::shared_ptr<UnsyncedSectorStore> store);
+
+  virtual void FlushBuffers();
+  virtual uint64_t DroppedTraces();
+
+  ~EraTracker() {}
+
+  EraTracker(const EraTracker &) = delete;
+  EraTracker& operator=(const EraTracker &) = delete;
+
+ private:
+  std::shared_ptr<DmEra> era_;
+  std::shared_ptr<UnsyncedSectorStore> store_;
+  // First era that hasn't been added to the store
+  uint32_t since_era_;
+  uint64_t failed_flushes_;
+  std::mutex flush_mutex_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_TRACE_ERA_TRACKER_H_
@@ -0,0 +1,287 @@
+#include "tracing/ring_trace_handler.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <glog/logging.h>
+#include <time.h>
+
+namespace {
+
+using ::datto_linux_client::TimedInterval;
+
+// Traces older than this are assumed to have a bad timestamp
+const uint64_t MAX_TRACE_AGE_NANOS = 3600ULL * 1000 * 1000 * 1000;
+const uint64_t NANOS_PER_SECOND = 1000 * 1000 * 1000;
+
+uint64_t MonotonicNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * NANOS_PER_SECOND + now.tv_nsec;
+}
+
+bool IntervalLess(const TimedInterval &a, const TimedInterval &b) {
+  return a.interval.lower() < b.interval.lower();
+}
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+const size_t RingTraceHandler::RING_CAPACITY;
+const int RingTraceHandler::MERGE_INTERVAL_MILLIS;
+const int RingTraceHandler::DISCARD_APPLY_MILLIS;
+const size_t RingTraceHandler::MAX_PENDING_DISCARDS;
+const size_t RingTraceHandler::MAX_WRITE_TIME_INTERVALS;
+
+RingTraceHandler::RingTraceHandler(std::shared_ptr<UnsyncedSectorStore> store,
+                                   int num_cpus)
+    : TraceHandler(store),
+      rings_(),
+      extents_(),
+      batch_(),
+      merge_mutex_(),
+      pending_discards_(),
+      first_pending_ns_(0),
+      discards_overflowed_(false),
+      write_times_(),
+      forgotten_write_ns_(0),
+      latest_write_ns_(0),
+      keep_write_times_(false),
+      write_times_mutex_(),
+      stop_merge_(false),
+      stop_mutex_(),
+      stop_var_() {
+  for (int i = 0; i < num_cpus; ++i) {
+    rings_.push_back(
+        std::unique_ptr<TraceRing>(new TraceRing(RING_CAPACITY)));
+  }
+  merge_thread_ = std::thread(&RingTraceHandler::DoMerge, this);
+}
+
+void RingTraceHandler::AddTrace(const struct blk_io_trace &trace_data) {
+  if (!(trace_data.action & BLK_TC_ACT(BLK_TC_WRITE))) {
+    VLOG(2) << "Discarding trace with action 0x"
+            << std::hex << trace_data.action << std::dec;
+    return;
+  }
+
+  if (trace_data.bytes == 0) {
+    return;
+  }
+
+  TraceExtent extent;
+  extent.sector = trace_data.sector;
+  extent.num_sectors = trace_data.bytes / SECTOR_SIZE;
+  extent.time_ns = trace_data.time;
+  // Discards are also marked as writes
+  extent.is_discard = trace_data.action & BLK_TC_ACT(BLK_TC_DISCARD);
+
+  if (trace_data.cpu < rings_.size() && rings_[trace_data.cpu]->Push(extent)) {
+    return;
+  }
+
+  // The ring is full (or the CPU is unknown), so take the slow path rather
+  // than block the tracer and risk the kernel dropping traces. A discard is
+  // added as a write, which is always safe.
+  VLOG(1) << "Adding trace for cpu " << trace_data.cpu << " directly";
+  SectorInterval interval(extent.sector, extent.sector + extent.num_sectors);
+  {
+    std::lock_guard<std::mutex> write_times_lock(write_times_mutex_);
+    NoteWrite(interval, extent.time_ns, keep_write_times_);
+  }
+  store_->AddInterval(interval, time(NULL));
+}
+
+void RingTraceHandler::Flush() {
+  std::lock_guard<std::mutex> merge_lock(merge_mutex_);
+  DrainRings();
+  ApplyDiscards();
+}
+
+void RingTraceHandler::NoteWrite(const SectorInterval &interval,
+                                 uint64_t time_ns, bool keep_time) {
+  latest_write_ns_ = std::max(latest_write_ns_, time_ns + 1);
+  if (!keep_time) {
+    forgotten_write_ns_ = std::max(forgotten_write_ns_, time_ns + 1);
+    return;
+  }
+  if (write_times_.iterative_size() >= MAX_WRITE_TIME_INTERVALS) {
+    discards_overflowed_ = true;
+    return;
+  }
+  write_times_ += std::make_pair(interval, time_ns + 1);
+}
+
+void RingTraceHandler::ApplyDiscards() {
+  std::lock_guard<std::mutex> write_times_lock(write_times_mutex_);
+  if (discards_overflowed_) {
+    LOG(WARNING) << "Dropping " << pending_discards_.size()
+                 << " discards, too many to track";
+  } else if (!pending_discards_.empty()) {
+    std::vector<SectorInterval> discarded;
+    for (const PendingDiscard &discard : pending_discards_) {
+      SectorSet remaining;
+      remaining += discard.interval;
+      auto range = write_times_.equal_range(discard.interval);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second > discard.time_ns) {
+          remaining -= it->first;
+        }
+      }
+      for (const SectorInterval &interval : remaining) {
+        discarded.push_back(interval);
+      }
+    }
+    VLOG(2) << "Discarding " << discarded.size() << " intervals";
+    store_->DiscardIntervals(discarded);
+  }
+
+  pending_discards_.clear();
+  first_pending_ns_ = 0;
+  write_times_.clear();
+  forgotten_write_ns_ = latest_write_ns_;
+  keep_write_times_ = false;
+  discards_overflowed_ = false;
+}
+
+bool RingTraceHandler::ShouldApplyDiscards() {
+  if (pending_discards_.empty()) {
+    return false;
+  }
+  if (pending_discards_.size() >= MAX_PENDING_DISCARDS / 2) {
+    return true;
+  }
+  {
+    std::lock_guard<std::mutex> write_times_lock(write_times_mutex_);
+    if (discards_overflowed_ ||
+        write_times_.iterative_size() >= MAX_WRITE_TIME_INTERVALS / 2) {
+      return true;
+    }
+  }
+  return MonotonicNanos() - first_pending_ns_ >=
+         DISCARD_APPLY_MILLIS * 1000000ULL;
+}
+
+void RingTraceHandler::DrainRings() {
+  extents_.clear();
+  batch_.clear();
+
+  bool has_discard = false;
+  TraceExtent extent;
+  for (auto &ring : rings_) {
+    while (ring->Pop(&extent)) {
+      has_discard = has_discard || extent.is_discard;
+      extents_.push_back(extent);
+    }
+  }
+
+  if (extents_.empty()) {
+    return;
+  }
+
+  time_t now = time(NULL);
+  uint64_t now_ns = MonotonicNanos();
+
+  {
+    std::lock_guard<std::mutex> write_times_lock(write_times_mutex_);
+    // The rings are drained one after another, so a write drained with a
+    // discard can be newer than it wherever it is in the batch
+    bool keep_times = has_discard || !pending_discards_.empty();
+    for (const TraceExtent &drained : extents_) {
+      SectorInterval interval(drained.sector,
+                              drained.sector + drained.num_sectors);
+      if (drained.is_discard) {
+        if (forgotten_write_ns_ > drained.time_ns) {
+          VLOG(2) << "Dropping discard of " << interval
+                  << ", it may have been written since";
+        } else if (pending_discards_.size() < MAX_PENDING_DISCARDS) {
+          if (pending_discards_.empty()) {
+            first_pending_ns_ = now_ns;
+          }
+          pending_discards_.push_back({interval, drained.time_ns});
+        } else {
+          discards_overflowed_ = true;
+        }
+        continue;
+      }
+      NoteWrite(interval, drained.time_ns, keep_times);
+
+      time_t epoch = now;
+      if (drained.time_ns <= now_ns &&
+          now_ns - drained.time_ns < MAX_TRACE_AGE_NANOS) {
+        epoch = now - (now_ns - drained.time_ns) / NANOS_PER_SECOND;
+      }
+      TimedInterval timed;
+      timed.interval = interval;
+      timed.epoch = epoch;
+      batch_.push_back(timed);
+    }
+    keep_write_times_ = !pending_discards_.empty();
+  }
+
+  if (batch_.empty()) {
+    return;
+  }
+
+  // Coalesce touching writes from the same second. Overlapping writes from
+  // different seconds are left for the store to merge.
+  std::sort(batch_.begin(), batch_.end(), IntervalLess);
+  size_t merged = 0;
+  for (size_t i = 1; i < batch_.size(); ++i) {
+    TimedInterval &last = batch_[merged];
+    const TimedInterval &next = batch_[i];
+    if (next.epoch == last.epoch &&
+        next.interval.lower() <= last.interval.upper()) {
+      last.interval = SectorInterval(
+          last.interval.lower(),
+          std::max(last.interval.upper(), next.interval.upper()));
+    } else {
+      batch_[++merged] = next;
+    }
+  }
+  batch_.resize(merged + 1);
+
+  VLOG(2) << "Adding " << batch_.size() << " merged intervals";
+  store_->AddIntervals(batch_);
+}
+
+// As this is the initial function of a thread, this method must not throw an
+// exception or the entire program will go down
+void RingTraceHandler::DoMerge() {
+  std::unique_lock<std::mutex> stop_lock(stop_mutex_);
+  while (!stop_merge_) {
+    stop_var_.wait_for(stop_lock,
+                       std::chrono::milliseconds(MERGE_INTERVAL_MILLIS),
+                       [&]{ return stop_merge_; });
+    try {
+      std::lock_guard<std::mutex> merge_lock(merge_mutex_);
+      DrainRings();
+      if (ShouldApplyDiscards()) {
+        ApplyDiscards();
+      }
+    } catch (const std::exception &e) {
+      LOG(ERROR) << "Exception while merging traces: " << e.what();
+    }
+  }
+}
+
+RingTraceHandler::~RingTraceHandler() {
+  {
+    std::lock_guard<std::mutex> stop_lock(stop_mutex_);
+    stop_merge_ = true;
+  }
+  stop_var_.notify_all();
+  if (merge_thread_.joinable()) {
+    merge_thread_.join();
+  }
+
+  try {
+    std::lock_guard<std::mutex> merge_lock(merge_mutex_);
+    DrainRings();
+  } catch (const std::exception &e) {
+    LOG(ERROR) << "Exception in RingTraceHandler destructor: " << e.what();
+  }
+}
+
+}
@@ -0,0 +1,110 @@
+#ifndef DATTO_CLIENT_BLOCK_TRACE_RING_TRACE_HANDLER_H_
+#define DATTO_CLIENT_BLOCK_TRACE_RING_TRACE_HANDLER_H_
+
+#include "tracing/trace_handler.h"
+#include "tracing/trace_ring.h"
+#include "unsynced_sector_manager/timed_interval.h"
+
+#include <boost/icl/interval_map.hpp>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace datto_linux_client {
+
+// RingTraceHandler keeps the CpuTracer threads away from the store lock.
+// Each CpuTracer pushes its writes into its own ring, and a merge thread
+// drains all of the rings every MERGE_INTERVAL_MILLIS, coalesces the
+// writes and adds them to the store with a single AddIntervals call.
+//
+// Writes are timestamped with the time in the trace rather than the time
+// they were merged.
+//
+// Discards are held back for up to DISCARD_APPLY_MILLIS, or until Flush
+// or too many are pending. Write times are only kept while discards are
+// pending, and any part of a discard written at or after the discard is
+// left out, so a discard that is read late never removes a newer write.
+// A discard older than a write whose time wasn't kept can't be checked.
+// It is dropped like any discard that can't be held, which only means
+// the discarded sectors are copied.
+class RingTraceHandler : public TraceHandler {
+ public:
+  static const size_t RING_CAPACITY = 4096;
+  static const int MERGE_INTERVAL_MILLIS = 10;
+  static const int DISCARD_APPLY_MILLIS = 1000;
+  static const size_t MAX_PENDING_DISCARDS = 4096;
+  static const size_t MAX_WRITE_TIME_INTERVALS = 65536;
+
+  // num_cpus is the number of CpuTracers, each of which must only add
+  // traces for its own CPU
+  RingTraceHandler(std::shared_ptr<UnsyncedSectorStore> store, int num_cpus);
+  virtual void AddTrace(const struct blk_io_trace &trace_data);
+  virtual void Flush();
+  virtual ~RingTraceHandler();
+
+  RingTraceHandler(const RingTraceHandler &) = delete;
+  RingTraceHandler& operator=(const RingTraceHandler &) = delete;
+
+ private:
+  // Latest trace time of the writes since the last Flush, plus one so
+  // a time of zero isn't absorbed
+  typedef boost::icl::interval_map<uint64_t,
+                                   uint64_t,
+                                   boost::icl::partial_absorber,
+                                   std::less,
+                                   boost::icl::inplace_max>::type
+      WriteTimeMap;
+
+  struct PendingDiscard {
+    SectorInterval interval;
+    uint64_t time_ns;
+  };
+
+  void DoMerge();
+  // Must be called with merge_mutex_ held
+  void DrainRings();
+  // Must be called with merge_mutex_ held, after DrainRings
+  void ApplyDiscards();
+  // Must be called with merge_mutex_ held
+  bool ShouldApplyDiscards();
+  // Must be called with write_times_mutex_ held
+  void NoteWrite(const SectorInterval &interval, uint64_t time_ns,
+                 bool keep_time);
+
+  std::vector<std::unique_ptr<TraceRing>> rings_;
+
+  // Only used by DrainRings, kept around to avoid allocating each time
+  std::vector<TraceExtent> extents_;
+  std::vector<TimedInterval> batch_;
+  std::mutex merge_mutex_;
+
+  std::vector<PendingDiscard> pending_discards_;
+  // Monotonic time the oldest pending discard was read
+  uint64_t first_pending_ns_;
+  // Set when a discard couldn't be held or the write times got too big,
+  // in which case the pending discards are dropped when next applied
+  bool discards_overflowed_;
+
+  // Also written by the slow path of AddTrace
+  WriteTimeMap write_times_;
+  // Latest trace time, plus one, of a write that isn't in write_times_.
+  // Discards from before it are dropped.
+  uint64_t forgotten_write_ns_;
+  // Latest trace time, plus one, of any write
+  uint64_t latest_write_ns_;
+  // Whether the slow path of AddTrace keeps write times, set while
+  // discards are pending
+  bool keep_write_times_;
+  std::mutex write_times_mutex_;
+
+  bool stop_merge_;
+  std::mutex stop_mutex_;
+  std::condition_variable stop_var_;
+  std::thread merge_thread_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_TRACE_RING_TRACE_HANDLER_H_
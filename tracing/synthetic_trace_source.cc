@@ -0,0 +1,141 @@
+#include "tracing/synthetic_trace_source.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "tracing/block_trace_exception.h"
+
+namespace {
+
+const uint64_t NANOS_PER_SECOND = 1000000000ULL;
+const uint64_t SECTOR_SIZE = 512;
+// zeta(n) is summed exactly up to here, and approximated with the integral
+// of x^-theta for the rest, so huge devices don't take long to set up
+const uint64_t MAX_EXACT_ZETA_TERMS = 1000000;
+
+double Zeta(uint64_t n, double theta) {
+  uint64_t exact_terms = std::min(n, MAX_EXACT_ZETA_TERMS);
+  double sum = 0;
+  for (uint64_t i = 1; i <= exact_terms; ++i) {
+    sum += 1.0 / pow(i, theta);
+  }
+  if (n > exact_terms) {
+    sum += (pow(n, 1 - theta) - pow(exact_terms, 1 - theta)) / (1 - theta);
+  }
+  return sum;
+}
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+SyntheticTraceSource::SyntheticTraceSource(
+    const SyntheticTraceOptions &options)
+    : options_(options),
+      num_blocks_(0),
+      generator_(options.seed),
+      writes_done_(0),
+      time_ns_(0),
+      next_sequential_block_(0),
+      zipf_alpha_(0),
+      zipf_zeta_n_(0),
+      zipf_eta_(0) {
+  if (options_.write_sectors == 0 ||
+      options_.device_sectors < options_.write_sectors ||
+      options_.writes_per_second == 0 || options_.num_cpus == 0) {
+    LOG(ERROR) << "Bad synthetic workload options";
+    throw BlockTraceException("Bad synthetic workload options");
+  }
+  num_blocks_ = options_.device_sectors / options_.write_sectors;
+
+  if (options_.pattern == ZIPFIAN_WRITES) {
+    double theta = options_.zipf_theta;
+    if (theta <= 0 || theta >= 1) {
+      LOG(ERROR) << "zipf_theta must be between 0 and 1, not " << theta;
+      throw BlockTraceException("Bad zipf_theta");
+    }
+    zipf_zeta_n_ = Zeta(num_blocks_, theta);
+    double zeta_2 = Zeta(2, theta);
+    zipf_alpha_ = 1 / (1 - theta);
+    zipf_eta_ = (1 - pow(2.0 / num_blocks_, 1 - theta)) /
+                (1 - zeta_2 / zipf_zeta_n_);
+  } else if (options_.pattern == BURSTY_WRITES &&
+             (options_.burst_writes == 0 || options_.burst_factor == 0)) {
+    LOG(ERROR) << "Bursts need a length and a rate";
+    throw BlockTraceException("Bad burst options");
+  }
+}
+
+bool SyntheticTraceSource::NextTrace(struct blk_io_trace *trace) {
+  if (writes_done_ >= options_.num_writes) {
+    return false;
+  }
+
+  memset(trace, 0, sizeof(*trace));
+  trace->magic = BLK_IO_TRACE_MAGIC | BLK_IO_TRACE_VERSION;
+  trace->action = BLK_TC_ACT(BLK_TC_WRITE) | __BLK_TA_QUEUE;
+  trace->time = time_ns_;
+  trace->sector = NextBlock() * options_.write_sectors;
+  trace->bytes = options_.write_sectors * SECTOR_SIZE;
+  trace->cpu = writes_done_ % options_.num_cpus;
+
+  writes_done_++;
+  time_ns_ += NextIntervalNanos();
+  return true;
+}
+
+uint64_t SyntheticTraceSource::NextBlock() {
+  switch (options_.pattern) {
+    case SEQUENTIAL_WRITES: {
+      uint64_t block = next_sequential_block_;
+      next_sequential_block_ = (next_sequential_block_ + 1) % num_blocks_;
+      return block;
+    }
+    case ZIPFIAN_WRITES:
+      return NextZipfianBlock();
+    case UNIFORM_RANDOM_WRITES:
+    case BURSTY_WRITES:
+    default: {
+      std::uniform_int_distribution<uint64_t> distribution(0,
+                                                           num_blocks_ - 1);
+      return distribution(generator_);
+    }
+  }
+}
+
+uint64_t SyntheticTraceSource::NextZipfianBlock() {
+  std::uniform_real_distribution<double> distribution(0.0, 1.0);
+  double u = distribution(generator_);
+  double uz = u * zipf_zeta_n_;
+
+  if (uz < 1.0) {
+    return 0;
+  }
+  if (uz < 1.0 + pow(0.5, options_.zipf_theta)) {
+    return std::min<uint64_t>(1, num_blocks_ - 1);
+  }
+  uint64_t block = num_blocks_ * pow(zipf_eta_ * u - zipf_eta_ + 1,
+                                     zipf_alpha_);
+  return std::min(block, num_blocks_ - 1);
+}
+
+uint64_t SyntheticTraceSource::NextIntervalNanos() {
+  uint64_t interval = NANOS_PER_SECOND / options_.writes_per_second;
+  if (options_.pattern != BURSTY_WRITES) {
+    return interval;
+  }
+
+  // Bursts run faster, and the idle time after each makes up for it
+  uint64_t burst_interval = interval / options_.burst_factor;
+  if (writes_done_ % options_.burst_writes != 0) {
+    return burst_interval;
+  }
+  return burst_interval +
+         (interval - burst_interval) * options_.burst_writes;
+}
+
+}
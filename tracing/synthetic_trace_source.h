@@ -0,0 +1,86 @@
+#ifndef DATTO_CLIENT_BLOCK_TRACE_SYNTHETIC_TRACE_SOURCE_H_
+#define DATTO_CLIENT_BLOCK_TRACE_SYNTHETIC_TRACE_SOURCE_H_
+
+#include <stdint.h>
+
+#include <random>
+
+#include "tracing/trace_source.h"
+
+namespace datto_linux_client {
+
+enum SyntheticPattern {
+  // Each write follows the previous one, wrapping at the end of the device
+  SEQUENTIAL_WRITES,
+  // Every block is equally likely
+  UNIFORM_RANDOM_WRITES,
+  // A few blocks get most writes, like a database or journal. The lowest
+  // blocks are the hottest.
+  ZIPFIAN_WRITES,
+  // Uniform random, in bursts at burst_factor times the rate followed by
+  // idle time that brings the average back down to writes_per_second
+  BURSTY_WRITES
+};
+
+struct SyntheticTraceOptions {
+  SyntheticPattern pattern;
+  uint64_t device_sectors;
+  // Each write is this many sectors, aligned to it
+  uint32_t write_sectors;
+  uint64_t num_writes;
+  uint64_t writes_per_second;
+  // Writes are spread over this many CPUs
+  uint32_t num_cpus;
+  // The same seed always gives the same stream
+  uint32_t seed;
+  // For ZIPFIAN_WRITES, closer to 1 is more skewed
+  double zipf_theta;
+  // For BURSTY_WRITES
+  uint32_t burst_writes;
+  uint32_t burst_factor;
+
+  SyntheticTraceOptions()
+      : pattern(UNIFORM_RANDOM_WRITES),
+        device_sectors(0),
+        write_sectors(8),
+        num_writes(0),
+        writes_per_second(1000),
+        num_cpus(1),
+        seed(1),
+        zipf_theta(0.99),
+        burst_writes(1000),
+        burst_factor(10) {}
+};
+
+// Generates write traces from a model of a workload, for benchmarking and
+// testing without tracing a real device
+class SyntheticTraceSource : public TraceSource {
+ public:
+  // Throws BlockTraceException if the options don't describe a workload
+  explicit SyntheticTraceSource(const SyntheticTraceOptions &options);
+
+  virtual bool NextTrace(struct blk_io_trace *trace);
+
+ private:
+  uint64_t NextBlock();
+  uint64_t NextZipfianBlock();
+  uint64_t NextIntervalNanos();
+
+  SyntheticTraceOptions options_;
+  uint64_t num_blocks_;
+  std::mt19937_64 generator_;
+
+  uint64_t writes_done_;
+  uint64_t time_ns_;
+  uint64_t next_sequential_block_;
+
+  // Constants of the zipfian generator from "Quickly Generating
+  // Billion-Record Synthetic Databases", Gray et al.
+  double zipf_alpha_;
+  double zipf_zeta_n_;
+  double zipf_eta_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_TRACE_SYNTHETIC_TRACE_SOURCE_H_
@@ -0,0 +1,89 @@
+#include "tracing/trace_buffer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+#include <linux/blktrace_api.h>
+
+#include "tracing/block_trace_exception.h"
+
+namespace {
+const size_t TRACE_SIZE = sizeof(struct blk_io_trace);
+} // namespace
+
+namespace datto_linux_client {
+
+const size_t TraceBuffer::BUFFER_BYTES;
+
+TraceBuffer::TraceBuffer()
+    : buffer_(BUFFER_BYTES),
+      buffered_bytes_(0),
+      skip_bytes_(0) { }
+
+ssize_t TraceBuffer::ReadFrom(int fd, TraceHandler *handler) {
+  // Read as many traces as fit after any partial trace from last time
+  ssize_t read_bytes = read(fd, buffer_.data() + buffered_bytes_,
+                            buffer_.size() - buffered_bytes_);
+  if (read_bytes == -1) {
+    if (errno == EAGAIN || errno == EINTR) {
+      return 0;
+    }
+    PLOG(ERROR) << "Error while reading trace file descriptor";
+    throw BlockTraceException("Couldn't read trace file descriptor");
+  }
+
+  buffered_bytes_ += read_bytes;
+  ParseTraces(handler);
+  return read_bytes;
+}
+
+void TraceBuffer::ParseTraces(TraceHandler *handler) {
+  size_t offset = 0;
+
+  if (skip_bytes_) {
+    offset = std::min(skip_bytes_, buffered_bytes_);
+    skip_bytes_ -= offset;
+  }
+
+  struct blk_io_trace trace;
+  while (buffered_bytes_ - offset >= TRACE_SIZE) {
+    // The buffer has no alignment guarantees for the trace
+    memcpy(&trace, buffer_.data() + offset, TRACE_SIZE);
+
+    // Sanity check
+    if (trace.magic != (BLK_IO_TRACE_MAGIC | BLK_IO_TRACE_VERSION)) {
+      LOG(ERROR) << "Bad magic number in trace";
+      throw BlockTraceException("Bad magic number in trace");
+    }
+
+    // Only trace types we don't care about have extra data at the end
+    size_t record_bytes = TRACE_SIZE + trace.pdu_len;
+    if (buffered_bytes_ - offset < record_bytes) {
+      if (record_bytes <= buffer_.size()) {
+        // The rest is in the next read
+        break;
+      }
+      skip_bytes_ = record_bytes - (buffered_bytes_ - offset);
+      offset = buffered_bytes_;
+      break;
+    }
+    offset += record_bytes;
+
+    if (!(trace.action & BLK_TC_ACT(BLK_TC_WRITE)) || trace.bytes == 0) {
+      continue;
+    }
+
+    handler->AddTrace(trace);
+  }
+
+  buffered_bytes_ -= offset;
+  if (buffered_bytes_) {
+    memmove(buffer_.data(), buffer_.data() + offset, buffered_bytes_);
+  }
+}
+
+}
@@ -0,0 +1,42 @@
+#ifndef DATTO_CLIENT_BLOCK_TRACE_TRACE_BUFFER_H_
+#define DATTO_CLIENT_BLOCK_TRACE_TRACE_BUFFER_H_
+
+#include <sys/types.h>
+
+#include <vector>
+
+#include "tracing/trace_handler.h"
+
+namespace datto_linux_client {
+
+// TraceBuffer reads blk_io_traces from a relay file many at a time and
+// hands the write traces to a TraceHandler. A trace split across reads is
+// kept until the rest of it is read.
+class TraceBuffer {
+ public:
+  static const size_t BUFFER_BYTES = 64 * 1024;
+
+  TraceBuffer();
+
+  // Reads from fd once and handles the traces that are complete. Returns
+  // the number of bytes read, which is 0 if nothing was ready.
+  //
+  // Throws BlockTraceException if reading fails or the data isn't trace
+  // data. Exceptions from handler are passed on.
+  ssize_t ReadFrom(int fd, TraceHandler *handler);
+
+  TraceBuffer(const TraceBuffer &) = delete;
+  TraceBuffer& operator=(const TraceBuffer &) = delete;
+
+ private:
+  void ParseTraces(TraceHandler *handler);
+
+  std::vector<char> buffer_;
+  size_t buffered_bytes_;
+  // Payload bytes still to be discarded from a trace too big for the buffer
+  size_t skip_bytes_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_TRACE_TRACE_BUFFER_H_
@@ -16,6 +16,11 @@ class TraceHandler {
 
   explicit TraceHandler(std::shared_ptr<UnsyncedSectorStore> store);
   virtual void AddTrace(const struct blk_io_trace &trace_data);
+
+  // Called by DeviceTracer after the trace buffers are flushed. Handlers
+  // that queue traces must hand them to the store before returning.
+  virtual void Flush() { }
+
   virtual ~TraceHandler() { }
 
   TraceHandler(const TraceHandler &) = delete;
@@ -25,7 +30,6 @@ class TraceHandler {
   // use UnsyncedSectorStore
   TraceHandler() { }
 
- private:
   std::shared_ptr<UnsyncedSectorStore> store_;
 };
 
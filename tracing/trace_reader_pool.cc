@@ -0,0 +1,301 @@
+#include "tracing/trace_reader_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sysinfo.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include <glog/logging.h>
+
+#include "cpu_placement/cpu_placement.h"
+#include "tracing/block_trace_exception.h"
+
+namespace {
+const int MAX_EVENTS = 64;
+} // namespace
+
+namespace datto_linux_client {
+
+const int TraceReaderPool::DEFAULT_NUM_THREADS;
+const int TraceReaderPool::HOTPLUG_CHECK_SECONDS;
+const int TraceReaderPool::DRAIN_MILLIS;
+
+TraceReaderPool::TraceReaderPool(int num_threads)
+    : TraceReaderPool(num_threads, std::vector<int>()) {}
+
+TraceReaderPool::TraceReaderPool(int num_threads,
+                                 const std::vector<int> &cpus)
+    : cpus_(cpus),
+      readers_(),
+      devices_(),
+      next_device_id_(0),
+      next_reader_(0),
+      stop_(false),
+      devices_mutex_() {
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  for (int i = 0; i < num_threads; ++i) {
+    std::unique_ptr<Reader> reader(new Reader());
+    reader->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reader->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reader->epoll_fd == -1 || reader->wake_fd == -1) {
+      PLOG(ERROR) << "Unable to create trace reader";
+      throw BlockTraceException("Unable to create trace reader");
+    }
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_ctl(reader->epoll_fd, EPOLL_CTL_ADD, reader->wake_fd,
+                  &event) == -1) {
+      PLOG(ERROR) << "epoll_ctl";
+      throw BlockTraceException("Unable to create trace reader");
+    }
+
+    readers_.push_back(std::move(reader));
+  }
+
+  // Only the first reader looks for CPUs coming online
+  for (size_t i = 0; i < readers_.size(); ++i) {
+    readers_[i]->thread = std::thread(&TraceReaderPool::DoRead, this,
+                                      readers_[i].get(), i == 0);
+  }
+}
+
+int TraceReaderPool::AddDevice(const std::string &trace_path_prefix,
+                               std::shared_ptr<TraceHandler> handler) {
+  std::lock_guard<std::mutex> devices_lock(devices_mutex_);
+  int device_id = next_device_id_++;
+  Device &device = devices_[device_id];
+  device.trace_path_prefix = trace_path_prefix;
+  device.handler = handler;
+  OpenNewFiles(&device);
+
+  if (device.files.empty()) {
+    LOG(ERROR) << "No trace files found at " << trace_path_prefix;
+    devices_.erase(device_id);
+    throw BlockTraceException("No trace files for device");
+  }
+  return device_id;
+}
+
+void TraceReaderPool::FlushDevice(int device_id) {
+  std::lock_guard<std::mutex> devices_lock(devices_mutex_);
+  if (!devices_.count(device_id)) {
+    return;
+  }
+
+  for (auto &cpu_file : devices_.at(device_id).files) {
+    TraceFile *file = cpu_file.second.get();
+    std::lock_guard<std::mutex> reader_lock(
+        readers_[file->reader_index]->mutex);
+    ReadFile(file, MAX_FLUSH_READS);
+  }
+}
+
+void TraceReaderPool::RemoveDevice(int device_id) {
+  std::lock_guard<std::mutex> devices_lock(devices_mutex_);
+  if (!devices_.count(device_id)) {
+    return;
+  }
+
+  for (auto &cpu_file : devices_.at(device_id).files) {
+    CloseFile(cpu_file.second.get());
+  }
+  devices_.erase(device_id);
+}
+
+size_t TraceReaderPool::FileCount(int device_id) const {
+  std::lock_guard<std::mutex> devices_lock(devices_mutex_);
+  if (!devices_.count(device_id)) {
+    return 0;
+  }
+  return devices_.at(device_id).files.size();
+}
+
+// As this is the initial function of a thread, this method must not throw an
+// exception or the entire program will go down
+void TraceReaderPool::DoRead(Reader *reader, bool check_hotplug) {
+  if (!cpus_.empty()) {
+    CpuPlacement::PinThread(cpus_);
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  const auto drain_interval = std::chrono::milliseconds(DRAIN_MILLIS);
+  auto next_drain = std::chrono::steady_clock::now() + drain_interval;
+  time_t next_hotplug_check = time(NULL) + HOTPLUG_CHECK_SECONDS;
+
+  while (!stop_) {
+    int num_events = epoll_wait(reader->epoll_fd, events, MAX_EVENTS,
+                                DRAIN_MILLIS);
+    if (num_events == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PLOG(ERROR) << "epoll_wait";
+      break;
+    }
+
+    {
+      std::lock_guard<std::mutex> reader_lock(reader->mutex);
+      for (int i = 0; i < num_events; ++i) {
+        TraceFile *file = static_cast<TraceFile *>(events[i].data.ptr);
+        if (file == nullptr) {
+          // Only used to wake up, so the value doesn't matter
+          uint64_t value;
+          if (read(reader->wake_fd, &value, sizeof(value)) == -1 &&
+              errno != EAGAIN) {
+            PLOG(ERROR) << "Unable to read wake event";
+          }
+          continue;
+        }
+        // The file may have been closed since epoll_wait returned
+        if (reader->files.count(file)) {
+          ReadFile(file, MAX_READS_PER_EVENT);
+        }
+      }
+
+      // Files that are busy enough to keep the reader from timing out
+      // still get drained, as others may never fill a sub-buffer
+      if (num_events == 0 ||
+          std::chrono::steady_clock::now() >= next_drain) {
+        DrainReader(reader);
+        next_drain = std::chrono::steady_clock::now() + drain_interval;
+      }
+    }
+
+    if (check_hotplug && time(NULL) >= next_hotplug_check) {
+      CheckHotplug();
+      next_hotplug_check = time(NULL) + HOTPLUG_CHECK_SECONDS;
+    }
+  }
+}
+
+void TraceReaderPool::DrainReader(Reader *reader) {
+  // ReadFile removes files it fails to read from the set
+  std::vector<TraceFile *> files(reader->files.begin(), reader->files.end());
+  for (TraceFile *file : files) {
+    ReadFile(file, MAX_READS_PER_EVENT);
+  }
+}
+
+void TraceReaderPool::CheckHotplug() {
+  try {
+    std::lock_guard<std::mutex> devices_lock(devices_mutex_);
+    for (auto &id_device : devices_) {
+      OpenNewFiles(&id_device.second);
+    }
+  } catch (const std::exception &e) {
+    LOG(ERROR) << "Error while checking for new CPUs: " << e.what();
+  }
+}
+
+void TraceReaderPool::ReadFile(TraceFile *file, int max_reads) {
+  if (!file->is_reading) {
+    return;
+  }
+
+  try {
+    for (int i = 0; i < max_reads; ++i) {
+      if (file->buffer.ReadFrom(file->fd, file->handler.get()) == 0) {
+        break;
+      }
+    }
+  } catch (const std::exception &e) {
+    LOG(ERROR) << "Exception while reading traces: " << e.what();
+    StopReading(file);
+  }
+}
+
+void TraceReaderPool::StopReading(TraceFile *file) {
+  Reader *reader = readers_[file->reader_index].get();
+  epoll_ctl(reader->epoll_fd, EPOLL_CTL_DEL, file->fd, nullptr);
+  reader->files.erase(file);
+  file->is_reading = false;
+}
+
+void TraceReaderPool::OpenNewFiles(Device *device) {
+  int num_cpus = get_nprocs_conf();
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    if (device->files.count(cpu)) {
+      continue;
+    }
+
+    // Relay only creates files for CPUs that have been online
+    std::string trace_path = device->trace_path_prefix + std::to_string(cpu);
+    int fd = open(trace_path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+      if (errno != ENOENT) {
+        PLOG(ERROR) << "Unable to open " << trace_path;
+      }
+      continue;
+    }
+    DLOG(INFO) << "Reading " << trace_path;
+
+    std::unique_ptr<TraceFile> file(new TraceFile());
+    file->fd = fd;
+    file->reader_index = next_reader_++ % readers_.size();
+    file->is_reading = true;
+    file->handler = device->handler;
+
+    Reader *reader = readers_[file->reader_index].get();
+    std::lock_guard<std::mutex> reader_lock(reader->mutex);
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = file.get();
+    if (epoll_ctl(reader->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      PLOG(ERROR) << "epoll_ctl on " << trace_path;
+      close(fd);
+      continue;
+    }
+    reader->files.insert(file.get());
+    device->files[cpu] = std::move(file);
+  }
+}
+
+void TraceReaderPool::CloseFile(TraceFile *file) {
+  {
+    std::lock_guard<std::mutex> reader_lock(
+        readers_[file->reader_index]->mutex);
+    if (file->is_reading) {
+      StopReading(file);
+    }
+  }
+  // Don't worry about the return value as we aren't writing anything
+  close(file->fd);
+}
+
+TraceReaderPool::~TraceReaderPool() {
+  stop_ = true;
+  for (auto &reader : readers_) {
+    uint64_t value = 1;
+    if (write(reader->wake_fd, &value, sizeof(value)) == -1) {
+      PLOG(ERROR) << "Unable to wake trace reader";
+    }
+  }
+  for (auto &reader : readers_) {
+    if (reader->thread.joinable()) {
+      reader->thread.join();
+    }
+  }
+
+  for (auto &id_device : devices_) {
+    for (auto &cpu_file : id_device.second.files) {
+      CloseFile(cpu_file.second.get());
+    }
+  }
+  for (auto &reader : readers_) {
+    close(reader->epoll_fd);
+    close(reader->wake_fd);
+  }
+}
+
+}
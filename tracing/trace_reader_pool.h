@@ -0,0 +1,117 @@
+#ifndef DATTO_CLIENT_BLOCK_TRACE_TRACE_READER_POOL_H_
+#define DATTO_CLIENT_BLOCK_TRACE_TRACE_READER_POOL_H_
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tracing/trace_buffer.h"
+#include "tracing/trace_handler.h"
+
+namespace datto_linux_client {
+
+// TraceReaderPool reads the relay files of every traced device with a
+// small, fixed number of threads instead of a thread per CPU per device.
+// Each thread waits on its own epoll set.
+//
+// Relay files only become readable once a sub-buffer fills, so a lightly
+// written device could hold its traces indefinitely. Each thread also
+// drains all of its files every DRAIN_MILLIS.
+//
+// The threads can be kept to a set of CPUs, such as the housekeeping CPUs
+// of CpuPlacement. The relay file of a CPU is read from wherever the
+// thread runs, so isolated CPUs aren't woken up by the drains.
+//
+// The trace file of a CPU is always read by the same thread, so a
+// TraceHandler gets the traces of each CPU from a single thread. Trace
+// files of CPUs that come online after a device is added are picked up
+// within HOTPLUG_CHECK_SECONDS.
+class TraceReaderPool {
+ public:
+  static const int DEFAULT_NUM_THREADS = 4;
+  static const int HOTPLUG_CHECK_SECONDS = 5;
+  static const int DRAIN_MILLIS = 100;
+  // Reads of one file before moving on to the next ready one
+  static const int MAX_READS_PER_EVENT = 16;
+  // Bounds a flush when the device is being written to continuously
+  static const int MAX_FLUSH_READS = 1024;
+
+  explicit TraceReaderPool(int num_threads);
+  // The threads are pinned to cpus, unless it is empty
+  TraceReaderPool(int num_threads, const std::vector<int> &cpus);
+  ~TraceReaderPool();
+
+  // Reads <trace_path_prefix><cpu> for every CPU with a trace file and
+  // hands the traces to handler. Returns the id used by the other methods.
+  int AddDevice(const std::string &trace_path_prefix,
+                std::shared_ptr<TraceHandler> handler);
+
+  // Returns once what the kernel had buffered for the device has been
+  // given to the handler
+  void FlushDevice(int device_id);
+
+  // Once this returns, the handler won't be called again
+  void RemoveDevice(int device_id);
+
+  // Number of trace files open for the device
+  size_t FileCount(int device_id) const;
+
+  TraceReaderPool(const TraceReaderPool &) = delete;
+  TraceReaderPool& operator=(const TraceReaderPool &) = delete;
+
+ private:
+  struct TraceFile {
+    int fd;
+    size_t reader_index;
+    bool is_reading;
+    std::shared_ptr<TraceHandler> handler;
+    TraceBuffer buffer;
+  };
+
+  struct Device {
+    std::string trace_path_prefix;
+    std::shared_ptr<TraceHandler> handler;
+    // By CPU number
+    std::map<int, std::unique_ptr<TraceFile>> files;
+  };
+
+  struct Reader {
+    int epoll_fd;
+    // Wakes the thread up when stopping
+    int wake_fd;
+    std::thread thread;
+    // Held while reading any of the files of this reader
+    std::mutex mutex;
+    // Events for files that are no longer here are ignored
+    std::set<TraceFile *> files;
+  };
+
+  void DoRead(Reader *reader, bool check_hotplug);
+  // Must be called with the reader's mutex held
+  void DrainReader(Reader *reader);
+  void CheckHotplug();
+  // Must be called with the reader's mutex held
+  void ReadFile(TraceFile *file, int max_reads);
+  void StopReading(TraceFile *file);
+
+  // These must be called with devices_mutex_ held
+  void OpenNewFiles(Device *device);
+  void CloseFile(TraceFile *file);
+
+  std::vector<int> cpus_;
+  std::vector<std::unique_ptr<Reader>> readers_;
+  std::map<int, Device> devices_;
+  int next_device_id_;
+  size_t next_reader_;
+  std::atomic<bool> stop_;
+  mutable std::mutex devices_mutex_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_TRACE_TRACE_READER_POOL_H_
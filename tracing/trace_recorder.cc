@@ -0,0 +1,143 @@
+#include "tracing/trace_recorder.h"
+
+#include <endian.h>
+#include <string.h>
+
+#include <glog/logging.h>
+
+#include "tracing/block_trace_exception.h"
+
+namespace datto_linux_client {
+
+const size_t TraceRecorder::RECORDS_PER_WRITE;
+
+TraceRecorder::TraceRecorder(const std::string &path,
+                             std::shared_ptr<TraceHandler> next_handler)
+    : path_(path),
+      next_handler_(next_handler),
+      file_(nullptr),
+      mutex_(),
+      records_(),
+      record_count_(0) {
+  file_ = fopen(path_.c_str(), "we");
+  if (file_ == nullptr) {
+    PLOG(ERROR) << "Unable to create " << path_;
+    throw BlockTraceException("Unable to create trace recording");
+  }
+
+  TraceRecordingHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_RECORDING_MAGIC, sizeof(header.magic));
+  header.version = htole32(TRACE_RECORDING_VERSION);
+  header.record_bytes = htole32(sizeof(TraceRecord));
+  if (fwrite(&header, sizeof(header), 1, file_) != 1) {
+    PLOG(ERROR) << "Unable to write " << path_;
+    fclose(file_);
+    throw BlockTraceException("Unable to write trace recording");
+  }
+
+  records_.reserve(RECORDS_PER_WRITE);
+  LOG(INFO) << "Recording traces to " << path_;
+}
+
+void TraceRecorder::AddTrace(const struct blk_io_trace &trace_data) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TraceRecord record;
+    record.time_ns = htole64(trace_data.time);
+    record.sector = htole64(trace_data.sector);
+    record.bytes = htole32(trace_data.bytes);
+    record.action = htole32(trace_data.action);
+    record.cpu = htole32(trace_data.cpu);
+    record.reserved = 0;
+    records_.push_back(record);
+    record_count_++;
+
+    if (records_.size() >= RECORDS_PER_WRITE) {
+      WriteRecords();
+    }
+  }
+
+  if (next_handler_) {
+    next_handler_->AddTrace(trace_data);
+  }
+}
+
+void TraceRecorder::Flush() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    WriteRecords();
+    fflush(file_);
+  }
+
+  if (next_handler_) {
+    next_handler_->Flush();
+  }
+}
+
+uint64_t TraceRecorder::RecordCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return record_count_;
+}
+
+void TraceRecorder::WriteRecords() {
+  if (records_.empty()) {
+    return;
+  }
+  // A recording is only a diagnostic, so tracking carries on without it
+  if (fwrite(records_.data(), sizeof(TraceRecord), records_.size(), file_) !=
+      records_.size()) {
+    PLOG(ERROR) << "Lost " << records_.size() << " records writing "
+                << path_;
+  }
+  records_.clear();
+}
+
+TraceRecorder::~TraceRecorder() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  WriteRecords();
+  if (fclose(file_)) {
+    PLOG(ERROR) << "Error closing " << path_;
+  }
+}
+
+TraceFileSource::TraceFileSource(const std::string &path)
+    : file_(nullptr) {
+  file_ = fopen(path.c_str(), "re");
+  if (file_ == nullptr) {
+    PLOG(ERROR) << "Unable to open " << path;
+    throw BlockTraceException("Unable to open trace recording");
+  }
+
+  TraceRecordingHeader header;
+  if (fread(&header, sizeof(header), 1, file_) != 1 ||
+      memcmp(header.magic, TRACE_RECORDING_MAGIC, sizeof(header.magic)) ||
+      le32toh(header.version) != TRACE_RECORDING_VERSION ||
+      le32toh(header.record_bytes) != sizeof(TraceRecord)) {
+    LOG(ERROR) << path << " isn't a trace recording";
+    fclose(file_);
+    throw BlockTraceException("Bad trace recording");
+  }
+}
+
+bool TraceFileSource::NextTrace(struct blk_io_trace *trace) {
+  TraceRecord record;
+  if (fread(&record, sizeof(record), 1, file_) != 1) {
+    return false;
+  }
+
+  memset(trace, 0, sizeof(*trace));
+  trace->magic = BLK_IO_TRACE_MAGIC | BLK_IO_TRACE_VERSION;
+  trace->time = le64toh(record.time_ns);
+  trace->sector = le64toh(record.sector);
+  trace->bytes = le32toh(record.bytes);
+  trace->action = le32toh(record.action);
+  trace->cpu = le32toh(record.cpu);
+  return true;
+}
+
+TraceFileSource::~TraceFileSource() {
+  fclose(file_);
+}
+
+}
@@ -0,0 +1,96 @@
+#ifndef DATTO_CLIENT_BLOCK_TRACE_TRACE_RECORDER_H_
+#define DATTO_CLIENT_BLOCK_TRACE_TRACE_RECORDER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "tracing/trace_handler.h"
+#include "tracing/trace_source.h"
+
+namespace datto_linux_client {
+
+// Trace recordings keep only what tracking uses of each trace, so they are
+// much smaller than blktrace output.
+//
+// A recording is a TraceRecordingHeader followed by TraceRecords in the
+// order they were handled. All integers are little endian.
+static const char TRACE_RECORDING_MAGIC[8] = {'D', 'A', 'T', 'T',
+                                              'O', 'T', 'R', 'C'};
+static const uint32_t TRACE_RECORDING_VERSION = 1;
+
+struct TraceRecordingHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_bytes;
+  uint64_t reserved[2];
+};
+
+struct TraceRecord {
+  uint64_t time_ns;
+  uint64_t sector;
+  uint32_t bytes;
+  uint32_t action;
+  uint32_t cpu;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(TraceRecordingHeader) == 32,
+              "TraceRecordingHeader must stay 32 bytes");
+static_assert(sizeof(TraceRecord) == 32, "TraceRecord must stay 32 bytes");
+
+// TraceRecorder writes every trace it gets to a recording, then passes it
+// on to next_handler if there is one
+class TraceRecorder : public TraceHandler {
+ public:
+  static const size_t RECORDS_PER_WRITE = 4096;
+
+  // Throws BlockTraceException if path can't be created
+  TraceRecorder(const std::string &path,
+                std::shared_ptr<TraceHandler> next_handler);
+
+  virtual void AddTrace(const struct blk_io_trace &trace_data);
+  // Writes out the buffered records as well
+  virtual void Flush();
+
+  uint64_t RecordCount() const;
+
+  virtual ~TraceRecorder();
+
+ private:
+  // Must be called with mutex_ held
+  void WriteRecords();
+
+  std::string path_;
+  std::shared_ptr<TraceHandler> next_handler_;
+  FILE *file_;
+
+  mutable std::mutex mutex_;
+  std::vector<TraceRecord> records_;
+  uint64_t record_count_;
+};
+
+// Reads back a recording made by TraceRecorder
+class TraceFileSource : public TraceSource {
+ public:
+  // Throws BlockTraceException if path isn't a recording
+  explicit TraceFileSource(const std::string &path);
+
+  virtual bool NextTrace(struct blk_io_trace *trace);
+
+  virtual ~TraceFileSource();
+
+  TraceFileSource(const TraceFileSource &) = delete;
+  TraceFileSource& operator=(const TraceFileSource &) = delete;
+
+ private:
+  FILE *file_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_TRACE_TRACE_RECORDER_H_
@@ -0,0 +1,44 @@
+#include "tracing/trace_replayer.h"
+
+#include <chrono>
+#include <thread>
+
+#include <glog/logging.h>
+
+namespace datto_linux_client {
+
+constexpr double TraceReplayer::AS_FAST_AS_POSSIBLE;
+
+TraceReplayer::TraceReplayer(std::shared_ptr<TraceHandler> handler)
+    : handler_(handler) {}
+
+uint64_t TraceReplayer::Replay(TraceSource *source, double speed) {
+  auto start = std::chrono::steady_clock::now();
+  uint64_t first_time_ns = 0;
+  uint64_t num_traces = 0;
+
+  struct blk_io_trace trace;
+  while (source->NextTrace(&trace)) {
+    if (num_traces == 0) {
+      first_time_ns = trace.time;
+    }
+
+    if (speed > AS_FAST_AS_POSSIBLE && trace.time > first_time_ns) {
+      auto offset = std::chrono::nanoseconds(
+          static_cast<uint64_t>((trace.time - first_time_ns) / speed));
+      std::this_thread::sleep_until(start + offset);
+    }
+
+    handler_->AddTrace(trace);
+    num_traces++;
+  }
+  handler_->Flush();
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  LOG(INFO) << "Replayed " << num_traces << " traces in "
+            << elapsed.count() << "ms";
+  return num_traces;
+}
+
+}
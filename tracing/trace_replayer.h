@@ -0,0 +1,37 @@
+#ifndef DATTO_CLIENT_BLOCK_TRACE_TRACE_REPLAYER_H_
+#define DATTO_CLIENT_BLOCK_TRACE_TRACE_REPLAYER_H_
+
+#include <stdint.h>
+
+#include <memory>
+
+#include "tracing/trace_handler.h"
+#include "tracing/trace_source.h"
+
+namespace datto_linux_client {
+
+// TraceReplayer feeds the traces of a TraceSource to a TraceHandler as if
+// they came from a DeviceTracer, so tracking and syncing can be measured
+// under a recorded or synthetic workload without root or a real device
+class TraceReplayer {
+ public:
+  // Replays as fast as the handler takes the traces
+  static constexpr double AS_FAST_AS_POSSIBLE = 0;
+
+  explicit TraceReplayer(std::shared_ptr<TraceHandler> handler);
+
+  // Hands every trace of source to the handler, then flushes it. With a
+  // speed of 1.0 the traces are spaced as in the source, 2.0 is twice as
+  // fast and so on. Returns the number of traces replayed.
+  uint64_t Replay(TraceSource *source, double speed);
+
+  TraceReplayer(const TraceReplayer &) = delete;
+  TraceReplayer& operator=(const TraceReplayer &) = delete;
+
+ private:
+  std::shared_ptr<TraceHandler> handler_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_TRACE_TRACE_REPLAYER_H_
@@ -0,0 +1,78 @@
+#ifndef DATTO_CLIENT_BLOCK_TRACE_TRACE_RING_H_
+#define DATTO_CLIENT_BLOCK_TRACE_TRACE_RING_H_
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+namespace datto_linux_client {
+
+// A write or discard decoded from a blk_io_trace
+struct TraceExtent {
+  uint64_t sector;
+  uint64_t num_sectors;
+  // Trace time in nanoseconds on the monotonic clock
+  uint64_t time_ns;
+  bool is_discard;
+};
+
+// Fixed size ring for handing TraceExtents from exactly one producer
+// thread to exactly one consumer thread without locking.
+class TraceRing {
+ public:
+  // capacity is rounded up to a power of two
+  explicit TraceRing(size_t capacity)
+      : mask_(RoundUp(capacity) - 1),
+        extents_(new TraceExtent[mask_ + 1]),
+        head_(0),
+        tail_(0) { }
+
+  // Producer only. Returns false if the ring is full.
+  bool Push(const TraceExtent &extent) {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_) {
+      return false;
+    }
+    extents_[tail & mask_] = extent;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Returns false if the ring is empty.
+  bool Pop(TraceExtent *const extent) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *extent = extents_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  TraceRing(const TraceRing &) = delete;
+  TraceRing& operator=(const TraceRing &) = delete;
+
+ private:
+  static size_t RoundUp(size_t capacity) {
+    size_t rounded = 1;
+    while (rounded < capacity) {
+      rounded <<= 1;
+    }
+    return rounded;
+  }
+
+  const uint64_t mask_;
+  std::unique_ptr<TraceExtent[]> extents_;
+
+  // Keep the two indexes on separate cache lines so the producer and
+  // consumer don't bounce a line between CPUs
+  static const size_t CACHE_LINE_SIZE = 64;
+  char pad0_[CACHE_LINE_SIZE];
+  std::atomic<uint64_t> head_;
+  char pad1_[CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>)];
+  std::atomic<uint64_t> tail_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_TRACE_TRACE_RING_H_
@@ -0,0 +1,25 @@
+#ifndef DATTO_CLIENT_BLOCK_TRACE_TRACE_SOURCE_H_
+#define DATTO_CLIENT_BLOCK_TRACE_TRACE_SOURCE_H_
+
+#include <linux/blktrace_api.h>
+
+namespace datto_linux_client {
+
+// A stream of traces that doesn't come from the kernel, such as a
+// recording or a synthetic workload. Traces come in time order, with
+// blk_io_trace::time in nanoseconds.
+class TraceSource {
+ public:
+  // Fills in trace and returns true, or returns false at the end of the
+  // stream
+  virtual bool NextTrace(struct blk_io_trace *trace) = 0;
+
+  virtual ~TraceSource() {}
+
+ protected:
+  TraceSource() {}
+};
+
+}
+
+#endif //  DATTO_CLIENT_BLOCK_TRACE_TRACE_SOURCE_H_
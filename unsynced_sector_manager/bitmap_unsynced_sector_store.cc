@@ -0,0 +1,601 @@
+#include "unsynced_sector_manager/bitmap_unsynced_sector_store.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+#include "unsynced_sector_manager/unsynced_tracking_exception.h"
+
+namespace {
+
+const uint64_t SECTOR_SIZE = 512;
+const uint64_t BITS_PER_WORD = 64;
+const uint64_t ALL_BITS = ~0ULL;
+
+inline uint64_t NumWords(uint64_t num_bits) {
+  return (num_bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+}
+
+// Bits [first_bit, end_bit) of a single word, both relative to the word
+inline uint64_t WordMask(uint64_t first_bit, uint64_t end_bit) {
+  uint64_t mask = ALL_BITS << first_bit;
+  if (end_bit < BITS_PER_WORD) {
+    mask &= ~(ALL_BITS << end_bit);
+  }
+  return mask;
+}
+
+// Applies func(word_index, mask) to every word touched by [first, end)
+template <typename Func>
+void ForEachWord(uint64_t first, uint64_t end, Func func) {
+  while (first < end) {
+    uint64_t word = first / BITS_PER_WORD;
+    uint64_t word_end = std::min(end, (word + 1) * BITS_PER_WORD);
+    func(word, WordMask(first % BITS_PER_WORD,
+                        word_end - word * BITS_PER_WORD));
+    first = word_end;
+  }
+}
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+BitmapUnsyncedSectorStore::BitmapUnsyncedSectorStore(
+    int volatile_seconds,
+    uint64_t device_size_bytes,
+    uint64_t block_size_bytes)
+    : volatile_window_(volatile_seconds),
+      device_size_sectors_(device_size_bytes / SECTOR_SIZE),
+      sectors_per_block_(std::max(block_size_bytes / SECTOR_SIZE,
+                                  (uint64_t)1)),
+      num_blocks_((device_size_sectors_ + sectors_per_block_ - 1) /
+                  sectors_per_block_),
+      dirty_words_(NumWords(num_blocks_), 0),
+      summary_words_(NumWords(dirty_words_.size()), 0),
+      synced_words_(NumWords(num_blocks_), 0),
+      chunk_times_((num_blocks_ + BLOCKS_PER_TIME_CHUNK - 1) /
+                   BLOCKS_PER_TIME_CHUNK, 0),
+      discarded_sector_set_(),
+      dirty_block_count_(0),
+      synced_block_count_(0),
+      cursor_block_(0),
+      mutex_(),
+      unsynced_sectors_(0),
+      synced_sectors_(0),
+      run_count_(0),
+      peak_extent_sectors_(0),
+      rewritten_sectors_(0),
+      discarded_sectors_(0),
+      recent_sectors_(),
+      heat_() {
+  if (block_size_bytes % SECTOR_SIZE) {
+    LOG(ERROR) << "Block size " << block_size_bytes
+               << " isn't a multiple of the sector size";
+    throw UnsyncedTrackingException("Bad block size for bitmap store");
+  }
+}
+
+void BitmapUnsyncedSectorStore::AddNonVolatileInterval(
+    const SectorInterval &sector_interval) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  uint64_t first_block, end_block;
+  if (ToBlocks(sector_interval, &first_block, &end_block)) {
+    SetDirty(first_block, end_block);
+    Undiscard(first_block, end_block);
+  }
+}
+
+void BitmapUnsyncedSectorStore::AddNonVolatileIntervals(
+    const std::vector<SectorInterval> &sorted_intervals) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  uint64_t first_block, end_block;
+  for (const SectorInterval &interval : sorted_intervals) {
+    if (ToBlocks(interval, &first_block, &end_block)) {
+      SetDirty(first_block, end_block);
+      Undiscard(first_block, end_block);
+    }
+  }
+}
+
+void BitmapUnsyncedSectorStore::AddInterval(
+    const SectorInterval &sector_interval,
+    const time_t epoch) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  CHECK_GT(epoch, volatile_window_.Seconds());
+  AddWrite(sector_interval, epoch);
+}
+
+void BitmapUnsyncedSectorStore::AddIntervals(
+    const std::vector<TimedInterval> &intervals) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  for (const TimedInterval &timed : intervals) {
+    CHECK_GT(timed.epoch, volatile_window_.Seconds());
+    AddWrite(timed.interval, timed.epoch);
+  }
+}
+
+void BitmapUnsyncedSectorStore::AddWrite(
+    const SectorInterval &sector_interval,
+    const time_t epoch) {
+  uint64_t first_block, end_block;
+  if (!ToBlocks(sector_interval, &first_block, &end_block)) {
+    return;
+  }
+
+  // Blocks that were already sent, and aren't already waiting to be sent
+  // again, will be sent a second time
+  uint64_t rewritten_blocks = 0;
+  ForEachWord(first_block, end_block, [&](uint64_t word, uint64_t mask) {
+    rewritten_blocks += __builtin_popcountll(
+        mask & synced_words_[word] & ~dirty_words_[word]);
+  });
+  rewritten_sectors_ += rewritten_blocks * sectors_per_block_;
+
+  SetDirty(first_block, end_block);
+  Undiscard(first_block, end_block);
+  MarkTime(first_block, end_block, epoch);
+  recent_sectors_.Add(epoch, (end_block - first_block) * sectors_per_block_);
+  heat_.AddWrite(sector_interval, epoch);
+}
+
+void BitmapUnsyncedSectorStore::ReturnClaimedIntervals(
+    const std::vector<ClaimedInterval> &claimed) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  uint64_t first_block, end_block;
+  for (const ClaimedInterval &returned : claimed) {
+    // Write times are kept by chunk and aren't cleared by claiming, so
+    // the interval stays as volatile as it was
+    if (ToBlocks(returned.interval, &first_block, &end_block)) {
+      ClearSynced(first_block, end_block);
+      SetDirty(first_block, end_block);
+      Undiscard(first_block, end_block);
+    }
+  }
+}
+
+void BitmapUnsyncedSectorStore::DiscardIntervals(
+    const std::vector<SectorInterval> &intervals) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  for (const SectorInterval &interval : intervals) {
+    // Round in, a partly discarded block still has data
+    uint64_t first_block = (interval.lower() + sectors_per_block_ - 1) /
+                           sectors_per_block_;
+    uint64_t end_block = std::min(interval.upper() / sectors_per_block_,
+                                  num_blocks_);
+    if (boost::icl::is_empty(interval) || first_block >= end_block) {
+      continue;
+    }
+    ClearDirty(first_block, end_block);
+    ClearSynced(first_block, end_block);
+
+    SectorInterval discarded = ToSectors(first_block, end_block);
+    discarded_sectors_ += boost::icl::cardinality(discarded) -
+        boost::icl::cardinality(discarded_sector_set_ & discarded);
+    discarded_sector_set_ += discarded;
+  }
+}
+
+void BitmapUnsyncedSectorStore::ClaimDiscardedIntervals(
+    std::vector<SectorInterval> *const output, size_t max_intervals) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  output->clear();
+  while (!discarded_sector_set_.empty() && output->size() < max_intervals) {
+    SectorInterval interval = *discarded_sector_set_.begin();
+    output->push_back(interval);
+    discarded_sector_set_ -= interval;
+    discarded_sectors_ -= boost::icl::cardinality(interval);
+  }
+}
+
+void BitmapUnsyncedSectorStore::RemoveInterval(
+    const SectorInterval &sector_interval) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  uint64_t first_block, end_block;
+  if (!ToBlocks(sector_interval, &first_block, &end_block)) {
+    return;
+  }
+  ClearDirty(first_block, end_block);
+  MarkSynced(first_block, end_block);
+}
+
+void BitmapUnsyncedSectorStore::ClaimIntervals(
+    std::vector<ClaimedInterval> *const output,
+    size_t max_intervals,
+    uint64_t max_sectors,
+    const time_t epoch,
+    bool defer_hot) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  CHECK_GT(epoch, volatile_window_.Seconds());
+  volatile_window_.Adapt(heat_);
+
+  ClaimPass(output, max_intervals, max_sectors, epoch, defer_hot);
+  if (defer_hot && output->empty()) {
+    // Only hot intervals are left
+    ClaimPass(output, max_intervals, max_sectors, epoch, false);
+  }
+}
+
+void BitmapUnsyncedSectorStore::ClaimPass(
+    std::vector<ClaimedInterval> *const output,
+    size_t max_intervals,
+    uint64_t max_sectors,
+    const time_t epoch,
+    bool skip_hot) {
+  output->clear();
+
+  if (max_sectors == 0) {
+    return;
+  }
+
+  // Always allow at least one block to be claimed
+  uint64_t blocks_left = std::max(max_sectors / sectors_per_block_,
+                                  (uint64_t)1);
+  // Start at the cursor, then wrap around to the beginning and stop once
+  // the starting point is reached again
+  const uint64_t start_block = cursor_block_;
+  uint64_t scan_block = cursor_block_;
+  uint64_t end_limit = num_blocks_;
+  bool wrapped = false;
+
+  while (output->size() < max_intervals && blocks_left > 0) {
+    uint64_t first_block = FindDirty(scan_block);
+    if (first_block >= end_limit) {
+      if (wrapped || start_block == 0) {
+        break;
+      }
+      wrapped = true;
+      end_limit = start_block;
+      scan_block = 0;
+      continue;
+    }
+
+    uint64_t run_end = std::min(FindClean(first_block), end_limit);
+    if (skip_hot && heat_.IsHot(ToSectors(first_block, run_end), epoch)) {
+      scan_block = run_end;
+      continue;
+    }
+
+    uint64_t end_block = std::min(run_end, first_block + blocks_left);
+
+    ClaimedInterval claimed;
+    claimed.interval = ToSectors(first_block, end_block);
+    claimed.is_volatile = IsVolatile(first_block, end_block, epoch);
+    claimed.epoch = LatestWrite(first_block, end_block);
+    output->push_back(claimed);
+
+    ClearDirty(first_block, end_block);
+    MarkSynced(first_block, end_block);
+
+    blocks_left -= end_block - first_block;
+    cursor_block_ = end_block;
+    scan_block = end_block;
+  }
+}
+
+// Return the dirty runs sequentially, starting after the last one returned
+bool BitmapUnsyncedSectorStore::GetInterval(SectorInterval *const output,
+                                            const time_t epoch) const {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  CHECK_GT(epoch, volatile_window_.Seconds());
+
+  uint64_t first_block = FindDirty(cursor_block_);
+  if (first_block == num_blocks_) {
+    first_block = FindDirty(0);
+  }
+
+  if (first_block == num_blocks_) {
+    *output = SectorInterval(0, 0);
+    cursor_block_ = 0;
+    return false;
+  }
+
+  uint64_t end_block = FindClean(first_block);
+  *output = ToSectors(first_block, end_block);
+  VLOG(2) << *output;
+
+  cursor_block_ = end_block;
+  return IsVolatile(first_block, end_block, epoch);
+}
+
+void BitmapUnsyncedSectorStore::ExportIntervals(SectorSet *const output,
+                                                bool reset) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  output->clear();
+  uint64_t first_block = FindDirty(0);
+  while (first_block < num_blocks_) {
+    uint64_t end_block = FindClean(first_block);
+    output->add(output->end(), ToSectors(first_block, end_block));
+    first_block = FindDirty(end_block);
+  }
+  if (reset) {
+    ClearAll();
+  }
+}
+
+void BitmapUnsyncedSectorStore::ClearIntervals() {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  ClearAll();
+}
+
+void BitmapUnsyncedSectorStore::ClearAll() {
+  std::fill(dirty_words_.begin(), dirty_words_.end(), 0);
+  std::fill(summary_words_.begin(), summary_words_.end(), 0);
+  std::fill(synced_words_.begin(), synced_words_.end(), 0);
+  std::fill(chunk_times_.begin(), chunk_times_.end(), 0);
+  discarded_sector_set_ = SectorSet();
+  dirty_block_count_ = 0;
+  synced_block_count_ = 0;
+  cursor_block_ = 0;
+
+  unsynced_sectors_ = 0;
+  synced_sectors_ = 0;
+  run_count_ = 0;
+  peak_extent_sectors_ = 0;
+  rewritten_sectors_ = 0;
+  discarded_sectors_ = 0;
+  recent_sectors_.Clear();
+  heat_.Clear();
+}
+
+void BitmapUnsyncedSectorStore::ClearSyncHistory() {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  std::fill(synced_words_.begin(), synced_words_.end(), 0);
+  synced_block_count_ = 0;
+  synced_sectors_ = 0;
+  rewritten_sectors_ = 0;
+}
+
+void BitmapUnsyncedSectorStore::ReInsertSyncHistory() {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  for (uint64_t word = 0; word < synced_words_.size(); ++word) {
+    uint64_t added = synced_words_[word] & ~dirty_words_[word];
+    if (added) {
+      dirty_words_[word] |= added;
+      summary_words_[word / BITS_PER_WORD] |= 1ULL << (word % BITS_PER_WORD);
+      dirty_block_count_ += __builtin_popcountll(added);
+    }
+    synced_words_[word] = 0;
+  }
+  synced_block_count_ = 0;
+  synced_sectors_ = 0;
+  rewritten_sectors_ = 0;
+  run_count_ = CountRuns(0, num_blocks_);
+  UpdateUnsyncedSectors();
+}
+
+uint64_t BitmapUnsyncedSectorStore::UnsyncedSectorCount() const {
+  return unsynced_sectors_;
+}
+
+StoreStatistics BitmapUnsyncedSectorStore::GetStatistics() const {
+  StoreStatistics stats;
+  stats.volatile_seconds = volatile_window_.Seconds();
+  stats.unsynced_sectors = unsynced_sectors_;
+  stats.volatile_sectors = std::min(
+      recent_sectors_.Count(time(NULL), stats.volatile_seconds),
+      stats.unsynced_sectors);
+  stats.interval_count = run_count_;
+  stats.synced_sectors = synced_sectors_;
+  stats.peak_extent_sectors = peak_extent_sectors_;
+  stats.rewritten_sectors = rewritten_sectors_;
+  // Memory use is fixed, so there is never a reason to coarsen
+  stats.granularity_sectors = sectors_per_block_;
+  stats.memory_bytes =
+      (dirty_words_.size() + summary_words_.size() + synced_words_.size()) *
+          sizeof(uint64_t) +
+      chunk_times_.size() * sizeof(time_t) +
+      discarded_sector_set_.iterative_size() * BYTES_PER_INTERVAL;
+  stats.discarded_sectors = discarded_sectors_;
+  return stats;
+}
+
+void BitmapUnsyncedSectorStore::SetAdaptiveVolatileSeconds(bool adaptive) {
+  volatile_window_.SetAdaptive(adaptive);
+}
+
+int BitmapUnsyncedSectorStore::VolatileSeconds() const {
+  return volatile_window_.Seconds();
+}
+
+void BitmapUnsyncedSectorStore::SetMemoryBudget(uint64_t budget_bytes) { }
+
+void BitmapUnsyncedSectorStore::UpdateUnsyncedSectors() {
+  uint64_t sector_count = dirty_block_count_ * sectors_per_block_;
+
+  // The last block can extend past the end of the device
+  uint64_t last_block = num_blocks_ - 1;
+  if (num_blocks_ &&
+      (dirty_words_[last_block / BITS_PER_WORD] &
+       (1ULL << (last_block % BITS_PER_WORD)))) {
+    sector_count -= num_blocks_ * sectors_per_block_ - device_size_sectors_;
+  }
+  unsynced_sectors_ = sector_count;
+  if (!dirty_block_count_) {
+    peak_extent_sectors_ = 0;
+  }
+}
+
+bool BitmapUnsyncedSectorStore::ToBlocks(const SectorInterval &sector_interval,
+                                         uint64_t *first_block,
+                                         uint64_t *end_block) const {
+  if (boost::icl::is_empty(sector_interval)) {
+    return false;
+  }
+  *first_block = sector_interval.lower() / sectors_per_block_;
+  *end_block = std::min(
+      (sector_interval.upper() + sectors_per_block_ - 1) / sectors_per_block_,
+      num_blocks_);
+  return *first_block < *end_block;
+}
+
+SectorInterval BitmapUnsyncedSectorStore::ToSectors(uint64_t first_block,
+                                                    uint64_t end_block) const {
+  return SectorInterval(first_block * sectors_per_block_,
+                        std::min(end_block * sectors_per_block_,
+                                 device_size_sectors_));
+}
+
+void BitmapUnsyncedSectorStore::SetDirty(uint64_t first_block,
+                                         uint64_t end_block) {
+  // Only runs touching the changed blocks or next to them can change
+  uint64_t runs_first = first_block ? first_block - 1 : 0;
+  uint64_t runs_end = std::min(end_block + 1, num_blocks_);
+  uint64_t runs_before = CountRuns(runs_first, runs_end);
+
+  ForEachWord(first_block, end_block, [&](uint64_t word, uint64_t mask) {
+    uint64_t added = mask & ~dirty_words_[word];
+    if (added) {
+      dirty_words_[word] |= added;
+      summary_words_[word / BITS_PER_WORD] |= 1ULL << (word % BITS_PER_WORD);
+      dirty_block_count_ += __builtin_popcountll(added);
+    }
+  });
+
+  run_count_ += CountRuns(runs_first, runs_end) - runs_before;
+  uint64_t length = (end_block - first_block) * sectors_per_block_;
+  if (length > peak_extent_sectors_) {
+    peak_extent_sectors_ = length;
+  }
+  UpdateUnsyncedSectors();
+}
+
+void BitmapUnsyncedSectorStore::ClearDirty(uint64_t first_block,
+                                           uint64_t end_block) {
+  uint64_t runs_first = first_block ? first_block - 1 : 0;
+  uint64_t runs_end = std::min(end_block + 1, num_blocks_);
+  uint64_t runs_before = CountRuns(runs_first, runs_end);
+
+  ForEachWord(first_block, end_block, [&](uint64_t word, uint64_t mask) {
+    uint64_t removed = mask & dirty_words_[word];
+    if (removed) {
+      dirty_words_[word] &= ~removed;
+      dirty_block_count_ -= __builtin_popcountll(removed);
+      if (!dirty_words_[word]) {
+        summary_words_[word / BITS_PER_WORD] &=
+            ~(1ULL << (word % BITS_PER_WORD));
+      }
+    }
+  });
+
+  run_count_ += CountRuns(runs_first, runs_end) - runs_before;
+  UpdateUnsyncedSectors();
+}
+
+void BitmapUnsyncedSectorStore::MarkSynced(uint64_t first_block,
+                                           uint64_t end_block) {
+  ForEachWord(first_block, end_block, [&](uint64_t word, uint64_t mask) {
+    uint64_t added = mask & ~synced_words_[word];
+    synced_words_[word] |= added;
+    synced_block_count_ += __builtin_popcountll(added);
+  });
+  synced_sectors_ = synced_block_count_ * sectors_per_block_;
+}
+
+void BitmapUnsyncedSectorStore::ClearSynced(uint64_t first_block,
+                                            uint64_t end_block) {
+  ForEachWord(first_block, end_block, [&](uint64_t word, uint64_t mask) {
+    uint64_t removed = mask & synced_words_[word];
+    synced_words_[word] &= ~removed;
+    synced_block_count_ -= __builtin_popcountll(removed);
+  });
+  synced_sectors_ = synced_block_count_ * sectors_per_block_;
+}
+
+void BitmapUnsyncedSectorStore::Undiscard(uint64_t first_block,
+                                          uint64_t end_block) {
+  if (discarded_sector_set_.empty()) {
+    return;
+  }
+  SectorInterval written = ToSectors(first_block, end_block);
+  discarded_sectors_ -=
+      boost::icl::cardinality(discarded_sector_set_ & written);
+  discarded_sector_set_ -= written;
+}
+
+void BitmapUnsyncedSectorStore::MarkTime(uint64_t first_block,
+                                         uint64_t end_block,
+                                         time_t epoch) {
+  for (uint64_t chunk = first_block / BLOCKS_PER_TIME_CHUNK;
+       chunk <= (end_block - 1) / BLOCKS_PER_TIME_CHUNK;
+       ++chunk) {
+    chunk_times_[chunk] = std::max(chunk_times_[chunk], epoch);
+  }
+}
+
+uint64_t BitmapUnsyncedSectorStore::FindDirty(uint64_t from_block) const {
+  if (from_block >= num_blocks_) {
+    return num_blocks_;
+  }
+
+  uint64_t word = from_block / BITS_PER_WORD;
+  uint64_t bits = dirty_words_[word] &
+                  (ALL_BITS << (from_block % BITS_PER_WORD));
+  if (bits) {
+    return word * BITS_PER_WORD + __builtin_ctzll(bits);
+  }
+
+  // Use the summary words to find the next word with a dirty block
+  uint64_t next_word = word + 1;
+  while (next_word < dirty_words_.size()) {
+    uint64_t summary_index = next_word / BITS_PER_WORD;
+    uint64_t summary = summary_words_[summary_index] &
+                       (ALL_BITS << (next_word % BITS_PER_WORD));
+    if (summary) {
+      uint64_t dirty_word = summary_index * BITS_PER_WORD +
+                            __builtin_ctzll(summary);
+      return dirty_word * BITS_PER_WORD +
+             __builtin_ctzll(dirty_words_[dirty_word]);
+    }
+    next_word = (summary_index + 1) * BITS_PER_WORD;
+  }
+  return num_blocks_;
+}
+
+uint64_t BitmapUnsyncedSectorStore::FindClean(uint64_t from_block) const {
+  uint64_t word = from_block / BITS_PER_WORD;
+  uint64_t bits = ~dirty_words_[word] &
+                  (ALL_BITS << (from_block % BITS_PER_WORD));
+  while (!bits) {
+    if (++word == dirty_words_.size()) {
+      return num_blocks_;
+    }
+    bits = ~dirty_words_[word];
+  }
+  return std::min(word * BITS_PER_WORD + __builtin_ctzll(bits), num_blocks_);
+}
+
+uint64_t BitmapUnsyncedSectorStore::CountRuns(uint64_t first_block,
+                                             uint64_t end_block) const {
+  // A run starts at every dirty block whose previous block is clean. The
+  // block before first_block is treated as clean so a run crossing
+  // first_block is counted.
+  uint64_t num_runs = 0;
+  uint64_t carry = 0;
+  ForEachWord(first_block, end_block, [&](uint64_t word, uint64_t mask) {
+    uint64_t dirty = dirty_words_[word] & mask;
+    num_runs += __builtin_popcountll(dirty & ~((dirty << 1) | carry));
+    carry = dirty >> (BITS_PER_WORD - 1);
+  });
+  return num_runs;
+}
+
+time_t BitmapUnsyncedSectorStore::LatestWrite(uint64_t first_block,
+                                              uint64_t end_block) const {
+  time_t latest = 0;
+  for (uint64_t chunk = first_block / BLOCKS_PER_TIME_CHUNK;
+       chunk <= (end_block - 1) / BLOCKS_PER_TIME_CHUNK;
+       ++chunk) {
+    latest = std::max(latest, chunk_times_[chunk]);
+  }
+  return latest;
+}
+
+bool BitmapUnsyncedSectorStore::IsVolatile(uint64_t first_block,
+                                           uint64_t end_block,
+                                           time_t epoch) const {
+  return LatestWrite(first_block, end_block) >
+         epoch - volatile_window_.Seconds();
+}
+
+}
@@ -0,0 +1,136 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_BITMAP_UNSYNCED_SECTOR_STORE_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_BITMAP_UNSYNCED_SECTOR_STORE_H_
+
+#include "unsynced_sector_manager/recent_sector_counter.h"
+#include "unsynced_sector_manager/unsynced_sector_store.h"
+#include "unsynced_sector_manager/volatile_window.h"
+#include "unsynced_sector_manager/write_heat_tracker.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+namespace datto_linux_client {
+
+// BitmapUnsyncedSectorStore tracks unsynced data with a dirty bitmap at
+// block granularity instead of an interval map. Memory use is fixed by the
+// size of the device and adding an interval never allocates, which makes it
+// a better fit for devices with many small, scattered writes.
+//
+// Every block has a dirty bit, and every 64 bit word of dirty bits has a
+// summary bit so large clean regions can be skipped quickly. Write times are
+// only kept per chunk of BLOCKS_PER_TIME_CHUNK blocks, so an interval is
+// considered volatile if anything in its chunks was written recently.
+//
+// Intervals are rounded out to whole blocks, so the intervals returned can
+// be larger than the ones that were added. Discards are rounded in, so only
+// whole blocks are discarded. As memory use is fixed, the memory budget is
+// ignored.
+class BitmapUnsyncedSectorStore : public UnsyncedSectorStore {
+ public:
+  static const uint64_t BLOCKS_PER_TIME_CHUNK = 256;
+
+  BitmapUnsyncedSectorStore(int volatile_seconds,
+                            uint64_t device_size_bytes,
+                            uint64_t block_size_bytes);
+  virtual ~BitmapUnsyncedSectorStore() {}
+
+  virtual void AddNonVolatileInterval(const SectorInterval &sector_interval);
+  virtual void AddNonVolatileIntervals(
+      const std::vector<SectorInterval> &sorted_intervals);
+  virtual void AddInterval(const SectorInterval &sector_interval,
+                           const time_t time);
+  virtual void AddIntervals(const std::vector<TimedInterval> &intervals);
+  virtual bool GetInterval(SectorInterval *const output,
+                           const time_t epoch) const;
+  virtual void ClaimIntervals(std::vector<ClaimedInterval> *const output,
+                              size_t max_intervals,
+                              uint64_t max_sectors,
+                              const time_t epoch,
+                              bool defer_hot);
+  virtual void ReturnClaimedIntervals(
+      const std::vector<ClaimedInterval> &claimed);
+  virtual void DiscardIntervals(const std::vector<SectorInterval> &intervals);
+  virtual void ClaimDiscardedIntervals(
+      std::vector<SectorInterval> *const output, size_t max_intervals);
+  virtual void RemoveInterval(const SectorInterval &sector_interval);
+  virtual void ExportIntervals(SectorSet *const output, bool reset);
+  virtual void ClearIntervals();
+  virtual void ClearSyncHistory();
+  virtual void ReInsertSyncHistory();
+  virtual uint64_t UnsyncedSectorCount() const;
+  virtual StoreStatistics GetStatistics() const;
+  virtual void SetAdaptiveVolatileSeconds(bool adaptive);
+  virtual int VolatileSeconds() const;
+  // Memory use is fixed by the size of the device, so this does nothing
+  virtual void SetMemoryBudget(uint64_t budget_bytes);
+
+  BitmapUnsyncedSectorStore(const BitmapUnsyncedSectorStore &) = delete;
+  BitmapUnsyncedSectorStore& operator=(
+      const BitmapUnsyncedSectorStore &) = delete;
+
+ private:
+  // Returns false if the interval doesn't cover any blocks
+  bool ToBlocks(const SectorInterval &sector_interval,
+                uint64_t *first_block, uint64_t *end_block) const;
+  SectorInterval ToSectors(uint64_t first_block, uint64_t end_block) const;
+
+  void ClearAll();
+  void AddWrite(const SectorInterval &sector_interval, const time_t epoch);
+  void ClaimPass(std::vector<ClaimedInterval> *const output,
+                 size_t max_intervals, uint64_t max_sectors,
+                 const time_t epoch, bool skip_hot);
+
+  // These keep the counters up to date
+  void SetDirty(uint64_t first_block, uint64_t end_block);
+  void ClearDirty(uint64_t first_block, uint64_t end_block);
+  void UpdateUnsyncedSectors();
+  void MarkSynced(uint64_t first_block, uint64_t end_block);
+  void ClearSynced(uint64_t first_block, uint64_t end_block);
+  void Undiscard(uint64_t first_block, uint64_t end_block);
+  void MarkTime(uint64_t first_block, uint64_t end_block, time_t epoch);
+
+  // Returns num_blocks_ if there is no dirty block at or after from_block
+  uint64_t FindDirty(uint64_t from_block) const;
+  // Returns the first clean block at or after from_block
+  uint64_t FindClean(uint64_t from_block) const;
+  // Number of dirty runs that overlap [first_block, end_block)
+  uint64_t CountRuns(uint64_t first_block, uint64_t end_block) const;
+
+  // Latest write time of the chunks the blocks are in
+  time_t LatestWrite(uint64_t first_block, uint64_t end_block) const;
+  bool IsVolatile(uint64_t first_block, uint64_t end_block,
+                  time_t epoch) const;
+
+  VolatileWindow volatile_window_;
+  const uint64_t device_size_sectors_;
+  const uint64_t sectors_per_block_;
+  const uint64_t num_blocks_;
+
+  std::vector<uint64_t> dirty_words_;
+  std::vector<uint64_t> summary_words_;
+  std::vector<uint64_t> synced_words_;
+  std::vector<time_t> chunk_times_;
+  // Whole blocks, in sectors
+  SectorSet discarded_sector_set_;
+
+  uint64_t dirty_block_count_;
+  uint64_t synced_block_count_;
+  mutable uint64_t cursor_block_;
+  mutable std::mutex mutex_;
+
+  std::atomic<uint64_t> unsynced_sectors_;
+  std::atomic<uint64_t> synced_sectors_;
+  std::atomic<uint64_t> run_count_;
+  std::atomic<uint64_t> peak_extent_sectors_;
+  std::atomic<uint64_t> rewritten_sectors_;
+  std::atomic<uint64_t> discarded_sectors_;
+  RecentSectorCounter recent_sectors_;
+  WriteHeatTracker heat_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_BITMAP_UNSYNCED_SECTOR_STORE_H_
@@ -0,0 +1,126 @@
+#include "unsynced_sector_manager/change_export.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "unsynced_sector_manager/unsynced_tracking_exception.h"
+
+namespace {
+
+using ::datto_linux_client::UnsyncedTrackingException;
+
+const uint64_t SECTOR_SIZE = 512;
+
+void WriteAll(int fd, const void *buf, size_t num_bytes) {
+  const char *pos = static_cast<const char *>(buf);
+  while (num_bytes > 0) {
+    ssize_t written = write(fd, pos, num_bytes);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PLOG(ERROR) << "Error writing change export";
+      throw UnsyncedTrackingException("Unable to write change export");
+    }
+    pos += written;
+    num_bytes -= written;
+  }
+}
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+void WriteChangeExport(const std::string &path,
+                       ChangeExportFormat format,
+                       const SectorSet &changed_sectors,
+                       uint64_t device_size_bytes,
+                       uint64_t block_size_bytes) {
+  if (block_size_bytes < SECTOR_SIZE || block_size_bytes % SECTOR_SIZE) {
+    LOG(ERROR) << "Bad block size " << block_size_bytes;
+    throw UnsyncedTrackingException("Bad block size for change export");
+  }
+
+  std::vector<uint64_t> entries;
+  if (format == RUN_LENGTH_EXPORT) {
+    entries.reserve(changed_sectors.iterative_size() * 2);
+    for (const auto &interval : changed_sectors) {
+      entries.push_back(htole64(interval.lower()));
+      entries.push_back(htole64(boost::icl::cardinality(interval)));
+    }
+  } else if (format == BITMAP_EXPORT) {
+    const uint64_t sectors_per_block = block_size_bytes / SECTOR_SIZE;
+    const uint64_t num_blocks =
+        (device_size_bytes + block_size_bytes - 1) / block_size_bytes;
+    entries.resize((num_blocks + 63) / 64, 0);
+    for (const auto &interval : changed_sectors) {
+      uint64_t first_block = interval.lower() / sectors_per_block;
+      uint64_t end_block = std::min(
+          (interval.upper() + sectors_per_block - 1) / sectors_per_block,
+          num_blocks);
+      for (uint64_t block = first_block; block < end_block;) {
+        uint64_t bit = block % 64;
+        uint64_t num_bits = std::min(64 - bit, end_block - block);
+        uint64_t mask = num_bits == 64 ? ~0ULL :
+                                         ((1ULL << num_bits) - 1) << bit;
+        entries[block / 64] |= mask;
+        block += num_bits;
+      }
+    }
+    for (uint64_t &word : entries) {
+      word = htole64(word);
+    }
+  } else {
+    throw UnsyncedTrackingException("Unknown change export format");
+  }
+
+  ChangeExportHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CHANGE_EXPORT_MAGIC, sizeof(header.magic));
+  header.version = htole32(CHANGE_EXPORT_VERSION);
+  header.format = htole32(format);
+  header.device_size_bytes = htole64(device_size_bytes);
+  header.block_size_bytes = htole64(block_size_bytes);
+  header.entry_count = htole64(format == RUN_LENGTH_EXPORT ?
+                               entries.size() / 2 : entries.size());
+  header.data_offset = htole64(sizeof(header));
+
+  std::string temp_path = path + ".tmp";
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0600);
+  if (fd == -1) {
+    PLOG(ERROR) << "Unable to open " << temp_path;
+    throw UnsyncedTrackingException("Unable to create change export");
+  }
+
+  try {
+    WriteAll(fd, &header, sizeof(header));
+    WriteAll(fd, entries.data(), entries.size() * sizeof(uint64_t));
+    if (fsync(fd)) {
+      PLOG(ERROR) << "fsync of " << temp_path;
+      throw UnsyncedTrackingException("Unable to sync change export");
+    }
+  } catch (...) {
+    close(fd);
+    unlink(temp_path.c_str());
+    throw;
+  }
+
+  close(fd);
+  if (rename(temp_path.c_str(), path.c_str())) {
+    PLOG(ERROR) << "Unable to rename " << temp_path << " to " << path;
+    unlink(temp_path.c_str());
+    throw UnsyncedTrackingException("Unable to move change export");
+  }
+}
+
+}
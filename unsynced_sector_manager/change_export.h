@@ -0,0 +1,58 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_CHANGE_EXPORT_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_CHANGE_EXPORT_H_
+
+#include "unsynced_sector_manager/sector_set.h"
+
+#include <string>
+#include <stdint.h>
+
+namespace datto_linux_client {
+
+// Changed block exports let other tools read which parts of a device have
+// changed, without going through dattod.
+//
+// An export file is a ChangeExportHeader followed by the entries, starting
+// at data_offset. All integers are little endian.
+//
+//   RUN_LENGTH: entry_count pairs of uint64_t, the first sector and the
+//               number of sectors of each changed run, in order
+//   BITMAP:     entry_count uint64_t words, where bit n of word w is set if
+//               block (w * 64 + n) changed
+//
+// Entries are 8 byte aligned so the file can be mmap()ed and used in place.
+enum ChangeExportFormat {
+  RUN_LENGTH_EXPORT = 0,
+  BITMAP_EXPORT = 1
+};
+
+static const char CHANGE_EXPORT_MAGIC[8] = {'D', 'A', 'T', 'T',
+                                            'O', 'C', 'B', 'T'};
+static const uint32_t CHANGE_EXPORT_VERSION = 1;
+
+struct ChangeExportHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t format;
+  uint64_t device_size_bytes;
+  uint64_t block_size_bytes;
+  uint64_t entry_count;
+  uint64_t data_offset;
+  uint64_t reserved[2];
+};
+
+static_assert(sizeof(ChangeExportHeader) == 64,
+              "ChangeExportHeader must stay 64 bytes");
+
+// Writes changed_sectors to path. The file is written next to path and
+// renamed into place, so readers never see a partial export.
+//
+// Throws UnsyncedTrackingException on failure.
+void WriteChangeExport(const std::string &path,
+                       ChangeExportFormat format,
+                       const SectorSet &changed_sectors,
+                       uint64_t device_size_bytes,
+                       uint64_t block_size_bytes);
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_CHANGE_EXPORT_H_
@@ -0,0 +1,136 @@
+#include "unsynced_sector_manager/change_history.h"
+#include "unsynced_sector_manager/interval_coarsening.h"
+#include "unsynced_sector_manager/interval_unsynced_sector_store.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace datto_linux_client {
+
+ChangeHistory::ChangeHistory()
+    : generation_map_(),
+      generation_(0),
+      is_recording_(false),
+      memory_budget_bytes_(UnsyncedSectorStore::DEFAULT_MEMORY_BUDGET_BYTES),
+      granularity_sectors_(1),
+      mutex_() { }
+
+void ChangeHistory::AddWrite(const SectorInterval &interval) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (is_recording_) {
+    generation_map_ += std::make_pair(interval, generation_);
+    EnforceMemoryBudget();
+  }
+}
+
+void ChangeHistory::AddWrites(const std::vector<TimedInterval> &intervals) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (is_recording_) {
+    for (const TimedInterval &timed : intervals) {
+      generation_map_ += std::make_pair(timed.interval, generation_);
+    }
+    EnforceMemoryBudget();
+  }
+}
+
+uint64_t ChangeHistory::StartGeneration() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  is_recording_ = true;
+  return ++generation_;
+}
+
+void ChangeHistory::AddChangedSince(uint64_t generation,
+                                    SectorSet *const output) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &interval_pair : generation_map_) {
+    if (interval_pair.second >= generation) {
+      output->add(interval_pair.first);
+    }
+  }
+}
+
+void ChangeHistory::Prune(uint64_t generation) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (generation == 0) {
+    generation_map_ = GenerationMap();
+    is_recording_ = false;
+    granularity_sectors_ = 1;
+    return;
+  }
+
+  // The map is ordered by sector, so the kept segments can be appended
+  GenerationMap pruned;
+  for (const auto &interval_pair : generation_map_) {
+    if (interval_pair.second >= generation) {
+      pruned.add(pruned.end(), interval_pair);
+    }
+  }
+  generation_map_.swap(pruned);
+}
+
+uint64_t ChangeHistory::IntervalCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return generation_map_.iterative_size();
+}
+
+void ChangeHistory::SetMemoryBudget(uint64_t budget_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  memory_budget_bytes_ = budget_bytes;
+  EnforceMemoryBudget();
+}
+
+uint64_t ChangeHistory::GranularitySectors() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return granularity_sectors_;
+}
+
+void ChangeHistory::EnforceMemoryBudget() {
+  uint64_t memory_bytes = generation_map_.iterative_size() *
+                          UnsyncedSectorStore::BYTES_PER_INTERVAL;
+  if (!memory_budget_bytes_ || memory_bytes <= memory_budget_bytes_) {
+    return;
+  }
+
+  // Go well under the budget so this doesn't run again right away
+  const uint64_t target_intervals = memory_budget_bytes_ / 4 * 3 /
+                                    UnsyncedSectorStore::BYTES_PER_INTERVAL;
+  uint64_t granularity = IntervalUnsyncedSectorStore::FIRST_COARSE_SECTORS;
+  if (granularity_sectors_ > granularity) {
+    granularity = granularity_sectors_;
+  }
+  Coarsen(granularity);
+  while (generation_map_.iterative_size() > target_intervals &&
+         granularity < IntervalUnsyncedSectorStore::MAX_COARSE_SECTORS) {
+    granularity *= IntervalUnsyncedSectorStore::COARSEN_FACTOR;
+    Coarsen(granularity);
+  }
+
+  if (granularity != granularity_sectors_) {
+    LOG(WARNING) << "Change history over the memory budget of "
+                 << memory_budget_bytes_ << " bytes, now tracking in chunks "
+                 << "of " << granularity << " sectors";
+    granularity_sectors_ = granularity;
+  }
+}
+
+void ChangeHistory::Coarsen(uint64_t granularity_sectors) {
+  // A merged interval takes the latest generation of what it covers, so
+  // it is reported as changed to every destination any part of it is
+  GenerationMap coarse_map;
+  CoarsenIntervals(generation_map_, granularity_sectors,
+                   [&](GenerationMap::const_iterator first,
+                       const SectorInterval &interval) {
+    uint64_t generation = 0;
+    for (auto itr = first;
+         itr != generation_map_.end() &&
+             itr->first.lower() < interval.upper();
+         ++itr) {
+      generation = std::max(generation, itr->second);
+    }
+    coarse_map += std::make_pair(interval, generation);
+  });
+  generation_map_.swap(coarse_map);
+}
+
+}
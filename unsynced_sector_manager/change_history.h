@@ -0,0 +1,78 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_CHANGE_HISTORY_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_CHANGE_HISTORY_H_
+
+#include "unsynced_sector_manager/sector_interval.h"
+#include "unsynced_sector_manager/sector_set.h"
+#include "unsynced_sector_manager/timed_interval.h"
+#include "unsynced_sector_manager/unsynced_sector_store.h"
+
+#include <boost/icl/interval_map.hpp>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+namespace datto_linux_client {
+
+// ChangeHistory records the generation each sector of a device was last
+// written in. A single history is shared by every destination the device is
+// backed up to, and a destination only has to remember the generation its
+// last backup finished in, so memory doesn't grow with the number of
+// destinations.
+//
+// Nothing is recorded until the first generation is started. Like the
+// stores, the history is kept under a memory budget by rounding out dense
+// regions, so a destination that stops being backed up can't make it grow
+// without bound. That only costs copying extra data.
+class ChangeHistory {
+ public:
+  ChangeHistory();
+
+  void AddWrite(const SectorInterval &interval);
+  // Only locks once, the times are ignored
+  void AddWrites(const std::vector<TimedInterval> &intervals);
+
+  // Starts a new generation and returns its number. Writes from now on are
+  // recorded with that number or a later one.
+  uint64_t StartGeneration();
+
+  // Adds the sectors written in generation or later to output
+  void AddChangedSince(uint64_t generation, SectorSet *const output) const;
+
+  // Forgets writes from before generation. 0 forgets everything and stops
+  // recording until the next StartGeneration.
+  void Prune(uint64_t generation);
+
+  uint64_t IntervalCount() const;
+
+  // See UnsyncedSectorStore::SetMemoryBudget. 0 means no limit.
+  void SetMemoryBudget(uint64_t budget_bytes);
+  // Writes are recorded rounded out to this many sectors
+  uint64_t GranularitySectors() const;
+
+  ChangeHistory(const ChangeHistory &) = delete;
+  ChangeHistory& operator=(const ChangeHistory &) = delete;
+
+ private:
+  // Generation 0 would be absorbed, so they start at 1
+  typedef boost::icl::interval_map<uint64_t,
+                                   uint64_t,
+                                   boost::icl::partial_absorber,
+                                   std::less,
+                                   boost::icl::inplace_max>::type
+      GenerationMap;
+
+  // These must be called with mutex_ held
+  void EnforceMemoryBudget();
+  void Coarsen(uint64_t granularity_sectors);
+
+  GenerationMap generation_map_;
+  uint64_t generation_;
+  bool is_recording_;
+  uint64_t memory_budget_bytes_;
+  uint64_t granularity_sectors_;
+  mutable std::mutex mutex_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_CHANGE_HISTORY_H_
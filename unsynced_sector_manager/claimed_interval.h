@@ -0,0 +1,23 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_CLAIMED_INTERVAL_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_CLAIMED_INTERVAL_H_
+
+#include "unsynced_sector_manager/sector_interval.h"
+
+#include <time.h>
+
+namespace datto_linux_client {
+
+// An interval handed out by UnsyncedSectorStore::ClaimIntervals
+struct ClaimedInterval {
+  SectorInterval interval;
+  // True if the interval was modified recently enough to need a
+  // file system freeze while it is read
+  bool is_volatile;
+  // Time of the latest write to the interval, for handing it back with
+  // UnsyncedSectorStore::ReturnClaimedIntervals
+  time_t epoch;
+};
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_CLAIMED_INTERVAL_H_
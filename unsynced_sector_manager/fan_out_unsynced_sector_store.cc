@@ -0,0 +1,65 @@
+#include "unsynced_sector_manager/fan_out_unsynced_sector_store.h"
+
+#include <algorithm>
+
+namespace datto_linux_client {
+
+FanOutUnsyncedSectorStore::FanOutUnsyncedSectorStore(
+    std::shared_ptr<ChangeHistory> history)
+    : history_(history),
+      stores_(),
+      stores_mutex_() { }
+
+void FanOutUnsyncedSectorStore::Attach(
+    std::shared_ptr<UnsyncedSectorStore> store) {
+  std::lock_guard<std::mutex> lock(stores_mutex_);
+  stores_.push_back(store);
+}
+
+void FanOutUnsyncedSectorStore::Detach(
+    const std::shared_ptr<UnsyncedSectorStore> &store) {
+  std::lock_guard<std::mutex> lock(stores_mutex_);
+  stores_.erase(std::remove(stores_.begin(), stores_.end(), store),
+                stores_.end());
+}
+
+void FanOutUnsyncedSectorStore::AddNonVolatileInterval(
+    const SectorInterval &sector_interval) {
+  std::lock_guard<std::mutex> lock(stores_mutex_);
+  history_->AddWrite(sector_interval);
+  for (const auto &store : stores_) {
+    store->AddNonVolatileInterval(sector_interval);
+  }
+}
+
+void FanOutUnsyncedSectorStore::AddInterval(
+    const SectorInterval &sector_interval,
+    const time_t epoch) {
+  std::lock_guard<std::mutex> lock(stores_mutex_);
+  history_->AddWrite(sector_interval);
+  for (const auto &store : stores_) {
+    store->AddInterval(sector_interval, epoch);
+  }
+}
+
+void FanOutUnsyncedSectorStore::AddIntervals(
+    const std::vector<TimedInterval> &intervals) {
+  std::lock_guard<std::mutex> lock(stores_mutex_);
+  history_->AddWrites(intervals);
+  for (const auto &store : stores_) {
+    store->AddIntervals(intervals);
+  }
+}
+
+void FanOutUnsyncedSectorStore::DiscardIntervals(
+    const std::vector<SectorInterval> &intervals) {
+  std::lock_guard<std::mutex> lock(stores_mutex_);
+  for (const SectorInterval &interval : intervals) {
+    history_->AddWrite(interval);
+  }
+  for (const auto &store : stores_) {
+    store->DiscardIntervals(intervals);
+  }
+}
+
+}
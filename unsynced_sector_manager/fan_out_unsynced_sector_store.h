@@ -0,0 +1,47 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_FAN_OUT_UNSYNCED_SECTOR_STORE_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_FAN_OUT_UNSYNCED_SECTOR_STORE_H_
+
+#include "unsynced_sector_manager/change_history.h"
+#include "unsynced_sector_manager/unsynced_sector_store.h"
+#include "unsynced_sector_manager/write_only_unsynced_sector_store.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace datto_linux_client {
+
+// FanOutUnsyncedSectorStore lets one tracer feed several stores. Writes are
+// recorded in the change history and passed on to every attached store;
+// nothing is kept in this store itself.
+class FanOutUnsyncedSectorStore : public WriteOnlyUnsyncedSectorStore {
+ public:
+  explicit FanOutUnsyncedSectorStore(std::shared_ptr<ChangeHistory> history);
+  virtual ~FanOutUnsyncedSectorStore() {}
+
+  // Once Attach returns, every later write reaches store. Once Detach
+  // returns, no more writes will.
+  void Attach(std::shared_ptr<UnsyncedSectorStore> store);
+  void Detach(const std::shared_ptr<UnsyncedSectorStore> &store);
+
+  virtual void AddNonVolatileInterval(const SectorInterval &sector_interval);
+  virtual void AddInterval(const SectorInterval &sector_interval,
+                           const time_t time);
+  virtual void AddIntervals(const std::vector<TimedInterval> &intervals);
+  // The history keeps discards as writes, so changes exported from it may
+  // include discarded sectors
+  virtual void DiscardIntervals(const std::vector<SectorInterval> &intervals);
+
+  FanOutUnsyncedSectorStore(const FanOutUnsyncedSectorStore &) = delete;
+  FanOutUnsyncedSectorStore& operator=(
+      const FanOutUnsyncedSectorStore &) = delete;
+
+ private:
+  std::shared_ptr<ChangeHistory> history_;
+  std::vector<std::shared_ptr<UnsyncedSectorStore>> stores_;
+  std::mutex stores_mutex_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_FAN_OUT_UNSYNCED_SECTOR_STORE_H_
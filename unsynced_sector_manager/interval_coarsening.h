@@ -0,0 +1,47 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_INTERVAL_COARSENING_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_INTERVAL_COARSENING_H_
+
+#include "unsynced_sector_manager/sector_interval.h"
+
+#include <boost/icl/interval_map.hpp>
+#include <boost/icl/interval_set.hpp>
+#include <stdint.h>
+
+namespace datto_linux_client {
+
+// Calls add with one interval for each granularity sized chunk of
+// container, covering every interval that starts in the chunk, along with
+// an iterator to the first of them. Used to bound the memory of interval
+// maps and sets by rounding them out.
+template <typename Container, typename AddFunc>
+void CoarsenIntervals(const Container &container, uint64_t granularity,
+                      AddFunc add) {
+  auto group_begin = container.begin();
+  while (group_begin != container.end()) {
+    uint64_t chunk = boost::icl::key_value<Container>(group_begin).lower() /
+                     granularity;
+    auto group_end = group_begin;
+    size_t group_size = 0;
+    while (group_end != container.end() &&
+           boost::icl::key_value<Container>(group_end).lower() / granularity ==
+               chunk) {
+      ++group_end;
+      ++group_size;
+    }
+
+    if (group_size == 1) {
+      add(group_begin, boost::icl::key_value<Container>(group_begin));
+    } else {
+      auto last = group_end;
+      --last;
+      add(group_begin, SectorInterval(
+          boost::icl::key_value<Container>(group_begin).lower(),
+          boost::icl::key_value<Container>(last).upper()));
+    }
+    group_begin = group_end;
+  }
+}
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_INTERVAL_COARSENING_H_
@@ -0,0 +1,507 @@
+#include "unsynced_sector_manager/interval_unsynced_sector_store.h"
+#include "unsynced_sector_manager/interval_coarsening.h"
+#include <glog/logging.h>
+
+#include <algorithm>
+
+namespace {
+
+using ::datto_linux_client::SectorInterval;
+
+// Number of sectors of interval that are already in container
+template <typename Container>
+uint64_t OverlapCount(const Container &container,
+                      const SectorInterval &interval) {
+  uint64_t overlap = 0;
+  auto range = container.equal_range(interval);
+  for (auto itr = range.first; itr != range.second; ++itr) {
+    overlap += boost::icl::cardinality(
+        boost::icl::key_value<Container>(itr) & interval);
+  }
+  return overlap;
+}
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+const uint64_t IntervalUnsyncedSectorStore::FIRST_COARSE_SECTORS;
+
+IntervalUnsyncedSectorStore::IntervalUnsyncedSectorStore(int volatile_seconds)
+    : volatile_window_(volatile_seconds),
+      unsynced_sector_map_(),
+      synced_sector_set_(),
+      discarded_sector_set_(),
+      end_of_last_continuous_(0),
+      claim_cursor_(0),
+      mutex_(),
+      unsynced_sectors_(0),
+      synced_sectors_(0),
+      interval_count_(0),
+      peak_extent_sectors_(0),
+      rewritten_sectors_(0),
+      recent_sectors_(),
+      heat_(),
+      memory_budget_bytes_(DEFAULT_MEMORY_BUDGET_BYTES),
+      granularity_sectors_(1),
+      memory_bytes_(0),
+      discarded_sectors_(0) { }
+
+void IntervalUnsyncedSectorStore::AddInterval(
+    const SectorInterval &sector_interval, const time_t epoch) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  // For some reason, when epoch = 0 the sector_interval doesn't get
+  // inserted. As epoch should never be less volatile_seconds anyway,
+  // assert it.
+  CHECK_GT(epoch, volatile_window_.Seconds());
+  AddWrite(sector_interval, epoch);
+}
+
+void IntervalUnsyncedSectorStore::AddIntervals(
+    const std::vector<TimedInterval> &intervals) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  for (const TimedInterval &timed : intervals) {
+    CHECK_GT(timed.epoch, volatile_window_.Seconds());
+    AddWrite(timed.interval, timed.epoch);
+  }
+}
+
+void IntervalUnsyncedSectorStore::AddNonVolatileInterval(
+    const SectorInterval &sector_interval) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  InsertUnsynced(sector_interval, 1);
+}
+
+void IntervalUnsyncedSectorStore::AddNonVolatileIntervals(
+    const std::vector<SectorInterval> &sorted_intervals) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  for (const SectorInterval &interval : sorted_intervals) {
+    if (boost::icl::is_empty(interval)) {
+      continue;
+    }
+
+    // Anything added since the load started, e.g. by a trace, can be in
+    // the way. Those use the normal path.
+    if (!unsynced_sector_map_.empty() &&
+        interval.lower() < unsynced_sector_map_.rbegin()->first.upper()) {
+      InsertUnsynced(interval, 1);
+      continue;
+    }
+
+    // With end() as the hint this doesn't search the map
+    unsynced_sector_map_.add(unsynced_sector_map_.end(),
+                             std::make_pair(interval, (time_t)1));
+    Undiscard(interval);
+    uint64_t length = boost::icl::cardinality(interval);
+    unsynced_sectors_ += length;
+    if (length > peak_extent_sectors_) {
+      peak_extent_sectors_ = length;
+    }
+  }
+  interval_count_ = unsynced_sector_map_.iterative_size();
+  EnforceMemoryBudget();
+}
+
+void IntervalUnsyncedSectorStore::DiscardIntervals(
+    const std::vector<SectorInterval> &intervals) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  for (const SectorInterval &interval : intervals) {
+    if (boost::icl::is_empty(interval)) {
+      continue;
+    }
+    unsynced_sectors_ -= OverlapCount(unsynced_sector_map_, interval);
+    unsynced_sector_map_ -= interval;
+    synced_sectors_ -= OverlapCount(synced_sector_set_, interval);
+    synced_sector_set_ -= interval;
+
+    discarded_sectors_ += boost::icl::cardinality(interval) -
+                          OverlapCount(discarded_sector_set_, interval);
+    discarded_sector_set_ += interval;
+  }
+  interval_count_ = unsynced_sector_map_.iterative_size();
+  if (unsynced_sector_map_.empty()) {
+    peak_extent_sectors_ = 0;
+  }
+  EnforceMemoryBudget();
+}
+
+void IntervalUnsyncedSectorStore::ClaimDiscardedIntervals(
+    std::vector<SectorInterval> *const output, size_t max_intervals) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  output->clear();
+  while (!discarded_sector_set_.empty() && output->size() < max_intervals) {
+    SectorInterval interval = *discarded_sector_set_.begin();
+    output->push_back(interval);
+    discarded_sector_set_ -= interval;
+    discarded_sectors_ -= boost::icl::cardinality(interval);
+  }
+  memory_bytes_ = MemoryBytes();
+}
+
+void IntervalUnsyncedSectorStore::RemoveInterval(
+    const SectorInterval &sector_interval) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  MoveToSynced(sector_interval);
+}
+
+// Return the intervals sequentially
+// TODO: Should this logic be here?
+bool IntervalUnsyncedSectorStore::GetInterval(SectorInterval *const output,
+                                              const time_t epoch) const {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  const int volatile_seconds = volatile_window_.Seconds();
+  CHECK_GT(epoch, volatile_seconds);
+
+  bool found_interval = false;
+  bool is_volatile = false;
+
+  // Find the interval directly after the last interval returned
+  auto interval_itr = unsynced_sector_map_.lower_bound(
+      SectorInterval(end_of_last_continuous_, end_of_last_continuous_ + 1));
+  if (interval_itr != unsynced_sector_map_.end() &&
+      interval_itr->first.lower() <= end_of_last_continuous_) {
+    ++interval_itr;
+  }
+
+  if (interval_itr != unsynced_sector_map_.end()) {
+    *output = interval_itr->first;
+    VLOG(2) << *output;
+    found_interval = true;
+    is_volatile = interval_itr->second > (epoch - volatile_seconds);
+  }
+
+  if (!found_interval) {
+    if (!unsynced_sector_map_.empty()) {
+      VLOG(2) << "no output: " << *output;
+      auto first_interval_pair = *unsynced_sector_map_.begin();
+      *output = first_interval_pair.first;
+      is_volatile = first_interval_pair.second > (epoch - volatile_seconds);
+    } else {
+      *output = SectorInterval(0, 0);
+    }
+  }
+
+  end_of_last_continuous_ = output->upper();
+  return is_volatile;
+}
+
+void IntervalUnsyncedSectorStore::ClaimIntervals(
+    std::vector<ClaimedInterval> *const output,
+    size_t max_intervals,
+    uint64_t max_sectors,
+    const time_t epoch,
+    bool defer_hot) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  CHECK_GT(epoch, volatile_window_.Seconds());
+  volatile_window_.Adapt(heat_);
+
+  ClaimPass(output, max_intervals, max_sectors, epoch, defer_hot);
+  if (defer_hot && output->empty()) {
+    // Only hot intervals are left
+    ClaimPass(output, max_intervals, max_sectors, epoch, false);
+  }
+
+  for (const ClaimedInterval &claimed : *output) {
+    MoveToSynced(claimed.interval);
+  }
+}
+
+void IntervalUnsyncedSectorStore::ClaimPass(
+    std::vector<ClaimedInterval> *const output,
+    size_t max_intervals,
+    uint64_t max_sectors,
+    const time_t epoch,
+    bool skip_hot) {
+  output->clear();
+
+  const int volatile_seconds = volatile_window_.Seconds();
+  uint64_t sectors_left = max_sectors;
+  // Start at the cursor, then wrap around to the beginning and stop once
+  // the starting point is reached again
+  const uint64_t start_cursor = claim_cursor_;
+  uint64_t end_sector = UINT64_MAX;
+  auto interval_itr = unsynced_sector_map_.lower_bound(
+      SectorInterval(claim_cursor_, claim_cursor_ + 1));
+
+  while (output->size() < max_intervals && sectors_left > 0) {
+    if (interval_itr == unsynced_sector_map_.end()) {
+      if (end_sector != UINT64_MAX || start_cursor == 0) {
+        break;
+      }
+      end_sector = start_cursor;
+      claim_cursor_ = 0;
+      interval_itr = unsynced_sector_map_.begin();
+      continue;
+    }
+
+    uint64_t lower = std::max(interval_itr->first.lower(), claim_cursor_);
+    if (lower >= end_sector) {
+      break;
+    }
+
+    if (skip_hot && heat_.IsHot(interval_itr->first, epoch)) {
+      ++interval_itr;
+      continue;
+    }
+
+    uint64_t upper = std::min(std::min(interval_itr->first.upper(),
+                                       end_sector),
+                              lower + sectors_left);
+
+    ClaimedInterval claimed;
+    claimed.interval = SectorInterval(lower, upper);
+    claimed.is_volatile = interval_itr->second > (epoch - volatile_seconds);
+    claimed.epoch = interval_itr->second;
+    output->push_back(claimed);
+
+    sectors_left -= upper - lower;
+    claim_cursor_ = upper;
+    if (upper == interval_itr->first.upper()) {
+      ++interval_itr;
+    }
+  }
+}
+
+void IntervalUnsyncedSectorStore::ReturnClaimedIntervals(
+    const std::vector<ClaimedInterval> &claimed) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  for (const ClaimedInterval &returned : claimed) {
+    synced_sectors_ -= OverlapCount(synced_sector_set_, returned.interval);
+    synced_sector_set_ -= returned.interval;
+    // A time of 0 would be absorbed by the map, see AddInterval
+    InsertUnsynced(returned.interval, std::max(returned.epoch, (time_t)1));
+  }
+}
+
+void IntervalUnsyncedSectorStore::ExportIntervals(SectorSet *const output,
+                                                  bool reset) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  output->clear();
+  for (const auto &interval_pair : unsynced_sector_map_) {
+    output->add(output->end(), interval_pair.first);
+  }
+  if (reset) {
+    ClearAll();
+  }
+}
+
+void IntervalUnsyncedSectorStore::ClearIntervals() {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  ClearAll();
+}
+
+void IntervalUnsyncedSectorStore::ClearAll() {
+  unsynced_sector_map_ = TimedSectorMap();
+  synced_sector_set_ = SectorSet();
+  discarded_sector_set_ = SectorSet();
+  claim_cursor_ = 0;
+
+  unsynced_sectors_ = 0;
+  synced_sectors_ = 0;
+  interval_count_ = 0;
+  peak_extent_sectors_ = 0;
+  rewritten_sectors_ = 0;
+  recent_sectors_.Clear();
+  heat_.Clear();
+  granularity_sectors_ = 1;
+  memory_bytes_ = 0;
+  discarded_sectors_ = 0;
+}
+
+void IntervalUnsyncedSectorStore::ClearSyncHistory() {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  synced_sector_set_ = SectorSet();
+  synced_sectors_ = 0;
+  rewritten_sectors_ = 0;
+  memory_bytes_ = MemoryBytes();
+}
+
+void IntervalUnsyncedSectorStore::ReInsertSyncHistory() {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  // Inserting can coarsen synced_sector_set_, so don't iterate over it
+  SectorSet synced_set;
+  synced_set.swap(synced_sector_set_);
+  synced_sectors_ = 0;
+  rewritten_sectors_ = 0;
+
+  // A time of 0 would be absorbed by the map, see AddInterval
+  for (auto interval : synced_set) {
+    InsertUnsynced(interval, 1);
+  }
+}
+
+uint64_t IntervalUnsyncedSectorStore::UnsyncedSectorCount() const {
+  return unsynced_sectors_;
+}
+
+StoreStatistics IntervalUnsyncedSectorStore::GetStatistics() const {
+  StoreStatistics stats;
+  stats.volatile_seconds = volatile_window_.Seconds();
+  stats.unsynced_sectors = unsynced_sectors_;
+  stats.volatile_sectors = std::min(
+      recent_sectors_.Count(time(NULL), stats.volatile_seconds),
+      stats.unsynced_sectors);
+  stats.interval_count = interval_count_;
+  stats.synced_sectors = synced_sectors_;
+  stats.peak_extent_sectors = peak_extent_sectors_;
+  stats.rewritten_sectors = rewritten_sectors_;
+  stats.granularity_sectors = granularity_sectors_;
+  stats.memory_bytes = memory_bytes_;
+  stats.discarded_sectors = discarded_sectors_;
+  return stats;
+}
+
+void IntervalUnsyncedSectorStore::SetMemoryBudget(uint64_t budget_bytes) {
+  std::lock_guard<std::mutex> set_lock(mutex_);
+  memory_budget_bytes_ = budget_bytes;
+  EnforceMemoryBudget();
+}
+
+void IntervalUnsyncedSectorStore::SetAdaptiveVolatileSeconds(bool adaptive) {
+  volatile_window_.SetAdaptive(adaptive);
+}
+
+int IntervalUnsyncedSectorStore::VolatileSeconds() const {
+  return volatile_window_.Seconds();
+}
+
+void IntervalUnsyncedSectorStore::AddWrite(
+    const SectorInterval &sector_interval, const time_t epoch) {
+  // Sectors that were already sent, and aren't already waiting to be sent
+  // again, will be sent a second time
+  if (OverlapCount(synced_sector_set_, sector_interval)) {
+    SectorSet resent;
+    resent += sector_interval;
+    resent &= synced_sector_set_;
+    auto range = unsynced_sector_map_.equal_range(sector_interval);
+    for (auto itr = range.first; itr != range.second; ++itr) {
+      resent -= itr->first;
+    }
+    rewritten_sectors_ += boost::icl::cardinality(resent);
+  }
+
+  InsertUnsynced(sector_interval, epoch);
+  recent_sectors_.Add(epoch, boost::icl::cardinality(sector_interval));
+  heat_.AddWrite(sector_interval, epoch);
+}
+
+void IntervalUnsyncedSectorStore::InsertUnsynced(
+    const SectorInterval &sector_interval, const time_t epoch) {
+  uint64_t length = boost::icl::cardinality(sector_interval);
+  unsynced_sectors_ += length - OverlapCount(unsynced_sector_map_,
+                                             sector_interval);
+  unsynced_sector_map_ += std::make_pair(sector_interval, epoch);
+  interval_count_ = unsynced_sector_map_.iterative_size();
+  Undiscard(sector_interval);
+  if (length > peak_extent_sectors_) {
+    peak_extent_sectors_ = length;
+  }
+  EnforceMemoryBudget();
+}
+
+void IntervalUnsyncedSectorStore::MoveToSynced(
+    const SectorInterval &sector_interval) {
+  uint64_t length = boost::icl::cardinality(sector_interval);
+  unsynced_sectors_ -= OverlapCount(unsynced_sector_map_, sector_interval);
+  unsynced_sector_map_ -= sector_interval;
+  interval_count_ = unsynced_sector_map_.iterative_size();
+  if (unsynced_sector_map_.empty()) {
+    peak_extent_sectors_ = 0;
+  }
+
+  synced_sectors_ += length - OverlapCount(synced_sector_set_,
+                                           sector_interval);
+  synced_sector_set_.add(sector_interval);
+  EnforceMemoryBudget();
+}
+
+void IntervalUnsyncedSectorStore::Undiscard(
+    const SectorInterval &sector_interval) {
+  if (discarded_sector_set_.empty()) {
+    return;
+  }
+  discarded_sectors_ -= OverlapCount(discarded_sector_set_, sector_interval);
+  discarded_sector_set_ -= sector_interval;
+}
+
+uint64_t IntervalUnsyncedSectorStore::MemoryBytes() const {
+  return (unsynced_sector_map_.iterative_size() +
+          synced_sector_set_.iterative_size() +
+          discarded_sector_set_.iterative_size()) * BYTES_PER_INTERVAL;
+}
+
+void IntervalUnsyncedSectorStore::EnforceMemoryBudget() {
+  memory_bytes_ = MemoryBytes();
+  if (!memory_budget_bytes_ || memory_bytes_ <= memory_budget_bytes_) {
+    return;
+  }
+
+  // Go well under the budget so this doesn't run again right away
+  const uint64_t target_bytes = memory_budget_bytes_ / 4 * 3;
+
+  // Discarded intervals can't be rounded out, but not trimming them only
+  // leaves stale data on the destination, so they go first
+  if (!discarded_sector_set_.empty()) {
+    LOG(WARNING) << "Over the memory budget, not trimming "
+                 << discarded_sectors_ << " discarded sectors";
+    discarded_sector_set_ = SectorSet();
+    discarded_sectors_ = 0;
+    memory_bytes_ = MemoryBytes();
+    if (memory_bytes_ <= target_bytes) {
+      return;
+    }
+  }
+  uint64_t granularity = std::max(granularity_sectors_.load(),
+                                  FIRST_COARSE_SECTORS);
+  Coarsen(granularity);
+  while (memory_bytes_ > target_bytes && granularity < MAX_COARSE_SECTORS) {
+    granularity *= COARSEN_FACTOR;
+    Coarsen(granularity);
+  }
+
+  if (granularity != granularity_sectors_) {
+    LOG(WARNING) << "Over the memory budget of " << memory_budget_bytes_
+                 << " bytes, now tracking in chunks of " << granularity
+                 << " sectors";
+    granularity_sectors_ = granularity;
+  }
+}
+
+void IntervalUnsyncedSectorStore::Coarsen(uint64_t granularity_sectors) {
+  TimedSectorMap coarse_map;
+  CoarsenIntervals(unsynced_sector_map_, granularity_sectors,
+                   [&](TimedSectorMap::const_iterator first,
+                       const SectorInterval &interval) {
+    time_t epoch = 0;
+    for (auto itr = first;
+         itr != unsynced_sector_map_.end() &&
+             itr->first.lower() < interval.upper();
+         ++itr) {
+      epoch = std::max(epoch, itr->second);
+    }
+    coarse_map += std::make_pair(interval, epoch);
+  });
+
+  SectorSet coarse_set;
+  CoarsenIntervals(synced_sector_set_, granularity_sectors,
+                   [&](SectorSet::const_iterator first,
+                       const SectorInterval &interval) {
+    coarse_set += interval;
+  });
+
+  unsynced_sector_map_.swap(coarse_map);
+  synced_sector_set_.swap(coarse_set);
+
+  unsynced_sectors_ = boost::icl::cardinality(unsynced_sector_map_);
+  synced_sectors_ = boost::icl::cardinality(synced_sector_set_);
+  interval_count_ = unsynced_sector_map_.iterative_size();
+  for (const auto &interval_pair : unsynced_sector_map_) {
+    uint64_t length = boost::icl::cardinality(interval_pair.first);
+    if (length > peak_extent_sectors_) {
+      peak_extent_sectors_ = length;
+    }
+  }
+  memory_bytes_ = MemoryBytes();
+}
+
+}
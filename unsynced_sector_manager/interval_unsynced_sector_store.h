@@ -0,0 +1,101 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_INTERVAL_UNSYNCED_SECTOR_STORE_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_INTERVAL_UNSYNCED_SECTOR_STORE_H_
+
+#include "unsynced_sector_manager/recent_sector_counter.h"
+#include "unsynced_sector_manager/timed_sector_map.h"
+#include "unsynced_sector_manager/unsynced_sector_store.h"
+#include "unsynced_sector_manager/volatile_window.h"
+#include "unsynced_sector_manager/write_heat_tracker.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+namespace datto_linux_client {
+
+// IntervalUnsyncedSectorStore keeps unsynced sectors in an interval map,
+// each interval with the time it was last written. Intervals are kept at
+// sector granularity until the memory budget is reached.
+class IntervalUnsyncedSectorStore : public UnsyncedSectorStore {
+ public:
+  // Granularity goes from sectors to 64KiB, to 1MiB, and so on
+  static const uint64_t FIRST_COARSE_SECTORS = 128;
+  static const uint64_t COARSEN_FACTOR = 16;
+  static const uint64_t MAX_COARSE_SECTORS = 128ULL << 20;
+
+  // volatile_seconds is the number of seconds ago a write should have
+  // occurred to not require special handling (i.e. a filesystem freeze)
+  explicit IntervalUnsyncedSectorStore(int volatile_seconds);
+  virtual ~IntervalUnsyncedSectorStore() {}
+
+  virtual void AddNonVolatileInterval(const SectorInterval &sector_interval);
+  virtual void AddNonVolatileIntervals(
+      const std::vector<SectorInterval> &sorted_intervals);
+  virtual void AddInterval(const SectorInterval &sector_interval,
+                           const time_t time);
+  virtual void AddIntervals(const std::vector<TimedInterval> &intervals);
+  virtual bool GetInterval(SectorInterval *const output,
+                           const time_t epoch) const;
+  virtual void ClaimIntervals(std::vector<ClaimedInterval> *const output,
+                              size_t max_intervals,
+                              uint64_t max_sectors,
+                              const time_t epoch,
+                              bool defer_hot);
+  virtual void ReturnClaimedIntervals(
+      const std::vector<ClaimedInterval> &claimed);
+  virtual void DiscardIntervals(const std::vector<SectorInterval> &intervals);
+  virtual void ClaimDiscardedIntervals(
+      std::vector<SectorInterval> *const output, size_t max_intervals);
+  virtual void RemoveInterval(const SectorInterval &sector_interval);
+  virtual void ExportIntervals(SectorSet *const output, bool reset);
+  virtual void ClearIntervals();
+  virtual void ClearSyncHistory();
+  virtual void ReInsertSyncHistory();
+  virtual uint64_t UnsyncedSectorCount() const;
+  virtual StoreStatistics GetStatistics() const;
+  virtual void SetAdaptiveVolatileSeconds(bool adaptive);
+  virtual int VolatileSeconds() const;
+  virtual void SetMemoryBudget(uint64_t budget_bytes);
+
+ private:
+  // These must be called with mutex_ held
+  void ClearAll();
+  void InsertUnsynced(const SectorInterval &sector_interval,
+                      const time_t epoch);
+  void MoveToSynced(const SectorInterval &sector_interval);
+  void Undiscard(const SectorInterval &sector_interval);
+  void AddWrite(const SectorInterval &sector_interval, const time_t epoch);
+  uint64_t MemoryBytes() const;
+  void EnforceMemoryBudget();
+  void Coarsen(uint64_t granularity_sectors);
+  void ClaimPass(std::vector<ClaimedInterval> *const output,
+                 size_t max_intervals, uint64_t max_sectors,
+                 const time_t epoch, bool skip_hot);
+
+  VolatileWindow volatile_window_;
+  TimedSectorMap unsynced_sector_map_;
+  SectorSet synced_sector_set_;
+  SectorSet discarded_sector_set_;
+  mutable uint64_t end_of_last_continuous_;
+  uint64_t claim_cursor_;
+  mutable std::mutex mutex_;
+
+  std::atomic<uint64_t> unsynced_sectors_;
+  std::atomic<uint64_t> synced_sectors_;
+  std::atomic<uint64_t> interval_count_;
+  std::atomic<uint64_t> peak_extent_sectors_;
+  std::atomic<uint64_t> rewritten_sectors_;
+  RecentSectorCounter recent_sectors_;
+  WriteHeatTracker heat_;
+
+  uint64_t memory_budget_bytes_;
+  std::atomic<uint64_t> granularity_sectors_;
+  std::atomic<uint64_t> memory_bytes_;
+  std::atomic<uint64_t> discarded_sectors_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_INTERVAL_UNSYNCED_SECTOR_STORE_H_
@@ -0,0 +1,107 @@
+#include "unsynced_sector_manager/partition_unsynced_sector_store.h"
+
+#include <algorithm>
+
+namespace datto_linux_client {
+
+PartitionUnsyncedSectorStore::PartitionUnsyncedSectorStore()
+    : partitions_(),
+      partitions_mutex_() { }
+
+void PartitionUnsyncedSectorStore::Attach(
+    const SectorInterval &partition,
+    std::shared_ptr<UnsyncedSectorStore> store) {
+  std::lock_guard<std::mutex> lock(partitions_mutex_);
+  partitions_.push_back({partition, store});
+}
+
+void PartitionUnsyncedSectorStore::Detach(
+    const std::shared_ptr<UnsyncedSectorStore> &store) {
+  std::lock_guard<std::mutex> lock(partitions_mutex_);
+  partitions_.erase(
+      std::remove_if(partitions_.begin(), partitions_.end(),
+                     [&](const Partition &partition) {
+                       return partition.store == store;
+                     }),
+      partitions_.end());
+}
+
+size_t PartitionUnsyncedSectorStore::PartitionCount() {
+  std::lock_guard<std::mutex> lock(partitions_mutex_);
+  return partitions_.size();
+}
+
+void PartitionUnsyncedSectorStore::AddNonVolatileInterval(
+    const SectorInterval &sector_interval) {
+  std::lock_guard<std::mutex> lock(partitions_mutex_);
+  SectorInterval partition_interval;
+  for (const auto &partition : partitions_) {
+    if (ToPartition(partition, sector_interval, &partition_interval)) {
+      partition.store->AddNonVolatileInterval(partition_interval);
+    }
+  }
+}
+
+void PartitionUnsyncedSectorStore::AddInterval(
+    const SectorInterval &sector_interval,
+    const time_t epoch) {
+  std::lock_guard<std::mutex> lock(partitions_mutex_);
+  SectorInterval partition_interval;
+  for (const auto &partition : partitions_) {
+    if (ToPartition(partition, sector_interval, &partition_interval)) {
+      partition.store->AddInterval(partition_interval, epoch);
+    }
+  }
+}
+
+void PartitionUnsyncedSectorStore::AddIntervals(
+    const std::vector<TimedInterval> &intervals) {
+  std::lock_guard<std::mutex> lock(partitions_mutex_);
+  std::vector<TimedInterval> partition_intervals;
+  TimedInterval timed;
+  for (const auto &partition : partitions_) {
+    partition_intervals.clear();
+    for (const TimedInterval &interval : intervals) {
+      if (ToPartition(partition, interval.interval, &timed.interval)) {
+        timed.epoch = interval.epoch;
+        partition_intervals.push_back(timed);
+      }
+    }
+    if (!partition_intervals.empty()) {
+      partition.store->AddIntervals(partition_intervals);
+    }
+  }
+}
+
+void PartitionUnsyncedSectorStore::DiscardIntervals(
+    const std::vector<SectorInterval> &intervals) {
+  std::lock_guard<std::mutex> lock(partitions_mutex_);
+  std::vector<SectorInterval> partition_intervals;
+  SectorInterval partition_interval;
+  for (const auto &partition : partitions_) {
+    partition_intervals.clear();
+    for (const SectorInterval &interval : intervals) {
+      if (ToPartition(partition, interval, &partition_interval)) {
+        partition_intervals.push_back(partition_interval);
+      }
+    }
+    if (!partition_intervals.empty()) {
+      partition.store->DiscardIntervals(partition_intervals);
+    }
+  }
+}
+
+bool PartitionUnsyncedSectorStore::ToPartition(
+    const Partition &partition,
+    const SectorInterval &sector_interval,
+    SectorInterval *const output) {
+  SectorInterval clipped = sector_interval & partition.range;
+  if (boost::icl::is_empty(clipped)) {
+    return false;
+  }
+  uint64_t start = partition.range.lower();
+  *output = SectorInterval(clipped.lower() - start, clipped.upper() - start);
+  return true;
+}
+
+}
@@ -0,0 +1,58 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_PARTITION_UNSYNCED_SECTOR_STORE_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_PARTITION_UNSYNCED_SECTOR_STORE_H_
+
+#include "unsynced_sector_manager/sector_interval.h"
+#include "unsynced_sector_manager/unsynced_sector_store.h"
+#include "unsynced_sector_manager/write_only_unsynced_sector_store.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace datto_linux_client {
+
+// PartitionUnsyncedSectorStore lets the tracer of a whole disk feed the
+// stores of its partitions. Intervals are clipped to each partition and
+// made relative to its start. Anything outside of the attached partitions,
+// like the partition table, is ignored.
+class PartitionUnsyncedSectorStore : public WriteOnlyUnsyncedSectorStore {
+ public:
+  PartitionUnsyncedSectorStore();
+  virtual ~PartitionUnsyncedSectorStore() {}
+
+  // partition is in sectors of the disk. Once Attach returns, every later
+  // write to partition reaches store. Once Detach returns, no more writes
+  // will.
+  void Attach(const SectorInterval &partition,
+              std::shared_ptr<UnsyncedSectorStore> store);
+  void Detach(const std::shared_ptr<UnsyncedSectorStore> &store);
+  size_t PartitionCount();
+
+  virtual void AddNonVolatileInterval(const SectorInterval &sector_interval);
+  virtual void AddInterval(const SectorInterval &sector_interval,
+                           const time_t time);
+  virtual void AddIntervals(const std::vector<TimedInterval> &intervals);
+  virtual void DiscardIntervals(const std::vector<SectorInterval> &intervals);
+
+  PartitionUnsyncedSectorStore(const PartitionUnsyncedSectorStore &) = delete;
+  PartitionUnsyncedSectorStore& operator=(
+      const PartitionUnsyncedSectorStore &) = delete;
+
+ private:
+  struct Partition {
+    SectorInterval range;
+    std::shared_ptr<UnsyncedSectorStore> store;
+  };
+
+  // False if none of sector_interval is in partition
+  static bool ToPartition(const Partition &partition,
+                          const SectorInterval &sector_interval,
+                          SectorInterval *const output);
+
+  std::vector<Partition> partitions_;
+  std::mutex partitions_mutex_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_PARTITION_UNSYNCED_SECTOR_STORE_H_
@@ -0,0 +1,64 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_RECENT_SECTOR_COUNTER_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_RECENT_SECTOR_COUNTER_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+
+namespace datto_linux_client {
+
+// Counts sectors written per second for the last MAX_SECONDS seconds.
+//
+// Add() must be serialized by the caller (the stores call it with their
+// mutex held), but Count() can be called from any thread without locking.
+class RecentSectorCounter {
+ public:
+  static const int MAX_SECONDS = 64;
+
+  RecentSectorCounter() {
+    Clear();
+  }
+
+  void Add(time_t epoch, uint64_t num_sectors) {
+    Bucket &bucket = buckets_[epoch % MAX_SECONDS];
+    if (bucket.epoch.load() != epoch) {
+      bucket.num_sectors = 0;
+      bucket.epoch = epoch;
+    }
+    bucket.num_sectors += num_sectors;
+  }
+
+  // Sectors added in the window_seconds before now
+  uint64_t Count(time_t now, int window_seconds) const {
+    uint64_t total = 0;
+    for (const Bucket &bucket : buckets_) {
+      time_t age = now - bucket.epoch.load();
+      if (age >= 0 && age < window_seconds) {
+        total += bucket.num_sectors.load();
+      }
+    }
+    return total;
+  }
+
+  void Clear() {
+    for (Bucket &bucket : buckets_) {
+      bucket.epoch = 0;
+      bucket.num_sectors = 0;
+    }
+  }
+
+  RecentSectorCounter(const RecentSectorCounter &) = delete;
+  RecentSectorCounter& operator=(const RecentSectorCounter &) = delete;
+
+ private:
+  struct Bucket {
+    std::atomic<time_t> epoch;
+    std::atomic<uint64_t> num_sectors;
+  };
+
+  Bucket buckets_[MAX_SECONDS];
+};
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_RECENT_SECTOR_COUNTER_H_
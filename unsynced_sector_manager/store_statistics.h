@@ -0,0 +1,38 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_STORE_STATISTICS_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_STORE_STATISTICS_H_
+
+#include <stdint.h>
+
+namespace datto_linux_client {
+
+// A snapshot of the counters kept by an UnsyncedSectorStore. All values
+// are in sectors except interval_count.
+struct StoreStatistics {
+  uint64_t unsynced_sectors;
+  // Estimate of the unsynced sectors written in the volatile window. This
+  // can be larger than the real value, but never larger than
+  // unsynced_sectors.
+  uint64_t volatile_sectors;
+  uint64_t interval_count;
+  uint64_t synced_sectors;
+  // High-water mark of the largest interval added since the store was
+  // last empty. Claims and discards don't lower it, so the largest
+  // interval still in the store can be smaller.
+  uint64_t peak_extent_sectors;
+  // Synced sectors that were written again and need to be sent again,
+  // since the sync history was last cleared
+  uint64_t rewritten_sectors;
+  // The current volatile window, in seconds
+  int volatile_seconds;
+  // Intervals are tracked rounded out to this many sectors. This grows
+  // when the store is over its memory budget.
+  uint64_t granularity_sectors;
+  // Estimate of the memory used to track intervals, in bytes
+  uint64_t memory_bytes;
+  // Discarded sectors the destination hasn't been trimmed of yet
+  uint64_t discarded_sectors;
+};
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_STORE_STATISTICS_H_
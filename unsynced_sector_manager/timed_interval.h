@@ -0,0 +1,19 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_TIMED_INTERVAL_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_TIMED_INTERVAL_H_
+
+#include "unsynced_sector_manager/sector_interval.h"
+
+#include <time.h>
+
+namespace datto_linux_client {
+
+// An interval and the time it was written, for adding in batches with
+// UnsyncedSectorStore::AddIntervals
+struct TimedInterval {
+  SectorInterval interval;
+  time_t epoch;
+};
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_TIMED_INTERVAL_H_
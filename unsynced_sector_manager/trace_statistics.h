@@ -0,0 +1,26 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_TRACE_STATISTICS_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_TRACE_STATISTICS_H_
+
+#include <stdint.h>
+
+namespace datto_linux_client {
+
+// A snapshot of how well the tracer of a device is keeping up
+struct TraceStatistics {
+  // Traces the kernel dropped since the current tracer started
+  uint64_t dropped_traces;
+  // Traces dropped by every tracer of the device so far
+  uint64_t total_dropped_traces;
+  // Times the device had to be resynced because of dropped traces
+  uint64_t resync_count;
+  // Relay buffer settings the current, or next, tracer uses
+  uint32_t relay_buffer_bytes;
+  uint32_t relay_num_buffers;
+  // Set when traces were dropped. The next backup of the device must be a
+  // full, which restarts the tracer with the larger buffers.
+  bool needs_resync;
+};
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_TRACE_STATISTICS_H_
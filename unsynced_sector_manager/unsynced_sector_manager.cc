@@ -3,19 +3,54 @@
 #include <glog/logging.h>
 #include <sys/sysmacros.h>
 
+#include "unsynced_sector_manager/bitmap_unsynced_sector_store.h"
+#include "unsynced_sector_manager/interval_unsynced_sector_store.h"
 #include "unsynced_sector_manager/unsynced_tracking_exception.h"
-#include "tracing/trace_handler.h"
+#include "tracing/bpf_dirty_tracker.h"
 #include "tracing/device_tracer.h"
+#include "tracing/dm_era.h"
+#include "tracing/era_tracker.h"
+#include "tracing/ring_trace_handler.h"
+#include "tracing/trace_recorder.h"
+
+#include <sys/sysinfo.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 
 namespace {
   // number of a seconds ago a write should have happened to be
-  // considered non-volatile
+  // considered non-volatile. This is only the starting point, the stores
+  // adapt it to how each device is written to.
   const int VOLATILE_SECONDS = 10;
 }
 
 namespace datto_linux_client {
 
-UnsyncedSectorManager::UnsyncedSectorManager() : store_map_(), tracer_map_() {}
+UnsyncedSectorManager::UnsyncedSectorManager()
+    : store_map_(),
+      tracer_map_(),
+      store_type_map_(),
+      default_store_type_(INTERVAL_STORE),
+      trace_backend_map_(),
+      default_trace_backend_(BLKTRACE_BACKEND),
+      memory_budget_map_(),
+      default_memory_budget_bytes_(
+          UnsyncedSectorStore::DEFAULT_MEMORY_BUDGET_BYTES),
+      history_map_(),
+      fan_out_map_(),
+      destination_map_(),
+      trace_state_map_(),
+      record_path_map_(),
+      record_dir_(),
+      reader_pool_(),
+      trace_whole_disk_(false),
+      cpu_placement_(),
+      export_dir_(),
+      export_format_(RUN_LENGTH_EXPORT),
+      disk_tracer_map_(),
+      partition_disk_map_() {}
 
 UnsyncedSectorManager::~UnsyncedSectorManager() {
   // The data structure destructors will cause the element destructors to run,
@@ -23,6 +58,7 @@ UnsyncedSectorManager::~UnsyncedSectorManager() {
 }
 
 void UnsyncedSectorManager::StartTracer(const BlockDevice &device) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
   if (tracer_map_[device.dev_t()]) {
     LOG(ERROR) << "Already tracing " << device.path();
     throw UnsyncedTrackingException("Already tracing block device");
@@ -30,25 +66,179 @@ void UnsyncedSectorManager::StartTracer(const BlockDevice &device) {
 
   LOG(INFO) << "Starting tracing on " << device.path();
 
-  auto store = GetStore(device);
-  auto device_tracer = CreateDeviceTracer(device.path(), store);
+  auto history = std::make_shared<ChangeHistory>();
+  history->SetMemoryBudget(MemoryBudget(device.dev_t()));
+  auto fan_out = std::make_shared<FanOutUnsyncedSectorStore>(history);
+  // The device's own store is only fed once something has asked for it,
+  // see GetStore
+  if (store_map_.count(device.dev_t()) && store_map_.at(device.dev_t())) {
+    fan_out->Attach(store_map_.at(device.dev_t()));
+  }
+
+  // A new tracer starts its own dropped count
+  TraceState &trace_state = trace_state_map_[device.dev_t()];
+  trace_state.path = device.path();
+  trace_state.dropped_traces = 0;
+  trace_state.needs_resync = false;
+
+  TraceBackend backend = default_trace_backend_;
+  if (trace_backend_map_.count(device.dev_t())) {
+    backend = trace_backend_map_.at(device.dev_t());
+  }
+
+  std::shared_ptr<DeviceTracer> device_tracer;
+  if (backend == DM_ERA_BACKEND) {
+    device_tracer = CreateEraTracker(device, fan_out);
+  } else if (backend == AUTO_BACKEND) {
+    try {
+      device_tracer = CreateEraTracker(device, fan_out);
+    } catch (const std::exception &e) {
+      VLOG(1) << device.path() << " isn't a dm-era target: " << e.what();
+    }
+  }
+  if (!device_tracer &&
+      (backend == BPF_BACKEND || backend == AUTO_BACKEND)) {
+    try {
+      device_tracer = CreateBpfTracker(device, fan_out);
+    } catch (const std::exception &e) {
+      LOG(WARNING) << "Unable to track " << device.path() << " with BPF, "
+                   << "falling back to blktrace: " << e.what();
+    }
+  }
+  if (!device_tracer && backend != DM_ERA_BACKEND && trace_whole_disk_) {
+    try {
+      device_tracer = AttachToDiskTracer(device, fan_out,
+                                         trace_state.relay_settings);
+    } catch (const std::exception &e) {
+      LOG(WARNING) << "Unable to trace the disk of " << device.path()
+                   << ", tracing it on its own: " << e.what();
+    }
+    if (device_tracer) {
+      // The disk tracer may have dropped traces before this partition
+      // joined it
+      try {
+        trace_state.dropped_traces = device_tracer->DroppedTraces();
+      } catch (const std::exception &e) {
+        LOG(WARNING) << "Unable to read dropped traces: " << e.what();
+      }
+    }
+  }
+  if (!device_tracer) {
+    device_tracer = CreateDeviceTracer(device.path(), fan_out,
+                                       trace_state.relay_settings);
+  }
 
-  store_map_[device.dev_t()] = store;
   tracer_map_[device.dev_t()] = std::move(device_tracer);
+  history_map_[device.dev_t()] = history;
+  fan_out_map_[device.dev_t()] = fan_out;
+
+  if (!export_dir_.empty()) {
+    // Exports come from the device's own store
+    GetStore(device);
+  }
 }
 
 void UnsyncedSectorManager::StopTracer(const BlockDevice &device) {
-  // Tracer destructor will stop the tracer from running
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  // Tracer destructor will stop the tracer from running. A disk tracer
+  // stops once its last partition is detached.
+  DetachFromDiskTracer(device);
   tracer_map_[device.dev_t()] = nullptr;
+  history_map_.erase(device.dev_t());
+  fan_out_map_.erase(device.dev_t());
+
+  // Writes aren't tracked anymore, so every destination needs a full
+  auto itr = destination_map_.lower_bound(
+      DestinationKey(device.dev_t(), std::string()));
+  while (itr != destination_map_.end() &&
+         itr->first.first == device.dev_t()) {
+    itr = destination_map_.erase(itr);
+  }
 }
 
 void UnsyncedSectorManager::FlushTracer(const BlockDevice &device) {
-  if (tracer_map_.count(device.dev_t())) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (IsTracing(device)) {
     tracer_map_[device.dev_t()]->FlushBuffers();
+    CheckDroppedTraces(device);
   }
 }
 
+bool UnsyncedSectorManager::NeedsResync(const BlockDevice &device) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  CheckDroppedTraces(device);
+  return trace_state_map_.count(device.dev_t()) &&
+         trace_state_map_.at(device.dev_t()).needs_resync;
+}
+
+TraceStatistics UnsyncedSectorManager::GetTraceStatistics(
+    const BlockDevice &device) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  CheckDroppedTraces(device);
+  TraceState trace_state;
+  if (trace_state_map_.count(device.dev_t())) {
+    trace_state = trace_state_map_.at(device.dev_t());
+  }
+
+  TraceStatistics stats;
+  stats.dropped_traces = trace_state.dropped_traces;
+  stats.total_dropped_traces = trace_state.total_dropped_traces;
+  stats.resync_count = trace_state.resync_count;
+  stats.relay_buffer_bytes = trace_state.relay_settings.buffer_bytes;
+  stats.relay_num_buffers = trace_state.relay_settings.num_buffers;
+  stats.needs_resync = trace_state.needs_resync;
+  return stats;
+}
+
+void UnsyncedSectorManager::CheckDroppedTraces(const BlockDevice &device) {
+  if (!IsTracing(device)) {
+    return;
+  }
+  TraceState &trace_state = trace_state_map_[device.dev_t()];
+
+  uint64_t dropped;
+  try {
+    dropped = tracer_map_.at(device.dev_t())->DroppedTraces();
+  } catch (const std::exception &e) {
+    // Without the count there is no telling what was missed
+    LOG(ERROR) << "Assuming traces of " << device.path()
+               << " were dropped: " << e.what();
+    dropped = trace_state.dropped_traces + 1;
+  }
+  if (dropped <= trace_state.dropped_traces) {
+    return;
+  }
+
+  trace_state.total_dropped_traces += dropped - trace_state.dropped_traces;
+  trace_state.dropped_traces = dropped;
+  if (trace_state.needs_resync) {
+    return;
+  }
+
+  trace_state.needs_resync = true;
+  trace_state.resync_count++;
+  trace_state.relay_settings =
+      DeviceTracer::GrowRelaySettings(trace_state.relay_settings);
+  LOG(ERROR) << "The kernel dropped " << dropped << " traces of "
+             << device.path() << ", the next backup must be a full. "
+             << "Relay buffers will be "
+             << trace_state.relay_settings.num_buffers << " x "
+             << trace_state.relay_settings.buffer_bytes << " bytes";
+
+  // Nothing that was tracked can be trusted to be complete anymore. Running
+  // backups find out when they commit.
+  auto itr = destination_map_.lower_bound(
+      DestinationKey(device.dev_t(), std::string()));
+  for (; itr != destination_map_.end() && itr->first.first == device.dev_t();
+       ++itr) {
+    itr->second.generation = 0;
+    itr->second.carry.clear();
+  }
+  PruneHistory(device.dev_t());
+}
+
 bool UnsyncedSectorManager::IsTracing(const BlockDevice &device) const {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
   if (tracer_map_.count(device.dev_t())) {
     return tracer_map_.at(device.dev_t()) != nullptr;
   } else {
@@ -58,19 +248,434 @@ bool UnsyncedSectorManager::IsTracing(const BlockDevice &device) const {
 
 std::shared_ptr<UnsyncedSectorStore> UnsyncedSectorManager::GetStore(
     const BlockDevice &device) {
-  if (!store_map_[device.dev_t()]) {
-    store_map_[device.dev_t()] =
-        std::make_shared<UnsyncedSectorStore>(VOLATILE_SECONDS);
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  std::shared_ptr<UnsyncedSectorStore> &store = store_map_[device.dev_t()];
+  if (!store) {
+    store = CreateStore(device);
+    if (fan_out_map_.count(device.dev_t())) {
+      fan_out_map_.at(device.dev_t())->Attach(store);
+    }
+  }
+  return store;
+}
+
+std::shared_ptr<UnsyncedSectorStore> UnsyncedSectorManager::GetStore(
+    const BlockDevice &device, const std::string &destination) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (destination.empty()) {
+    return GetStore(device);
+  }
+
+  DestinationState &state =
+      destination_map_[DestinationKey(device.dev_t(), destination)];
+  if (state.store) {
+    return state.store;
+  }
+
+  state.store = CreateStore(device);
+  if (!fan_out_map_.count(device.dev_t())) {
+    return state.store;
+  }
+
+  // Attach before reading the history so no write is missed. Writes in
+  // between end up in the store twice, which is harmless.
+  fan_out_map_.at(device.dev_t())->Attach(state.store);
+
+  SectorSet changed = state.carry;
+  if (state.generation) {
+    history_map_.at(device.dev_t())->AddChangedSince(state.generation,
+                                                     &changed);
+  }
+  state.store->AddNonVolatileIntervals(
+      std::vector<SectorInterval>(changed.begin(), changed.end()));
+  LOG(INFO) << "Tracking " << device.path() << " for " << destination
+            << " starting with " << boost::icl::cardinality(changed)
+            << " changed sectors";
+  return state.store;
+}
+
+bool UnsyncedSectorManager::HasGeneration(
+    const BlockDevice &device, const std::string &destination) const {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  auto itr = destination_map_.find(DestinationKey(device.dev_t(),
+                                                  destination));
+  auto trace_itr = trace_state_map_.find(device.dev_t());
+  if (trace_itr != trace_state_map_.end() && trace_itr->second.needs_resync) {
+    return false;
+  }
+  return IsTracing(device) && itr != destination_map_.end() &&
+         itr->second.generation != 0;
+}
+
+void UnsyncedSectorManager::CommitGeneration(const BlockDevice &device,
+                                             const std::string &destination) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  auto itr = destination_map_.find(DestinationKey(device.dev_t(),
+                                                  destination));
+  if (itr == destination_map_.end() || !itr->second.store) {
+    LOG(ERROR) << "No backup of " << device.path() << " to " << destination
+               << " is running";
+    throw UnsyncedTrackingException("No backup to commit");
+  }
+  DestinationState &state = itr->second;
+
+  if (!fan_out_map_.count(device.dev_t())) {
+    // Not traced, so there is nothing to continue from
+    state = DestinationState();
+    return;
+  }
+
+  // Anything written from here on is in the new generation. Anything
+  // written before it that the backup didn't get to is still in its store.
+  FlushTracer(device);
+  if (trace_state_map_[device.dev_t()].needs_resync) {
+    fan_out_map_.at(device.dev_t())->Detach(state.store);
+    state = DestinationState();
+    LOG(ERROR) << "Traces were dropped during the backup of " << device.path()
+               << " to " << destination << ", the next one must be a full";
+    throw UnsyncedTrackingException("Traces were dropped during the backup");
+  }
+
+  uint64_t generation = history_map_.at(device.dev_t())->StartGeneration();
+  fan_out_map_.at(device.dev_t())->Detach(state.store);
+
+  SectorSet carry;
+  state.store->ExportIntervals(&carry, false);
+  state.carry.swap(carry);
+  state.generation = generation;
+  state.store = nullptr;
+
+  LOG(INFO) << "Backup of " << device.path() << " to " << destination
+            << " committed as generation " << generation << " with "
+            << boost::icl::cardinality(state.carry) << " sectors left over";
+  PruneHistory(device.dev_t());
+}
+
+void UnsyncedSectorManager::AbandonGeneration(
+    const BlockDevice &device, const std::string &destination) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  auto itr = destination_map_.find(DestinationKey(device.dev_t(),
+                                                  destination));
+  if (itr == destination_map_.end() || !itr->second.store) {
+    return;
+  }
+
+  if (fan_out_map_.count(device.dev_t())) {
+    fan_out_map_.at(device.dev_t())->Detach(itr->second.store);
+  }
+  // The generation and carry still describe everything since the last
+  // successful backup
+  itr->second.store = nullptr;
+  LOG(INFO) << "Backup of " << device.path() << " to " << destination
+            << " abandoned";
+}
+
+std::shared_ptr<DeviceTracer> UnsyncedSectorManager::AttachToDiskTracer(
+    const BlockDevice &device, std::shared_ptr<UnsyncedSectorStore> store,
+    const RelayBufferSettings &relay_settings) {
+  PartitionInfo info;
+  if (!GetPartitionInfo(device, &info)) {
+    return nullptr;
+  }
+
+  DiskTracer &disk = disk_tracer_map_[info.disk_dev_t];
+  if (!disk.tracer) {
+    LOG(INFO) << "Tracing " << info.disk_path << " for its partitions";
+    auto partitions = std::make_shared<PartitionUnsyncedSectorStore>();
+    try {
+      disk.tracer = CreateDeviceTracer(info.disk_path, partitions,
+                                       relay_settings);
+    } catch (...) {
+      disk_tracer_map_.erase(info.disk_dev_t);
+      throw;
+    }
+    disk.partitions = partitions;
+  }
+
+  LOG(INFO) << "Tracing " << device.path() << " through " << info.disk_path
+            << " from sector " << info.start_sector;
+  disk.partitions->Attach(
+      SectorInterval(info.start_sector,
+                     info.start_sector + info.num_sectors),
+      store);
+  partition_disk_map_[device.dev_t()] = info.disk_dev_t;
+  return disk.tracer;
+}
+
+void UnsyncedSectorManager::DetachFromDiskTracer(const BlockDevice &device) {
+  auto disk_itr = partition_disk_map_.find(device.dev_t());
+  if (disk_itr == partition_disk_map_.end()) {
+    return;
+  }
+
+  DiskTracer &disk = disk_tracer_map_.at(disk_itr->second);
+  if (fan_out_map_.count(device.dev_t())) {
+    disk.partitions->Detach(fan_out_map_.at(device.dev_t()));
+  }
+  if (!disk.partitions->PartitionCount()) {
+    disk_tracer_map_.erase(disk_itr->second);
+  }
+  partition_disk_map_.erase(disk_itr);
+}
+
+std::shared_ptr<DeviceTracer> UnsyncedSectorManager::CreateEraTracker(
+    const BlockDevice &device, std::shared_ptr<UnsyncedSectorStore> store) {
+  auto era = std::make_shared<DmEra>(
+      DmEra::DeviceMapperName(device.dev_t()));
+  return std::make_shared<EraTracker>(era, store);
+}
+
+std::shared_ptr<DeviceTracer> UnsyncedSectorManager::CreateBpfTracker(
+    const BlockDevice &device, std::shared_ptr<UnsyncedSectorStore> store) {
+  return std::make_shared<BpfDirtyTracker>(device.dev_t(),
+                                           device.DeviceSizeBytes(), store);
+}
+
+bool UnsyncedSectorManager::GetPartitionInfo(const BlockDevice &device,
+                                             PartitionInfo *const info) {
+  try {
+    return ReadPartitionInfo(device.dev_t(), info);
+  } catch (const std::exception &e) {
+    LOG(WARNING) << "Tracing " << device.path() << " on its own: "
+                 << e.what();
+    return false;
+  }
+}
+
+std::shared_ptr<UnsyncedSectorStore> UnsyncedSectorManager::CreateStore(
+    const BlockDevice &device) {
+  StoreType store_type = default_store_type_;
+  if (store_type_map_.count(device.dev_t())) {
+    store_type = store_type_map_.at(device.dev_t());
+  }
+
+  std::shared_ptr<UnsyncedSectorStore> store;
+  if (store_type == BITMAP_STORE) {
+    store = std::make_shared<BitmapUnsyncedSectorStore>(
+        VOLATILE_SECONDS,
+        device.DeviceSizeBytes(),
+        device.BlockSizeBytes());
+  } else {
+    store = std::make_shared<IntervalUnsyncedSectorStore>(VOLATILE_SECONDS);
+  }
+  store->SetAdaptiveVolatileSeconds(true);
+  store->SetMemoryBudget(MemoryBudget(device.dev_t()));
+  return store;
+}
+
+uint64_t UnsyncedSectorManager::MemoryBudget(dev_t device_id) const {
+  if (memory_budget_map_.count(device_id)) {
+    return memory_budget_map_.at(device_id);
+  }
+  return default_memory_budget_bytes_;
+}
+
+void UnsyncedSectorManager::PruneHistory(dev_t device_id) {
+  if (!history_map_.count(device_id)) {
+    return;
+  }
+
+  uint64_t oldest_generation = 0;
+  auto itr = destination_map_.lower_bound(
+      DestinationKey(device_id, std::string()));
+  for (; itr != destination_map_.end() && itr->first.first == device_id;
+       ++itr) {
+    uint64_t generation = itr->second.generation;
+    if (generation &&
+        (!oldest_generation || generation < oldest_generation)) {
+      oldest_generation = generation;
+    }
+  }
+  history_map_.at(device_id)->Prune(oldest_generation);
+}
+
+void UnsyncedSectorManager::SetStoreType(const BlockDevice &device,
+                                         StoreType store_type) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (store_map_.count(device.dev_t()) && store_map_[device.dev_t()]) {
+    LOG(ERROR) << "Store for " << device.path() << " already exists";
+    throw UnsyncedTrackingException("Store type must be set before use");
+  }
+  store_type_map_[device.dev_t()] = store_type;
+}
+
+void UnsyncedSectorManager::SetDefaultStoreType(StoreType store_type) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  default_store_type_ = store_type;
+}
+
+void UnsyncedSectorManager::SetTraceBackend(const BlockDevice &device,
+                                            TraceBackend backend) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  trace_backend_map_[device.dev_t()] = backend;
+}
+
+void UnsyncedSectorManager::SetDefaultTraceBackend(TraceBackend backend) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  default_trace_backend_ = backend;
+}
+
+void UnsyncedSectorManager::SetTraceRecordPath(const BlockDevice &device,
+                                               const std::string &path) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (path.empty()) {
+    record_path_map_.erase(device.path());
+  } else {
+    record_path_map_[device.path()] = path;
+  }
+}
+
+void UnsyncedSectorManager::SetTraceRecordDir(const std::string &dir) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  record_dir_ = dir;
+}
+
+void UnsyncedSectorManager::SetTraceWholeDisk(bool trace_whole_disk) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  trace_whole_disk_ = trace_whole_disk;
+}
+
+void UnsyncedSectorManager::SetCpuPlacement(
+    std::shared_ptr<const CpuPlacement> placement) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (reader_pool_) {
+    LOG(WARNING) << "Trace readers already started, not moving them";
+  }
+  cpu_placement_ = placement;
+}
+
+void UnsyncedSectorManager::SetMemoryBudget(const BlockDevice &device,
+                                            uint64_t budget_bytes) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  memory_budget_map_[device.dev_t()] = budget_bytes;
+  if (store_map_.count(device.dev_t()) && store_map_[device.dev_t()]) {
+    store_map_[device.dev_t()]->SetMemoryBudget(budget_bytes);
+  }
+  if (history_map_.count(device.dev_t())) {
+    history_map_.at(device.dev_t())->SetMemoryBudget(budget_bytes);
+  }
+  auto itr = destination_map_.lower_bound(
+      DestinationKey(device.dev_t(), std::string()));
+  for (; itr != destination_map_.end() && itr->first.first == device.dev_t();
+       ++itr) {
+    if (itr->second.store) {
+      itr->second.store->SetMemoryBudget(budget_bytes);
+    }
+  }
+}
+
+void UnsyncedSectorManager::SetDefaultMemoryBudget(uint64_t budget_bytes) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  default_memory_budget_bytes_ = budget_bytes;
+}
+
+void UnsyncedSectorManager::ExportChanges(const BlockDevice &device,
+                                          ChangeExportFormat format,
+                                          const std::string &path,
+                                          bool reset) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (!IsTracing(device)) {
+    LOG(ERROR) << "Can't export changes, " << device.path()
+               << " isn't being traced";
+    throw UnsyncedTrackingException("Device isn't being traced");
+  }
+
+  // Make sure recent writes are in the store before taking the snapshot
+  FlushTracer(device);
+  if (NeedsResync(device)) {
+    LOG(ERROR) << "Can't export changes, traces of " << device.path()
+               << " were dropped";
+    throw UnsyncedTrackingException("Traces were dropped");
+  }
+
+  auto store = GetStore(device);
+  SectorSet changed_sectors;
+  store->ExportIntervals(&changed_sectors, reset);
+  LOG(INFO) << "Exporting " << changed_sectors.iterative_size()
+            << " changed intervals of " << device.path() << " to " << path;
+
+  try {
+    WriteChangeExport(path, format, changed_sectors, device.DeviceSizeBytes(),
+                      device.BlockSizeBytes());
+  } catch (...) {
+    // Don't lose the changes if they never made it to the file
+    if (reset) {
+      for (const auto &interval : changed_sectors) {
+        store->AddNonVolatileInterval(interval);
+      }
+    }
+    throw;
+  }
+}
+
+void UnsyncedSectorManager::SetChangeExportDir(const std::string &dir,
+                                               ChangeExportFormat format) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  export_dir_ = dir;
+  export_format_ = format;
+}
+
+void UnsyncedSectorManager::ExportAllChanges() {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (export_dir_.empty()) {
+    LOG(ERROR) << "Can't export changes, no export directory is set";
+    throw UnsyncedTrackingException("No export directory");
+  }
+
+  for (const auto &tracer_pair : tracer_map_) {
+    if (!tracer_pair.second) {
+      continue;
+    }
+    const std::string &path = trace_state_map_.at(tracer_pair.first).path;
+    std::string name = path.substr(path.rfind('/') + 1);
+    try {
+      BlockDevice device(path);
+      ExportChanges(device, export_format_,
+                    export_dir_ + "/" + name + ".changes", true);
+    } catch (const std::exception &e) {
+      LOG(ERROR) << "Unable to export changes of " << path << ": "
+                 << e.what();
+    }
   }
-  return store_map_.at(device.dev_t());
 }
 
 std::shared_ptr<DeviceTracer> UnsyncedSectorManager::CreateDeviceTracer(
     const std::string &path,
-    std::shared_ptr<UnsyncedSectorStore> store) {
-  auto trace_handler = std::make_shared<TraceHandler>(store);
+    std::shared_ptr<UnsyncedSectorStore> store,
+    const RelayBufferSettings &relay_settings) {
+  std::shared_ptr<TraceHandler> trace_handler =
+      std::make_shared<RingTraceHandler>(store, get_nprocs_conf());
+  if (record_path_map_.count(path)) {
+    trace_handler = std::make_shared<TraceRecorder>(
+        record_path_map_.at(path), trace_handler);
+  } else if (!record_dir_.empty()) {
+    std::string record_path = record_dir_ + "/" +
+                              path.substr(path.rfind('/') + 1) + "." +
+                              std::to_string(time(NULL)) + ".trace";
+    try {
+      trace_handler = std::make_shared<TraceRecorder>(record_path,
+                                                      trace_handler);
+      LOG(INFO) << "Recording traces of " << path << " to " << record_path;
+    } catch (const std::exception &e) {
+      LOG(WARNING) << "Not recording traces of " << path << ": "
+                   << e.what();
+    }
+  }
+
+  // All devices share the reader threads
+  if (!reader_pool_) {
+    int num_threads = std::min(TraceReaderPool::DEFAULT_NUM_THREADS,
+                               get_nprocs());
+    std::vector<int> cpus;
+    if (cpu_placement_) {
+      cpus = cpu_placement_->housekeeping_cpus();
+      num_threads = std::min(num_threads, static_cast<int>(cpus.size()));
+    }
+    reader_pool_ = std::make_shared<TraceReaderPool>(num_threads, cpus);
+  }
+
   std::shared_ptr<DeviceTracer> device_tracer(
-      new DeviceTracer(path, trace_handler));
+      new DeviceTracer(path, trace_handler, reader_pool_, relay_settings));
   return device_tracer;
 }
 
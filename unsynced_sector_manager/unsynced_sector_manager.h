@@ -4,39 +4,280 @@
 #include <linux/types.h>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
 
 #include "block_device/block_device.h"
+#include "block_device/partition_info.h"
+#include "cpu_placement/cpu_placement.h"
 #include "tracing/device_tracer.h"
+#include "tracing/trace_reader_pool.h"
+#include "unsynced_sector_manager/change_export.h"
+#include "unsynced_sector_manager/change_history.h"
+#include "unsynced_sector_manager/fan_out_unsynced_sector_store.h"
+#include "unsynced_sector_manager/partition_unsynced_sector_store.h"
+#include "unsynced_sector_manager/trace_statistics.h"
 #include "unsynced_sector_manager/unsynced_sector_store.h"
 
 namespace datto_linux_client {
 
-// This class is not thread safe
+// The public methods can be called from any thread; sync threads and the
+// backup builder share one manager. They are serialized by a single
+// mutex, which is recursive as they call each other.
 class UnsyncedSectorManager {
  public:
+  enum StoreType {
+    // Interval map based, exact to the sector. Memory grows with the number
+    // of unsynced intervals.
+    INTERVAL_STORE,
+    // Bitmap based, rounds to the block size. Memory is fixed by the
+    // device size.
+    BITMAP_STORE
+  };
+
+  enum TraceBackend {
+    // A blktrace session, every write is sent to user space
+    BLKTRACE_BACKEND,
+    // The device is a dm-era target, written blocks are read from its
+    // metadata when the tracer is flushed. See era_tracker.h.
+    DM_ERA_BACKEND,
+    // An eBPF program marks written blocks in a map read when the tracer
+    // is flushed, see bpf_dirty_tracker.h. Falls back to BLKTRACE_BACKEND
+    // where BPF isn't available.
+    BPF_BACKEND,
+    // DM_ERA_BACKEND for dm-era targets, otherwise BPF_BACKEND
+    AUTO_BACKEND
+  };
+
   UnsyncedSectorManager();
   virtual ~UnsyncedSectorManager();
 
   virtual void StartTracer(const BlockDevice &device);
   virtual void StopTracer(const BlockDevice &device);
   virtual bool IsTracing(const BlockDevice &device) const;
+  // Also checks whether the kernel dropped any traces, see NeedsResync
   virtual void FlushTracer(const BlockDevice &device);
 
+  // True if the kernel dropped traces of the device, so its stores and
+  // change history are missing writes. Incrementals aren't possible until
+  // a full backup has run on a restarted tracer, which uses larger relay
+  // buffers.
+  virtual bool NeedsResync(const BlockDevice &device);
+
+  virtual TraceStatistics GetTraceStatistics(const BlockDevice &device);
+
+  // The device's own store, for exports and syncs without a destination.
+  // The tracer only feeds it from the first call on, so devices that are
+  // only backed up to destinations don't pay for it.
   virtual std::shared_ptr<UnsyncedSectorStore> GetStore(
       const BlockDevice &device);
 
+  // Changes are tracked separately for each destination a device is backed
+  // up to, all fed by the device's tracer. The store for a destination only
+  // exists while a backup to it is running; in between, the destination
+  // just refers to the shared change history. An empty destination is the
+  // same as GetStore(device).
+  virtual std::shared_ptr<UnsyncedSectorStore> GetStore(
+      const BlockDevice &device, const std::string &destination);
+
+  // True if a backup of device to destination has succeeded since the
+  // device started being traced, so an incremental is possible
+  virtual bool HasGeneration(const BlockDevice &device,
+                             const std::string &destination) const;
+
+  // Call when a backup of device to destination succeeded. The next
+  // backup to destination will include what was written from now on, plus
+  // anything this backup left unsynced. Throws if traces were dropped
+  // during the backup, as it is then missing writes; the destination is
+  // left without a generation, so the next backup to it must be a full.
+  virtual void CommitGeneration(const BlockDevice &device,
+                                const std::string &destination);
+
+  // Call when a backup of device to destination failed or was cancelled.
+  // The next backup to destination will include everything since its last
+  // successful backup.
+  virtual void AbandonGeneration(const BlockDevice &device,
+                                 const std::string &destination);
+
+  // Selects the type of store used for the device. This must be called
+  // before the store for the device is created, otherwise an exception
+  // is thrown. Devices default to the type set with SetDefaultStoreType.
+  virtual void SetStoreType(const BlockDevice &device, StoreType store_type);
+
+  // Selects the type of store for devices SetStoreType wasn't called for.
+  // Only stores created afterwards are affected. INTERVAL_STORE by default.
+  virtual void SetDefaultStoreType(StoreType store_type);
+
+  // Selects how writes to the device are tracked. Takes effect the next
+  // time the tracer starts. Devices default to the backend set with
+  // SetDefaultTraceBackend.
+  virtual void SetTraceBackend(const BlockDevice &device,
+                               TraceBackend backend);
+
+  // Selects the backend for devices SetTraceBackend wasn't called for.
+  // BLKTRACE_BACKEND by default.
+  virtual void SetDefaultTraceBackend(TraceBackend backend);
+
+  // Records every trace of the device to path, see trace_recorder.h, so
+  // its workload can be replayed offline. Takes effect the next time the
+  // tracer starts. An empty path stops recording.
+  virtual void SetTraceRecordPath(const BlockDevice &device,
+                                  const std::string &path);
+
+  // Records the traces of devices without a record path into dir, as
+  // <device name>.<start time>.trace, so every tracer started afterwards
+  // gets its own recording. Tracing goes on without recording if one
+  // can't be created. An empty dir stops recording.
+  virtual void SetTraceRecordDir(const std::string &dir);
+
+  // Traces partitions through their disk, so the partitions of a disk that
+  // are traced at the same time share one tracer. Takes effect for tracers
+  // started afterwards. Partitions whose disk can't be traced are traced on
+  // their own. Off by default.
+  virtual void SetTraceWholeDisk(bool trace_whole_disk);
+
+  // Keeps the threads reading traces on the housekeeping CPUs of
+  // placement. Must be called before the first tracer starts.
+  virtual void SetCpuPlacement(std::shared_ptr<const CpuPlacement> placement);
+
+  // Limits the memory used by each store and the change history of the
+  // device, see UnsyncedSectorStore::SetMemoryBudget. This can be called at
+  // any time.
+  virtual void SetMemoryBudget(const BlockDevice &device,
+                               uint64_t budget_bytes);
+
+  // Memory budget for devices SetMemoryBudget wasn't called for. Only
+  // stores and histories created afterwards are affected. Defaults to
+  // UnsyncedSectorStore::DEFAULT_MEMORY_BUDGET_BYTES.
+  virtual void SetDefaultMemoryBudget(uint64_t budget_bytes);
+
+  // Writes the unsynced sectors of a traced device to path, see
+  // change_export.h for the format. If reset is set, tracking starts over
+  // from the time of the export.
+  //
+  // Resetting drops what the next backup of the device would copy, so it
+  // must not be used on devices that are also backed up incrementally.
+  virtual void ExportChanges(const BlockDevice &device,
+                             ChangeExportFormat format,
+                             const std::string &path,
+                             bool reset);
+
+  // Sets where ExportAllChanges writes to. Devices whose tracer starts
+  // afterwards are fed to their own store from the start, so their first
+  // export has everything written since tracing started. An empty dir
+  // turns this off.
+  virtual void SetChangeExportDir(const std::string &dir,
+                                  ChangeExportFormat format);
+
+  // Exports the changes of every traced device since its previous export
+  // to <dir>/<device name>.changes, see SetChangeExportDir. Devices that
+  // fail are logged and skipped.
+  //
+  // This resets the device's own store, see ExportChanges, which is fine
+  // as backups to a destination have their own stores.
+  virtual void ExportAllChanges();
+
   UnsyncedSectorManager(const UnsyncedSectorManager&) = delete;
   UnsyncedSectorManager& operator=(const UnsyncedSectorManager&) = delete;
 
  protected:
   // Virtual to allow overriding in tests
   virtual std::shared_ptr<DeviceTracer> CreateDeviceTracer(
-      const std::string &path, std::shared_ptr<UnsyncedSectorStore> store);
+      const std::string &path, std::shared_ptr<UnsyncedSectorStore> store,
+      const RelayBufferSettings &relay_settings);
+
+  // Virtual to allow overriding in tests
+  virtual std::shared_ptr<DeviceTracer> CreateEraTracker(
+      const BlockDevice &device, std::shared_ptr<UnsyncedSectorStore> store);
+
+  // Virtual to allow overriding in tests
+  virtual std::shared_ptr<DeviceTracer> CreateBpfTracker(
+      const BlockDevice &device, std::shared_ptr<UnsyncedSectorStore> store);
+
+  // Virtual to allow overriding in tests. Returns false if device isn't a
+  // partition.
+  virtual bool GetPartitionInfo(const BlockDevice &device,
+                                PartitionInfo *const info);
 
  private:
+  struct DestinationState {
+    // Generation the last successful backup finished in, 0 if none
+    uint64_t generation;
+    // Sectors left unsynced by the last successful backup
+    SectorSet carry;
+    // Only set while a backup is running
+    std::shared_ptr<UnsyncedSectorStore> store;
+
+    DestinationState() : generation(0), carry(), store() {}
+  };
+  typedef std::pair<dev_t, std::string> DestinationKey;
+
+  struct TraceState {
+    // Of the device, as the manager isn't given one when exporting
+    std::string path;
+    RelayBufferSettings relay_settings;
+    // As last read from the current tracer
+    uint64_t dropped_traces;
+    uint64_t total_dropped_traces;
+    uint64_t resync_count;
+    bool needs_resync;
+
+    TraceState()
+        : path(),
+          relay_settings(DeviceTracer::DefaultRelaySettings()),
+          dropped_traces(0),
+          total_dropped_traces(0),
+          resync_count(0),
+          needs_resync(false) {}
+  };
+
+  // One tracer of a disk, shared by its traced partitions
+  struct DiskTracer {
+    std::shared_ptr<DeviceTracer> tracer;
+    std::shared_ptr<PartitionUnsyncedSectorStore> partitions;
+  };
+
+  std::shared_ptr<UnsyncedSectorStore> CreateStore(const BlockDevice &device);
+  // Starts or joins the tracer of the disk device is on. Returns nullptr
+  // if device isn't a partition.
+  std::shared_ptr<DeviceTracer> AttachToDiskTracer(
+      const BlockDevice &device, std::shared_ptr<UnsyncedSectorStore> store,
+      const RelayBufferSettings &relay_settings);
+  void DetachFromDiskTracer(const BlockDevice &device);
+  // Drops history no destination of the device needs anymore
+  void PruneHistory(dev_t device_id);
+  // Marks the device for a resync if its tracer dropped traces
+  void CheckDroppedTraces(const BlockDevice &device);
+  uint64_t MemoryBudget(dev_t device_id) const;
+
   std::map<dev_t, std::shared_ptr<UnsyncedSectorStore>> store_map_;
   std::map<dev_t, std::shared_ptr<DeviceTracer>> tracer_map_;
+  std::map<dev_t, StoreType> store_type_map_;
+  StoreType default_store_type_;
+  std::map<dev_t, TraceBackend> trace_backend_map_;
+  TraceBackend default_trace_backend_;
+  std::map<dev_t, uint64_t> memory_budget_map_;
+  uint64_t default_memory_budget_bytes_;
+  std::map<dev_t, std::shared_ptr<ChangeHistory>> history_map_;
+  std::map<dev_t, std::shared_ptr<FanOutUnsyncedSectorStore>> fan_out_map_;
+  std::map<DestinationKey, DestinationState> destination_map_;
+  std::map<dev_t, TraceState> trace_state_map_;
+  // By device path, as that is all CreateDeviceTracer gets
+  std::map<std::string, std::string> record_path_map_;
+  std::string record_dir_;
+  // Created with the first tracer
+  std::shared_ptr<TraceReaderPool> reader_pool_;
+  bool trace_whole_disk_;
+  std::shared_ptr<const CpuPlacement> cpu_placement_;
+  std::string export_dir_;
+  ChangeExportFormat export_format_;
+  // By disk
+  std::map<dev_t, DiskTracer> disk_tracer_map_;
+  // The disk each partition traced through its disk is on
+  std::map<dev_t, dev_t> partition_disk_map_;
+
+  mutable std::recursive_mutex mutex_;
 };
 
 }
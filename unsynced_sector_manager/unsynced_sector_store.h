@@ -1,30 +1,48 @@
 #ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_UNSYNCED_SECTOR_STORE_H_
 #define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_UNSYNCED_SECTOR_STORE_H_
 
+#include "unsynced_sector_manager/claimed_interval.h"
 #include "unsynced_sector_manager/sector_interval.h"
 #include "unsynced_sector_manager/sector_set.h"
-#include "unsynced_sector_manager/timed_sector_map.h"
+#include "unsynced_sector_manager/store_statistics.h"
+#include "unsynced_sector_manager/timed_interval.h"
 
-#include <mutex>
+#include <vector>
 #include <stdint.h>
 #include <time.h>
 
 namespace datto_linux_client {
 
+// UnsyncedSectorStore keeps track of what has to be copied to bring a
+// destination up to date. IntervalUnsyncedSectorStore and
+// BitmapUnsyncedSectorStore do the real work.
 class UnsyncedSectorStore {
  public:
-  // volatile_seconds is the number of seconds ago a write should have
-  // occurred to not require special handling (i.e. a filesystem freeze)
-  explicit UnsyncedSectorStore(int volatile_seconds);
+  static const uint64_t DEFAULT_MEMORY_BUDGET_BYTES = 64 * 1024 * 1024;
+  // Rough size of a node in an interval map or set
+  static const uint64_t BYTES_PER_INTERVAL = 64;
+
   virtual ~UnsyncedSectorStore() {}
 
   // Add an interval that has not been modified recently
-  virtual void AddNonVolatileInterval(const SectorInterval &sector_interval);
+  virtual void AddNonVolatileInterval(
+      const SectorInterval &sector_interval) = 0;
+
+  // Same as calling AddNonVolatileInterval for each interval, but intended
+  // for loading a whole filesystem. The intervals must be sorted and not
+  // overlap each other, which lets them be appended in one pass instead of
+  // searching the store for each one.
+  virtual void AddNonVolatileIntervals(
+      const std::vector<SectorInterval> &sorted_intervals) = 0;
 
   // Add an interval that was modified recently. This is intended for inserting
   // block trace data
   virtual void AddInterval(const SectorInterval &sector_interval,
-                           const time_t time);
+                           const time_t time) = 0;
+
+  // Same as calling AddInterval for each interval, but the store is only
+  // locked once
+  virtual void AddIntervals(const std::vector<TimedInterval> &intervals) = 0;
 
   // Copies an unsynced interval into output.
   // epoch is the current time (as returned by time())
@@ -32,30 +50,87 @@ class UnsyncedSectorStore {
   // The return value indicated if the interval was modified in the
   // past volatile_seconds and thus should need a file system freeze.
   virtual bool GetInterval(SectorInterval *const output,
-                           const time_t epoch) const;
+                           const time_t epoch) const = 0;
+
+  // Claims up to max_intervals unsynced intervals totalling at most
+  // max_sectors, continuing from where the previous claim left off.
+  // Intervals larger than what is left of max_sectors are split, so
+  // something is always claimed if the store isn't empty.
+  //
+  // If defer_hot is set, intervals in frequently rewritten regions are
+  // skipped unless nothing else is left.
+  //
+  // Claimed intervals are moved to the synced intervals in the same step,
+  // so the caller should copy them afterwards. output is cleared first.
+  virtual void ClaimIntervals(std::vector<ClaimedInterval> *const output,
+                              size_t max_intervals,
+                              uint64_t max_sectors,
+                              const time_t epoch,
+                              bool defer_hot) = 0;
+
+  // Hands back claimed intervals that weren't copied, with the write time
+  // and volatility they were claimed with. Unlike AddInterval, they aren't
+  // counted as rewrites or heat, as nothing wrote them again.
+  virtual void ReturnClaimedIntervals(
+      const std::vector<ClaimedInterval> &claimed) = 0;
+
+  // Drops discarded intervals from what needs to be copied, as their
+  // contents no longer matter, and keeps them to be trimmed from the
+  // destination. A later write takes an interval back out.
+  //
+  // A discard must only be added once every earlier write to the same
+  // sectors has been, otherwise the write is lost. RingTraceHandler takes
+  // care of this for traces.
+  virtual void DiscardIntervals(
+      const std::vector<SectorInterval> &intervals) = 0;
+
+  // Moves up to max_intervals discarded intervals into output, to trim
+  // from the destination. output is cleared first.
+  virtual void ClaimDiscardedIntervals(
+      std::vector<SectorInterval> *const output, size_t max_intervals) = 0;
 
   // Removes the marked interval
   // This should be called before copying an interval to the destination
-  virtual void RemoveInterval(const SectorInterval &sector_interval);
+  virtual void RemoveInterval(const SectorInterval &sector_interval) = 0;
+
+  // Copies all of the unsynced intervals into output. If reset is set,
+  // the store is cleared in the same step, so no write is missed or
+  // reported twice by consecutive exports.
+  virtual void ExportIntervals(SectorSet *const output, bool reset) = 0;
 
   // Clears the entire Store
-  virtual void ClearIntervals();
+  virtual void ClearIntervals() = 0;
 
   // Clears synced intervals. Should be called when a backup completes
-  virtual void ClearSyncHistory();
+  virtual void ClearSyncHistory() = 0;
 
   // Loads the synced intervals into the unsynced intervals
   // This should be called when a backup is stopped or fails
-  virtual void ReInsertSyncHistory();
+  virtual void ReInsertSyncHistory() = 0;
 
   // Returns the total number of unsynced sectors
-  virtual uint64_t UnsyncedSectorCount() const;
- private:
-  const int volatile_seconds_;
-  TimedSectorMap unsynced_sector_map_;
-  SectorSet synced_sector_set_;
-  mutable uint64_t end_of_last_continuous_;
-  mutable std::mutex mutex_;
+  // This doesn't lock, so it is cheap enough to call while frozen
+  virtual uint64_t UnsyncedSectorCount() const = 0;
+
+  // Returns the counters kept by the store. These are updated as intervals
+  // are added and removed, so this doesn't lock or walk the store.
+  virtual StoreStatistics GetStatistics() const = 0;
+
+  // When enabled, the volatile window follows how quickly regions are
+  // rewritten, see VolatileWindow
+  virtual void SetAdaptiveVolatileSeconds(bool adaptive) = 0;
+  virtual int VolatileSeconds() const = 0;
+
+  // Limits the memory used for tracking intervals. When the limit is
+  // reached, regions with many intervals are merged into a single
+  // interval, which costs copying some extra data. 0 means no limit.
+  virtual void SetMemoryBudget(uint64_t budget_bytes) = 0;
+
+  UnsyncedSectorStore(const UnsyncedSectorStore &) = delete;
+  UnsyncedSectorStore& operator=(const UnsyncedSectorStore &) = delete;
+
+ protected:
+  UnsyncedSectorStore() {}
 };
 
 }
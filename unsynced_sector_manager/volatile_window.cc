@@ -0,0 +1,48 @@
+#include "unsynced_sector_manager/volatile_window.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+namespace datto_linux_client {
+
+const int VolatileWindow::MIN_SECONDS;
+const int VolatileWindow::MAX_SECONDS;
+
+VolatileWindow::VolatileWindow(int seconds)
+    : initial_seconds_(seconds),
+      seconds_(seconds),
+      adaptive_(false) { }
+
+void VolatileWindow::SetAdaptive(bool adaptive) {
+  adaptive_ = adaptive;
+  if (!adaptive) {
+    seconds_ = initial_seconds_;
+  }
+}
+
+int VolatileWindow::Seconds() const {
+  return seconds_;
+}
+
+void VolatileWindow::Adapt(const WriteHeatTracker &heat) {
+  if (!adaptive_) {
+    return;
+  }
+
+  // A region that keeps being rewritten every n seconds is likely to be
+  // written again within n seconds of its last write, so give it twice
+  // that before it is considered stable
+  int rewrite_seconds = heat.AverageRewriteSeconds();
+  if (rewrite_seconds == 0) {
+    return;
+  }
+  int adapted = std::min(std::max(rewrite_seconds * 2, MIN_SECONDS),
+                         MAX_SECONDS);
+  if (adapted != seconds_) {
+    VLOG(1) << "Volatile window is now " << adapted << " seconds";
+    seconds_ = adapted;
+  }
+}
+
+}
@@ -0,0 +1,41 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_VOLATILE_WINDOW_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_VOLATILE_WINDOW_H_
+
+#include "unsynced_sector_manager/write_heat_tracker.h"
+
+#include <atomic>
+
+namespace datto_linux_client {
+
+// VolatileWindow is the number of seconds ago a write should have occurred
+// to not require special handling (i.e. a filesystem freeze). The stores
+// share it so they pick the window the same way.
+class VolatileWindow {
+ public:
+  // Bounds on the window when it is adaptive
+  static const int MIN_SECONDS = 2;
+  static const int MAX_SECONDS = 60;
+
+  explicit VolatileWindow(int seconds);
+
+  // When enabled, the window follows how quickly regions are rewritten,
+  // between MIN_SECONDS and MAX_SECONDS. Disabling it goes back to the
+  // initial window.
+  void SetAdaptive(bool adaptive);
+  int Seconds() const;
+
+  // Updates the window from heat if it is adaptive
+  void Adapt(const WriteHeatTracker &heat);
+
+  VolatileWindow(const VolatileWindow &) = delete;
+  VolatileWindow& operator=(const VolatileWindow &) = delete;
+
+ private:
+  const int initial_seconds_;
+  std::atomic<int> seconds_;
+  std::atomic<bool> adaptive_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_VOLATILE_WINDOW_H_
@@ -0,0 +1,105 @@
+#include "unsynced_sector_manager/write_heat_tracker.h"
+
+#include <glog/logging.h>
+
+#include <cmath>
+
+namespace datto_linux_client {
+
+WriteHeatTracker::WriteHeatTracker()
+    : regions_(),
+      average_rewrite_seconds_(0) { }
+
+void WriteHeatTracker::AddWrite(const SectorInterval &interval,
+                                time_t epoch) {
+  if (boost::icl::is_empty(interval)) {
+    return;
+  }
+
+  uint64_t first_region = interval.lower() / REGION_SECTORS;
+  uint64_t end_region = (interval.upper() - 1) / REGION_SECTORS + 1;
+
+  for (uint64_t region_num = first_region; region_num < end_region;
+       ++region_num) {
+    auto region_itr = regions_.find(region_num);
+    if (region_itr == regions_.end()) {
+      if (regions_.size() >= MAX_REGIONS) {
+        PruneColdRegions(epoch);
+        if (regions_.size() >= MAX_REGIONS) {
+          VLOG(1) << "Too many regions to track heat for " << region_num;
+          continue;
+        }
+      }
+      Region region = {1, epoch};
+      regions_[region_num] = region;
+      continue;
+    }
+
+    Region &region = region_itr->second;
+    time_t gap = epoch - region.last_write;
+    // Writes in the same second are most likely a single larger write
+    if (gap <= 0) {
+      continue;
+    }
+
+    if (gap <= MAX_REWRITE_SECONDS) {
+      if (average_rewrite_seconds_ == 0) {
+        average_rewrite_seconds_ = gap;
+      } else {
+        average_rewrite_seconds_ += (gap - average_rewrite_seconds_) / 8;
+      }
+    }
+
+    region.write_count = DecayedCount(region, epoch) + 1;
+    region.last_write = epoch;
+  }
+}
+
+bool WriteHeatTracker::IsHot(const SectorInterval &interval,
+                             time_t epoch) const {
+  if (boost::icl::is_empty(interval)) {
+    return false;
+  }
+
+  uint64_t end_region = (interval.upper() - 1) / REGION_SECTORS + 1;
+  for (auto region_itr = regions_.lower_bound(interval.lower() /
+                                              REGION_SECTORS);
+       region_itr != regions_.end() && region_itr->first < end_region;
+       ++region_itr) {
+    if (DecayedCount(region_itr->second, epoch) >= HOT_WRITE_COUNT) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int WriteHeatTracker::AverageRewriteSeconds() const {
+  return std::ceil(average_rewrite_seconds_);
+}
+
+void WriteHeatTracker::Clear() {
+  regions_.clear();
+  average_rewrite_seconds_ = 0;
+}
+
+uint32_t WriteHeatTracker::DecayedCount(const Region &region, time_t epoch) {
+  time_t half_lives = (epoch - region.last_write) / HALF_LIFE_SECONDS;
+  if (half_lives <= 0) {
+    return region.write_count;
+  } else if (half_lives >= 32) {
+    return 0;
+  }
+  return region.write_count >> half_lives;
+}
+
+void WriteHeatTracker::PruneColdRegions(time_t epoch) {
+  for (auto region_itr = regions_.begin(); region_itr != regions_.end();) {
+    if (DecayedCount(region_itr->second, epoch) <= 1) {
+      region_itr = regions_.erase(region_itr);
+    } else {
+      ++region_itr;
+    }
+  }
+}
+
+}
@@ -0,0 +1,55 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_WRITE_HEAT_TRACKER_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_WRITE_HEAT_TRACKER_H_
+
+#include "unsynced_sector_manager/sector_interval.h"
+
+#include <map>
+#include <stdint.h>
+#include <time.h>
+
+namespace datto_linux_client {
+
+// WriteHeatTracker counts how often regions of a device are rewritten so
+// frequently rewritten (hot) regions, such as journals, can be synced last.
+//
+// A region's count goes up once for every second it is written in and is
+// halved every HALF_LIFE_SECONDS. It isn't thread safe; the stores only
+// use it with their mutex held.
+class WriteHeatTracker {
+ public:
+  static const uint64_t REGION_SECTORS = 2048;
+  static const int HALF_LIFE_SECONDS = 60;
+  static const uint32_t HOT_WRITE_COUNT = 8;
+  // Rewrites further apart than this don't count towards the average
+  static const int MAX_REWRITE_SECONDS = 60;
+  static const size_t MAX_REGIONS = 64 * 1024;
+
+  WriteHeatTracker();
+
+  void AddWrite(const SectorInterval &interval, time_t epoch);
+
+  // True if any region in the interval is hot
+  bool IsHot(const SectorInterval &interval, time_t epoch) const;
+
+  // Average number of seconds between rewrites of a region, or 0 if
+  // no region has been rewritten yet
+  int AverageRewriteSeconds() const;
+
+  void Clear();
+
+ private:
+  struct Region {
+    uint32_t write_count;
+    time_t last_write;
+  };
+
+  static uint32_t DecayedCount(const Region &region, time_t epoch);
+  void PruneColdRegions(time_t epoch);
+
+  std::map<uint64_t, Region> regions_;
+  double average_rewrite_seconds_;
+};
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_WRITE_HEAT_TRACKER_H_
@@ -0,0 +1,90 @@
+#include "unsynced_sector_manager/write_only_unsynced_sector_store.h"
+
+#include <glog/logging.h>
+
+#include "unsynced_sector_manager/unsynced_tracking_exception.h"
+
+namespace {
+
+void ThrowWriteOnly(const char *method) {
+  LOG(ERROR) << method << " called on a store that only passes writes on";
+  throw datto_linux_client::UnsyncedTrackingException(
+      "Store doesn't keep intervals");
+}
+
+} // unnamed namespace
+
+namespace datto_linux_client {
+
+void WriteOnlyUnsyncedSectorStore::AddNonVolatileIntervals(
+    const std::vector<SectorInterval> &sorted_intervals) {
+  for (const SectorInterval &interval : sorted_intervals) {
+    AddNonVolatileInterval(interval);
+  }
+}
+
+bool WriteOnlyUnsyncedSectorStore::GetInterval(SectorInterval *const output,
+                                               const time_t epoch) const {
+  ThrowWriteOnly("GetInterval");
+  return false;
+}
+
+void WriteOnlyUnsyncedSectorStore::ClaimIntervals(
+    std::vector<ClaimedInterval> *const output,
+    size_t max_intervals,
+    uint64_t max_sectors,
+    const time_t epoch,
+    bool defer_hot) {
+  ThrowWriteOnly("ClaimIntervals");
+}
+
+void WriteOnlyUnsyncedSectorStore::ReturnClaimedIntervals(
+    const std::vector<ClaimedInterval> &claimed) {
+  ThrowWriteOnly("ReturnClaimedIntervals");
+}
+
+void WriteOnlyUnsyncedSectorStore::ClaimDiscardedIntervals(
+    std::vector<SectorInterval> *const output, size_t max_intervals) {
+  ThrowWriteOnly("ClaimDiscardedIntervals");
+}
+
+void WriteOnlyUnsyncedSectorStore::RemoveInterval(
+    const SectorInterval &sector_interval) {
+  ThrowWriteOnly("RemoveInterval");
+}
+
+void WriteOnlyUnsyncedSectorStore::ExportIntervals(SectorSet *const output,
+                                                   bool reset) {
+  ThrowWriteOnly("ExportIntervals");
+}
+
+void WriteOnlyUnsyncedSectorStore::ClearIntervals() {
+  ThrowWriteOnly("ClearIntervals");
+}
+
+void WriteOnlyUnsyncedSectorStore::ClearSyncHistory() {
+  ThrowWriteOnly("ClearSyncHistory");
+}
+
+void WriteOnlyUnsyncedSectorStore::ReInsertSyncHistory() {
+  ThrowWriteOnly("ReInsertSyncHistory");
+}
+
+uint64_t WriteOnlyUnsyncedSectorStore::UnsyncedSectorCount() const {
+  return 0;
+}
+
+StoreStatistics WriteOnlyUnsyncedSectorStore::GetStatistics() const {
+  return StoreStatistics();
+}
+
+int WriteOnlyUnsyncedSectorStore::VolatileSeconds() const {
+  return 0;
+}
+
+void WriteOnlyUnsyncedSectorStore::SetAdaptiveVolatileSeconds(
+    bool adaptive) { }
+
+void WriteOnlyUnsyncedSectorStore::SetMemoryBudget(uint64_t budget_bytes) { }
+
+}
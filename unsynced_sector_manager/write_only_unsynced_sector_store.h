@@ -0,0 +1,56 @@
+#ifndef DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_WRITE_ONLY_UNSYNCED_SECTOR_STORE_H_
+#define DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_WRITE_ONLY_UNSYNCED_SECTOR_STORE_H_
+
+#include "unsynced_sector_manager/unsynced_sector_store.h"
+
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+namespace datto_linux_client {
+
+// WriteOnlyUnsyncedSectorStore is the base of stores that only pass writes
+// on to other stores, so a tracer can feed them. Subclasses implement
+// AddNonVolatileInterval, AddInterval, AddIntervals and DiscardIntervals.
+// As nothing is kept, reading from one throws UnsyncedTrackingException.
+class WriteOnlyUnsyncedSectorStore : public UnsyncedSectorStore {
+ public:
+  virtual ~WriteOnlyUnsyncedSectorStore() {}
+
+  // Calls AddNonVolatileInterval for each interval
+  virtual void AddNonVolatileIntervals(
+      const std::vector<SectorInterval> &sorted_intervals);
+
+  virtual bool GetInterval(SectorInterval *const output,
+                           const time_t epoch) const;
+  virtual void ClaimIntervals(std::vector<ClaimedInterval> *const output,
+                              size_t max_intervals,
+                              uint64_t max_sectors,
+                              const time_t epoch,
+                              bool defer_hot);
+  virtual void ReturnClaimedIntervals(
+      const std::vector<ClaimedInterval> &claimed);
+  virtual void ClaimDiscardedIntervals(
+      std::vector<SectorInterval> *const output, size_t max_intervals);
+  virtual void RemoveInterval(const SectorInterval &sector_interval);
+  virtual void ExportIntervals(SectorSet *const output, bool reset);
+  virtual void ClearIntervals();
+  virtual void ClearSyncHistory();
+  virtual void ReInsertSyncHistory();
+
+  // Nothing is kept, so these are all 0
+  virtual uint64_t UnsyncedSectorCount() const;
+  virtual StoreStatistics GetStatistics() const;
+  virtual int VolatileSeconds() const;
+
+  // These don't apply to a store that keeps nothing and do nothing
+  virtual void SetAdaptiveVolatileSeconds(bool adaptive);
+  virtual void SetMemoryBudget(uint64_t budget_bytes);
+
+ protected:
+  WriteOnlyUnsyncedSectorStore() {}
+};
+
+}
+
+#endif //  DATTO_CLIENT_UNSYNCED_SECTOR_MANAGER_WRITE_ONLY_UNSYNCED_SECTOR_STORE_H_